@@ -25,6 +25,7 @@ OPTION_HELP=no
 OPTION_DEBUG=no
 OPTION_STATIC=no
 OPTION_MINGW=no
+OPTION_TLB_BITS=
 
 HOST_CC=${CC:-gcc}
 OPTION_CC=
@@ -63,6 +64,8 @@ for opt do
   ;;
   --static) OPTION_STATIC=yes
   ;;
+  --tlb-bits=*) OPTION_TLB_BITS=$optarg
+  ;;
   *)
     echo "unknown option '$opt', use --help"
     exit 1
@@ -89,12 +92,23 @@ EOF
     echo "  --try-64                 try to build a 64-bit executable (may crash)"
     echo "  --mingw                  build Windows executable on Linux"
     echo "  --static                 build a completely static executable"
+    echo "  --tlb-bits=N             use 2^N entries per software TLB [8]"
     echo "  --verbose                verbose configuration"
     echo "  --debug                  build debug version of the emulator"
     echo ""
     exit 1
 fi
 
+# tlb_flush() clears every TLB entry, so don't let the TLB grow past
+# 4096 entries per MMU mode
+case "$OPTION_TLB_BITS" in
+    ""|8|9|10|11|12)
+    ;;
+    *)
+    echo "Invalid --tlb-bits value '$OPTION_TLB_BITS', must be between 8 and 12"
+    exit 1
+esac
+
 # On Linux, try to use our 32-bit prebuilt toolchain to generate binaries
 # that are compatible with Ubuntu 8.04
 if [ -z "$CC" -a -z "$OPTION_CC" -a "$HOST_OS" = linux -a "$OPTION_TRY_64" != "yes" ] ; then
@@ -442,13 +456,18 @@ echo "#define CONFIG_SLIRP    1" >> $config_h
 echo "#define CONFIG_SKINS    1" >> $config_h
 echo "#define CONFIG_TRACE    1" >> $config_h
 
-# only Linux has fdatasync()
+# only Linux has fdatasync() and epoll
 case "$TARGET_OS" in
     linux-*)
         echo "#define CONFIG_FDATASYNC    1" >> $config_h
+        echo "#define CONFIG_EPOLL        1" >> $config_h
         ;;
 esac
 
+if [ -n "$OPTION_TLB_BITS" ] ; then
+    echo "#define CONFIG_CPU_TLB_BITS $OPTION_TLB_BITS" >> $config_h
+fi
+
 # the -nand-limits options can only work on non-windows systems
 if [ "$TARGET_OS" != "windows" ] ; then
     echo "#define CONFIG_NAND_LIMITS  1" >> $config_h
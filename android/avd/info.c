@@ -23,6 +23,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 /* global variables - see android/globals.h */
 AvdInfoParams   android_avdParams[1];
@@ -143,6 +148,9 @@ struct AvdInfo {
     /* image files */
     char*     imagePath [ AVD_IMAGE_MAX ];
     char      imageState[ AVD_IMAGE_MAX ];
+
+    /* base image, if the data image is a thin overlay */
+    char*     dataOverlayBase;
 };
 
 
@@ -157,6 +165,7 @@ avdInfo_free( AvdInfo*  i )
 
         AFREE(i->skinName);
         AFREE(i->skinDirPath);
+        AFREE(i->dataOverlayBase);
 
         for (nn = 0; nn < i->numSearchPaths; nn++)
             AFREE(i->searchPaths[nn]);
@@ -558,6 +567,127 @@ imageLoader_empty( ImageLoader*  l, unsigned  flags )
 }
 
 
+/* The user data image can be a thin overlay of the initial data image,
+ * that only stores the blocks written by the emulated system (see the
+ * 'basefile' option of NAND devices). In this case, the path of the base
+ * image is stored in a "<image>.base" file next to it.
+ */
+static char*
+_getDataOverlayMarker( const char*  dataPath )
+{
+    char   temp[PATH_MAX], *p=temp, *end=p+sizeof(temp);
+
+    p = bufprint(temp, end, "%s.base", dataPath);
+    if (p >= end)
+        return NULL;
+
+    return ASTRDUP(temp);
+}
+
+/* create an empty overlay of 'srcPath' at 'dstPath'. this only works
+ * on filesystems that support sparse files, since the emulator relies
+ * on holes to know which blocks of the overlay were written.
+ */
+static int
+_createDataOverlay( const char*  dstPath, const char*  srcPath, const char*  marker )
+{
+#ifdef _WIN32
+    return -1;
+#else
+    struct stat  st;
+    uint64_t     size;
+    int          fd, ret;
+    FILE*        f;
+
+    if (path_get_size(srcPath, &size) < 0)
+        return -1;
+
+    fd = open(dstPath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return -1;
+
+    ret = ftruncate(fd, size);
+    if (ret == 0)
+        ret = fstat(fd, &st);
+    close(fd);
+
+    if (ret < 0 || (size > 0 && st.st_blocks != 0)) {
+        D("no sparse file support for %s", dstPath);
+        return -1;
+    }
+
+    f = fopen(marker, "w");
+    if (f == NULL)
+        return -1;
+    ret = fputs(srcPath, f);
+    if (fclose(f) != 0 || ret < 0) {
+        path_delete_file(marker);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+/* initialize the user data image at 'dstPath' from the initial image
+ * at 'srcPath'. if 'overlay' is set, try to create a thin overlay first,
+ * otherwise clone the initial image.
+ */
+static APosixStatus
+_initDataImage( AvdInfo*  i, const char*  dstPath, const char*  srcPath, int  overlay )
+{
+    char*  marker = _getDataOverlayMarker(dstPath);
+
+    AFREE(i->dataOverlayBase);
+    i->dataOverlayBase = NULL;
+
+    if (marker != NULL) {
+        if (path_exists(marker))
+            path_delete_file(marker);
+
+        if (overlay) {
+            if (_createDataOverlay(dstPath, srcPath, marker) == 0) {
+                D("created %s as an overlay of %s", dstPath, srcPath);
+                i->dataOverlayBase = ASTRDUP(srcPath);
+                AFREE(marker);
+                return 0;
+            }
+            dwarning("can't create a data overlay at %s, copying the data image",
+                     dstPath);
+        }
+        AFREE(marker);
+    }
+
+    return path_clone_file(dstPath, srcPath);
+}
+
+/* check whether the existing user data image at 'dataPath' is an overlay,
+ * and if so, record its base image.
+ */
+static void
+_loadDataOverlay( AvdInfo*  i, const char*  dataPath )
+{
+    char*   marker = _getDataOverlayMarker(dataPath);
+    char*   base;
+
+    if (marker == NULL || !path_exists(marker)) {
+        AFREE(marker);
+        return;
+    }
+
+    base = path_load_file(marker, NULL);
+    if (base == NULL || !path_exists(base)) {
+        derror("missing base image of the %s data overlay: %s\n"
+               "use -wipe-data to reset it",
+               dataPath, base ? base : marker);
+        exit(2);
+    }
+    D("data image %s is an overlay of %s", dataPath, base);
+
+    AFREE(i->dataOverlayBase);
+    i->dataOverlayBase = base;
+    AFREE(marker);
+}
+
 /* copy image file from a given source 
  * assumes locking is needed.
  */
@@ -581,7 +711,8 @@ imageLoader_copyFrom( ImageLoader*  l, const char*  srcPath )
     imageLoader_lock(l, 0);
 
     /* make the copy */
-    if (path_copy_file(dstPath, srcPath) < 0) {
+    if (_initDataImage(l->info, dstPath, srcPath,
+                       (l->params->flags & AVDINFO_DATA_OVERLAY) != 0) < 0) {
         derror("can't initialize %s image from SDK: %s: %s",
                l->imageText, dstPath, strerror(errno));
         exit(2);
@@ -780,6 +911,8 @@ _getImagePaths(AvdInfo*  i, AvdInfoParams*  params )
         /* lock the data partition image */
         l->pState[0] = IMAGE_STATE_MUSTLOCK;
         imageLoader_lock( l, 0 );
+        if (l->pPath[0] != NULL)
+            _loadDataOverlay(i, l->pPath[0]);
     }
 
     /* the cache partition: unless the user doesn't want one,
@@ -1174,6 +1307,7 @@ _getBuildImagePaths( AvdInfo*  i, AvdInfoParams*  params )
 #if CONFIG_ANDROID_SNAPSHOTS
     int   noSnapshots = (params->flags & AVDINFO_NO_SNAPSHOTS) != 0;
 #endif
+    int   isTemp      = 0;
 
     char         temp[PATH_MAX], *p=temp, *end=p+sizeof temp;
     char*        srcData;
@@ -1235,6 +1369,7 @@ _getBuildImagePaths( AvdInfo*  i, AvdInfoParams*  params )
         imageLoader_setPath(l, tempfile_path(temp));
         dwarning( "Another emulator is running. user data changes will *NOT* be saved");
         wipeData = 1;
+        isTemp   = 1;
     }
 
     /* in the case of a data wipe, copy userdata.img into
@@ -1245,12 +1380,15 @@ _getBuildImagePaths( AvdInfo*  i, AvdInfoParams*  params )
                    l->imageText, _imageFileNames[l->id]);
             exit(2);
         }
-        if (path_copy_file( l->pPath[0], srcData ) < 0) {
+        if (_initDataImage( i, l->pPath[0], srcData,
+                            !isTemp && (params->flags & AVDINFO_DATA_OVERLAY) ) < 0) {
             derror("could not initialize %s image from %s: %s",
                    l->imageText, temp, strerror(errno));
             exit(2);
         }
     }
+    else
+        _loadDataOverlay(i, l->pPath[0]);
 
     AFREE(srcData);
 
@@ -1462,6 +1600,12 @@ avdInfo_isImageReadOnly( AvdInfo*  i, AvdImageType  imageType )
     return (i->imageState[imageType] == IMAGE_STATE_READONLY);
 }
 
+const char*
+avdInfo_getDataOverlayBase( AvdInfo*  i )
+{
+    return i ? i->dataOverlayBase : NULL;
+}
+
 const char*
 avdInfo_getSkinName( AvdInfo*  i )
 {
@@ -98,6 +98,8 @@ typedef enum {
     /* use to ignore ignore state snapshot image (default or provided) */
     AVDINFO_NO_SNAPSHOTS = (1 << 5),
 #endif
+    /* use to create the data image as a thin overlay of the initial one */
+    AVDINFO_DATA_OVERLAY = (1 << 6),
 } AvdFlags;
 
 typedef struct {
@@ -152,6 +154,11 @@ uint64_t     avdInfo_getImageFileSize( AvdInfo*  i, AvdImageType  imageType );
  */
 int          avdInfo_isImageReadOnly( AvdInfo*  i, AvdImageType  imageType );
 
+/* Returns the path of the base image if the user data image is a thin
+ * overlay of it (see AVDINFO_DATA_OVERLAY), or NULL if it is a full image.
+ */
+const char*  avdInfo_getDataOverlayBase( AvdInfo*  i );
+
 /* lock an image file if it is writable. returns 0 on success, or -1
  * otherwise. note that if the file is read-only, it doesn't need to
  * be locked and the function will return success.
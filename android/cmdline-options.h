@@ -82,10 +82,12 @@ OPT_PARAM( snapshot,       "<name>", "name of snapshot within storage file for a
 OPT_FLAG ( no_snapshot,    "perform a full boot and do not do not auto-save, but qemu vmload and vmsave operate on snapstorage" )
 OPT_FLAG ( no_snapshot_save, "do not auto-save to snapshot on exit: abandon changed state" )
 OPT_FLAG ( no_snapshot_load, "do not auto-start from snapshot: perform a full boot" )
+OPT_FLAG ( snapshot_lazy_load, "auto-start from snapshot, restoring RAM on demand" )
 OPT_FLAG ( snapshot_list,  "show a list of available snapshots" )
 OPT_FLAG ( no_snapshot_update_time, "do not do try to correct snapshot time on restore" )
 #endif
 OPT_FLAG ( wipe_data, "reset the use data image (copy it from initdata)" )
+OPT_FLAG ( data_overlay, "create new user data images as thin overlays of initdata" )
 CFG_PARAM( avd, "<name>", "use a specific android virtual device" )
 CFG_PARAM( skindir, "<dir>", "search skins in <dir> (default <system>/skins)" )
 CFG_PARAM( skin, "<name>", "select a given skin" )
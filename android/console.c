@@ -2557,10 +2557,23 @@ do_create_framebuffer_service( ControlClient client, char* args )
     core_fb = corefb_create(client->sock, protocol, coredisplay_get_framebuffer());
     if (!coredisplay_attach_fb_service(core_fb)) {
         char reply_buf[4096];
+        const char* shared_path = corefb_get_shared_path(core_fb);
+        const char* encoding = corefb_get_encoding(core_fb);
+        char* p = reply_buf;
+        char* end = reply_buf + sizeof(reply_buf);
         framebuffer_client = client;
-        // Reply "OK" with the framebuffer's bits per pixel
-        snprintf(reply_buf, sizeof(reply_buf), "OK: -bitsperpixel=%d\r\n",
-                 corefb_get_bits_per_pixel(core_fb));
+        // Reply "OK" with the framebuffer's bits per pixel, followed by the
+        // encoding confirmation, and by the shared memory path, if pixels are
+        // not going to be sent over socket. The path must go last.
+        p = bufprint(p, end, "OK: -bitsperpixel=%d",
+                     corefb_get_bits_per_pixel(core_fb));
+        if (encoding != NULL) {
+            p = bufprint(p, end, " -encoding=%s", encoding);
+        }
+        if (shared_path != NULL) {
+            p = bufprint(p, end, " -shared=%s", shared_path);
+        }
+        bufprint(p, end, "\r\n");
         control_write( client, reply_buf);
     } else {
         control_write( client, "KO\r\n" );
@@ -0,0 +1,294 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/*
+ * Replays a stream of framebuffer frames through the encoder of the
+ * AFB_ENCODING_XOR_ZLIB framebuffer updates, and reports the number of bytes
+ * sent per frame with and without the encoding, and the encoding time.
+ *
+ * usage: framebuffer-bench [-w width] [-h height] [-b bits] [-n frames] [file]
+ *
+ * 'file' contains raw frames of 'width' x 'height' pixels of 'bits' bits,
+ * one after the other. It can be recorded from a running system with:
+ *
+ *   for i in $(seq 100); do adb shell cat /dev/graphics/fb0; done > frames
+ *
+ * Without a file, a synthetic stream is used: a list scrolling for the first
+ * half of the frames, then a blinking cursor, with a status bar clock that
+ * changes every 30 frames.
+ *
+ * Like the core service, frames are compared in 32x32 tiles, and the rows of
+ * adjacent damaged tiles are encoded as rectangles. Rows are not merged
+ * vertically, so the raw figure is slightly pessimistic for both encodings.
+ * Every encoded rectangle is decoded again, and checked against the frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "android/framebuffer-common.h"
+#include "android/framebuffer-encoder.h"
+
+#define AFB_TILE_SIZE   32
+
+static int  _width  = 1080;
+static int  _height = 1920;
+static int  _bpp    = 2;
+
+static double
+now_us(void)
+{
+    struct timeval  tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static void
+put_pixel(uint8_t* frame, int x, int y, int black)
+{
+    uint8_t* p = frame + (y * _width + x) * _bpp;
+    if (_bpp == 2) {
+        uint16_t pix = black ? 0x0000 : 0xffff;
+        memcpy(p, &pix, 2);
+    } else {
+        uint32_t pix = black ? 0xff000000 : 0xffffffff;
+        memcpy(p, &pix, 4);
+    }
+}
+
+/* Draws a line of pseudo-text: 12x24 pixel cells with random glyph bits. */
+static int
+text_pixel(unsigned line, int x, int y)
+{
+    unsigned h;
+    if (y < 12 || y >= 36 || x < 24) {
+        return 0;
+    }
+    h = (line * 7919u + (x / 12) * 104729u) * 2654435761u;
+    if ((h >> 28) < 3) {
+        return 0;   // space
+    }
+    return (h >> (((y - 12) / 4) * 3 + (x % 12) / 4)) & 1;
+}
+
+static void
+synth_frame(uint8_t* frame, int n, int frames)
+{
+    const int scroll = (n < frames / 2) ? n * 16 : (frames / 2) * 16;
+    const int cursor = (n >= frames / 2) && ((n / 15) & 1);
+    int x, y;
+
+    for (y = 0; y < _height; y++) {
+        for (x = 0; x < _width; x++) {
+            int black;
+            if (y < 48) {
+                // Status bar, the clock is on the right.
+                black = (x >= _width - 120) ? text_pixel(1000 + n / 30, x, y)
+                                            : text_pixel(999, x, y);
+            } else {
+                const int yy = y - 48 + scroll;
+                black = text_pixel(yy / 48, x, yy % 48);
+                if (cursor && y >= _height / 2 && y < _height / 2 + 32 &&
+                    x >= 200 && x < 204) {
+                    black = 1;
+                }
+            }
+            put_pixel(frame, x, y, black);
+        }
+    }
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: framebuffer-bench [-w width] [-h height] "
+                    "[-b bits] [-n frames] [file]\n");
+    exit(1);
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* path = NULL;
+    FILE* file = NULL;
+    int frames = 200;
+    int pitch, tiles_x, tiles_y;
+    size_t size;
+    uint8_t *frame, *sent, *ui, *delta, *pixels;
+    z_stream zenc, zdec;
+    long long raw_bytes = 0, enc_bytes = 0;
+    double enc_time = 0;
+    int damaged_frames = 0;
+    int n;
+
+    for (n = 1; n < argc; n++) {
+        if (argv[n][0] != '-') {
+            if (path != NULL) {
+                usage();
+            }
+            path = argv[n];
+            continue;
+        }
+        if (n + 1 == argc) {
+            usage();
+        }
+        if (!strcmp(argv[n], "-w")) {
+            _width = atoi(argv[++n]);
+        } else if (!strcmp(argv[n], "-h")) {
+            _height = atoi(argv[++n]);
+        } else if (!strcmp(argv[n], "-b")) {
+            _bpp = atoi(argv[++n]) / 8;
+        } else if (!strcmp(argv[n], "-n")) {
+            frames = atoi(argv[++n]);
+        } else {
+            usage();
+        }
+    }
+    if (_width <= 0 || _height <= 0 || frames <= 0 ||
+        (_bpp != 2 && _bpp != 4)) {
+        usage();
+    }
+    if (path != NULL) {
+        file = fopen(path, "rb");
+        if (file == NULL) {
+            perror(path);
+            return 1;
+        }
+    }
+
+    pitch = _width * _bpp;
+    size = (size_t)pitch * _height;
+    tiles_x = (_width + AFB_TILE_SIZE - 1) / AFB_TILE_SIZE;
+    tiles_y = (_height + AFB_TILE_SIZE - 1) / AFB_TILE_SIZE;
+    frame = malloc(size);
+    pixels = malloc(size);
+    // Both sides start off with the framebuffer filled with zeroes.
+    sent = calloc(1, size);
+    ui = calloc(1, size);
+    delta = malloc(size);
+    if (!frame || !pixels || !sent || !ui || !delta) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(&zenc, 0, sizeof(zenc));
+    memset(&zdec, 0, sizeof(zdec));
+    if (deflateInit(&zenc, Z_BEST_SPEED) != Z_OK ||
+        inflateInit(&zdec) != Z_OK) {
+        fprintf(stderr, "unable to initialize zlib\n");
+        return 1;
+    }
+
+    for (n = 0; n < frames; n++) {
+        int tx, ty, damaged = 0;
+
+        if (file != NULL) {
+            if (fread(frame, 1, size, file) != size) {
+                break;
+            }
+        } else {
+            synth_frame(frame, n, frames);
+        }
+
+        for (ty = 0; ty < tiles_y; ty++) {
+            const int y = ty * AFB_TILE_SIZE;
+            const int h = (_height - y < AFB_TILE_SIZE) ? _height - y
+                                                        : AFB_TILE_SIZE;
+            for (tx = 0; tx < tiles_x; ) {
+                int first = tx, x, w, yy;
+                size_t line_size, enc_size;
+                uint8_t* enc;
+                double start;
+
+                // Find a run of damaged tiles on this row.
+                for (; tx < tiles_x; tx++) {
+                    const int tw = (_width - tx * AFB_TILE_SIZE < AFB_TILE_SIZE) ?
+                            _width - tx * AFB_TILE_SIZE : AFB_TILE_SIZE;
+                    int changed = 0;
+                    for (yy = y; yy < y + h && !changed; yy++) {
+                        const size_t off = yy * pitch + tx * AFB_TILE_SIZE * _bpp;
+                        changed = memcmp(frame + off, sent + off, tw * _bpp);
+                    }
+                    if (!changed) {
+                        break;
+                    }
+                }
+                if (tx == first) {
+                    tx++;
+                    continue;
+                }
+                x = first * AFB_TILE_SIZE;
+                w = ((tx * AFB_TILE_SIZE < _width) ? tx * AFB_TILE_SIZE
+                                                   : _width) - x;
+                line_size = w * _bpp;
+                damaged = 1;
+
+                start = now_us();
+                fbencoder_xor_rect(delta, frame + y * pitch + x * _bpp,
+                                   sent + y * pitch + x * _bpp, pitch,
+                                   line_size, h);
+                enc = fbencoder_deflate(&zenc, delta, line_size * h, 0,
+                                        &enc_size);
+                enc_time += now_us() - start;
+
+                raw_bytes += sizeof(FBUpdateMessage) + line_size * h;
+                enc_bytes += sizeof(FBUpdateMessage) + sizeof(FBEncodedRect) +
+                             enc_size;
+
+                // Decode it the way the UI does.
+                zdec.next_in = enc;
+                zdec.avail_in = enc_size;
+                zdec.next_out = pixels;
+                zdec.avail_out = line_size * h + 1;
+                if (inflate(&zdec, Z_SYNC_FLUSH) != Z_OK ||
+                    zdec.avail_out != 1 || zdec.avail_in != 0) {
+                    fprintf(stderr, "frame %d: unable to decode rectangle\n", n);
+                    return 1;
+                }
+                for (yy = 0; yy < h; yy++) {
+                    uint8_t* dst = ui + (y + yy) * pitch + x * _bpp;
+                    const uint8_t* src = pixels + yy * line_size;
+                    size_t i;
+                    for (i = 0; i < line_size; i++) {
+                        dst[i] ^= src[i];
+                    }
+                }
+                free(enc);
+            }
+        }
+        if (memcmp(ui, frame, size)) {
+            fprintf(stderr, "frame %d: decoded pixels don't match\n", n);
+            return 1;
+        }
+        damaged_frames += damaged;
+    }
+    frames = n;
+    if (frames == 0) {
+        fprintf(stderr, "no frames\n");
+        return 1;
+    }
+
+    printf("%d frames of %dx%d at %d bits, %d with damage\n",
+           frames, _width, _height, _bpp * 8, damaged_frames);
+    printf("raw:      %10.0f bytes/frame\n", (double)raw_bytes / frames);
+    printf("xor-zlib: %10.0f bytes/frame (%.1f%%), %.0f us/frame to encode\n",
+           (double)enc_bytes / frames,
+           raw_bytes ? 100. * enc_bytes / raw_bytes : 0.,
+           enc_time / frames);
+
+    deflateEnd(&zenc);
+    inflateEnd(&zdec);
+    if (file != NULL) {
+        fclose(file);
+    }
+    return 0;
+}
@@ -31,6 +31,26 @@ typedef struct FBUpdateMessage {
     uint8_t rect[0];
 } FBUpdateMessage;
 
+/* Name of the encoding where each update rectangle is XOR-ed against the
+ * pixels previously sent for it, and compressed with zlib. Both sides keep a
+ * single zlib stream for the lifetime of the connection, and start off with
+ * the framebuffer filled with zeroes.
+ * The UI asks for an encoding by appending "-encoding=<name>" to the
+ * framebuffer service command. The core confirms it by appending the same
+ * parameter to the handshake reply. If the reply doesn't mention it, the
+ * pixels are sent raw. */
+#define AFB_ENCODING_XOR_ZLIB   "xor-zlib"
+
+/* Header of the data that follows FBUpdateMessage when an encoding has been
+ * negotiated for the connection. */
+typedef struct FBEncodedRect {
+    /* Number of bytes of encoded data that follow. */
+    uint32_t    size;
+
+    /* Encoded rectangle pixels. */
+    uint8_t     data[0];
+} FBEncodedRect;
+
 /* Requests the service to refresh framebuffer. */
 #define AFB_REQUEST_REFRESH     1
 
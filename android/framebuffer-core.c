@@ -22,8 +22,27 @@
 #include "android/async-utils.h"
 #include "android/framebuffer-common.h"
 #include "android/framebuffer-core.h"
+#include "android/framebuffer-encoder.h"
 #include "android/utils/system.h"
 #include "android/utils/debug.h"
+#include "android/utils/tempfile.h"
+#include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/* Size (in pixels) of the square tiles the damage map splits the framebuffer
+ * into. Only tiles whose pixels have actually changed since they were last
+ * sent to the UI are transferred. */
+#define AFB_TILE_SIZE   32
+
+/* Rectangle that is about to be sent to the UI. */
+typedef struct FBRect {
+    int x;
+    int y;
+    int w;
+    int h;
+} FBRect;
 
 /* Core framebuffer descriptor. */
 struct CoreFramebuffer {
@@ -53,6 +72,48 @@ struct CoreFramebuffer {
 
     /* Framebuffer request header. */
     FBRequestHeader         fb_req_header;
+
+    /* Copy of the framebuffer pixels as they were last seen by the service.
+     * Tiles are compared against this copy to find out which of them have
+     * changed. In the -shared protocol this is the memory shared with the
+     * UI, and update messages carry no pixels. */
+    uint8_t*                shadow;
+
+    /* Size of a single line in the shadow buffer. */
+    int                     shadow_pitch;
+
+    /* Total size of the shadow buffer. */
+    size_t                  shadow_size;
+
+    /* Number of tile columns and rows in the damage map. */
+    int                     tiles_x;
+    int                     tiles_y;
+
+    /* Damage map: non-zero for the tiles that have to be sent to the UI. */
+    uint8_t*                damage;
+
+    /* Number of non-zero entries in the damage map. */
+    int                     damage_count;
+
+    /* Scratch array used to collect rectangles when flushing the damage. */
+    FBRect*                 rects;
+
+    /* Temporary file backing the shared shadow buffer, or NULL if the pixels
+     * are sent over the socket. */
+    TempFile*               shared_file;
+
+    /* Boolean: non-zero if the updates are sent with AFB_ENCODING_XOR_ZLIB
+     * encoding. */
+    int                     encoded;
+
+    /* Pixels as the UI has them. Only used by encoded updates. */
+    uint8_t*                sent;
+
+    /* Scratch buffer for the XOR-ed rectangle. Only used by encoded updates. */
+    uint8_t*                delta;
+
+    /* Compressor for the encoded updates. */
+    z_stream                zstream;
 };
 
 /* Framebuffer update notification descriptor to the core. */
@@ -85,38 +146,135 @@ _pixel_offset(const QFrameBuffer* fb, int x, int y)
 }
 
 /*
- * Copies pixels from a framebuffer rectangle.
+ * Gets pointer in the shadow buffer for the given pixel.
+ * Param:
+ *  core_fb - CoreFramebuffer instance.
+ *  x, and y identify the pixel to get pointer for.
+ * Return:
+ *  Pointer in the shadow buffer for the given pixel.
+ */
+static uint8_t*
+_shadow_offset(const CoreFramebuffer* core_fb, int x, int y)
+{
+    return core_fb->shadow + y * core_fb->shadow_pitch +
+           x * core_fb->fb->bytes_per_pixel;
+}
+
+/*
+ * Copies pixels of a rectangle in the shadow buffer.
  * Param:
  *  rect - Buffer where to copy pixel.
- *  fb - Framebuffer containing the rectangle to copy.
+ *  core_fb - CoreFramebuffer instance.
  *  x, y, w, and h - dimensions of the rectangle to copy.
  */
 static void
-_copy_fb_rect(uint8_t* rect, const QFrameBuffer* fb, int x, int y, int w, int h)
+_copy_shadow_rect(uint8_t* rect, const CoreFramebuffer* core_fb,
+                  int x, int y, int w, int h)
 {
-    const uint8_t* start = _pixel_offset(fb, x, y);
+    const uint8_t* start = _shadow_offset(core_fb, x, y);
+    const size_t line_size = w * core_fb->fb->bytes_per_pixel;
     for (; h > 0; h--) {
-        memcpy(rect, start, w * fb->bytes_per_pixel);
-        start += fb->pitch;
-        rect += w * fb->bytes_per_pixel;
+        memcpy(rect, start, line_size);
+        start += core_fb->shadow_pitch;
+        rect += line_size;
+    }
+}
+
+/*
+ * Synchronizes a tile in the shadow buffer with the framebuffer.
+ * Param:
+ *  core_fb - CoreFramebuffer instance.
+ *  fb - Framebuffer containing pixels.
+ *  tx, ty - Column and row of the tile in the damage map.
+ * Return:
+ *  Boolean: 1 if the tile has changed since it has been synchronized last
+ *  time, or 0 if it has not.
+ */
+static int
+_sync_tile(CoreFramebuffer* core_fb, const QFrameBuffer* fb, int tx, int ty)
+{
+    const int x = tx * AFB_TILE_SIZE;
+    const int y = ty * AFB_TILE_SIZE;
+    const int w = MIN(AFB_TILE_SIZE, fb->width - x);
+    int h = MIN(AFB_TILE_SIZE, fb->height - y);
+    const size_t line_size = w * fb->bytes_per_pixel;
+    const uint8_t* src = _pixel_offset(fb, x, y);
+    uint8_t* dst = _shadow_offset(core_fb, x, y);
+    int changed = 0;
+
+    for (; h > 0; h--) {
+        // Once a difference is found the rest of the tile is copied blindly.
+        if (changed || memcmp(dst, src, line_size)) {
+            memcpy(dst, src, line_size);
+            changed = 1;
+        }
+        src += fb->pitch;
+        dst += core_fb->shadow_pitch;
     }
+    return changed;
+}
+
+/*
+ * Allocates and initializes framebuffer update notification descriptor for
+ * a rectangle encoded with AFB_ENCODING_XOR_ZLIB encoding.
+ * Param:
+ *  core_fb - CoreFramebuffer instance.
+ *  x, y, w, and h identify the rectangle that is being updated.
+ * Return:
+ *  Initialized framebuffer update notification descriptor.
+ */
+static FBUpdateNotify*
+fbupdatenotify_create_encoded(CoreFramebuffer* core_fb,
+                              int x, int y, int w, int h)
+{
+    const size_t line_size = w * core_fb->fb->bytes_per_pixel;
+    const uint8_t* cur = _shadow_offset(core_fb, x, y);
+    FBUpdateNotify* ret;
+    FBEncodedRect* enc;
+    size_t size;
+
+    fbencoder_xor_rect(core_fb->delta, cur,
+                       core_fb->sent + (cur - core_fb->shadow),
+                       core_fb->shadow_pitch, line_size, h);
+    ret = fbencoder_deflate(&core_fb->zstream, core_fb->delta, line_size * h,
+                            sizeof(FBUpdateNotify) + sizeof(FBEncodedRect),
+                            &size);
+    enc = (FBEncodedRect*)ret->message.rect;
+    enc->size = size;
+
+    ret->next_fb_update = NULL;
+    ret->core_fb = core_fb;
+    ret->message_size = sizeof(FBUpdateMessage) + sizeof(FBEncodedRect) +
+                        enc->size;
+    ret->message.x = x;
+    ret->message.y = y;
+    ret->message.w = w;
+    ret->message.h = h;
+    return ret;
 }
 
 /*
  * Allocates and initializes framebuffer update notification descriptor.
  * Param:
- *  ds - Display state for the framebuffer.
- *  fb Framebuffer containing pixels.
+ *  core_fb - CoreFramebuffer instance.
  *  x, y, w, and h identify the rectangle that is being updated.
  * Return:
  *  Initialized framebuffer update notification descriptor.
  */
 static FBUpdateNotify*
-fbupdatenotify_create(CoreFramebuffer* core_fb, const QFrameBuffer* fb,
-                      int x, int y, int w, int h)
+fbupdatenotify_create(CoreFramebuffer* core_fb, int x, int y, int w, int h)
 {
-    const size_t rect_size = w * h * fb->bytes_per_pixel;
-    FBUpdateNotify* ret = malloc(sizeof(FBUpdateNotify) + rect_size);
+    // With the -shared protocol the UI picks the pixels from the shared
+    // memory, so only the rectangle is sent over the socket.
+    const size_t rect_size = (core_fb->shared_file != NULL) ? 0 :
+                                    w * h * core_fb->fb->bytes_per_pixel;
+    FBUpdateNotify* ret;
+
+    if (core_fb->encoded) {
+        return fbupdatenotify_create_encoded(core_fb, x, y, w, h);
+    }
+
+    ret = malloc(sizeof(FBUpdateNotify) + rect_size);
 
     ret->next_fb_update = NULL;
     ret->core_fb = core_fb;
@@ -125,7 +283,9 @@ fbupdatenotify_create(CoreFramebuffer* core_fb, const QFrameBuffer* fb,
     ret->message.y = y;
     ret->message.w = w;
     ret->message.h = h;
-    _copy_fb_rect(ret->message.rect, fb, x, y, w, h);
+    if (rect_size != 0) {
+        _copy_shadow_rect(ret->message.rect, core_fb, x, y, w, h);
+    }
     return ret;
 }
 
@@ -145,6 +305,8 @@ fbupdatenotify_delete(FBUpdateNotify* desc)
 /* Implemented in android/console.c */
 extern void destroy_control_fb_client(void);
 
+static void _corefb_flush_damage(CoreFramebuffer* core_fb);
+
 /*
  * Asynchronous write I/O callback launched when writing framebuffer
  * notifications to the socket.
@@ -188,6 +350,117 @@ corefb_io_write(CoreFramebuffer* core_fb)
                              &core_fb->io);
         }
     }
+
+    // All queued updates are sent. Send tiles that got damaged meanwhile.
+    _corefb_flush_damage(core_fb);
+}
+
+/*
+ * Collects damaged tiles into update notifications, and starts sending them.
+ * Horizontally adjacent damaged tiles are sent as a single rectangle, and so
+ * are the rows of tiles that share the same horizontal span. The damage is
+ * left untouched while there are still updates being sent: the tiles are
+ * picked up, with their most recent pixels, once the socket drains.
+ * Param:
+ *  core_fb - CoreFramebuffer instance.
+ */
+static void
+_corefb_flush_damage(CoreFramebuffer* core_fb)
+{
+    const QFrameBuffer* fb = core_fb->fb;
+    int num_rects = 0;
+    int prev_row = 0;
+    int tx, ty, n;
+
+    if (core_fb->damage_count == 0 || core_fb->fb_update_head != NULL) {
+        return;
+    }
+
+    for (ty = 0; ty < core_fb->tiles_y; ty++) {
+        const uint8_t* row = core_fb->damage + ty * core_fb->tiles_x;
+        const int y = ty * AFB_TILE_SIZE;
+        const int h = MIN(AFB_TILE_SIZE, fb->height - y);
+        const int row_start = num_rects;
+        int next_row = -1;
+
+        for (tx = 0; tx < core_fb->tiles_x; tx++) {
+            const int first = tx;
+            int x, w;
+            if (!row[tx]) {
+                continue;
+            }
+            while (tx < core_fb->tiles_x && row[tx]) {
+                tx++;
+            }
+            x = first * AFB_TILE_SIZE;
+            w = MIN(tx * AFB_TILE_SIZE, fb->width) - x;
+
+            // Extend a rectangle that ends right above this row of tiles if
+            // it covers the same span, or start a new one.
+            for (n = prev_row; n < row_start; n++) {
+                FBRect* r = &core_fb->rects[n];
+                if (r->x == x && r->w == w && r->y + r->h == y) {
+                    r->h += h;
+                    break;
+                }
+            }
+            if (n == row_start) {
+                FBRect* r = &core_fb->rects[num_rects];
+                r->x = x;
+                r->y = y;
+                r->w = w;
+                r->h = h;
+                n = num_rects++;
+            }
+            if (next_row < 0 || n < next_row) {
+                next_row = n;
+            }
+        }
+        // Rectangles listed before the first one that reaches this row of
+        // tiles can't be extended any further.
+        prev_row = (next_row < 0) ? num_rects : next_row;
+    }
+    memset(core_fb->damage, 0, core_fb->tiles_x * core_fb->tiles_y);
+    core_fb->damage_count = 0;
+
+    for (n = 0; n < num_rects; n++) {
+        const FBRect* r = &core_fb->rects[n];
+        FBUpdateNotify* descr =
+            fbupdatenotify_create(core_fb, r->x, r->y, r->w, r->h);
+        if (core_fb->fb_update_tail != NULL) {
+            core_fb->fb_update_tail->next_fb_update = descr;
+        } else {
+            core_fb->fb_update_head = descr;
+        }
+        core_fb->fb_update_tail = descr;
+    }
+
+    if (core_fb->fb_update_head != NULL) {
+        asyncWriter_init(&core_fb->fb_update_writer,
+                         &core_fb->fb_update_head->message,
+                         core_fb->fb_update_head->message_size, &core_fb->io);
+        corefb_io_write(core_fb);
+    }
+}
+
+/*
+ * Marks the entire framebuffer as damaged, and sends it to the UI.
+ * Param:
+ *  core_fb - CoreFramebuffer instance.
+ */
+static void
+_corefb_refresh(CoreFramebuffer* core_fb)
+{
+    const QFrameBuffer* fb = core_fb->fb;
+    int y;
+
+    for (y = 0; y < fb->height; y++) {
+        memcpy(_shadow_offset(core_fb, 0, y), _pixel_offset(fb, 0, y),
+               fb->width * fb->bytes_per_pixel);
+    }
+    core_fb->damage_count = core_fb->tiles_x * core_fb->tiles_y;
+    memset(core_fb->damage, 1, core_fb->damage_count);
+    _corefb_flush_damage(core_fb);
 }
 
 /*
@@ -208,8 +481,7 @@ corefb_io_read(CoreFramebuffer* core_fb)
             switch (core_fb->fb_req_header.request_type) {
                 case AFB_REQUEST_REFRESH:
                     // Force full screen update to be sent
-                    corefb_update(core_fb, core_fb->fb,
-                                  0, 0, core_fb->fb->width, core_fb->fb->height);
+                    _corefb_refresh(core_fb);
                     break;
                 default:
                     derror("Unknown framebuffer request %d\n",
@@ -250,10 +522,53 @@ corefb_io_func(void* opaque, int fd, unsigned events)
     }
 }
 
+#ifndef _WIN32
+/*
+ * Places the shadow buffer into a file mapping that can be shared with a UI
+ * running on the same host.
+ * Param:
+ *  core_fb - CoreFramebuffer instance.
+ * Return:
+ *  0 on success, or -1 on failure.
+ */
+static int
+_corefb_create_shared(CoreFramebuffer* core_fb)
+{
+    void* mapped;
+    int fd;
+
+    core_fb->shared_file = tempfile_create();
+    if (core_fb->shared_file == NULL) {
+        return -1;
+    }
+    fd = open(tempfile_path(core_fb->shared_file), O_RDWR);
+    if (fd < 0 || ftruncate(fd, core_fb->shadow_size) < 0) {
+        goto fail;
+    }
+    mapped = mmap(NULL, core_fb->shadow_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        goto fail;
+    }
+    // The mapping keeps its own reference to the file.
+    close(fd);
+    core_fb->shadow = mapped;
+    return 0;
+
+fail:
+    derror("Unable to create shared framebuffer memory: %s\n", errno_str);
+    if (fd >= 0) {
+        close(fd);
+    }
+    tempfile_close(core_fb->shared_file);
+    core_fb->shared_file = NULL;
+    return -1;
+}
+#endif  // _WIN32
+
 CoreFramebuffer*
 corefb_create(int sock, const char* protocol, QFrameBuffer* fb)
 {
-    // At this point we're implementing the -raw protocol only.
     CoreFramebuffer* ret;
     ANEW0(ret);
     ret->sock = sock;
@@ -261,6 +576,32 @@ corefb_create(int sock, const char* protocol, QFrameBuffer* fb)
     ret->fb = fb;
     ret->fb_update_head = NULL;
     ret->fb_update_tail = NULL;
+    ret->tiles_x = (fb->width + AFB_TILE_SIZE - 1) / AFB_TILE_SIZE;
+    ret->tiles_y = (fb->height + AFB_TILE_SIZE - 1) / AFB_TILE_SIZE;
+    AARRAY_NEW0(ret->damage, ret->tiles_x * ret->tiles_y);
+    AARRAY_NEW(ret->rects, ret->tiles_x * ret->tiles_y);
+    ret->shadow_pitch = fb->width * fb->bytes_per_pixel;
+    ret->shadow_size = ret->shadow_pitch * fb->height;
+#ifndef _WIN32
+    // If shared memory can't be set up here, pixels are sent over the socket.
+    // The UI finds out about that from the handshake reply.
+    if (!strncmp(protocol, "-shared", 7)) {
+        _corefb_create_shared(ret);
+    }
+#endif  // _WIN32
+    if (ret->shadow == NULL) {
+        AARRAY_NEW0(ret->shadow, ret->shadow_size);
+        // Encoding only makes sense for the pixels sent over the socket.
+        if (strstr(protocol, "-encoding=" AFB_ENCODING_XOR_ZLIB) != NULL) {
+            if (deflateInit(&ret->zstream, Z_BEST_SPEED) == Z_OK) {
+                ret->encoded = 1;
+                AARRAY_NEW0(ret->sent, ret->shadow_size);
+                AARRAY_NEW(ret->delta, ret->shadow_size);
+            } else {
+                derror("Unable to initialize framebuffer compression\n");
+            }
+        }
+    }
     loopIo_init(&ret->io, ret->looper, sock, corefb_io_func, ret);
     asyncReader_init(&ret->fb_req_reader, &ret->fb_req_header,
                      sizeof(ret->fb_req_header), &ret->io);
@@ -284,6 +625,31 @@ corefb_destroy(CoreFramebuffer* core_fb)
             looper_free(core_fb->looper);
             core_fb->looper = NULL;
         }
+        if (core_fb->shadow != NULL) {
+#ifndef _WIN32
+            if (core_fb->shared_file != NULL) {
+                munmap(core_fb->shadow, core_fb->shadow_size);
+                tempfile_close(core_fb->shared_file);
+                core_fb->shared_file = NULL;
+            } else
+#endif  // _WIN32
+            {
+                AFREE(core_fb->shadow);
+            }
+            core_fb->shadow = NULL;
+        }
+        if (core_fb->encoded) {
+            deflateEnd(&core_fb->zstream);
+            AFREE(core_fb->sent);
+            core_fb->sent = NULL;
+            AFREE(core_fb->delta);
+            core_fb->delta = NULL;
+            core_fb->encoded = 0;
+        }
+        AFREE(core_fb->damage);
+        core_fb->damage = NULL;
+        AFREE(core_fb->rects);
+        core_fb->rects = NULL;
     }
 }
 
@@ -291,35 +657,37 @@ void
 corefb_update(CoreFramebuffer* core_fb,
               struct QFrameBuffer* fb, int x, int y, int w, int h)
 {
-    AsyncStatus status;
-    FBUpdateNotify* descr = fbupdatenotify_create(core_fb, fb, x, y, w, h);
+    int tx, ty, tx_end, ty_end;
 
-    // Lets see if we should list it behind other pending updates.
-    if (core_fb->fb_update_tail != NULL) {
-        core_fb->fb_update_tail->next_fb_update = descr;
-        core_fb->fb_update_tail = descr;
+    // Clip the rectangle to the framebuffer.
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    w = MIN(w, fb->width - x);
+    h = MIN(h, fb->height - y);
+    if (w <= 0 || h <= 0) {
         return;
     }
 
-    // We're first in the list. Just send it now.
-    core_fb->fb_update_head = core_fb->fb_update_tail = descr;
-    asyncWriter_init(&core_fb->fb_update_writer,
-                     &core_fb->fb_update_head->message,
-                     core_fb->fb_update_head->message_size, &core_fb->io);
-    status = asyncWriter_write(&core_fb->fb_update_writer, &core_fb->io);
-    switch (status) {
-        case ASYNC_COMPLETE:
-            fbupdatenotify_delete(descr);
-            core_fb->fb_update_head = core_fb->fb_update_tail = NULL;
-            return;
-        case ASYNC_ERROR:
-            fbupdatenotify_delete(descr);
-            core_fb->fb_update_head = core_fb->fb_update_tail = NULL;
-            return;
-        case ASYNC_NEED_MORE:
-            // Update transfer will eventually complete in corefb_io_func
-            return;
+    // Find out which of the tiles touched by the rectangle really changed.
+    tx_end = (x + w - 1) / AFB_TILE_SIZE;
+    ty_end = (y + h - 1) / AFB_TILE_SIZE;
+    for (ty = y / AFB_TILE_SIZE; ty <= ty_end; ty++) {
+        uint8_t* row = core_fb->damage + ty * core_fb->tiles_x;
+        for (tx = x / AFB_TILE_SIZE; tx <= tx_end; tx++) {
+            if (_sync_tile(core_fb, fb, tx, ty) && !row[tx]) {
+                row[tx] = 1;
+                core_fb->damage_count++;
+            }
+        }
     }
+
+    _corefb_flush_damage(core_fb);
 }
 
 int
@@ -328,3 +696,16 @@ corefb_get_bits_per_pixel(CoreFramebuffer* core_fb)
     return (core_fb != NULL && core_fb->fb != NULL) ?
                                                 core_fb->fb->bits_per_pixel : -1;
 }
+
+const char*
+corefb_get_shared_path(CoreFramebuffer* core_fb)
+{
+    return (core_fb != NULL && core_fb->shared_file != NULL) ?
+                                    tempfile_path(core_fb->shared_file) : NULL;
+}
+
+const char*
+corefb_get_encoding(CoreFramebuffer* core_fb)
+{
+    return (core_fb != NULL && core_fb->encoded) ? AFB_ENCODING_XOR_ZLIB : NULL;
+}
@@ -29,6 +29,9 @@ typedef struct CoreFramebuffer CoreFramebuffer;
  *      supported values ar:
  *      -raw Transfers the updating rectangle buffer over the socket.
  *      -shared Used a shared memory to transfer the updating rectangle buffer.
+ *          Falls back to -raw if shared memory can't be created.
+ *      The protocol can be followed by -encoding=<name> parameter, selecting
+ *      encoding for the pixels sent over the socket. See AFB_ENCODING_XXX.
  *  fb - Framebuffer descriptor for this service.
  * Return:
  *  Framebuffer service descriptor.
@@ -61,4 +64,25 @@ void corefb_update(CoreFramebuffer* core_fb, struct QFrameBuffer* fb,
  */
 int corefb_get_bits_per_pixel(CoreFramebuffer* core_fb);
 
+/*
+ * Gets path to the file that is mapped to the memory shared with the UI.
+ * Param:
+ *  core_fb - Framebuffer service descriptor created with corefb_create
+ * Return:
+ *  Path to the shared memory file, or NULL if pixels are sent over the
+ *  socket. The shared memory contains framebuffer pixels, with lines
+ *  that are framebuffer width * bytes per pixel long.
+ */
+const char* corefb_get_shared_path(CoreFramebuffer* core_fb);
+
+/*
+ * Gets encoding used for the pixels sent over the socket.
+ * Param:
+ *  core_fb - Framebuffer service descriptor created with corefb_create
+ * Return:
+ *  Name of the encoding (one of AFB_ENCODING_XXX), or NULL if raw pixels are
+ *  sent.
+ */
+const char* corefb_get_encoding(CoreFramebuffer* core_fb);
+
 #endif /* _ANDROID_FRAMEBUFFER_CORE_H */
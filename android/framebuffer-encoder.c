@@ -0,0 +1,67 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/*
+ * Contains the encoder of the framebuffer updates sent with
+ * AFB_ENCODING_XOR_ZLIB encoding.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "android/framebuffer-encoder.h"
+
+void
+fbencoder_xor_rect(uint8_t* delta, const uint8_t* cur, uint8_t* sent,
+                   int pitch, size_t line_size, int h)
+{
+    size_t i;
+
+    for (; h > 0; h--) {
+        for (i = 0; i < line_size; i++) {
+            delta[i] = cur[i] ^ sent[i];
+        }
+        memcpy(sent, cur, line_size);
+        cur += pitch;
+        sent += pitch;
+        delta += line_size;
+    }
+}
+
+void*
+fbencoder_deflate(z_stream* zs, const uint8_t* delta, size_t size,
+                  size_t offset, size_t* encoded_size)
+{
+    // Extra room is for the sync flush marker.
+    size_t capacity = deflateBound(zs, size) + 16;
+    uint8_t* ret = malloc(offset + capacity);
+
+    zs->next_in = (Bytef*)delta;
+    zs->avail_in = size;
+    zs->next_out = ret + offset;
+    zs->avail_out = capacity;
+    for (;;) {
+        size_t used;
+        // Sync flush makes the rectangle decodable as soon as it is received,
+        // while keeping the dictionary for the rectangles that follow.
+        deflate(zs, Z_SYNC_FLUSH);
+        if (zs->avail_out != 0) {
+            break;
+        }
+        used = capacity;
+        capacity *= 2;
+        ret = realloc(ret, offset + capacity);
+        zs->next_out = ret + offset + used;
+        zs->avail_out = capacity - used;
+    }
+    *encoded_size = capacity - zs->avail_out;
+    return ret;
+}
@@ -0,0 +1,57 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/*
+ * Contains the encoder of the framebuffer updates sent with
+ * AFB_ENCODING_XOR_ZLIB encoding. It is used by the core framebuffer
+ * service, and by the framebuffer-bench tool.
+ */
+
+#ifndef _ANDROID_FRAMEBUFFER_ENCODER_H
+#define _ANDROID_FRAMEBUFFER_ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/*
+ * XORs a rectangle against the pixels the UI has, so pixels that didn't
+ * change turn into runs of zeroes, and copies the rectangle to the UI pixels.
+ * Param:
+ *  delta - Buffer receiving the 'line_size' * 'h' bytes of XOR-ed pixels.
+ *  cur - First line of the rectangle in the current pixels.
+ *  sent - First line of the rectangle in the pixels the UI has.
+ *  pitch - Size of a line in 'cur' and 'sent'.
+ *  line_size - Size of a line of the rectangle, in bytes.
+ *  h - Number of lines in the rectangle.
+ */
+extern void fbencoder_xor_rect(uint8_t* delta, const uint8_t* cur,
+                               uint8_t* sent, int pitch,
+                               size_t line_size, int h);
+
+/*
+ * Compresses XOR-ed pixels with the connection's zlib stream. The stream is
+ * sync flushed, so the data can be decoded as soon as it is received.
+ * Param:
+ *  zs - zlib stream of the connection.
+ *  delta, size - XOR-ed pixels to compress.
+ *  offset - Number of bytes to reserve for the caller in front of the data.
+ *  encoded_size - Upon return contains the size of the compressed data.
+ * Return:
+ *  Buffer allocated with malloc, containing 'offset' bytes of room followed
+ *  by the compressed data.
+ */
+extern void* fbencoder_deflate(z_stream* zs, const uint8_t* delta,
+                               size_t size, size_t offset,
+                               size_t* encoded_size);
+
+#endif /* _ANDROID_FRAMEBUFFER_ENCODER_H */
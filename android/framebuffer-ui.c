@@ -15,11 +15,18 @@
  * from the core.
  */
 
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "android/framebuffer-common.h"
 #include "android/framebuffer-ui.h"
 #include "android/utils/system.h"
 #include "android/utils/debug.h"
+#include "android/utils/mapfile.h"
 #include "android/sync-utils.h"
+#include <zlib.h>
 
 #define  PANIC(...) do { fprintf(stderr, __VA_ARGS__);  \
                          exit(1);                       \
@@ -32,6 +39,9 @@ typedef enum ClientFBState {
     /* The reader is waiting on update header. */
     WAIT_HEADER,
 
+    /* The reader is waiting on encoded rectangle header. */
+    WAIT_ENCODED_HEADER,
+
     /* The reader is waiting on pixels. */
     WAIT_PIXELS,
 } ClientFBState;
@@ -66,6 +76,41 @@ struct ClientFramebuffer {
 
     /* Number of bits used to encode single pixel. */
     int             bits_per_pixel;
+
+    /* Buffer where pixels streamed over the socket are read into. */
+    uint8_t*        pixels_buffer;
+
+    /* Allocated size of the pixels buffer. */
+    size_t          pixels_buffer_size;
+
+    /* Base address of the memory shared with the core, or NULL if pixels
+     * are streamed over the socket. */
+    void*           shared_base;
+
+    /* Size of the mapping at shared_base. */
+    size_t          shared_size;
+
+    /* Framebuffer pixels in the memory shared with the core. */
+    const uint8_t*  shared_pixels;
+
+    /* Size of a single line of pixels in the shared memory. */
+    size_t          shared_pitch;
+
+    /* Boolean: non-zero if the core sends updates with AFB_ENCODING_XOR_ZLIB
+     * encoding. */
+    int             encoded;
+
+    /* Current encoded rectangle header. */
+    FBEncodedRect   encoded_header;
+
+    /* Buffer where encoded pixels are read into. */
+    uint8_t*        encoded_buffer;
+
+    /* Allocated size of the encoded pixels buffer. */
+    size_t          encoded_buffer_size;
+
+    /* Decompressor for the encoded updates. */
+    z_stream        zstream;
 };
 
 /* The only instance of framebuffer client. */
@@ -77,26 +122,162 @@ static ClientFramebuffer _client_fb;
  *  fb - Framebuffer where to update the rectangle.
  *  x, y, w, and h define rectangle to update.
  *  bits_per_pixel define number of bits used to encode a single pixel.
- *  pixels contains pixels for the rectangle. Buffer addressed by this parameter
- *      must be eventually freed with free()
+ *  pixels contains pixels for the rectangle.
+ *  pitch - Size of a single line in the pixels buffer.
  */
 static void
 update_rect(QFrameBuffer* fb, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-            uint8_t bits_per_pixel, uint8_t* pixels)
+            uint8_t bits_per_pixel, const uint8_t* pixels, size_t pitch)
 {
     if (fb != NULL) {
         uint16_t n;
         const uint8_t* src = pixels;
         const uint16_t src_line_size = w * ((bits_per_pixel + 7) / 8);
         uint8_t* dst  = (uint8_t*)fb->pixels + y * fb->pitch + x * fb->bytes_per_pixel;
-        for (n = 0; n < h; n++) {
-            memcpy(dst, src, src_line_size);
-            src += src_line_size;
-            dst += fb->pitch;
+
+        if (x + w > fb->width || y + h > fb->height) {
+            derror("Framebuffer update %dx%d at %d,%d is out of bounds\n",
+                   w, h, x, y);
+            return;
+        }
+        if (pitch == fb->pitch && src_line_size == fb->pitch) {
+            memcpy(dst, src, h * pitch);
+        } else {
+            for (n = 0; n < h; n++) {
+                memcpy(dst, src, src_line_size);
+                src += pitch;
+                dst += fb->pitch;
+            }
         }
         qframebuffer_update(fb, x, y, w, h);
     }
-    free(pixels);
+}
+
+/*
+ * Maps memory shared with the core.
+ * Param:
+ *  fb_client - ClientFramebuffer instance.
+ *  path - Path to the file backing the shared memory.
+ * Return:
+ *  0 on success, or -1 on failure.
+ */
+static int
+_clientfb_map_shared(ClientFramebuffer* fb_client, const char* path)
+{
+    struct stat st;
+    MapFile* handle;
+    void* pixels;
+
+    fb_client->shared_pitch = fb_client->fb->width *
+                              ((fb_client->bits_per_pixel + 7) / 8);
+    fb_client->shared_size = fb_client->shared_pitch * fb_client->fb->height;
+    if (stat(path, &st) < 0 || (size_t)st.st_size < fb_client->shared_size) {
+        derror("Invalid shared framebuffer file %s\n", path);
+        return -1;
+    }
+    handle = mapfile_open(path, O_RDONLY, S_IREAD | S_IWRITE);
+    if (!mapfile_is_valid(handle)) {
+        derror("Unable to open shared framebuffer file %s: %s\n",
+               path, errno_str);
+        return -1;
+    }
+    fb_client->shared_base = mapfile_map(handle, 0, fb_client->shared_size,
+                                         PROT_READ, &pixels,
+                                         &fb_client->shared_size);
+    // The mapping keeps its own reference to the file.
+    mapfile_close(handle);
+    if (fb_client->shared_base == NULL) {
+        derror("Unable to map shared framebuffer file %s: %s\n",
+               path, errno_str);
+        return -1;
+    }
+    fb_client->shared_pixels = pixels;
+    return 0;
+}
+
+/*
+ * Makes sure that a buffer is big enough. The buffer is reused for all
+ * updates, and only grows.
+ * Param:
+ *  buffer, buffer_size - Buffer, and its allocated size.
+ *  size - Number of bytes the buffer must fit.
+ */
+static void
+_ensure_buffer(uint8_t** buffer, size_t* buffer_size, size_t size)
+{
+    if (size > *buffer_size) {
+        free(*buffer);
+        *buffer = malloc(size);
+        if (*buffer == NULL) {
+            PANIC("Unable to allocate memory for framebuffer update\n");
+        }
+        *buffer_size = size;
+    }
+}
+
+/*
+ * Decodes a rectangle encoded with AFB_ENCODING_XOR_ZLIB encoding, and
+ * updates the display with it.
+ * Param:
+ *  fb_client - ClientFramebuffer instance.
+ * Return:
+ *  0 on success, or -1 if the rectangle could not be decoded, or applied to
+ *  the display.
+ */
+static int
+_clientfb_update_encoded(ClientFramebuffer* fb_client)
+{
+    const FBUpdateMessage* hdr = &fb_client->update_header;
+    QFrameBuffer* fb = fb_client->fb;
+    const size_t line_size = hdr->w * (fb_client->bits_per_pixel / 8);
+    const size_t rect_size = line_size * hdr->h;
+    z_stream* zs = &fb_client->zstream;
+    const uint8_t* src;
+    uint8_t* dst;
+    size_t i;
+    int n;
+
+    // The rectangle is a difference against the display pixels. If it can't
+    // be applied to them, they no longer match what the core has, and every
+    // rectangle that follows would be decoded against the wrong reference.
+    if (fb == NULL) {
+        derror("Framebuffer update received without a display\n");
+        return -1;
+    }
+    if (hdr->x + hdr->w > fb->width || hdr->y + hdr->h > fb->height ||
+        fb->bytes_per_pixel != fb_client->bits_per_pixel / 8) {
+        derror("Framebuffer update %dx%d at %d,%d does not match the display\n",
+               hdr->w, hdr->h, hdr->x, hdr->y);
+        return -1;
+    }
+
+    // One extra byte of room lets inflate consume the sync flush marker that
+    // follows the pixels, and catches rectangles that decode too long.
+    _ensure_buffer(&fb_client->pixels_buffer, &fb_client->pixels_buffer_size,
+                   rect_size + 1);
+    zs->next_in = fb_client->encoded_buffer;
+    zs->avail_in = fb_client->encoded_header.size;
+    zs->next_out = fb_client->pixels_buffer;
+    zs->avail_out = rect_size + 1;
+    n = inflate(zs, Z_SYNC_FLUSH);
+    if (n != Z_OK || zs->avail_out != 1 || zs->avail_in != 0) {
+        derror("Unable to decode framebuffer update: %s\n",
+               zs->msg ? zs->msg : "truncated rectangle");
+        return -1;
+    }
+
+    // Rectangle contains the difference from what is on the display.
+    src = fb_client->pixels_buffer;
+    dst = (uint8_t*)fb->pixels + hdr->y * fb->pitch + hdr->x * fb->bytes_per_pixel;
+    for (n = 0; n < hdr->h; n++) {
+        for (i = 0; i < line_size; i++) {
+            dst[i] ^= src[i];
+        }
+        src += line_size;
+        dst += fb->pitch;
+    }
+    qframebuffer_update(fb, hdr->x, hdr->y, hdr->w, hdr->h);
+    return 0;
 }
 
 /*
@@ -138,31 +319,70 @@ _clientfb_read_cb(void* opaque)
         }
 
         // All expected data has been read. Time to change the state.
-        if (fb_client->fb_state == WAIT_HEADER) {
+        if (fb_client->fb_state == WAIT_HEADER &&
+            fb_client->shared_pixels != NULL) {
+            // Pixels are already in the shared memory. Only the header is
+            // sent over the socket.
+            const FBUpdateMessage* hdr = &fb_client->update_header;
+            const size_t bpp = (fb_client->bits_per_pixel + 7) / 8;
+
+            fb_client->reader_offset = 0;
+            update_rect(fb_client->fb, hdr->x, hdr->y, hdr->w, hdr->h,
+                        fb_client->bits_per_pixel,
+                        fb_client->shared_pixels +
+                            hdr->y * fb_client->shared_pitch + hdr->x * bpp,
+                        fb_client->shared_pitch);
+        } else if (fb_client->fb_state == WAIT_HEADER &&
+                   fb_client->encoded) {
+            // Update header has been read. Prepare for the size of the
+            // encoded pixels.
+            fb_client->fb_state = WAIT_ENCODED_HEADER;
+            fb_client->reader_offset = 0;
+            fb_client->reader_bytes = sizeof(FBEncodedRect);
+            fb_client->reader_buffer = (uint8_t*)&fb_client->encoded_header;
+        } else if (fb_client->fb_state == WAIT_ENCODED_HEADER) {
+            // Encoded rectangle header has been read. Prepare for the pixels.
+            fb_client->fb_state = WAIT_PIXELS;
+            fb_client->reader_offset = 0;
+            fb_client->reader_bytes = fb_client->encoded_header.size;
+            _ensure_buffer(&fb_client->encoded_buffer,
+                           &fb_client->encoded_buffer_size,
+                           fb_client->reader_bytes);
+            fb_client->reader_buffer = fb_client->encoded_buffer;
+        } else if (fb_client->fb_state == WAIT_HEADER) {
             // Update header has been read. Prepare for the pixels.
             fb_client->fb_state = WAIT_PIXELS;
             fb_client->reader_offset = 0;
             fb_client->reader_bytes = fb_client->update_header.w *
                                       fb_client->update_header.h *
                                       (fb_client->bits_per_pixel / 8);
-            fb_client->reader_buffer = malloc(fb_client->reader_bytes);
-            if (fb_client->reader_buffer == NULL) {
-                PANIC("Unable to allocate memory for framebuffer update\n");
-            }
+            _ensure_buffer(&fb_client->pixels_buffer,
+                           &fb_client->pixels_buffer_size,
+                           fb_client->reader_bytes);
+            fb_client->reader_buffer = fb_client->pixels_buffer;
         } else {
             // Pixels have been read. Prepare for the header.
-             uint8_t* pixels = fb_client->reader_buffer;
-
             fb_client->fb_state = WAIT_HEADER;
             fb_client->reader_offset = 0;
             fb_client->reader_bytes = sizeof(FBUpdateMessage);
             fb_client->reader_buffer = (uint8_t*)&fb_client->update_header;
 
-            // Perform the update. Note that pixels buffer must be freed there.
-            update_rect(fb_client->fb, fb_client->update_header.x,
-                        fb_client->update_header.y, fb_client->update_header.w,
-                        fb_client->update_header.h, fb_client->bits_per_pixel,
-                        pixels);
+            if (fb_client->encoded) {
+                if (_clientfb_update_encoded(fb_client)) {
+                    // The stream can't be recovered from this point.
+                    clientfb_destroy(fb_client);
+                    return;
+                }
+            } else {
+                update_rect(fb_client->fb, fb_client->update_header.x,
+                            fb_client->update_header.y,
+                            fb_client->update_header.w,
+                            fb_client->update_header.h,
+                            fb_client->bits_per_pixel,
+                            fb_client->pixels_buffer,
+                            fb_client->update_header.w *
+                                (fb_client->bits_per_pixel / 8));
+            }
         }
     }
 }
@@ -189,7 +409,10 @@ clientfb_create(SockAddress* console_socket,
                errno_str);
         return NULL;
     }
-    snprintf(switch_cmd, sizeof(switch_cmd), "framebuffer %s", protocol);
+    // Ask for the compressed updates. Cores that don't support encodings
+    // ignore the parameter, and don't confirm it in the handshake.
+    snprintf(switch_cmd, sizeof(switch_cmd), "framebuffer %s -encoding=%s",
+             protocol, AFB_ENCODING_XOR_ZLIB);
     if (core_connection_switch_stream(_client_fb.core_connection, switch_cmd,
                                       &connect_message)) {
         derror("Unable to attach to the framebuffer %s: %s\n",
@@ -230,6 +453,44 @@ clientfb_create(SockAddress* console_socket,
 
     // Now that we're connected lets initialize the descriptor.
     _client_fb.fb = fb;
+    _client_fb.shared_base = NULL;
+    _client_fb.shared_pixels = NULL;
+
+    _client_fb.encoded = 0;
+
+    // If the core has put pixels into shared memory, it sends us the path
+    // to the file backing it as the last parameter of the handshake.
+    // Otherwise it may confirm the encoding we asked for.
+    if (connect_message != NULL) {
+        char* shared = strstr(connect_message, "-shared=");
+        if (shared != NULL) {
+            if (_clientfb_map_shared(&_client_fb, shared + strlen("-shared="))) {
+                free(connect_message);
+                core_connection_close(_client_fb.core_connection);
+                core_connection_free(_client_fb.core_connection);
+                _client_fb.core_connection = NULL;
+                return NULL;
+            }
+        } else if (strstr(connect_message,
+                          "-encoding=" AFB_ENCODING_XOR_ZLIB) != NULL) {
+            memset(&_client_fb.zstream, 0, sizeof(_client_fb.zstream));
+            if (inflateInit(&_client_fb.zstream) != Z_OK) {
+                derror("Unable to initialize framebuffer decompression\n");
+                free(connect_message);
+                core_connection_close(_client_fb.core_connection);
+                core_connection_free(_client_fb.core_connection);
+                _client_fb.core_connection = NULL;
+                return NULL;
+            }
+            _client_fb.encoded = 1;
+            // Encoded updates are relative to a framebuffer filled with
+            // zeroes.
+            if (fb != NULL) {
+                memset(fb->pixels, 0, fb->pitch * fb->height);
+            }
+        }
+    }
+
     _client_fb.sock = core_connection_get_socket(_client_fb.core_connection);
     _client_fb.fb_state = WAIT_HEADER;
     _client_fb.reader_buffer = (uint8_t*)&_client_fb.update_header;
@@ -277,5 +538,21 @@ clientfb_destroy(ClientFramebuffer* client_fb)
         core_connection_close(client_fb->core_connection);
         core_connection_free(client_fb->core_connection);
         client_fb->core_connection = NULL;
+
+        if (client_fb->shared_base != NULL) {
+            mapfile_unmap(client_fb->shared_base, client_fb->shared_size);
+            client_fb->shared_base = NULL;
+            client_fb->shared_pixels = NULL;
+        }
+        free(client_fb->pixels_buffer);
+        client_fb->pixels_buffer = NULL;
+        client_fb->pixels_buffer_size = 0;
+        if (client_fb->encoded) {
+            inflateEnd(&client_fb->zstream);
+            client_fb->encoded = 0;
+        }
+        free(client_fb->encoded_buffer);
+        client_fb->encoded_buffer = NULL;
+        client_fb->encoded_buffer_size = 0;
     }
 }
@@ -577,6 +577,26 @@ help_wipe_data(stralloc_t*  out)
     );
 }
 
+static void
+help_data_overlay(stralloc_t*  out)
+{
+    PRINTF(
+    "  use '-data-overlay' to create the /data partition image as a thin overlay\n"
+    "  of the initial data image, the next time it is created or reset with\n"
+    "  '-wipe-data'. the overlay only stores the blocks modified by the system,\n"
+    "  and reads the other ones from the initial image, so it is created\n"
+    "  instantly.\n\n"
+
+    "  the initial image must not be modified or removed while the overlay is\n"
+    "  in use, and the overlay must stay on a filesystem that supports sparse\n"
+    "  files. otherwise, a regular copy is made. this is not supported on\n"
+    "  Windows.\n\n"
+
+    "  without this option, the initial image is cloned when the filesystem\n"
+    "  supports it (e.g. btrfs or XFS), or copied without its empty blocks.\n\n"
+    );
+}
+
 static void
 help_cache(stralloc_t*  out)
 {
@@ -698,6 +718,16 @@ help_no_snapshot_load(stralloc_t*  out)
     );
 }
 
+static void
+help_snapshot_lazy_load(stralloc_t*  out)
+{
+    PRINTF(
+    "  When loading the AVD's state from the snapshot storage on start, resume\n"
+    "  right away and read the memory of the snapshot as it is accessed, or in\n"
+    "  the background, instead of reading all of it first.\n\n"
+    );
+}
+
 static void
 help_no_snapshot_save(stralloc_t*  out)
 {
@@ -15,6 +15,7 @@
 #include "android/utils/system.h"
 #include "android/utils/bufprint.h"
 #include "hw/hw.h"
+#include "hw/goldfish_pipe.h"
 #include "qemu-char.h"
 #include "charpipe.h"
 #include "cbuffer.h"
@@ -571,6 +572,13 @@ qemud_serial_send( QemudSerial*    s,
 /** CLIENTS
  **/
 
+/* Clients can also be connected through the goldfish pipe device instead
+ * of the serial port (see "PIPE TRANSPORT" below). Such clients have a
+ * negative channel id, and a QemudPipe that holds the messages that the
+ * guest has not read yet.
+ */
+typedef struct QemudPipe  QemudPipe;
+
 /* A QemudClient models a single client as seen by the emulator.
  * Each client has its own channel id, and belongs to a given
  * QemudService (see below).
@@ -592,6 +600,7 @@ struct QemudClient {
     QemudClient*      next_serv; /* next in same service */
     QemudClient*      next;
     QemudClient**     pref;
+    QemudPipe*        pipe;      /* non-NULL for pipe clients */
 
     /* framing support */
     int               framing;
@@ -603,6 +612,9 @@ struct QemudClient {
 
 static void  qemud_service_remove_client( QemudService*  service,
                                           QemudClient*   client );
+static void  qemud_pipe_detach( QemudPipe*  pipe );
+static void  qemud_pipe_send( QemudPipe*  pipe, ABool  framing,
+                              const uint8_t*  msg, int  msglen );
 
 /* remove a QemudClient from global list */
 static void
@@ -730,6 +742,13 @@ qemud_client_disconnect( void*  opaque )
         qemud_serial_send(c->serial, 0, 0, (uint8_t*)tmp, p-tmp);
     }
 
+    /* tell the guest that a pipe client was closed */
+    if (c->pipe) {
+        QemudPipe*  pipe = c->pipe;
+        c->pipe = NULL;
+        qemud_pipe_detach(pipe);
+    }
+
     /* call the client close callback */
     if (c->clie_close) {
         c->clie_close(c->clie_opaque);
@@ -1124,6 +1143,7 @@ struct QemudMultiplexer {
     QemudSerial    serial[1];
     QemudClient*   clients;
     QemudService*  services;
+    QemudPipe*     connecting_pipe;  /* pipe being connected, see qemud_pipe_init */
 };
 
 /* this is the serial_recv callback that is called
@@ -1396,6 +1416,248 @@ qemud_multiplexer_init( QemudMultiplexer*  mult,
 /* the global multiplexer state */
 static QemudMultiplexer  _multiplexer[1];
 
+/** PIPE TRANSPORT
+ **/
+
+/* A client can connect to any qemud service through the goldfish pipe
+ * device, by opening "pipe:qemud:<service-name>". The data is then
+ * exchanged through guest memory directly, without the serial port's
+ * hex headers and packet size limit.
+ *
+ * Services see no difference: messages sent with qemud_client_send() are
+ * queued until the guest reads them, and each guest write is passed to
+ * the client's receive callback as a single message (with framing
+ * support as usual).
+ */
+
+typedef struct QemudPipeMessage  QemudPipeMessage;
+
+struct QemudPipeMessage {
+    QemudPipeMessage*  next;
+    int                size;
+    int                offset;
+    uint8_t            data[1];
+};
+
+struct QemudPipe {
+    void*              hwpipe;
+    QemudClient*       client;
+    QemudPipeMessage*  messages;
+    QemudPipeMessage** last;
+    int                wanted;   /* PIPE_WAKE_XXX asked by the guest */
+};
+
+static void
+qemud_pipe_attach( QemudPipe*  pipe, QemudClient*  c )
+{
+    pipe->client = c;
+    c->pipe      = pipe;
+}
+
+/* called when the client is disconnected by the service. The guest can
+ * still read the pending messages, and sees the pipe closed afterwards. */
+static void
+qemud_pipe_detach( QemudPipe*  pipe )
+{
+    pipe->client = NULL;
+    if (pipe->messages == NULL)
+        goldfish_pipe_close(pipe->hwpipe);
+}
+
+static void
+qemud_pipe_send( QemudPipe*      pipe,
+                 ABool           framing,
+                 const uint8_t*  msg,
+                 int             msglen )
+{
+    QemudPipeMessage*  m;
+    int                size = msglen;
+
+    if (msglen <= 0)
+        return;
+
+    if (framing)
+        size += FRAME_HEADER_SIZE;
+
+    m = android_alloc(sizeof(*m) + size);
+    m->next   = NULL;
+    m->size   = size;
+    m->offset = 0;
+    if (framing) {
+        int2hex(m->data, FRAME_HEADER_SIZE, msglen);
+        memcpy(m->data + FRAME_HEADER_SIZE, msg, msglen);
+    } else {
+        memcpy(m->data, msg, msglen);
+    }
+
+    *pipe->last = m;
+    pipe->last  = &m->next;
+
+    if (pipe->wanted & PIPE_WAKE_READ) {
+        pipe->wanted &= ~PIPE_WAKE_READ;
+        goldfish_pipe_wake(pipe->hwpipe, PIPE_WAKE_READ);
+    }
+}
+
+static void*
+qemud_pipe_init( void*  hwpipe, void*  opaque, const char*  args )
+{
+    QemudMultiplexer*  m = opaque;
+    QemudPipe*         pipe;
+
+    if (args == NULL) {
+        D("%s: missing service name", __FUNCTION__);
+        return NULL;
+    }
+
+    ANEW0(pipe);
+    pipe->hwpipe = hwpipe;
+    pipe->last   = &pipe->messages;
+
+    /* the service's serv_connect callback calls qemud_client_new(),
+     * which attaches the new client to the pipe */
+    m->connecting_pipe = pipe;
+    qemud_multiplexer_connect(m, args, -1);
+    m->connecting_pipe = NULL;
+
+    if (pipe->client == NULL) {
+        AFREE(pipe);
+        return NULL;
+    }
+    return pipe;
+}
+
+/* called when the guest closes the pipe */
+static void
+qemud_pipe_close( void*  opaque )
+{
+    QemudPipe*    pipe = opaque;
+    QemudClient*  c    = pipe->client;
+
+    if (c != NULL) {
+        c->pipe      = NULL;
+        pipe->client = NULL;
+        qemud_client_disconnect(c);
+    }
+
+    while (pipe->messages) {
+        QemudPipeMessage*  m = pipe->messages;
+        pipe->messages = m->next;
+        AFREE(m);
+    }
+    AFREE(pipe);
+}
+
+static int
+qemud_pipe_sendBuffers( void*  opaque, const GoldfishPipeBuffer*  buffers, int  count )
+{
+    QemudPipe*  pipe = opaque;
+    uint8_t*    msg;
+    uint8_t*    p;
+    int         nn, msglen = 0;
+
+    if (pipe->client == NULL)
+        return PIPE_ERROR_IO;
+
+    for (nn = 0; nn < count; nn++)
+        msglen += buffers[nn].size;
+
+    /* the message is zero-terminated for convenience, as with the
+     * serial transport */
+    AARRAY_NEW(msg, msglen + 1);
+    p = msg;
+
+    for (nn = 0; nn < count; nn++) {
+        memcpy(p, buffers[nn].data, buffers[nn].size);
+        p += buffers[nn].size;
+    }
+    *p = 0;
+
+    qemud_client_recv(pipe->client, msg, msglen);
+    AFREE(msg);
+    return msglen;
+}
+
+static int
+qemud_pipe_recvBuffers( void*  opaque, GoldfishPipeBuffer*  buffers, int  count )
+{
+    QemudPipe*  pipe  = opaque;
+    int         total = 0;
+
+    /* 'buffers' is unmapped by the caller, don't modify it */
+    for ( ; count > 0 && pipe->messages != NULL; count--, buffers++ ) {
+        uint8_t*  data = buffers->data;
+        uint32_t  size = buffers->size;
+
+        while (size > 0 && pipe->messages != NULL) {
+            QemudPipeMessage*  m     = pipe->messages;
+            uint32_t           avail = m->size - m->offset;
+
+            if (avail > size)
+                avail = size;
+
+            memcpy(data, m->data + m->offset, avail);
+            m->offset += avail;
+            total     += avail;
+            data      += avail;
+            size      -= avail;
+
+            if (m->offset == m->size) {
+                pipe->messages = m->next;
+                if (pipe->messages == NULL)
+                    pipe->last = &pipe->messages;
+                AFREE(m);
+            }
+        }
+    }
+
+    if (pipe->messages == NULL && pipe->client == NULL)
+        goldfish_pipe_close(pipe->hwpipe);
+
+    if (total == 0)
+        return PIPE_ERROR_AGAIN;
+
+    return total;
+}
+
+static unsigned
+qemud_pipe_poll( void*  opaque )
+{
+    QemudPipe*  pipe = opaque;
+    unsigned    ret  = PIPE_POLL_OUT;
+
+    if (pipe->messages != NULL)
+        ret |= PIPE_POLL_IN;
+
+    return ret;
+}
+
+static void
+qemud_pipe_wakeOn( void*  opaque, int  flags )
+{
+    QemudPipe*  pipe = opaque;
+
+    /* writes never block */
+    if (flags & PIPE_WAKE_WRITE)
+        goldfish_pipe_wake(pipe->hwpipe, PIPE_WAKE_WRITE);
+
+    if (flags & PIPE_WAKE_READ) {
+        if (pipe->messages != NULL)
+            goldfish_pipe_wake(pipe->hwpipe, PIPE_WAKE_READ);
+        else
+            pipe->wanted |= PIPE_WAKE_READ;
+    }
+}
+
+static const GoldfishPipeFuncs  qemud_pipe_funcs = {
+    qemud_pipe_init,
+    qemud_pipe_close,
+    qemud_pipe_sendBuffers,
+    qemud_pipe_recvBuffers,
+    qemud_pipe_poll,
+    qemud_pipe_wakeOn,
+};
+
 /** HIGH-LEVEL API
  **/
 
@@ -1428,6 +1690,12 @@ qemud_client_new( QemudService*     service,
                                                m->serial,
                                                &m->clients );
 
+    /* attach the client to the pipe it was created for, if any */
+    if (m->connecting_pipe != NULL) {
+        qemud_pipe_attach(m->connecting_pipe, c);
+        m->connecting_pipe = NULL;
+    }
+
     qemud_service_add_client(service, c);
     return c;
 }
@@ -1438,6 +1706,10 @@ qemud_client_new( QemudService*     service,
 void
 qemud_client_send ( QemudClient*  client, const uint8_t*  msg, int  msglen )
 {
+    if (client->pipe) {
+        qemud_pipe_send(client->pipe, client->framing != 0, msg, msglen);
+        return;
+    }
     qemud_serial_send(client->serial, client->channel, client->framing != 0, msg, msglen);
 }
 
@@ -1619,6 +1891,8 @@ android_qemud_init( void )
 
     register_savevm( "qemud", 0, QEMUD_SAVE_VERSION,
                       qemud_save, qemud_load, _multiplexer);
+
+    goldfish_pipe_add_type("qemud", _multiplexer, &qemud_pipe_funcs);
 }
 
 /* return the serial charpipe endpoint that must be used
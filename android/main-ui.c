@@ -873,6 +873,7 @@ attach_to_core(AndroidOptions* opts) {
     SockAddress console_socket;
     SockAddress** sockaddr_list;
     QEmulator* emulator;
+    const char* fb_protocol = "-raw";
 
     // Parse attach_core param extracting the host name, and the port name.
     char* console_address = strdup(opts->attach_core);
@@ -959,8 +960,13 @@ attach_to_core(AndroidOptions* opts) {
     emulator = qemulator_get();
     qemulator_set_title(emulator);
 
-    // Connect to the core's framebuffer service
-    fb_client = clientfb_create(&console_socket, "-raw",
+    // Connect to the core's framebuffer service. A core running on this host
+    // can hand the pixels over via shared memory rather than the socket.
+    if (sock_address_get_family(&console_socket) == SOCKET_INET &&
+        sock_address_get_ip(&console_socket) == SOCK_ADDRESS_INET_LOOPBACK) {
+        fb_protocol = "-shared";
+    }
+    fb_client = clientfb_create(&console_socket, fb_protocol,
                                 qemulator_get_first_framebuffer(emulator));
     if (fb_client == NULL) {
         return -1;
@@ -1267,6 +1273,9 @@ int main(int argc, char **argv)
     if (opts->wipe_data) {
         android_avdParams->flags |= AVDINFO_WIPE_DATA | AVDINFO_WIPE_CACHE;
     }
+    if (opts->data_overlay) {
+        android_avdParams->flags |= AVDINFO_DATA_OVERLAY;
+    }
 #if CONFIG_ANDROID_SNAPSHOTS
     if (opts->no_snapstorage) {
         android_avdParams->flags |= AVDINFO_NO_SNAPSHOTS;
@@ -1597,10 +1606,19 @@ int main(int argc, char **argv)
         args[n++] = strdup(tmp);
     }
 
-    bufprint(tmp, tmpend,
-             "userdata,size=0x%x,file=%s",
-             dataPartitionSize,
-             avdInfo_getImageFile(avd, AVD_IMAGE_USERDATA));
+    {
+        const char*  dataBase = avdInfo_getDataOverlayBase(avd);
+        char*        q;
+
+        q = bufprint(tmp, tmpend,
+                 "userdata,size=0x%x,file=%s",
+                 dataPartitionSize,
+                 avdInfo_getImageFile(avd, AVD_IMAGE_USERDATA));
+
+        /* only the written blocks are stored in an overlay */
+        if (dataBase != NULL)
+            bufprint(q, tmpend, ",basefile=%s", dataBase);
+    }
 
     args[n++] = "-nand";
     args[n++] = strdup(tmp);
@@ -1672,6 +1690,8 @@ int main(int argc, char **argv)
             if (!opts->no_snapshot_load) {
               args[n++] = "-loadvm";
               args[n++] = snapshot_name;
+              if (opts->snapshot_lazy_load)
+                  args[n++] = "-lazy-restore";
             }
             if (!opts->no_snapshot_save) {
               args[n++] = "-savevm-on-exit";
@@ -1021,6 +1021,9 @@ int main(int argc, char **argv)
     if (opts->wipe_data) {
         android_avdParams->flags |= AVDINFO_WIPE_DATA | AVDINFO_WIPE_CACHE;
     }
+    if (opts->data_overlay) {
+        android_avdParams->flags |= AVDINFO_DATA_OVERLAY;
+    }
 #if CONFIG_ANDROID_SNAPSHOTS
     if (opts->no_snapstorage) {
         android_avdParams->flags |= AVDINFO_NO_SNAPSHOTS;
@@ -1331,10 +1334,19 @@ int main(int argc, char **argv)
         args[n++] = strdup(tmp);
     }
 
-    bufprint(tmp, tmpend,
-             "userdata,size=0x%x,file=%s",
-             dataPartitionSize,
-             avdInfo_getImageFile(avd, AVD_IMAGE_USERDATA));
+    {
+        const char*  dataBase = avdInfo_getDataOverlayBase(avd);
+        char*        q;
+
+        q = bufprint(tmp, tmpend,
+                 "userdata,size=0x%x,file=%s",
+                 dataPartitionSize,
+                 avdInfo_getImageFile(avd, AVD_IMAGE_USERDATA));
+
+        /* only the written blocks are stored in an overlay */
+        if (dataBase != NULL)
+            bufprint(q, tmpend, ",basefile=%s", dataBase);
+    }
 
     args[n++] = "-nand";
     args[n++] = strdup(tmp);
@@ -1406,6 +1418,8 @@ int main(int argc, char **argv)
             if (!opts->no_snapshot_load) {
               args[n++] = "-loadvm";
               args[n++] = snapshot_name;
+              if (opts->snapshot_lazy_load)
+                  args[n++] = "-lazy-restore";
             }
             if (!opts->no_snapshot_save) {
               args[n++] = "-savevm-on-exit";
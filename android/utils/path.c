@@ -34,6 +34,17 @@
 #include <signal.h>
 #endif
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE  _IOW(0x94, 9, int)
+#endif
+#ifndef SEEK_DATA
+#define SEEK_DATA  3
+#define SEEK_HOLE  4
+#endif
+#endif
+
 #include "android/utils/debug.h"
 #define  D(...)  VERBOSE_PRINT(init,__VA_ARGS__)
 
@@ -427,7 +438,10 @@ path_is_absolute( const char*  path )
  **
  **  path_copy_file() copies one file into another.
  **
- **  both functions return 0 on success, and -1 on error
+ **  path_clone_file() does the same, but shares the data blocks with the
+ **  source when the filesystem allows it, and doesn't write zero blocks.
+ **
+ **  these functions return 0 on success, and -1 on error
  **/
 
 APosixStatus
@@ -498,6 +512,130 @@ path_copy_file( const char*  dest, const char*  source )
     return result;
 }
 
+#ifndef _WIN32
+/* copies 'size' bytes from 'fs' to 'fd', skipping the holes of the source
+ * (when the system can report them) and the all-zero chunks, which are
+ * left as holes in the destination */
+static int
+_copy_sparse( int  fd, int  fs, off_t  size )
+{
+    char   buf[65536];
+    off_t  pos = 0;
+
+    while (pos < size) {
+        off_t  end = size;
+#ifdef SEEK_DATA
+        off_t  data = lseek(fs, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO)  /* only a hole remains */
+                break;
+            data = pos;          /* not supported, copy everything */
+        } else {
+            off_t  hole = lseek(fs, data, SEEK_HOLE);
+            if (hole > data && hole < size)
+                end = hole;
+        }
+        pos = data;
+#endif
+        if (lseek(fs, pos, SEEK_SET) < 0)
+            return -1;
+
+        while (pos < end) {
+            size_t   len = sizeof(buf);
+            ssize_t  n;
+            int      nn;
+
+            if ((off_t)len > end - pos)
+                len = end - pos;
+
+            do {
+                n = read(fs, buf, len);
+            } while (n < 0 && errno == EINTR);
+
+            if (n < 0)
+                return -1;
+            if (n == 0) {  /* file was truncated under us */
+                size = pos;
+                break;
+            }
+
+            for (nn = 0; nn < n && buf[nn] == 0; nn++)
+                ;
+            if (nn < n) {
+                ssize_t  ret;
+                do {
+                    ret = pwrite(fd, buf, n, pos);
+                } while (ret < 0 && errno == EINTR);
+                if (ret != n)
+                    return -1;
+            }
+            pos += n;
+        }
+    }
+    return ftruncate(fd, size);
+}
+#endif /* !_WIN32 */
+
+APosixStatus
+path_clone_file( const char*  dest, const char*  source )
+{
+#ifdef _WIN32
+    return path_copy_file(dest, source);
+#else
+    int          fd, fs, result = -1, err;
+    struct stat  st;
+
+    fs = open(source, O_RDONLY);
+    if (fs < 0)
+        return -1;
+
+    if (fstat(fs, &st) < 0) {
+        err = errno;
+        close(fs);
+        errno = err;
+        return -1;
+    }
+
+    /* see path_empty_file() for the permissions */
+    fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        err = errno;
+        close(fs);
+        errno = err;
+        return -1;
+    }
+
+#ifdef __linux__
+    /* share the source's data blocks (btrfs, xfs, ...) */
+    if (ioctl(fd, FICLONE, fs) == 0) {
+        D("%s: cloned '%s' to '%s'", __FUNCTION__, source, dest);
+        result = 0;
+        goto EXIT;
+    }
+    D("%s: can't clone '%s': %s, copying it", __FUNCTION__, source,
+      strerror(errno));
+#endif
+
+    result = _copy_sparse(fd, fs, st.st_size);
+    if (result < 0) {
+        D("Failed to copy '%s' to '%s': %s (%d)",
+          source, dest, strerror(errno), errno);
+    }
+
+#ifdef __linux__
+EXIT:
+#endif
+    err = errno;
+    close(fs);
+    if (close(fd) < 0 && result == 0) {
+        err    = errno;
+        result = -1;
+    }
+    errno = err;
+    return result;
+#endif
+}
+
 
 APosixStatus
 path_delete_file( const char*  path )
@@ -116,6 +116,8 @@ extern char*  path_basename( const char*  path );
  **
  **  path_copy_file() copies one file into another.
  **
+ **  path_clone_file() is a faster path_copy_file() for large disk images.
+ **
  **  unlink_file() is equivalent to unlink() on Unix, on Windows,
  **  it will handle the case where _unlink() fails because the file is
  **  read-only by trying to change its access rights then calling _unlink()
@@ -137,6 +139,12 @@ extern APosixStatus   path_empty_file( const char*  path );
  * (error code in errno). Does not work on directories */
 extern APosixStatus   path_copy_file( const char*  dest, const char*  source );
 
+/* same as path_copy_file(), but tries to share the data blocks of the
+ * source file (reflink) first, then falls back to a sparse copy that does
+ * not write the holes and zero blocks of the source. 0 on success, -1 on
+ * failure (error code in errno) */
+extern APosixStatus   path_clone_file( const char*  dest, const char*  source );
+
 /* unlink/delete a given file. Note that on Win32, this will
  * fail if the program has an opened handle to the file
  */
@@ -146,6 +146,10 @@ void bdrv_flush(BlockDriverState *bs);
 void bdrv_flush_all(void);
 void bdrv_close_all(void);
 
+/* Memory used to cache the metadata of each qcow2 image, in bytes. The
+ * driver uses small default caches when this is 0. */
+extern int64_t qcow2_cache_size;
+
 int bdrv_has_zero_init(BlockDriverState *bs);
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 	int *pnum);
@@ -0,0 +1,376 @@
+/*
+ * L2/refcount table cache for the QCOW2 format
+ *
+ * Copyright (c) 2011 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+/*
+ * Each cache holds a fixed number of cluster-sized tables. Tables are found
+ * through a hash of their offset in the image file, and the least recently
+ * used one that isn't in use is recycled on a miss.
+ *
+ * Tables are written back lazily. Ordering between the metadata updates is
+ * kept with dependencies: when a cache depends on another one, the other
+ * cache is flushed (and the image file synced) before any table of the first
+ * one is written. L2 tables that point to new clusters depend on the
+ * refcount blocks, refcount blocks that free clusters depend on the L2
+ * tables.
+ */
+
+int64_t qcow2_cache_size = 0;
+
+typedef struct Qcow2CachedTable {
+    int64_t                         offset;     /* 0 if unused */
+    int                             dirty;
+    int                             ref;
+    struct Qcow2CachedTable        *hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable)  lru;
+} Qcow2CachedTable;
+
+struct Qcow2Cache {
+    Qcow2CachedTable                *entries;
+    Qcow2CachedTable               **buckets;
+    uint8_t                         *tables;
+    int                              size;
+    int                              hash_mask;
+    int                              table_bits;
+    /* most recently used first */
+    QTAILQ_HEAD(Qcow2CachedTableList, Qcow2CachedTable) lru;
+    /* flushed before any table of this cache is written */
+    struct Qcow2Cache               *depends;
+    /* the image file must be synced before any table is written */
+    int                              depends_on_flush;
+    /* tables were written since the image file was last synced */
+    int                              unsynced;
+};
+
+static inline void *cache_table(Qcow2Cache *c, Qcow2CachedTable *e)
+{
+    return c->tables + ((size_t)(e - c->entries) << c->table_bits);
+}
+
+static inline Qcow2CachedTable *cache_entry(Qcow2Cache *c, void *table)
+{
+    int i = ((uint8_t *)table - c->tables) >> c->table_bits;
+
+    assert(i >= 0 && i < c->size);
+    return &c->entries[i];
+}
+
+static inline Qcow2CachedTable **cache_bucket(Qcow2Cache *c, int64_t offset)
+{
+    uint32_t h = (uint32_t)(offset >> c->table_bits) * 2654435761U;
+
+    return &c->buckets[(h >> 8) & c->hash_mask];
+}
+
+static void cache_unhash(Qcow2Cache *c, Qcow2CachedTable *e)
+{
+    Qcow2CachedTable **pnode = cache_bucket(c, e->offset);
+
+    for (;;) {
+        Qcow2CachedTable *node = *pnode;
+
+        if (node == NULL)
+            break;
+        if (node == e) {
+            *pnode = e->hash_next;
+            break;
+        }
+        pnode = &node->hash_next;
+    }
+    e->hash_next = NULL;
+    e->offset = 0;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+    int i, buckets;
+
+    for (buckets = 1; buckets < 2 * num_tables; buckets <<= 1)
+        ;
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = num_tables;
+    c->table_bits = s->cluster_bits;
+    c->hash_mask = buckets - 1;
+    c->entries = qemu_mallocz(num_tables * sizeof(*c->entries));
+    c->buckets = qemu_mallocz(buckets * sizeof(*c->buckets));
+    c->tables = qemu_blockalign(bs->file, (size_t)num_tables << c->table_bits);
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
+    }
+    return c;
+}
+
+void qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+    }
+    qemu_vfree(c->tables);
+    qemu_free(c->buckets);
+    qemu_free(c->entries);
+    qemu_free(c);
+}
+
+static int cache_flush(BlockDriverState *bs, Qcow2Cache *c, int sync);
+
+static int cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int ret;
+
+    /* the image file is synced after the dependency is written, which
+     * also takes care of depends_on_flush */
+    ret = cache_flush(bs, c->depends, c->depends_on_flush);
+    if (ret < 0) {
+        return ret;
+    }
+
+    c->depends = NULL;
+    c->depends_on_flush = 0;
+    return 0;
+}
+
+static int cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c,
+                             Qcow2CachedTable *e)
+{
+    int ret;
+
+    if (!e->dirty || !e->offset) {
+        return 0;
+    }
+
+    if (c->depends) {
+        ret = cache_flush_dependency(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+    } else if (c->depends_on_flush) {
+        bdrv_flush(bs->file);
+        c->depends_on_flush = 0;
+    }
+
+    ret = bdrv_pwrite(bs->file, e->offset, cache_table(c, e),
+                      1 << c->table_bits);
+    if (ret < 0) {
+        return ret;
+    }
+
+    e->dirty = 0;
+    c->unsynced = 1;
+    return 0;
+}
+
+static int cache_entry_compare(const void *a, const void *b)
+{
+    int64_t oa = (*(Qcow2CachedTable * const *)a)->offset;
+    int64_t ob = (*(Qcow2CachedTable * const *)b)->offset;
+
+    return (oa > ob) - (oa < ob);
+}
+
+/* Writes all dirty tables in file order, then syncs the image file once for
+ * the whole batch if anything was written, or if 'sync' is set */
+static int cache_flush(BlockDriverState *bs, Qcow2Cache *c, int sync)
+{
+    Qcow2CachedTable **dirty;
+    int i, n = 0, ret = 0;
+
+    dirty = qemu_malloc(c->size * sizeof(*dirty));
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            dirty[n++] = &c->entries[i];
+        }
+    }
+    qsort(dirty, n, sizeof(*dirty), cache_entry_compare);
+
+    for (i = 0; i < n; i++) {
+        ret = cache_entry_flush(bs, c, dirty[i]);
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_free(dirty);
+
+    if (c->unsynced || sync) {
+        bdrv_flush(bs->file);
+        c->unsynced = 0;
+    }
+    return ret;
+}
+
+/* Writes back all dirty tables. Returns 0 on success, -errno otherwise. */
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    return cache_flush(bs, c, 0);
+}
+
+/*
+ * Makes the tables of 'c' depend on those of 'dependency': the latter are
+ * flushed before any table of 'c' is written.
+ */
+int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2Cache *dependency)
+{
+    int ret;
+
+    /* break cycles by flushing the other direction first */
+    if (dependency->depends) {
+        ret = cache_flush_dependency(bs, dependency);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (c->depends && c->depends != dependency) {
+        ret = cache_flush_dependency(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    c->depends = dependency;
+    return 0;
+}
+
+/* Syncs the image file before any table of 'c' is written */
+void qcow2_cache_depends_on_flush(Qcow2Cache *c)
+{
+    c->depends_on_flush = 1;
+}
+
+/* Flushes the cache and forgets all tables */
+int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i, ret;
+
+    ret = qcow2_cache_flush(bs, c);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+        c->entries[i].offset = 0;
+        c->entries[i].dirty = 0;
+        c->entries[i].hash_next = NULL;
+    }
+    memset(c->buckets, 0, (c->hash_mask + 1) * sizeof(*c->buckets));
+    return 0;
+}
+
+static int cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table, int read_from_disk)
+{
+    Qcow2CachedTable **bucket = cache_bucket(c, offset);
+    Qcow2CachedTable *e;
+    int ret;
+
+    for (e = *bucket; e != NULL; e = e->hash_next) {
+        if (e->offset == offset) {
+            goto found;
+        }
+    }
+
+    /* recycle the least recently used table that isn't in use */
+    QTAILQ_FOREACH_REVERSE(e, &c->lru, Qcow2CachedTableList, lru) {
+        if (e->ref == 0) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        /* the cache is too small for the callers */
+        abort();
+    }
+
+    ret = cache_entry_flush(bs, c, e);
+    if (ret < 0) {
+        return ret;
+    }
+    if (e->offset) {
+        cache_unhash(c, e);
+    }
+
+    if (read_from_disk) {
+        ret = bdrv_pread(bs->file, offset, cache_table(c, e),
+                         1 << c->table_bits);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    e->offset = offset;
+    e->dirty = 0;
+    e->hash_next = *bucket;
+    *bucket = e;
+
+found:
+    e->ref++;
+    QTAILQ_REMOVE(&c->lru, e, lru);
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+    *table = cache_table(c, e);
+    return 0;
+}
+
+/*
+ * Returns the table at 'offset' in *table, reading it from the image file
+ * if it isn't cached. The table stays in the cache until it is released
+ * with qcow2_cache_put(). Returns 0 on success, -errno otherwise.
+ */
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table)
+{
+    return cache_do_get(bs, c, offset, table, 1);
+}
+
+/* Same as qcow2_cache_get(), for a new table that the caller initializes */
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table)
+{
+    return cache_do_get(bs, c, offset, table, 0);
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    Qcow2CachedTable *e = cache_entry(c, *table);
+
+    assert(e->ref > 0);
+    e->ref--;
+    *table = NULL;
+    return 0;
+}
+
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+{
+    cache_entry(c, table)->dirty = 1;
+}
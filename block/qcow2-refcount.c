@@ -24,6 +24,7 @@
 
 #include "qemu-common.h"
 #include "block_int.h"
+#include "host-utils.h"
 #include "block/qcow2.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
@@ -32,27 +33,6 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int addend);
 
 
-static int cache_refcount_updates = 0;
-
-static int write_refcount_block(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    size_t size = s->cluster_size;
-
-    if (s->refcount_block_cache_offset == 0) {
-        return 0;
-    }
-
-    BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE);
-    if (bdrv_pwrite_sync(bs->file, s->refcount_block_cache_offset,
-            s->refcount_block_cache, size) < 0)
-    {
-        return -EIO;
-    }
-
-    return 0;
-}
-
 /*********************************************************/
 /* refcount handling */
 
@@ -61,7 +41,6 @@ int qcow2_refcount_init(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret, refcount_table_size2, i;
 
-    s->refcount_block_cache = qemu_malloc(s->cluster_size);
     refcount_table_size2 = s->refcount_table_size * sizeof(uint64_t);
     s->refcount_table = qemu_malloc(refcount_table_size2);
     if (s->refcount_table_size > 0) {
@@ -81,33 +60,20 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    qemu_free(s->refcount_block_cache);
     qemu_free(s->refcount_table);
+    qemu_free(s->cluster_bitmap);
 }
 
 
 static int load_refcount_block(BlockDriverState *bs,
-                               int64_t refcount_block_offset)
+                               int64_t refcount_block_offset,
+                               uint16_t **refcount_block)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret;
-
-    if (cache_refcount_updates) {
-        ret = write_refcount_block(bs);
-        if (ret < 0) {
-            return ret;
-        }
-    }
 
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_LOAD);
-    ret = bdrv_pread(bs->file, refcount_block_offset, s->refcount_block_cache,
-                     s->cluster_size);
-    if (ret < 0) {
-        return ret;
-    }
-
-    s->refcount_block_cache_offset = refcount_block_offset;
-    return 0;
+    return qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+        (void**) refcount_block);
 }
 
 /*
@@ -120,7 +86,8 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     BDRVQcowState *s = bs->opaque;
     int refcount_table_index, block_index;
     int64_t refcount_block_offset;
-    int ret;
+    uint16_t *refcount_block;
+    int ret, refcount;
 
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
     if (refcount_table_index >= s->refcount_table_size)
@@ -128,16 +95,165 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     refcount_block_offset = s->refcount_table[refcount_table_index];
     if (!refcount_block_offset)
         return 0;
-    if (refcount_block_offset != s->refcount_block_cache_offset) {
-        /* better than nothing: return allocated if read error */
-        ret = load_refcount_block(bs, refcount_block_offset);
+
+    ret = load_refcount_block(bs, refcount_block_offset, &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    block_index = cluster_index &
+        ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
+    refcount = be16_to_cpu(refcount_block[block_index]);
+
+    qcow2_cache_put(bs, s->refcount_block_cache, (void**) &refcount_block);
+    return refcount;
+}
+
+/*********************************************************/
+/* free cluster bitmap */
+
+/*
+ * Finding free clusters through get_refcount() costs a refcount block load
+ * per candidate, so allocations search an in-memory bitmap of the clusters
+ * in use instead. Clusters past the end of the bitmap are free. Allocated
+ * clusters are marked before their refcount is increased, so that nested
+ * allocations (for new refcount blocks) can't return them again.
+ *
+ * free_cluster_index is a hint: all clusters below it are in use.
+ */
+
+static void cluster_bitmap_resize(BDRVQcowState *s, int64_t nb_clusters)
+{
+    int64_t old_words = s->cluster_bitmap_size >> 6;
+    int64_t new_words;
+
+    if (nb_clusters <= s->cluster_bitmap_size) {
+        return;
+    }
+
+    new_words = MAX(old_words, 16);
+    while ((new_words << 6) < nb_clusters) {
+        new_words *= 2;
+    }
+
+    s->cluster_bitmap = qemu_realloc(s->cluster_bitmap,
+        new_words * sizeof(uint64_t));
+    memset(s->cluster_bitmap + old_words, 0,
+        (new_words - old_words) * sizeof(uint64_t));
+    s->cluster_bitmap_size = new_words << 6;
+}
+
+static void cluster_bitmap_set(BDRVQcowState *s, int64_t cluster_index,
+    int64_t nb_clusters, int used)
+{
+    int64_t i;
+
+    if (used) {
+        cluster_bitmap_resize(s, cluster_index + nb_clusters);
+    } else {
+        nb_clusters = MIN(nb_clusters,
+            s->cluster_bitmap_size - cluster_index);
+        if (cluster_index < s->free_cluster_index) {
+            s->free_cluster_index = cluster_index;
+        }
+    }
+
+    for (i = cluster_index; i < cluster_index + nb_clusters; i++) {
+        if (used) {
+            s->cluster_bitmap[i >> 6] |= 1ULL << (i & 63);
+        } else {
+            s->cluster_bitmap[i >> 6] &= ~(1ULL << (i & 63));
+        }
+    }
+}
+
+/* Returns the index of the first free cluster at or after cluster_index */
+static int64_t cluster_bitmap_next_free(BDRVQcowState *s,
+    int64_t cluster_index)
+{
+    int64_t i = cluster_index;
+
+    while (i < s->cluster_bitmap_size) {
+        int bit = i & 63;
+        int n = cto64(s->cluster_bitmap[i >> 6] >> bit);
+
+        if (n < 64 - bit) {
+            return i + n;
+        }
+        i += 64 - bit;
+    }
+    return i;
+}
+
+/* Returns the index of the first used cluster in [cluster_index, limit[, or
+ * limit if they are all free */
+static int64_t cluster_bitmap_next_used(BDRVQcowState *s,
+    int64_t cluster_index, int64_t limit)
+{
+    int64_t i = cluster_index;
+
+    while (i < limit && i < s->cluster_bitmap_size) {
+        int bit = i & 63;
+        int n = ctz64(s->cluster_bitmap[i >> 6] >> bit);
+
+        if (n < 64 - bit) {
+            return MIN(i + n, limit);
+        }
+        i += 64 - bit;
+    }
+    return limit;
+}
+
+/* Returns the number of clusters up to the last one in use */
+static int64_t cluster_bitmap_end(BDRVQcowState *s)
+{
+    int64_t i;
+
+    for (i = (s->cluster_bitmap_size >> 6) - 1; i >= 0; i--) {
+        if (s->cluster_bitmap[i]) {
+            return (i << 6) + 64 - clz64(s->cluster_bitmap[i]);
+        }
+    }
+    return 0;
+}
+
+static int cluster_bitmap_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int refcount_block_entries = 1 << (s->cluster_bits - REFCOUNT_SHIFT);
+    uint16_t *refcount_block;
+    int64_t length;
+    int i, j, ret;
+
+    length = MAX(bdrv_getlength(bs->file), 0);
+    cluster_bitmap_resize(s,
+        MAX(1, (length + s->cluster_size - 1) >> s->cluster_bits));
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        if (!s->refcount_table[i]) {
+            continue;
+        }
+
+        ret = load_refcount_block(bs, s->refcount_table[i], &refcount_block);
         if (ret < 0) {
+            qemu_free(s->cluster_bitmap);
+            s->cluster_bitmap = NULL;
+            s->cluster_bitmap_size = 0;
             return ret;
         }
+
+        for (j = 0; j < refcount_block_entries; j++) {
+            if (refcount_block[j]) {
+                cluster_bitmap_set(s,
+                    (int64_t) i * refcount_block_entries + j, 1, 1);
+            }
+        }
+
+        qcow2_cache_put(bs, s->refcount_block_cache, (void**) &refcount_block);
     }
-    block_index = cluster_index &
-        ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    return be16_to_cpu(s->refcount_block_cache[block_index]);
+
+    s->free_cluster_index = 0;
+    return 0;
 }
 
 /*
@@ -173,9 +289,11 @@ static int in_same_refcount_block(BDRVQcowState *s, uint64_t offset_a,
  * Loads a refcount block. If it doesn't exist yet, it is allocated first
  * (including growing the refcount table if needed).
  *
- * Returns the offset of the refcount block on success or -errno in error case
+ * Returns 0 and the refcount block in *refcount_block on success, or -errno
+ * in error case. The block must be released with qcow2_cache_put().
  */
-static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
+static int alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index,
+    uint16_t **refcount_block)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int refcount_table_index;
@@ -193,13 +311,8 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
         /* If it's already there, we're done */
         if (refcount_block_offset) {
-            if (refcount_block_offset != s->refcount_block_cache_offset) {
-                ret = load_refcount_block(bs, refcount_block_offset);
-                if (ret < 0) {
-                    return ret;
-                }
-            }
-            return refcount_block_offset;
+            return load_refcount_block(bs, refcount_block_offset,
+                refcount_block);
         }
     }
 
@@ -218,18 +331,20 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
      * - We need to consider that at this point we are inside update_refcounts
      *   and doing the initial refcount increase. This means that some clusters
      *   have already been allocated by the caller, but their refcount isn't
-     *   accurate yet. free_cluster_index tells us where this allocation ends
-     *   as long as we don't overwrite it by freeing clusters.
+     *   accurate yet. They are reserved in the cluster bitmap, which also
+     *   tells us where the used part of the image ends.
      *
      * - alloc_clusters_noref and qcow2_free_clusters may load a different
      *   refcount block into the cache
      */
 
-    if (cache_refcount_updates) {
-        ret = write_refcount_block(bs);
-        if (ret < 0) {
-            return ret;
-        }
+    *refcount_block = NULL;
+
+    /* Refcount blocks that free clusters may depend on L2 tables, write
+     * these first since the refcount table is updated directly */
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
     }
 
     /* Allocate the refcount block itself and mark it as used */
@@ -246,13 +361,17 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
     if (in_same_refcount_block(s, new_block, cluster_index << s->cluster_bits)) {
         /* Zero the new refcount block before updating it */
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        s->refcount_block_cache_offset = new_block;
+        ret = qcow2_cache_get_empty(bs, s->refcount_block_cache, new_block,
+            (void**) refcount_block);
+        if (ret < 0) {
+            goto fail_block;
+        }
+        memset(*refcount_block, 0, s->cluster_size);
 
         /* The block describes itself, need to update the cache */
         int block_index = (new_block >> s->cluster_bits) &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-        s->refcount_block_cache[block_index] = cpu_to_be16(1);
+        (*refcount_block)[block_index] = cpu_to_be16(1);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -263,14 +382,19 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
         /* Initialize the new refcount block only after updating its refcount,
          * update_refcount uses the refcount cache itself */
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        s->refcount_block_cache_offset = new_block;
+        ret = qcow2_cache_get_empty(bs, s->refcount_block_cache, new_block,
+            (void**) refcount_block);
+        if (ret < 0) {
+            goto fail_block;
+        }
+        memset(*refcount_block, 0, s->cluster_size);
     }
 
-    /* Now the new refcount block needs to be written to disk */
+    /* Now the new refcount block needs to be written to disk, before the
+     * refcount table points to it */
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_WRITE);
-    ret = bdrv_pwrite_sync(bs->file, new_block, s->refcount_block_cache,
-        s->cluster_size);
+    qcow2_cache_entry_mark_dirty(s->refcount_block_cache, *refcount_block);
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
     if (ret < 0) {
         goto fail_block;
     }
@@ -287,9 +411,11 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
         }
 
         s->refcount_table[refcount_table_index] = new_block;
-        return new_block;
+        return 0;
     }
 
+    qcow2_cache_put(bs, s->refcount_block_cache, (void**) refcount_block);
+
     /*
      * If we come here, we need to grow the refcount table. Again, a new
      * refcount table needs some space and we can't simply allocate to avoid
@@ -305,7 +431,7 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
     /* Calculate the number of refcount blocks needed so far */
     uint64_t refcount_block_clusters = 1 << (s->cluster_bits - REFCOUNT_SHIFT);
-    uint64_t blocks_used = (s->free_cluster_index +
+    uint64_t blocks_used = (cluster_bitmap_end(s) +
         refcount_block_clusters - 1) / refcount_block_clusters;
 
     /* And now we need at least one block more for the new metadata */
@@ -338,7 +464,7 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
     uint16_t *new_blocks = qemu_mallocz(blocks_clusters * s->cluster_size);
     uint64_t *new_table = qemu_mallocz(table_size * sizeof(uint64_t));
 
-    assert(meta_offset >= (s->free_cluster_index * s->cluster_size));
+    assert(meta_offset >= (cluster_bitmap_end(s) * s->cluster_size));
 
     /* Fill the new refcount table */
     memcpy(new_table, s->refcount_table,
@@ -402,67 +528,29 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
-    /* Free old table. Remember, we must not change free_cluster_index */
-    uint64_t old_free_cluster_index = s->free_cluster_index;
+    /* The new metadata is in use now, the old table can be freed */
+    cluster_bitmap_set(s, meta_offset >> s->cluster_bits,
+        blocks_clusters + table_clusters, 1);
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t));
-    s->free_cluster_index = old_free_cluster_index;
 
-    ret = load_refcount_block(bs, new_block);
-    if (ret < 0) {
-        goto fail_block;
-    }
-
-    return new_block;
+    return load_refcount_block(bs, new_block, refcount_block);
 
 fail_table:
     qemu_free(new_table);
 fail_block:
-    s->refcount_block_cache_offset = 0;
-    return ret;
-}
-
-#define REFCOUNTS_PER_SECTOR (512 >> REFCOUNT_SHIFT)
-static int write_refcount_block_entries(BlockDriverState *bs,
-    int64_t refcount_block_offset, int first_index, int last_index)
-{
-    BDRVQcowState *s = bs->opaque;
-    size_t size;
-    int ret;
-
-    if (cache_refcount_updates) {
-        return 0;
+    if (*refcount_block != NULL) {
+        qcow2_cache_put(bs, s->refcount_block_cache, (void**) refcount_block);
     }
-
-    if (first_index < 0) {
-        return 0;
-    }
-
-    first_index &= ~(REFCOUNTS_PER_SECTOR - 1);
-    last_index = (last_index + REFCOUNTS_PER_SECTOR)
-        & ~(REFCOUNTS_PER_SECTOR - 1);
-
-    size = (last_index - first_index) << REFCOUNT_SHIFT;
-
-    BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
-    ret = bdrv_pwrite_sync(bs->file,
-        refcount_block_offset + (first_index << REFCOUNT_SHIFT),
-        &s->refcount_block_cache[first_index], size);
-    if (ret < 0) {
-        return ret;
-    }
-
-    return 0;
+    return ret;
 }
 
-/* XXX: cache several refcount block clusters ? */
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     int64_t offset, int64_t length, int addend)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t start, last, cluster_offset;
-    int64_t refcount_block_offset = 0;
-    int64_t table_index = -1, old_table_index;
-    int first_index = -1, last_index = -1;
+    uint16_t *refcount_block = NULL;
+    int64_t old_table_index = -1;
     int ret;
 
 #ifdef DEBUG_ALLOC2
@@ -475,6 +563,16 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         return 0;
     }
 
+    /* A freed cluster must not be reused before the L2 tables that
+     * referenced it are updated on the disk */
+    if (addend < 0) {
+        ret = qcow2_cache_set_dependency(bs, s->refcount_block_cache,
+            s->l2_table_cache);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     start = offset & ~(s->cluster_size - 1);
     last = (offset + length - 1) & ~(s->cluster_size - 1);
     for(cluster_offset = start; cluster_offset <= last;
@@ -482,64 +580,47 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     {
         int block_index, refcount;
         int64_t cluster_index = cluster_offset >> s->cluster_bits;
-        int64_t new_block;
+        int64_t table_index =
+            cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
 
-        /* Only write refcount block to disk when we are done with it */
-        old_table_index = table_index;
-        table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
-        if ((old_table_index >= 0) && (table_index != old_table_index)) {
+        /* Load the refcount block and allocate it if needed */
+        if (table_index != old_table_index) {
+            if (refcount_block) {
+                qcow2_cache_put(bs, s->refcount_block_cache,
+                    (void**) &refcount_block);
+            }
 
-            ret = write_refcount_block_entries(bs, refcount_block_offset,
-                first_index, last_index);
+            ret = alloc_refcount_block(bs, cluster_index, &refcount_block);
             if (ret < 0) {
-                return ret;
+                goto fail;
             }
 
-            first_index = -1;
-            last_index = -1;
+            BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+            qcow2_cache_entry_mark_dirty(s->refcount_block_cache,
+                refcount_block);
         }
-
-        /* Load the refcount block and allocate it if needed */
-        new_block = alloc_refcount_block(bs, cluster_index);
-        if (new_block < 0) {
-            ret = new_block;
-            goto fail;
-        }
-        refcount_block_offset = new_block;
+        old_table_index = table_index;
 
         /* we can update the count and save it */
         block_index = cluster_index &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-        if (first_index == -1 || block_index < first_index) {
-            first_index = block_index;
-        }
-        if (block_index > last_index) {
-            last_index = block_index;
-        }
 
-        refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+        refcount = be16_to_cpu(refcount_block[block_index]);
         refcount += addend;
         if (refcount < 0 || refcount > 0xffff) {
             ret = -EINVAL;
             goto fail;
         }
-        if (refcount == 0 && cluster_index < s->free_cluster_index) {
-            s->free_cluster_index = cluster_index;
+        if (s->cluster_bitmap && (refcount == 0 || refcount == addend)) {
+            cluster_bitmap_set(s, cluster_index, 1, refcount != 0);
         }
-        s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
+        refcount_block[block_index] = cpu_to_be16(refcount);
     }
 
     ret = 0;
 fail:
-
-    /* Write last changed block to disk */
-    if (refcount_block_offset != 0) {
-        int wret;
-        wret = write_refcount_block_entries(bs, refcount_block_offset,
-            first_index, last_index);
-        if (wret < 0) {
-            return ret < 0 ? ret : wret;
-        }
+    if (refcount_block) {
+        qcow2_cache_put(bs, s->refcount_block_cache, (void**) &refcount_block);
     }
 
     /*
@@ -587,30 +668,44 @@ static int update_cluster_refcount(BlockDriverState *bs,
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, nb_clusters, refcount;
+    int64_t nb_clusters, start, end;
+    int ret;
 
-    nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        int64_t next_cluster_index = s->free_cluster_index++;
-        refcount = get_refcount(bs, next_cluster_index);
+    if (!s->cluster_bitmap) {
+        ret = cluster_bitmap_init(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
-        if (refcount < 0) {
-            return refcount;
-        } else if (refcount != 0) {
-            goto retry;
+    /* first fit, skipping full words of used clusters */
+    nb_clusters = size_to_clusters(s, size);
+    s->free_cluster_index = cluster_bitmap_next_free(s, s->free_cluster_index);
+    start = s->free_cluster_index;
+    for (;;) {
+        end = cluster_bitmap_next_used(s, start, start + nb_clusters);
+        if (end - start == nb_clusters) {
+            break;
         }
+        start = cluster_bitmap_next_free(s, end);
     }
+
+    /* reserve the clusters until update_refcount() accounts for them */
+    cluster_bitmap_set(s, start, nb_clusters, 1);
+    if (start == s->free_cluster_index) {
+        s->free_cluster_index = start + nb_clusters;
+    }
+
 #ifdef DEBUG_ALLOC2
     printf("alloc_clusters: size=%" PRId64 " -> %" PRId64 "\n",
-            size,
-            (s->free_cluster_index - nb_clusters) << s->cluster_bits);
+            size, start << s->cluster_bits);
 #endif
-    return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+    return start << s->cluster_bits;
 }
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
 {
+    BDRVQcowState *s = bs->opaque;
     int64_t offset;
     int ret;
 
@@ -622,6 +717,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
 
     ret = update_refcount(bs, offset, size, 1);
     if (ret < 0) {
+        /* the refcounts were restored, drop the reservation */
+        cluster_bitmap_set(s, offset >> s->cluster_bits,
+            size_to_clusters(s, size), 0);
         return ret;
     }
     return offset;
@@ -750,8 +848,10 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t old_offset, old_l2_offset;
     int l2_size, i, j, l1_modified, l2_modified, nb_csectors, refcount;
 
-    qcow2_l2_cache_reset(bs);
-    cache_refcount_updates = 1;
+    /* the L2 tables are read and written directly below */
+    if (qcow2_cache_empty(bs, s->l2_table_cache) < 0) {
+        return -EIO;
+    }
 
     l2_table = NULL;
     l1_table = NULL;
@@ -859,15 +959,12 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
-    cache_refcount_updates = 0;
-    write_refcount_block(bs);
-    return 0;
+    return qcow2_cache_flush(bs, s->refcount_block_cache);
  fail:
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
-    cache_refcount_updates = 0;
-    write_refcount_block(bs);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
     return -EIO;
 }
 
@@ -1110,6 +1207,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
     uint16_t *refcount_table;
     int ret;
 
+    /* the L2 tables are read from the disk below */
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
     refcount_table = qemu_mallocz(nb_clusters * sizeof(uint16_t));
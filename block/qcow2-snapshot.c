@@ -158,17 +158,23 @@ static int qcow_write_snapshots(BlockDriverState *bs)
         h.id_str_size = cpu_to_be16(id_str_size);
         h.name_size = cpu_to_be16(name_size);
         offset = align_offset(offset, 8);
-        if (bdrv_pwrite_sync(bs->file, offset, &h, sizeof(h)) < 0)
+        if (bdrv_pwrite(bs->file, offset, &h, sizeof(h)) < 0)
             goto fail;
         offset += sizeof(h);
-        if (bdrv_pwrite_sync(bs->file, offset, sn->id_str, id_str_size) < 0)
+        if (bdrv_pwrite(bs->file, offset, sn->id_str, id_str_size) < 0)
             goto fail;
         offset += id_str_size;
-        if (bdrv_pwrite_sync(bs->file, offset, sn->name, name_size) < 0)
+        if (bdrv_pwrite(bs->file, offset, sn->name, name_size) < 0)
             goto fail;
         offset += name_size;
     }
 
+    /* the snapshot table and its refcounts must be on the disk before
+     * the header points to it, sync them all at once */
+    if (qcow2_cache_flush(bs, s->refcount_block_cache) < 0)
+        goto fail;
+    bdrv_flush(bs->file);
+
     /* update the various header fields */
     data64 = cpu_to_be64(snapshots_offset);
     if (bdrv_pwrite_sync(bs->file, offsetof(QCowHeader, snapshots_offset),
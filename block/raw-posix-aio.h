@@ -30,6 +30,11 @@ int paio_init(void);
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+/* same as paio_submit, but for requests that are not sector-aligned.
+ * 'bs' may be NULL for requests that do not come from the block layer. */
+BlockDriverAIOCB *paio_submit_bytes(BlockDriverState *bs, int fd,
+        int64_t offset, QEMUIOVector *qiov, size_t nbytes,
+        BlockDriverCompletionFunc *cb, void *opaque, int type);
 BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
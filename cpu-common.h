@@ -46,6 +46,9 @@ void qemu_ram_free(ram_addr_t addr);
 void *qemu_get_ram_ptr(ram_addr_t addr);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
+/* Restores the pages of a lazily restored snapshot in a range of ram
+   before the emulator accesses it through its host address.  */
+void ram_lazy_touch(ram_addr_t addr, ram_addr_t size);
 
 int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
                            CPUWriteMemoryFunc * const *mem_write,
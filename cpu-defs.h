@@ -73,8 +73,17 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* The size of the software TLB can be chosen at build time, see the
+   --tlb-bits option of android-configure.sh */
+#ifdef CONFIG_CPU_TLB_BITS
+#define CPU_TLB_BITS CONFIG_CPU_TLB_BITS
+#else
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* Number of entries of the fully associative victim TLB, which keeps the
+   entries recently evicted from the direct mapped one. */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -109,7 +118,16 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    /* Checked by the softmmu helpers before calling tlb_fill() */      \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index;                                            \
+    /* Statistics reported by 'info jit'. Hits are only counted by the  \
+       x86 backends in CONFIG_PROFILER builds. */                       \
+    uint64_t tlb_hit_count;                                             \
+    uint64_t tlb_miss_count;                                            \
+    uint64_t tlb_victim_hit_count;
 
 #else
 
@@ -189,6 +189,44 @@ static inline TranslationBlock *tb_find_fast(void)
     return tb;
 }
 
+/* number of indirect jumps that tb_lookup_ptr() chained to their target,
+   and of those that had to return to the main loop instead */
+uint64_t tb_lookup_chain_count;
+uint64_t tb_lookup_exit_count;
+
+/* Called by generated code that ends with an indirect jump, once the new
+   pc has been stored in the CPU state. Returns the host code of the next
+   TB, or NULL if the main loop must run first: when the TB is not in the
+   jump cache, or when an interrupt or exit request is pending. Never
+   translates, as the code buffer could be flushed under the caller. */
+void *tb_lookup_ptr(void)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        goto exit;
+    }
+    /* as in cpu_exec(), make the TB current before looking at the pending
+       requests, so that cpu_interrupt() unlinks it if it misses them */
+    env->current_tb = tb;
+    barrier();
+    if (unlikely(env->interrupt_request || env->exit_request ||
+                 env->singlestep_enabled)) {
+        goto exit;
+    }
+    tb_lookup_chain_count++;
+    return tb->tc_ptr;
+
+ exit:
+    tb_lookup_exit_count++;
+    return NULL;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
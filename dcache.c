@@ -149,33 +149,6 @@ void dcache_cleanup()
   dcache_free();
 }
 
-void compress_trace_addresses(TraceAddr *trace_addr)
-{
-  AddrRec *ptr;
-  char *comp_ptr = trace_addr->compressed_ptr;
-  uint32_t prev_addr = trace_addr->prev_addr;
-  uint64_t prev_time = trace_addr->prev_time;
-  AddrRec *last = &trace_addr->buffer[kMaxNumAddrs];
-  for (ptr = trace_addr->buffer; ptr != last; ++ptr) {
-    if (comp_ptr >= trace_addr->high_water_ptr) {
-      uint32_t size = comp_ptr - trace_addr->compressed;
-      fwrite(trace_addr->compressed, sizeof(char), size, trace_addr->fstream);
-      comp_ptr = trace_addr->compressed;
-    }
-
-    int addr_diff = ptr->addr - prev_addr;
-    uint64_t time_diff = ptr->time - prev_time;
-    prev_addr = ptr->addr;
-    prev_time = ptr->time;
-
-    comp_ptr = varint_encode_signed(addr_diff, comp_ptr);
-    comp_ptr = varint_encode(time_diff, comp_ptr);
-  }
-  trace_addr->compressed_ptr = comp_ptr;
-  trace_addr->prev_addr = prev_addr;
-  trace_addr->prev_time = prev_time;
-}
-
 // This function is called by the generated code to simulate
 // a dcache load access.
 void dcache_load(uint32_t addr)
@@ -199,9 +172,8 @@ void dcache_load(uint32_t addr)
         next->time = sim_time;
         next += 1;
         if (next == &trace_load.buffer[kMaxNumAddrs]) {
-          // Compress the trace
-          compress_trace_addresses(&trace_load);
-          next = &trace_load.buffer[0];
+          // Hand the buffer over to the trace writer
+          next = trace_flush_addr(&trace_load);
         }
         trace_load.next = next;
       }
@@ -220,9 +192,8 @@ void dcache_load(uint32_t addr)
     next->time = sim_time;
     next += 1;
     if (next == &trace_load.buffer[kMaxNumAddrs]) {
-      // Compress the trace
-      compress_trace_addresses(&trace_load);
-      next = &trace_load.buffer[0];
+      // Hand the buffer over to the trace writer
+      next = trace_flush_addr(&trace_load);
     }
     trace_load.next = next;
   }
@@ -286,9 +257,8 @@ void dcache_store(uint32_t addr, uint32_t val)
         next->time = sim_time;
         next += 1;
         if (next == &trace_store.buffer[kMaxNumAddrs]) {
-          // Compress the trace
-          compress_trace_addresses(&trace_store);
-          next = &trace_store.buffer[0];
+          // Hand the buffer over to the trace writer
+          next = trace_flush_addr(&trace_store);
         }
         trace_store.next = next;
       }
@@ -312,9 +282,8 @@ void dcache_store(uint32_t addr, uint32_t val)
     next->time = sim_time;
     next += 1;
     if (next == &trace_store.buffer[kMaxNumAddrs]) {
-      // Compress the trace
-      compress_trace_addresses(&trace_store);
-      next = &trace_store.buffer[0];
+      // Hand the buffer over to the trace writer
+      next = trace_flush_addr(&trace_store);
     }
     trace_store.next = next;
   }
@@ -97,6 +97,8 @@ static inline int tlb_set_page(CPUState *env1, target_ulong vaddr,
         prot |= PAGE_EXEC;
     return tlb_set_page_exec(env1, vaddr, paddr, prot, mmu_idx, is_softmmu);
 }
+int tlb_victim_hit(CPUState *env1, target_ulong addr, int mmu_idx,
+                   int access_type);
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
@@ -344,6 +346,10 @@ extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
 
+void *tb_lookup_ptr(void);
+extern uint64_t tb_lookup_chain_count;
+extern uint64_t tb_lookup_exit_count;
+
 #if !defined(CONFIG_USER_ONLY)
 
 void tlb_fill(target_ulong addr, int is_write, int mmu_idx,
@@ -40,6 +40,7 @@
 #include "osdep.h"
 #include "kvm.h"
 #include "qemu-timer.h"
+#include "tb-cache.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #endif
@@ -106,7 +107,8 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
     __attribute__((aligned (32)))
 #endif
 
-uint8_t code_gen_prologue[1024] code_gen_section;
+/* also holds the qemu_ld/st TLB miss thunks of the x86 backends */
+uint8_t code_gen_prologue[4096] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
 /* threshold to flush the translated code buffer */
@@ -924,7 +926,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->bb_rec = NULL;
     tb->prev_time = 0;
 #endif
-    cpu_gen_code(env, tb, &code_gen_size);
+    if (!tb_cache_load(env, tb, phys_pc, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_store(env, tb, phys_pc, code_gen_size);
+    }
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -1802,6 +1807,7 @@ void tlb_flush(CPUState *env, int flush_global)
             env->tlb_table[mmu_idx][i].addr_code = -1;
         }
     }
+    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -1813,14 +1819,20 @@ void tlb_flush(CPUState *env, int flush_global)
     tlb_flush_count++;
 }
 
+/* return true if the entry maps the page 'addr' for any kind of access */
+static inline int tlb_entry_is_page(CPUTLBEntry *tlb_entry, target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_is_page(tlb_entry, addr)) {
         tlb_entry->addr_read = -1;
         tlb_entry->addr_write = -1;
         tlb_entry->addr_code = -1;
@@ -1829,7 +1841,7 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
-    int i;
+    int i, vidx;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
@@ -1841,8 +1853,11 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++)
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx], addr);
+    }
 
     tlb_flush_jmp_cache(env, addr);
 }
@@ -1913,6 +1928,9 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
             for(i = 0; i < CPU_TLB_SIZE; i++)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+            for(i = 0; i < CPU_VTLB_SIZE; i++)
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
         }
     }
 }
@@ -1964,6 +1982,8 @@ void cpu_tlb_update_dirty(CPUState *env)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for(i = 0; i < CPU_VTLB_SIZE; i++)
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
     }
 }
 
@@ -1977,13 +1997,58 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
 {
-    int i;
+    int i, vidx;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++)
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][vidx], vaddr);
+    }
+}
+
+/* Called on a miss in the direct mapped TLB for an access of type
+   'access_type' (0 = read, 1 = write, 2 = code, as for tlb_fill()).
+   If the page of 'addr' is in the victim TLB, swap its entry with the
+   one it conflicts with and return 1. Otherwise, return 0: the caller
+   must call tlb_fill(). */
+int tlb_victim_hit(CPUState *env, target_ulong addr, int mmu_idx,
+                   int access_type)
+{
+    unsigned int index, vidx;
+    target_ulong page = addr & TARGET_PAGE_MASK;
+
+    env->tlb_miss_count++;
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp;
+
+        if (access_type == 0)
+            cmp = vte->addr_read;
+        else if (access_type == 1)
+            cmp = vte->addr_write;
+        else
+            cmp = vte->addr_code;
+
+        if (page == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            CPUTLBEntry *te, tmp;
+            target_phys_addr_t iotlb;
+
+            index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+            te = &env->tlb_table[mmu_idx][index];
+            tmp = *te;
+            *te = *vte;
+            *vte = tmp;
+            iotlb = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = iotlb;
+            env->tlb_victim_hit_count++;
+            return 1;
+        }
+    }
+    return 0;
 }
 
 /* add a new TLB entry. At most one entry for a given virtual address
@@ -1996,7 +2061,7 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
 {
     PhysPageDesc *p;
     unsigned long pd;
-    unsigned int index;
+    unsigned int index, vidx;
     target_ulong address;
     target_ulong code_address;
     ptrdiff_t addend;
@@ -2022,6 +2087,10 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
         /* IO memory case (romd handled later) */
         address |= TLB_MMIO;
     }
+    if ((pd & ~TARGET_PAGE_MASK) <= IO_MEM_ROM || (pd & IO_MEM_ROMD)) {
+        /* the generated code accesses the page without any check */
+        ram_lazy_touch(pd & TARGET_PAGE_MASK, TARGET_PAGE_SIZE);
+    }
     addend = (ptrdiff_t)qemu_get_ram_ptr(pd & TARGET_PAGE_MASK);
     if ((pd & ~TARGET_PAGE_MASK) <= IO_MEM_ROM) {
         /* Normal RAM.  */
@@ -2058,8 +2127,21 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
     }
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* drop any stale copy of the page from the victim TLB, then move the
+       entry we are about to replace there */
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++)
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx], vaddr);
+    if (!tlb_entry_is_page(te, vaddr) &&
+        (te->addr_read != -1 || te->addr_write != -1 ||
+         te->addr_code != -1)) {
+        vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -3152,6 +3234,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 unsigned long addr1;
                 addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
                 /* RAM case */
+                ram_lazy_touch(addr1, l);
                 ptr = qemu_get_ram_ptr(addr1);
                 memcpy(ptr, buf, l);
                 if (!cpu_physical_memory_is_dirty(addr1)) {
@@ -3188,6 +3271,8 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 }
             } else {
                 /* RAM case */
+                ram_lazy_touch((pd & TARGET_PAGE_MASK) +
+                               (addr & ~TARGET_PAGE_MASK), l);
                 ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
                     (addr & ~TARGET_PAGE_MASK);
                 memcpy(buf, ptr, l);
@@ -3229,6 +3314,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
             unsigned long addr1;
             addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
             /* ROM/RAM case */
+            ram_lazy_touch(addr1, l);
             ptr = qemu_get_ram_ptr(addr1);
             memcpy(ptr, buf, l);
         }
@@ -3331,6 +3417,7 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
         } else {
             addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
             ptr = qemu_get_ram_ptr(addr1);
+            ram_lazy_touch(addr1, l);
         }
         if (!done) {
             ret = ptr;
@@ -3407,6 +3494,7 @@ uint32_t ldl_phys(target_phys_addr_t addr)
         val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
     } else {
         /* RAM case */
+        ram_lazy_touch((pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK), 4);
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
             (addr & ~TARGET_PAGE_MASK);
         val = ldl_p(ptr);
@@ -3445,6 +3533,7 @@ uint64_t ldq_phys(target_phys_addr_t addr)
 #endif
     } else {
         /* RAM case */
+        ram_lazy_touch((pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK), 8);
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
             (addr & ~TARGET_PAGE_MASK);
         val = ldq_p(ptr);
@@ -3492,6 +3581,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
     } else {
         unsigned long addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+        ram_lazy_touch(addr1, 4);
         ptr = qemu_get_ram_ptr(addr1);
         stl_p(ptr, val);
 
@@ -3533,6 +3623,7 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val >> 32);
 #endif
     } else {
+        ram_lazy_touch((pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK), 8);
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
             (addr & ~TARGET_PAGE_MASK);
         stq_p(ptr, val);
@@ -3563,6 +3654,7 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
         unsigned long addr1;
         addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
         /* RAM case */
+        ram_lazy_touch(addr1, 4);
         ptr = qemu_get_ram_ptr(addr1);
         stl_p(ptr, val);
         if (!cpu_physical_memory_is_dirty(addr1)) {
@@ -3740,6 +3832,35 @@ void dump_exec_info(FILE *f,
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "indirect jump count %" PRId64 " (%0.1f%% left the TB)\n",
+                tb_lookup_chain_count + tb_lookup_exit_count,
+                tb_lookup_exit_count ?
+                    (double)tb_lookup_exit_count /
+                    (tb_lookup_chain_count + tb_lookup_exit_count) * 100.0 : 0);
+    {
+        uint64_t misses = 0, victim_hits = 0;
+#ifdef CONFIG_PROFILER
+        uint64_t hits = 0;
+#endif
+        CPUState *env;
+
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+#ifdef CONFIG_PROFILER
+            hits += env->tlb_hit_count;
+#endif
+            misses += env->tlb_miss_count;
+            victim_hits += env->tlb_victim_hit_count;
+        }
+        cpu_fprintf(f, "TLB size            %d entries + %d victim\n",
+                    CPU_TLB_SIZE, CPU_VTLB_SIZE);
+#ifdef CONFIG_PROFILER
+        cpu_fprintf(f, "TLB hits            %" PRId64 "\n", hits);
+#endif
+        cpu_fprintf(f, "TLB misses          %" PRId64 "\n", misses);
+        cpu_fprintf(f, "TLB victim hits     %" PRId64 " (%0.1f%%)\n",
+                    victim_hits,
+                    misses ? (double)victim_hits / misses * 100.0 : 0);
+    }
     tcg_dump_info(f, cpu_fprintf);
 }
 
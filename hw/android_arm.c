@@ -45,7 +45,8 @@ static struct goldfish_device event0_device = {
 static struct goldfish_device nand_device = {
     .name = "goldfish_nand",
     .id = 0,
-    .size = 0x1000
+    .size = 0x1000,
+    .irq_count = 1
 };
 
 /* Board init.  */
@@ -109,6 +110,8 @@ static void android_arm_init_(ram_addr_t ram_size,
                 smc_device->irq_count = 1;
                 goldfish_add_device_no_io(smc_device);
                 smc91c111_init(&nd_table[i], smc_device->base, goldfish_pic[smc_device->irq]);
+            } else if (strcmp(nd_table[i].model, "goldfish") == 0) {
+                goldfish_nic_init(&nd_table[i], i);
             } else {
                 fprintf(stderr, "qemu: Unsupported NIC: %s\n", nd_table[0].model);
                 exit (1);
@@ -132,12 +135,14 @@ static void android_arm_init_(ram_addr_t ram_size,
     if (android_hw->hw_battery)
         goldfish_battery_init();
 
+    goldfish_pipe_init();
+
     goldfish_add_device_no_io(&event0_device);
     events_dev_init(event0_device.base, goldfish_pic[event0_device.irq]);
 
 #ifdef CONFIG_NAND
     goldfish_add_device_no_io(&nand_device);
-    nand_dev_init(nand_device.base);
+    nand_dev_init(nand_device.base, goldfish_pic[nand_device.irq]);
 #endif
 #ifdef CONFIG_TRACE
     extern const char *trace_filename;
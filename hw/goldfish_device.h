@@ -46,13 +46,16 @@ void goldfish_audio_init(uint32_t base, int id, const char* input_source);
 void goldfish_battery_init();
 void goldfish_battery_set_prop(int ac, int property, int value);
 void goldfish_battery_display(void (* callback)(void *data, const char* string), void *data);
+void goldfish_pipe_init(void);
 void goldfish_mmc_init(uint32_t base, int id, BlockDriverState* bs);
+void goldfish_nic_init(NICInfo *nd, int id);
 void *goldfish_switch_add(char *name, uint32_t (*writefn)(void *opaque, uint32_t state), void *writeopaque, int id);
 void goldfish_switch_set_state(void *opaque, uint32_t state);
 
 // these do not add a device
 void trace_dev_init();
 void events_dev_init(uint32_t base, qemu_irq irq);
-void nand_dev_init(uint32_t base);
+void events_dev_info(Monitor *mon);
+void nand_dev_init(uint32_t base, qemu_irq irq);
 
 #endif
@@ -16,8 +16,12 @@
 #include "irq.h"
 #include "user-events.h"
 #include "console.h"
+#include "monitor.h"
 
-#define MAX_EVENTS 256*4
+/* the event queue holds 3 words per event, and grows up to MAX_EVENTS
+ * words when the guest doesn't drain it fast enough */
+#define MIN_EVENTS 256*4
+#define MAX_EVENTS 65536*4
 
 enum {
     REG_READ        = 0x00,
@@ -25,6 +29,21 @@ enum {
     REG_LEN         = 0x04,
     REG_DATA        = 0x08,
 
+    /* Batched mode: the driver gives the physical address and the size (in
+     * events) of a buffer, then each read of REG_BATCH_READ copies as many
+     * queued events as fit into it, as (type, code, value) triples of 32-bit
+     * words, and returns their count. The IRQ stays raised while events are
+     * queued. REG_FEATURES reads 0 on devices without batched mode.
+     * REG_BATCH_READ drops the rest of an event that was partly read
+     * through REG_READ, so the two modes shouldn't be mixed. */
+    REG_BATCH_ADDR  = 0xf00,
+    REG_BATCH_SIZE  = 0xf04,
+    REG_BATCH_READ  = 0xf08,
+    REG_DROPPED     = 0xf0c,  /* events lost because the queue was full */
+    REG_FEATURES    = 0xf10,
+
+    FEATURE_BATCH   = 1,
+
     PAGE_NAME       = 0x00000,
     PAGE_EVBITS     = 0x10000,
     PAGE_ABSDATA    = 0x20000 | EV_ABS,
@@ -52,11 +71,17 @@ typedef struct
     int pending;
     int page;
 
-    unsigned events[MAX_EVENTS];
+    unsigned *events;
+    unsigned size;      /* in words, a power of 2 */
     unsigned first;
     unsigned last;
     unsigned state;
 
+    uint32_t batch_addr;
+    uint32_t batch_size;
+    uint32_t dropped;
+    int      overflow;  /* the queue is full, a message was printed */
+
     const char *name;
 
     struct {
@@ -68,10 +93,13 @@ typedef struct
     size_t abs_info_count;
 } events_state;
 
+/* only one instance, for the monitor */
+static events_state *events_dev;
+
 /* modify this each time you change the events_device structure. you
  * will also need to upadte events_state_load and events_state_save
  */
-#define  EVENTS_STATE_SAVE_VERSION  2
+#define  EVENTS_STATE_SAVE_VERSION  3
 
 #undef  QFIELD_STRUCT
 #define QFIELD_STRUCT  events_state
@@ -79,40 +107,103 @@ typedef struct
 QFIELD_BEGIN(events_state_fields)
     QFIELD_INT32(pending),
     QFIELD_INT32(page),
-    QFIELD_BUFFER(events),
-    QFIELD_INT32(first),
-    QFIELD_INT32(last),
     QFIELD_INT32(state),
+    QFIELD_INT32(batch_addr),
+    QFIELD_INT32(batch_size),
+    QFIELD_INT32(dropped),
 QFIELD_END
 
+static unsigned events_queued(events_state *s)
+{
+    return (s->last - s->first) & (s->size - 1);
+}
+
+/* makes room for at least 'count' queued words, returns 0 if the queue
+ * can't grow anymore */
+static int events_reserve(events_state *s, unsigned count)
+{
+    unsigned queued = events_queued(s);
+    unsigned size = s->size;
+    unsigned *events;
+    unsigned n;
+
+    if (count >= MAX_EVENTS)
+        return 0;
+
+    /* one slot is kept free to tell a full queue from an empty one */
+    while (count >= size) {
+        size *= 2;
+    }
+    if (size == s->size)
+        return 1;
+    if (size > MAX_EVENTS)
+        return 0;
+
+    events = qemu_malloc(size * sizeof(events[0]));
+    for (n = 0; n < queued; n++)
+        events[n] = s->events[(s->first + n) & (s->size - 1)];
+
+    qemu_free(s->events);
+    s->events = events;
+    s->size = size;
+    s->first = 0;
+    s->last = queued;
+    return 1;
+}
+
 static void  events_state_save(QEMUFile*  f, void*  opaque)
 {
     events_state*  s = opaque;
+    unsigned queued = events_queued(s);
+    unsigned n;
 
     qemu_put_struct(f, events_state_fields, s);
+
+    /* the guest may have read part of the first event through REG_READ */
+    qemu_put_be32(f, (3 - queued % 3) % 3);
+    qemu_put_be32(f, queued);
+    for (n = 0; n < queued; n++)
+        qemu_put_be32(f, s->events[(s->first + n) & (s->size - 1)]);
 }
 
 static int  events_state_load(QEMUFile*  f, void* opaque, int  version_id)
 {
     events_state*  s = opaque;
+    unsigned head, queued, n;
+    int ret;
 
     if (version_id != EVENTS_STATE_SAVE_VERSION)
         return -1;
 
-    return qemu_get_struct(f, events_state_fields, s);
+    ret = qemu_get_struct(f, events_state_fields, s);
+    if (ret < 0)
+        return ret;
+
+    head = qemu_get_be32(f);
+    queued = qemu_get_be32(f);
+    if (head >= 3 || queued >= MAX_EVENTS || (head + queued) % 3 != 0)
+        return -1;
+    s->first = s->last = 0;
+    if (!events_reserve(s, head + queued))
+        return -1;
+    for (n = 0; n < queued; n++)
+        s->events[head + n] = qemu_get_be32(f);
+    s->first = head;
+    s->last = head + queued;
+    s->overflow = 0;
+    return 0;
 }
 
 extern const char*  android_skin_keycharmap;
 
 static void enqueue_event(events_state *s, unsigned int type, unsigned int code, int value)
 {
-    int  enqueued = s->last - s->first;
-
-    if (enqueued < 0)
-        enqueued += MAX_EVENTS;
-
-    if (enqueued + 3 > MAX_EVENTS) {
-        fprintf(stderr, "##KBD: Full queue, lose event\n");
+    if (!events_reserve(s, events_queued(s) + 3)) {
+        if (!s->overflow) {
+            fprintf(stderr, "##KBD: Full queue, lose events\n");
+            s->overflow = 1;
+        }
+        s->dropped++;
         return;
     }
 
@@ -127,11 +218,11 @@ static void enqueue_event(events_state *s, unsigned int type, unsigned int code,
     //fprintf(stderr, "##KBD: type=%d code=%d value=%d\n", type, code, value);
 
     s->events[s->last] = type;
-    s->last = (s->last + 1) & (MAX_EVENTS-1);
+    s->last = (s->last + 1) & (s->size-1);
     s->events[s->last] = code;
-    s->last = (s->last + 1) & (MAX_EVENTS-1);
+    s->last = (s->last + 1) & (s->size-1);
     s->events[s->last] = value;
-    s->last = (s->last + 1) & (MAX_EVENTS-1);
+    s->last = (s->last + 1) & (s->size-1);
 }
 
 static unsigned dequeue_event(events_state *s)
@@ -144,15 +235,51 @@ static unsigned dequeue_event(events_state *s)
 
     n = s->events[s->first];
 
-    s->first = (s->first + 1) & (MAX_EVENTS - 1);
+    s->first = (s->first + 1) & (s->size - 1);
 
     if(s->first == s->last) {
         qemu_irq_lower(s->irq);
+        s->overflow = 0;
     }
 
     return n;
 }
 
+/* copies the queued events to the batch buffer, returns their count */
+static unsigned dequeue_batch(events_state *s)
+{
+    target_phys_addr_t len;
+    unsigned count, n;
+    uint32_t *buf;
+
+    /* start on a (type, code, value) triple */
+    while (events_queued(s) % 3 != 0)
+        dequeue_event(s);
+
+    count = MIN(events_queued(s) / 3, s->batch_size);
+    if (count == 0 || s->batch_addr == 0)
+        return 0;
+
+    len = count * 3 * sizeof(uint32_t);
+    buf = cpu_physical_memory_map(s->batch_addr, &len, 1);
+    if (buf == NULL)
+        return 0;
+    count = MIN(count, len / (3 * sizeof(uint32_t)));
+
+    for (n = 0; n < count * 3; n++) {
+        buf[n] = tswap32(s->events[s->first]);
+        s->first = (s->first + 1) & (s->size - 1);
+    }
+    cpu_physical_memory_unmap(buf, len, 1, count * 3 * sizeof(uint32_t));
+
+    if(s->first == s->last) {
+        qemu_irq_lower(s->irq);
+        s->overflow = 0;
+    }
+
+    return count;
+}
+
 static const char*
 get_charmap_name(events_state *s)
 {
@@ -215,7 +342,17 @@ static uint32_t events_read(void *x, target_phys_addr_t off)
         return dequeue_event(s);
     else if (offset == REG_LEN)
         return get_page_len(s);
-    else if (offset >= REG_DATA)
+    else if (offset == REG_BATCH_ADDR)
+        return s->batch_addr;
+    else if (offset == REG_BATCH_SIZE)
+        return s->batch_size;
+    else if (offset == REG_BATCH_READ)
+        return dequeue_batch(s);
+    else if (offset == REG_DROPPED)
+        return s->dropped;
+    else if (offset == REG_FEATURES)
+        return FEATURE_BATCH;
+    else if (offset >= REG_DATA && offset < REG_BATCH_ADDR)
         return get_page_data(s, offset - REG_DATA);
     return 0; // this shouldn't happen, if the driver does the right thing
 }
@@ -226,6 +363,25 @@ static void events_write(void *x, target_phys_addr_t off, uint32_t val)
     int offset = off; // - s->base;
     if (offset == REG_SET_PAGE)
         s->page = val;
+    else if (offset == REG_BATCH_ADDR)
+        s->batch_addr = val;
+    else if (offset == REG_BATCH_SIZE)
+        s->batch_size = val;
+}
+
+void events_dev_info(Monitor *mon)
+{
+    events_state *s = events_dev;
+
+    if (s == NULL) {
+        monitor_printf(mon, "no events device\n");
+        return;
+    }
+    monitor_printf(mon, "queued events: %u (queue size %u)\n",
+                   events_queued(s) / 3, (s->size - 1) / 3);
+    monitor_printf(mon, "dropped events: %u\n", s->dropped);
+    monitor_printf(mon, "batched mode: %s\n",
+                   s->batch_addr ? "on" : "off");
 }
 
 static CPUReadMemoryFunc *events_readfn[] = {
@@ -437,9 +593,12 @@ void events_dev_init(uint32_t base, qemu_irq irq)
     s->base = base;
     s->irq = irq;
 
+    s->events = qemu_malloc(MIN_EVENTS * sizeof(s->events[0]));
+    s->size = MIN_EVENTS;
     s->first = 0;
     s->last = 0;
     s->state = STATE_INIT;
+    events_dev = s;
 
     /* This function migh fire buffered events to the device, so
      * ensure that it is called after initialization is complete
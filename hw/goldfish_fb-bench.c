@@ -0,0 +1,311 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* Micro-benchmark of the goldfish framebuffer dirty rectangle scan.
+ *
+ * This runs compute_fb_update_rect_linear() of goldfish_fb_scan.h on
+ * synthetic framebuffers, against the per-line dirty page polling and
+ * per-pixel DUFF4 loops that it used before, for a few typical update
+ * patterns. The VGA dirty bits are simulated: before each frame, the
+ * pages of the lines that the guest redrew are marked dirty.
+ *
+ * usage: goldfish_fb-bench [-w width] [-h height] [-n frames]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define  TARGET_PAGE_BITS  12
+#define  TARGET_PAGE_SIZE  (1 << TARGET_PAGE_BITS)
+#define  TARGET_PAGE_MASK  ~(TARGET_PAGE_SIZE - 1)
+#define  VGA_DIRTY_FLAG    0x01
+
+/* The framebuffer is simulated at this physical address */
+#define  BENCH_FB_BASE     0x10000000
+
+static uint8_t*  _dirty_pages;
+
+static int
+cpu_physical_memory_get_dirty(uint32_t addr, int dirty_flags)
+{
+    return _dirty_pages[(addr - BENCH_FB_BASE) >> TARGET_PAGE_BITS] & dirty_flags;
+}
+
+static void
+cpu_physical_memory_reset_dirty(uint32_t start, uint32_t end, int dirty_flags)
+{
+    uint32_t  page;
+
+    for (page = start & TARGET_PAGE_MASK; page < end; page += TARGET_PAGE_SIZE)
+        _dirty_pages[(page - BENCH_FB_BASE) >> TARGET_PAGE_BITS] &= ~dirty_flags;
+}
+
+#include "goldfish_fb_scan.h"
+
+typedef int (*ScanFunc)(FbUpdateState* fbs, uint32_t dirty_base,
+                        FbUpdateRect* rect);
+
+/* compute_fb_update_rect_linear() as it was before the byte scans and the
+ * per-frame dirty page walk, for 16 and 32 bpp */
+static int
+compute_fb_update_rect_pixels(FbUpdateState*  fbs,
+                              uint32_t        dirty_base,
+                              FbUpdateRect*   rect)
+{
+    int  yy;
+    int  width = fbs->width;
+    const uint8_t* src_line = fbs->src_pixels;
+    uint8_t*       dst_line = fbs->dst_pixels;
+    uint32_t       dirty_addr = dirty_base;
+    rect->xmin = rect->ymin = INT_MAX;
+    rect->xmax = rect->ymax = INT_MIN;
+    for (yy = 0; yy < fbs->height; yy++) {
+        int xx1, xx2;
+
+        if (dirty_addr != 0) {
+            int  dirty = 0;
+            int  len   = fbs->src_pitch;
+
+            while (len > 0) {
+                int  len2 = TARGET_PAGE_SIZE - (dirty_addr & (TARGET_PAGE_SIZE-1));
+
+                if (len2 > len)
+                    len2 = len;
+
+                dirty |= cpu_physical_memory_get_dirty(dirty_addr, VGA_DIRTY_FLAG);
+                dirty_addr  += len2;
+                len         -= len2;
+            }
+
+            if (!dirty) { /* this line was not modified, skip to next one */
+                goto NEXT_LINE;
+            }
+        }
+
+        if (fbs->bytes_per_pixel == 2) {
+            const uint16_t* src = (const uint16_t*) src_line;
+            uint16_t*       dst = (uint16_t*) dst_line;
+
+            xx1 = 0;
+            DUFF4(width, {
+                if (src[xx1] != dst[xx1])
+                    break;
+                xx1++;
+            });
+            if (xx1 == width)
+                goto NEXT_LINE;
+            xx2 = width-1;
+            DUFF4(xx2-xx1, {
+                if (src[xx2] != dst[xx2])
+                    break;
+                xx2--;
+            });
+            memcpy( dst+xx1, src+xx1, (xx2-xx1+1)*2 );
+        } else {
+            const uint32_t* src = (const uint32_t*) src_line;
+            uint32_t*       dst = (uint32_t*) dst_line;
+
+            xx1 = 0;
+            DUFF4(width, {
+                if (src[xx1] != dst[xx1])
+                    break;
+                xx1++;
+            });
+            if (xx1 == width)
+                goto NEXT_LINE;
+            xx2 = width-1;
+            DUFF4(xx2-xx1, {
+                if (src[xx2] != dst[xx2])
+                    break;
+                xx2--;
+            });
+            memcpy( dst+xx1, src+xx1, (xx2-xx1+1)*4 );
+        }
+        if (xx1 < rect->xmin) rect->xmin = xx1;
+        if (xx2 > rect->xmax) rect->xmax = xx2;
+        if (yy < rect->ymin) rect->ymin = yy;
+        if (yy > rect->ymax) rect->ymax = yy;
+    NEXT_LINE:
+        src_line += fbs->src_pitch;
+        dst_line += fbs->dst_pitch;
+    }
+
+    if (rect->ymin > rect->ymax) { /* nothing changed */
+        return 0;
+    }
+
+    cpu_physical_memory_reset_dirty(dirty_base + rect->ymin * fbs->src_pitch,
+                                    dirty_base + (rect->ymax+1)* fbs->src_pitch,
+                                    VGA_DIRTY_FLAG);
+    return 1;
+}
+
+/* An update pattern: the rectangle of pixels that differs between the
+ * two source frames that are shown alternately. */
+typedef struct {
+    const char*  name;
+    int          x, y, w, h;   /* in 1/64th of the framebuffer size */
+} BenchPattern;
+
+static const BenchPattern  _patterns[] = {
+    { "idle",       0,  0,  0,  0 },
+    { "cursor",    30, 30,  1,  1 },
+    { "statusbar",  0,  0, 64,  2 },
+    { "list",       4, 12, 56, 40 },
+    { "full",       0,  0, 64, 64 },
+};
+
+#define  N_PATTERNS  (int)(sizeof(_patterns)/sizeof(_patterns[0]))
+
+static double
+now_ms(void)
+{
+    struct timeval  tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000. + tv.tv_usec / 1000.;
+}
+
+/* Scan 'frames' frames alternating between 'src0' and 'src1', and return
+ * the average time per frame in milliseconds. Lines [y1..y2) are redrawn
+ * by the guest before each frame, which marks their pages dirty. */
+static double
+run_pattern(ScanFunc scan, uint8_t* src0, uint8_t* src1, uint8_t* dst,
+            int width, int height, int bpp, int y1, int y2, int frames,
+            FbUpdateRect* rect)
+{
+    FbUpdateState  fbs;
+    int     pitch = width * bpp;
+    int     npages = (pitch * height + TARGET_PAGE_SIZE - 1) / TARGET_PAGE_SIZE;
+    int     nn;
+    double  start;
+
+    fbs.width           = width;
+    fbs.height          = height;
+    fbs.bytes_per_pixel = bpp;
+    fbs.src_pitch       = pitch;
+    fbs.dst_pixels      = dst;
+    fbs.dst_pitch       = pitch;
+    fbs.dirty_lines     = malloc(height);
+
+    memcpy(dst, src0, pitch * height);
+    memset(_dirty_pages, 0, npages);
+    start = now_ms();
+    for (nn = 0; nn < frames; nn++) {
+        if (y1 < y2) {
+            int  p1 = (y1 * pitch) >> TARGET_PAGE_BITS;
+            int  p2 = (y2 * pitch - 1) >> TARGET_PAGE_BITS;
+            memset(_dirty_pages + p1, VGA_DIRTY_FLAG, p2 - p1 + 1);
+        }
+        fbs.src_pixels = (nn & 1) ? src0 : src1;
+        scan(&fbs, BENCH_FB_BASE, rect);
+    }
+    free(fbs.dirty_lines);
+    return (now_ms() - start) / frames;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: goldfish_fb-bench [-w width] [-h height] [-n frames]\n");
+    exit(1);
+}
+
+int
+main(int argc, char** argv)
+{
+    int  width  = 1080;
+    int  height = 1920;
+    int  frames = 200;
+    int  bpp, nn;
+
+    for (nn = 1; nn < argc; nn++) {
+        if (nn + 1 == argc)
+            usage();
+        if (!strcmp(argv[nn], "-w"))
+            width = atoi(argv[++nn]);
+        else if (!strcmp(argv[nn], "-h"))
+            height = atoi(argv[++nn]);
+        else if (!strcmp(argv[nn], "-n"))
+            frames = atoi(argv[++nn]);
+        else
+            usage();
+    }
+    if (width <= 0 || height <= 0 || frames <= 0)
+        usage();
+
+    printf("%dx%d, %d frames, %s kernels\n", width, height, frames,
+#if FB_SCAN_AVX2
+           fb_scan_has_avx2() ? "AVX2" :
+#endif
+#if FB_SCAN_SSE2
+           fb_scan_has_sse2() ? "SSE2" :
+#endif
+           "scalar");
+    printf("bits pattern     pixels ms/frame  bytes ms/frame  speedup\n");
+
+    _dirty_pages = calloc(((size_t)width * height * 4 + TARGET_PAGE_SIZE - 1) / TARGET_PAGE_SIZE, 1);
+    if (!_dirty_pages) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (bpp = 2; bpp <= 4; bpp += 2) {
+        size_t    size = (size_t)width * height * bpp;
+        uint8_t*  src0 = malloc(size);
+        uint8_t*  src1 = malloc(size);
+        uint8_t*  dst  = malloc(size);
+        int       pp;
+
+        if (!src0 || !src1 || !dst) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        for (nn = 0; nn < (int)size; nn++)
+            src0[nn] = (uint8_t)(nn * 7 + nn / 4096);
+
+        for (pp = 0; pp < N_PATTERNS; pp++) {
+            const BenchPattern*  p = &_patterns[pp];
+            int        x1 = p->x * width / 64, x2 = (p->x + p->w) * width / 64;
+            int        y1 = p->y * height / 64, y2 = (p->y + p->h) * height / 64;
+            FbUpdateRect r1, r2;
+            double     t1, t2;
+            int        yy, xx;
+
+            memcpy(src1, src0, size);
+            for (yy = y1; yy < y2; yy++)
+                for (xx = x1 * bpp; xx < x2 * bpp; xx++)
+                    src1[yy * width * bpp + xx] ^= 0x5a;
+
+            t1 = run_pattern(compute_fb_update_rect_pixels, src0, src1, dst,
+                             width, height, bpp, y1, y2, frames, &r1);
+            t2 = run_pattern(compute_fb_update_rect_linear, src0, src1, dst,
+                             width, height, bpp, y1, y2, frames, &r2);
+
+            if (memcmp(&r1, &r2, sizeof r1)) {
+                fprintf(stderr, "%s: rectangles differ\n", p->name);
+                return 1;
+            }
+            if (memcmp(dst, ((frames - 1) & 1) ? src0 : src1, size)) {
+                fprintf(stderr, "%s: surface differs from the last frame\n", p->name);
+                return 1;
+            }
+            printf("%3d  %-10s %15.3f %15.3f %7.1fx\n",
+                   bpp * 8, p->name, t1, t2, t1 / t2);
+        }
+        free(src0);
+        free(src1);
+        free(dst);
+    }
+    free(_dirty_pages);
+    return 0;
+}
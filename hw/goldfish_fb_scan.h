@@ -0,0 +1,415 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _HW_GOLDFISH_FB_SCAN_H
+#define _HW_GOLDFISH_FB_SCAN_H
+
+/* The dirty rectangle scan of the goldfish framebuffer device. It is kept
+ * in this header so that goldfish_fb-bench.c can measure it without
+ * linking the device. The includer must provide TARGET_PAGE_SIZE,
+ * TARGET_PAGE_MASK, VGA_DIRTY_FLAG, cpu_physical_memory_get_dirty() and
+ * cpu_physical_memory_reset_dirty().
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include "android/utils/duff.h"
+
+/* The AVX2 kernels are compiled with a target attribute and only used
+ * when the host CPU supports them, as the emulator must also run on
+ * older CPUs. So are the SSE2 kernels when the compiler doesn't target
+ * SSE2 already, as in 32-bit x86 builds.
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__) && \
+    !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define FB_SCAN_AVX2  1
+#include <immintrin.h>
+#else
+#define FB_SCAN_AVX2  0
+#endif
+
+#if defined(__SSE2__) || FB_SCAN_AVX2
+#define FB_SCAN_SSE2  1
+#include <emmintrin.h>
+#else
+#define FB_SCAN_SSE2  0
+#endif
+
+#if FB_SCAN_SSE2 && !defined(__SSE2__)
+#define FB_SCAN_SSE2_TARGET  __attribute__((target("sse2")))
+
+static __inline__ int
+fb_scan_has_sse2(void)
+{
+    static int  has_sse2 = -1;
+
+    if (has_sse2 < 0) {
+        __builtin_cpu_init();
+        has_sse2 = __builtin_cpu_supports("sse2") != 0;
+    }
+    return has_sse2;
+}
+#else
+#define FB_SCAN_SSE2_TARGET
+#define fb_scan_has_sse2()  1
+#endif
+
+#if FB_SCAN_AVX2
+static __inline__ int
+fb_scan_has_avx2(void)
+{
+    static int  has_avx2 = -1;
+
+    if (has_avx2 < 0) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    return has_avx2;
+}
+
+static __inline__ __attribute__((target("avx2"))) int
+fb_scan_left_avx2(const uint8_t* src, const uint8_t* dst, int len)
+{
+    int  nn = 0;
+
+    for ( ; nn + 32 <= len; nn += 32) {
+        __m256i   a    = _mm256_loadu_si256((const __m256i*)(src + nn));
+        __m256i   b    = _mm256_loadu_si256((const __m256i*)(dst + nn));
+        unsigned  mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (mask != 0)
+            return nn + __builtin_ctz(mask);
+    }
+    for ( ; nn < len; nn++) {
+        if (src[nn] != dst[nn])
+            break;
+    }
+    return nn;
+}
+
+static __inline__ __attribute__((target("avx2"))) int
+fb_scan_right_avx2(const uint8_t* src, const uint8_t* dst, int len)
+{
+    int  nn = len;
+
+    for ( ; nn >= 32; nn -= 32) {
+        __m256i   a    = _mm256_loadu_si256((const __m256i*)(src + nn - 32));
+        __m256i   b    = _mm256_loadu_si256((const __m256i*)(dst + nn - 32));
+        unsigned  mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (mask != 0)
+            return nn - 32 + (31 - __builtin_clz(mask));
+    }
+    for ( ; nn > 0; nn--) {
+        if (src[nn-1] != dst[nn-1])
+            break;
+    }
+    return nn - 1;
+}
+#endif /* FB_SCAN_AVX2 */
+
+#if FB_SCAN_SSE2
+static __inline__ FB_SCAN_SSE2_TARGET int
+fb_scan_left_sse2(const uint8_t* src, const uint8_t* dst, int len)
+{
+    int  nn = 0;
+
+    for ( ; nn + 16 <= len; nn += 16) {
+        __m128i  a    = _mm_loadu_si128((const __m128i*)(src + nn));
+        __m128i  b    = _mm_loadu_si128((const __m128i*)(dst + nn));
+        int      mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+        if (mask != 0)
+            return nn + __builtin_ctz(mask);
+    }
+    for ( ; nn < len; nn++) {
+        if (src[nn] != dst[nn])
+            break;
+    }
+    return nn;
+}
+
+static __inline__ FB_SCAN_SSE2_TARGET int
+fb_scan_right_sse2(const uint8_t* src, const uint8_t* dst, int len)
+{
+    int  nn = len;
+
+    for ( ; nn >= 16; nn -= 16) {
+        __m128i  a    = _mm_loadu_si128((const __m128i*)(src + nn - 16));
+        __m128i  b    = _mm_loadu_si128((const __m128i*)(dst + nn - 16));
+        int      mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+        if (mask != 0)
+            return nn - 16 + (31 - __builtin_clz(mask));
+    }
+    for ( ; nn > 0; nn--) {
+        if (src[nn-1] != dst[nn-1])
+            break;
+    }
+    return nn - 1;
+}
+#endif /* FB_SCAN_SSE2 */
+
+/* Return the offset of the first byte that differs between 'src' and 'dst',
+ * or 'len' if both buffers are identical.
+ */
+static __inline__ int
+fb_scan_left(const uint8_t* src, const uint8_t* dst, int len)
+{
+    int  nn = 0;
+
+#if FB_SCAN_AVX2
+    if (fb_scan_has_avx2())
+        return fb_scan_left_avx2(src, dst, len);
+#endif
+#if FB_SCAN_SSE2
+    if (fb_scan_has_sse2())
+        return fb_scan_left_sse2(src, dst, len);
+#endif
+    for ( ; nn + (int)sizeof(unsigned long) <= len; nn += sizeof(unsigned long)) {
+        unsigned long  a, b;
+        memcpy(&a, src + nn, sizeof a);
+        memcpy(&b, dst + nn, sizeof b);
+        if (a != b)
+            break;
+    }
+    for ( ; nn < len; nn++) {
+        if (src[nn] != dst[nn])
+            break;
+    }
+    return nn;
+}
+
+/* Return the offset of the last byte that differs between 'src' and 'dst',
+ * or -1 if both buffers are identical.
+ */
+static __inline__ int
+fb_scan_right(const uint8_t* src, const uint8_t* dst, int len)
+{
+    int  nn = len;
+
+#if FB_SCAN_AVX2
+    if (fb_scan_has_avx2())
+        return fb_scan_right_avx2(src, dst, len);
+#endif
+#if FB_SCAN_SSE2
+    if (fb_scan_has_sse2())
+        return fb_scan_right_sse2(src, dst, len);
+#endif
+    for ( ; nn >= (int)sizeof(unsigned long); nn -= sizeof(unsigned long)) {
+        unsigned long  a, b;
+        memcpy(&a, src + nn - sizeof a, sizeof a);
+        memcpy(&b, dst + nn - sizeof b, sizeof b);
+        if (a != b)
+            break;
+    }
+    for ( ; nn > 0; nn--) {
+        if (src[nn-1] != dst[nn-1])
+            break;
+    }
+    return nn - 1;
+}
+
+/* Copy pixels [xx1..xx2] of a line from the framebuffer to the surface */
+static __inline__ void
+fb_copy_pixels(uint8_t* dst_line, const uint8_t* src_line,
+               int xx1, int xx2, int bytes_per_pixel)
+{
+#if HOST_WORDS_BIGENDIAN
+    /* Convert the guest little-endian pixels into big-endian ones */
+    if (bytes_per_pixel == 2) {
+        const uint16_t* src = (const uint16_t*) src_line;
+        uint16_t*       dst = (uint16_t*) dst_line;
+        int xx = xx1;
+        DUFF4(xx2-xx1+1,{
+            unsigned   spix = src[xx];
+            dst[xx] = (uint16_t)((spix << 8) | (spix >> 8));
+            xx++;
+        });
+        return;
+    }
+    if (bytes_per_pixel == 4) {
+        const uint32_t* src = (const uint32_t*) src_line;
+        uint32_t*       dst = (uint32_t*) dst_line;
+        int xx = xx1;
+        DUFF4(xx2-xx1+1,{
+            uint32_t   spix = src[xx];
+            spix = (spix << 16) | (spix >> 16);
+            spix = ((spix << 8) & 0xff00ff00) | ((spix >> 8) & 0x00ff00ff);
+            dst[xx] = spix;
+            xx++;
+        });
+        return;
+    }
+#endif
+    memcpy( dst_line + xx1*bytes_per_pixel, src_line + xx1*bytes_per_pixel,
+            (xx2-xx1+1)*bytes_per_pixel );
+}
+
+/* This structure is used to hold the inputs for
+ * compute_fb_update_rect_linear below.
+ * This corresponds to the source framebuffer and destination
+ * surface pixel buffers.
+ */
+typedef struct {
+    int            width;
+    int            height;
+    int            bytes_per_pixel;
+    const uint8_t* src_pixels;
+    int            src_pitch;
+    uint8_t*       dst_pixels;
+    int            dst_pitch;
+    uint8_t*       dirty_lines;  /* scratch array of 'height' bytes */
+} FbUpdateState;
+
+/* This structure is used to hold the outputs for
+ * compute_fb_update_rect_linear below.
+ * This corresponds to the smalled bounding rectangle of the
+ * latest framebuffer update.
+ */
+typedef struct {
+    int xmin, ymin, xmax, ymax;
+} FbUpdateRect;
+
+/* Walk the VGA dirty bits of the framebuffer pages once, and record in
+ * fbs->dirty_lines which lines overlap a dirty page.
+ *
+ * Return 0 if no page was modified, 1 otherwise.
+ */
+static int
+compute_fb_dirty_lines(FbUpdateState*  fbs,
+                       uint32_t        dirty_base)
+{
+    uint32_t  start = dirty_base;
+    uint32_t  end   = dirty_base + fbs->height * fbs->src_pitch;
+    uint32_t  page;
+    int       found = 0;
+
+    memset(fbs->dirty_lines, 0, fbs->height);
+
+    for (page = start & TARGET_PAGE_MASK; page < end; page += TARGET_PAGE_SIZE) {
+        uint32_t  lo, hi;
+        int       y1, y2;
+
+        if (!cpu_physical_memory_get_dirty(page, VGA_DIRTY_FLAG))
+            continue;
+
+        lo = (page > start) ? page : start;
+        hi = page + TARGET_PAGE_SIZE;
+        if (hi > end)
+            hi = end;
+
+        y1 = (lo - start) / fbs->src_pitch;
+        y2 = (hi - 1 - start) / fbs->src_pitch;
+        memset(fbs->dirty_lines + y1, 1, y2 - y1 + 1);
+        found = 1;
+    }
+    return found;
+}
+
+/* Determine the smallest bounding rectangle of pixels which changed
+ * between the source (framebuffer) and destination (surface) pixel
+ * buffers.
+ *
+ * Return 0 if there was no change, otherwise, populate '*rect'
+ * and return 1.
+ *
+ * If 'dirty_base' is not 0, it is a physical address that will be
+ * used to speed-up the check using the VGA dirty bits. In practice
+ * this is only used if your kernel driver does not implement.
+ *
+ * This function assumes that the framebuffers are in linear memory.
+ * This may change later when we want to support larger framebuffers
+ * that exceed the max DMA aperture size though.
+ */
+static int
+compute_fb_update_rect_linear(FbUpdateState*  fbs,
+                              uint32_t        dirty_base,
+                              FbUpdateRect*   rect)
+{
+    int  yy;
+    int  bpp      = fbs->bytes_per_pixel;
+    int  line_len = fbs->width * bpp;
+    int  contiguous = (fbs->src_pitch == line_len && fbs->dst_pitch == line_len);
+    const uint8_t* src_line = fbs->src_pixels;
+    uint8_t*       dst_line = fbs->dst_pixels;
+    rect->xmin = rect->ymin = INT_MAX;
+    rect->xmax = rect->ymax = INT_MIN;
+
+    if (bpp < 2 || bpp > 4)
+        return 0;
+
+    /* If dirty_base is != 0, then use it as a physical address to
+     * use the VGA dirty bits table to skip unmodified lines.
+     */
+    if (dirty_base != 0 && !compute_fb_dirty_lines(fbs, dirty_base))
+        return 0;
+
+    for (yy = 0; yy < fbs->height; yy++) {
+        int  xb1, xb2;
+
+        if (dirty_base != 0 && !fbs->dirty_lines[yy]) {
+            /* this line was not modified, skip to next one */
+            goto NEXT_LINE;
+        }
+
+        /* Then compute actual bounds of the changed pixels, and copy
+         * them from 'src' to 'dst'.
+         */
+        xb1 = fb_scan_left(src_line, dst_line, line_len);
+        if (xb1 == line_len)
+            goto NEXT_LINE;
+
+        xb2 = fb_scan_right(src_line + xb1, dst_line + xb1, line_len - xb1) + xb1;
+        fb_copy_pixels(dst_line, src_line, xb1 / bpp, xb2 / bpp, bpp);
+
+        /* Update bounds since pixels on this line were modified */
+        if (xb1 / bpp < rect->xmin) rect->xmin = xb1 / bpp;
+        if (xb2 / bpp > rect->xmax) rect->xmax = xb2 / bpp;
+        if (yy < rect->ymin) rect->ymin = yy;
+        if (yy > rect->ymax) rect->ymax = yy;
+
+        /* Once the rectangle spans whole lines, as in animations, the
+         * following lines don't need to be scanned: find the last line
+         * that changed, and copy all the lines up to it at once. */
+        if (contiguous && rect->xmin == 0 && rect->xmax == fbs->width - 1) {
+            int  last = fbs->height - 1;
+
+            for ( ; last > yy; last--) {
+                size_t  offset = (size_t)(last - yy) * line_len;
+
+                if (dirty_base != 0 && !fbs->dirty_lines[last])
+                    continue;
+                if (fb_scan_left(src_line + offset, dst_line + offset, line_len) < line_len)
+                    break;
+            }
+            if (last > yy) {
+                fb_copy_pixels(dst_line + line_len, src_line + line_len,
+                               0, (last - yy) * fbs->width - 1, bpp);
+                rect->ymax = last;
+            }
+            break;
+        }
+
+    NEXT_LINE:
+        src_line += fbs->src_pitch;
+        dst_line += fbs->dst_pitch;
+    }
+
+    if (rect->ymin > rect->ymax) { /* nothing changed */
+        return 0;
+    }
+
+    /* Always clear the dirty VGA bits */
+    cpu_physical_memory_reset_dirty(dirty_base + rect->ymin * fbs->src_pitch,
+                                    dirty_base + (rect->ymax+1)* fbs->src_pitch,
+                                    VGA_DIRTY_FLAG);
+    return 1;
+}
+
+#endif /* _HW_GOLDFISH_FB_SCAN_H */
@@ -14,6 +14,8 @@
 #include "mmc.h"
 #include "sd.h"
 #include "block.h"
+#include "dma.h"
+#include "qemu-aio.h"
 
 enum {
     /* status register */
@@ -79,7 +81,9 @@ struct goldfish_mmc_state {
     uint32_t block_count;
     int is_SDHC;
 
-    uint8_t* buf;
+    // in-flight data transfer, NULL if none
+    BlockDriverAIOCB* aiocb;
+    QEMUSGList sg;
 };
 
 #define  GOLDFISH_MMC_SAVE_VERSION  2
@@ -170,47 +174,83 @@ static const char* get_command_name(int command)
 }
 #endif
 
-static int  goldfish_mmc_bdrv_read(struct goldfish_mmc_state *s,
-                                   int64_t                    sector_number,
-                                   target_phys_addr_t         dst_address,
-                                   int                        num_sectors)
+/* Performs a transfer synchronously, with a single bounce buffer for the
+ * whole request. Only used when the guest buffer cannot be mapped. */
+static int  goldfish_mmc_bdrv_rw_sync(struct goldfish_mmc_state *s,
+                                      int64_t                    sector_number,
+                                      target_phys_addr_t         address,
+                                      int                        num_sectors,
+                                      int                        is_write)
 {
-    int  ret;
-
-    while (num_sectors > 0) {
-        ret = bdrv_read(s->bs, sector_number, s->buf, 1);
-        if (ret < 0)
-            return ret;
+    uint8_t*  buf = qemu_memalign(512, num_sectors * 512);
+    int       ret;
+
+    if (is_write) {
+        cpu_physical_memory_read(address, buf, num_sectors * 512);
+        ret = bdrv_write(s->bs, sector_number, buf, num_sectors);
+    } else {
+        ret = bdrv_read(s->bs, sector_number, buf, num_sectors);
+        if (ret >= 0)
+            cpu_physical_memory_write(address, buf, num_sectors * 512);
+    }
+    qemu_vfree(buf);
+    return ret;
+}
 
-        cpu_physical_memory_write(dst_address, s->buf, 512);
-        dst_address   += 512;
-        num_sectors   -= 1;
-        sector_number += 1;
+static void goldfish_mmc_update_irq(struct goldfish_mmc_state *s)
+{
+    if ((s->int_status & s->int_enable)) {
+        goldfish_device_set_irq(&s->dev, 0, (s->int_status & s->int_enable));
     }
-    return 0;
 }
 
-static int  goldfish_mmc_bdrv_write(struct goldfish_mmc_state *s,
-                                    int64_t                    sector_number,
-                                    target_phys_addr_t         dst_address,
-                                    int                        num_sectors)
+static void goldfish_mmc_dma_cb(void *opaque, int ret)
 {
-    int  ret;
+    struct goldfish_mmc_state *s = opaque;
 
-    while (num_sectors > 0) {
-        cpu_physical_memory_read(dst_address, s->buf, 512);
+    if (ret < 0)
+        fprintf(stderr, "goldfish_mmc: I/O error: %s\n", strerror(-ret));
 
-        ret = bdrv_write(s->bs, sector_number, s->buf, 1);
-        if (ret < 0)
-            return ret;
+    s->aiocb = NULL;
+    qemu_sglist_destroy(&s->sg);
 
-        dst_address   += 512;
-        num_sectors   -= 1;
-        sector_number += 1;
-    }
-    return 0;
+    s->int_status |= MMC_STAT_END_OF_CMD | MMC_STAT_END_OF_DATA;
+    goldfish_mmc_update_irq(s);
+}
+
+/* Starts a read or write of 'num_sectors' sectors between the card and the
+ * guest buffer at 'address'. The guest memory is mapped and transferred with
+ * a single vectored request, and completion is signaled from
+ * goldfish_mmc_dma_cb(). Returns 0 if the request is in flight. Otherwise the
+ * transfer was performed synchronously, and 1 (success) or -1 (error) is
+ * returned. */
+static int  goldfish_mmc_bdrv_rw(struct goldfish_mmc_state *s,
+                                 int64_t                    sector_number,
+                                 target_phys_addr_t         address,
+                                 int                        num_sectors,
+                                 int                        is_write)
+{
+    qemu_sglist_init(&s->sg, 1);
+    qemu_sglist_add(&s->sg, address, (target_phys_addr_t)num_sectors * 512);
+
+    if (is_write)
+        s->aiocb = dma_bdrv_write(s->bs, &s->sg, sector_number, goldfish_mmc_dma_cb, s);
+    else
+        s->aiocb = dma_bdrv_read(s->bs, &s->sg, sector_number, goldfish_mmc_dma_cb, s);
+
+    if (s->aiocb != NULL)
+        return 0;
+
+    qemu_sglist_destroy(&s->sg);
+    return goldfish_mmc_bdrv_rw_sync(s, sector_number, address, num_sectors, is_write) < 0 ? -1 : 1;
 }
 
+/* Waits for the completion of the in-flight transfer, if any */
+static void goldfish_mmc_wait(struct goldfish_mmc_state *s)
+{
+    while (s->aiocb != NULL)
+        qemu_aio_wait();
+}
 
 static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd, uint32_t arg)
 {
@@ -371,9 +411,14 @@ static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd,
                 if (arg & 511) fprintf(stderr, "offset %d is not multiple of 512 when reading\n", arg);
                 arg /= s->block_length;
             }
-            result = goldfish_mmc_bdrv_read(s, arg, s->buffer_address, s->block_count);
-            new_status |= MMC_STAT_END_OF_DATA;
             s->resp[0] = SET_R1_CURRENT_STATE(4) | R1_READY_FOR_DATA; // 2304
+            result = goldfish_mmc_bdrv_rw(s, arg, s->buffer_address, s->block_count, 0);
+            if (result == 0) {
+                // command and data completion are signaled together when
+                // the transfer is done
+                return;
+            }
+            new_status |= MMC_STAT_END_OF_DATA;
             break;
         }
 
@@ -388,11 +433,14 @@ static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd,
                 if (arg & 511) fprintf(stderr, "offset %d is not multiple of 512 when writing\n", arg);
                 arg /= s->block_length;
             }
-            // arg is byte offset
-            result = goldfish_mmc_bdrv_write(s, arg, s->buffer_address, s->block_count);
-//            bdrv_flush(s->bs);
-            new_status |= MMC_STAT_END_OF_DATA;
             s->resp[0] = SET_R1_CURRENT_STATE(4) | R1_READY_FOR_DATA; // 2304
+            result = goldfish_mmc_bdrv_rw(s, arg, s->buffer_address, s->block_count, 1);
+            if (result == 0) {
+                // command and data completion are signaled together when
+                // the transfer is done
+                return;
+            }
+            new_status |= MMC_STAT_END_OF_DATA;
             break;
         }
 
@@ -406,10 +454,7 @@ static void goldfish_mmc_do_command(struct goldfish_mmc_state *s, uint32_t cmd,
      }
 
     s->int_status |= new_status;
-
-    if ((s->int_status & s->int_enable)) {
-        goldfish_device_set_irq(&s->dev, 0, (s->int_status & s->int_enable));
-    }
+    goldfish_mmc_update_irq(s);
 }
 
 static uint32_t goldfish_mmc_read(void *opaque, target_phys_addr_t offset)
@@ -470,6 +515,8 @@ static void goldfish_mmc_write(void *opaque, target_phys_addr_t offset, uint32_t
             s->buffer_address = val;
             break;
         case MMC_CMD:
+            // commands are processed in order
+            goldfish_mmc_wait(s);
             goldfish_mmc_do_command(s, val, s->arg);
             break;
         case MMC_ARG:
@@ -510,7 +557,6 @@ void goldfish_mmc_init(uint32_t base, int id, BlockDriverState* bs)
     s->dev.size = 0x1000;
     s->dev.irq_count = 1;
     s->bs = bs;
-    s->buf = qemu_memalign(512,512);
 
     goldfish_device_add(&s->dev, goldfish_mmc_readfn, goldfish_mmc_writefn, s);
 
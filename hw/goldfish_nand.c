@@ -15,6 +15,18 @@
 #include "android/utils/tempfile.h"
 #include "qemu_debug.h"
 #include "android/android.h"
+#include "irq.h"
+#ifndef _WIN32
+#include "qemu-aio.h"
+#include "block_int.h"
+#include "block/raw-posix-aio.h"
+#endif
+
+/* glibc only exposes these with _GNU_SOURCE */
+#if defined(__linux__) && !defined(SEEK_DATA)
+#define SEEK_DATA  3
+#define SEEK_HOLE  4
+#endif
 
 #define  DEBUG  1
 #if DEBUG
@@ -62,6 +74,26 @@ typedef struct {
     uint32_t   erase_size;   /* size of the data buffer mentioned above */
     uint64_t   max_size;     /* Capacity limit for the image. The actual underlying
                               * file may be smaller. */
+
+    /* Snapshot support. The device keeps track of which erase blocks differ
+     * from the read-only image it was initialized from, or from erased flash
+     * if there is none, so that snapshots only need to store those blocks,
+     * and of which blocks were modified since the last snapshot was saved or
+     * loaded, so that restoring that same snapshot again only rewrites those
+     * blocks. */
+    int        base_fd;      /* read-only base image (initfile), or -1 */
+    uint64_t   base_size;    /* size and modification time of the base image, */
+    uint64_t   base_mtime;   /* used to check that a snapshot still applies   */
+    uint32_t   num_blocks;   /* number of erase blocks in max_size */
+    uint32_t*  base_dirty;   /* bitmap of blocks that differ from the base image */
+    uint32_t*  sync_dirty;   /* bitmap of blocks modified since sync_id */
+    uint64_t   sync_id;      /* id of the last snapshot saved/loaded, 0 if none */
+
+    /* Thin overlay support. When the device is created with basefile=, the
+     * image in 'fd' only holds the erase blocks written since it was
+     * created, and the other blocks are holes that read from 'base_fd'.
+     * base_dirty then tells which blocks are stored in the overlay. */
+    int        overlay;
 } nand_dev;
 
 nand_threshold    android_nand_write_threshold;
@@ -113,11 +145,34 @@ nand_threshold_update( nand_threshold*  t, uint32_t  len )
 static nand_dev *nand_devs = NULL;
 static uint32_t nand_dev_count = 0;
 
+#ifndef _WIN32
+/* An asynchronous transfer between a NAND image and guest memory. The
+ * guest buffer is mapped into host memory and handed to the posix-aio
+ * thread pool, which reads or writes it directly with preadv/pwritev.
+ */
+typedef struct {
+    BlockDriverAIOCB*  acb;       /* in-flight request, NULL if idle */
+    int                is_write;
+    uint32_t           len;       /* total transfer length */
+    uint32_t           file_len;  /* part of a read that lies within the file,
+                                   * the rest reads as erased flash */
+    QEMUIOVector       mapped;    /* guest memory, one entry per mapping */
+    QEMUIOVector       io;        /* the part of 'mapped' sent to the file */
+} nand_dev_async_req;
+
+/* preadv/pwritev accept at most IOV_MAX buffers; longer scatter lists
+ * make the request fall back to the synchronous path. */
+#define NAND_ASYNC_MAX_IOV  1024
+
+static int nand_dev_async_enabled;
+#endif
+
 /* The controller is the single access point for all NAND images currently
  * attached to the system.
  */
 typedef struct {
     uint32_t base;
+    qemu_irq irq;
 
     // register state
     uint32_t dev;            /* offset in nand_devs for the device that is
@@ -127,14 +182,22 @@ typedef struct {
     uint32_t transfer_size;
     uint32_t data;
     uint32_t result;
+    uint32_t irq_status;
+
+#ifndef _WIN32
+    nand_dev_async_req  req;
+#endif
 } nand_dev_controller_state;
 
 /* update this everytime you change the nand_dev_controller_state structure
  * 1: initial version, saving only nand_dev_controller_state fields
  * 2: saving actual disk contents as well
  * 3: use the correct data length and truncate to avoid padding.
+ * 4: only save the erase blocks that differ from the base image.
+ * 5: save the interrupt status of async commands.
+ * 6: images without a base are saved as a delta from erased flash.
  */
-#define  NAND_DEV_STATE_SAVE_VERSION  3
+#define  NAND_DEV_STATE_SAVE_VERSION  6
 
 #define  QFIELD_STRUCT  nand_dev_controller_state
 QFIELD_BEGIN(nand_dev_controller_state_fields)
@@ -144,6 +207,7 @@ QFIELD_BEGIN(nand_dev_controller_state_fields)
     QFIELD_INT32(transfer_size),
     QFIELD_INT32(data),
     QFIELD_INT32(result),
+    QFIELD_INT32(irq_status),
 QFIELD_END
 
 
@@ -191,55 +255,353 @@ static int  do_ftruncate(int  fd, size_t  size)
     return ret;
 }
 
-#define NAND_DEV_SAVE_DISK_BUF_SIZE 2048
+/* Flags stored in the snapshot header of each disk */
+#define NAND_SNAPSHOT_DELTA  0x00000001  /* only blocks that differ from the
+                                          * base image are stored */
+#define NAND_SNAPSHOT_ERASED 0x00000002  /* the base image is erased flash */
+
+#define NAND_BITMAP_WORDS(n)  (((n) + 31) / 32)
+
+static inline int nand_bitmap_test(const uint32_t* map, uint32_t bit)
+{
+    return (map[bit >> 5] >> (bit & 31)) & 1;
+}
+
+static inline void nand_bitmap_set(uint32_t* map, uint32_t bit)
+{
+    map[bit >> 5] |= 1U << (bit & 31);
+}
+
+static inline void nand_bitmap_clear(uint32_t* map, uint32_t bit)
+{
+    map[bit >> 5] &= ~(1U << (bit & 31));
+}
+
+/* Marks all erase blocks touched by [addr, addr+len) as modified */
+static void nand_dev_mark_dirty(nand_dev *dev, uint64_t addr, uint32_t len)
+{
+    uint32_t block, last;
+
+    if (len == 0 || dev->num_blocks == 0)
+        return;
+
+    block = addr / dev->erase_size;
+    last  = (addr + len - 1) / dev->erase_size;
+    if (last >= dev->num_blocks)
+        last = dev->num_blocks - 1;
+
+    for ( ; block <= last; block++) {
+        nand_bitmap_set(dev->base_dirty, block);
+        nand_bitmap_set(dev->sync_dirty, block);
+    }
+}
+
+/* Returns a new, non-zero snapshot identifier. Identifiers are seeded from
+ * the current time and process id so that a snapshot saved by another
+ * emulator session is never mistaken for one saved by this session. */
+static uint64_t nand_dev_new_sync_id(void)
+{
+    static uint64_t  next_id;
+
+    if (next_id == 0)
+        next_id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16);
+
+    if (++next_id == 0)
+        next_id = 1;
+
+    return next_id;
+}
+
+/* Returns the number of bytes of erase block 'block' that lie within a file
+ * of 'total_size' bytes */
+static uint32_t nand_dev_block_len(nand_dev *dev, uint32_t block, uint64_t total_size)
+{
+    uint64_t  offset = (uint64_t)block * dev->erase_size;
+
+    if (total_size - offset < dev->erase_size)
+        return total_size - offset;
+
+    return dev->erase_size;
+}
+
+/* Reads 'len' bytes of erase block 'block' from 'fd' into dev->data. Data
+ * beyond the end of the file reads as erased flash (0xff). */
+static int nand_dev_read_block(nand_dev *dev, int fd, uint32_t block, uint32_t len)
+{
+    uint32_t  done = 0;
+    int       ret;
+
+    ret = do_lseek(fd, (off_t)block * dev->erase_size, SEEK_SET);
+    if (ret < 0)
+        return -1;
+
+    while (done < len) {
+        ret = do_read(fd, dev->data + done, len - done);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    if (done < len)
+        memset(dev->data + done, 0xff, len - done);
+
+    return 0;
+}
 
+/* Reads 'len' bytes of erase block 'block' of the base image into dev->data.
+ * Without a base image, the block reads as erased flash. */
+static int nand_dev_read_base_block(nand_dev *dev, uint32_t block, uint32_t len)
+{
+    if (dev->base_fd < 0) {
+        memset(dev->data, 0xff, len);
+        return 0;
+    }
+    return nand_dev_read_block(dev, dev->base_fd, block, len);
+}
+
+/* Returns 1 if the first 'len' bytes of dev->data are erased flash */
+static int nand_dev_data_erased(nand_dev *dev, uint32_t len)
+{
+    uint32_t  i;
+
+    for (i = 0; i < len; i++) {
+        if (dev->data[i] != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+/* Writes the first 'len' bytes of dev->data to erase block 'block' */
+static int nand_dev_write_block(nand_dev *dev, uint32_t block, uint32_t len)
+{
+    int  ret;
+
+    ret = do_lseek(dev->fd, (off_t)block * dev->erase_size, SEEK_SET);
+    if (ret < 0)
+        return -1;
+
+    ret = do_write(dev->fd, dev->data, len);
+    if (ret != (int)len)
+        return -1;
+
+    return 0;
+}
+
+#ifdef SEEK_DATA
+/* Rebuilds the list of blocks stored in an overlay image from its holes.
+ * Returns -1 if the host can't report the holes of the file. */
+static int nand_dev_overlay_scan(nand_dev *dev)
+{
+    off_t  pos = 0, data, hole;
+
+    memset(dev->base_dirty, 0, NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+    for (;;) {
+        data = lseek(dev->fd, pos, SEEK_DATA);
+        if (data < 0)
+            return (errno == ENXIO) ? 0 : -1;  /* ENXIO: no data past pos */
+
+        hole = lseek(dev->fd, data, SEEK_HOLE);
+        if (hole <= data)
+            return -1;
+
+        for ( ; data < hole; data += dev->erase_size - data % dev->erase_size) {
+            uint32_t  block = data / dev->erase_size;
+            if (block >= dev->num_blocks)
+                return 0;
+            nand_bitmap_set(dev->base_dirty, block);
+        }
+        pos = hole;
+    }
+}
+
+/* Sets up 'dev' as an overlay of the image in 'basefd'. Blocks that were
+ * never written are holes in the overlay, so erase blocks must be made of
+ * whole filesystem blocks. The file is extended to the device size so that
+ * they all lie before its end, which also keeps snapshots from truncating
+ * them. */
+static int nand_dev_overlay_init(nand_dev *dev, int basefd)
+{
+    struct stat  st;
+
+    if (fstat(dev->fd, &st) < 0)
+        return -1;
+    if (dev->erase_size % st.st_blksize != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(dev->flags & NAND_DEV_FLAG_READ_ONLY) &&
+        do_ftruncate(dev->fd, dev->max_size) < 0)
+        return -1;
+    if (nand_dev_overlay_scan(dev) < 0)
+        return -1;
+    if (fstat(basefd, &st) < 0)
+        return -1;
+
+    dev->base_fd = basefd;
+    dev->base_size = st.st_size;
+    dev->base_mtime = st.st_mtime;
+    dev->overlay = 1;
+    return 0;
+}
+#else
+#define nand_dev_overlay_scan(dev)          (-1)
+#define nand_dev_overlay_init(dev, basefd)  (errno = ENOSYS, -1)
+#endif
+
+/* Finds the erase blocks of an image without a base that may hold data.
+ * Everything past the end of the file reads as erased flash, but holes in
+ * the file read as zeros, so they are data like any other block. */
+static void nand_dev_erased_base_init(nand_dev *dev)
+{
+    uint32_t  block, num_blocks;
+    int       ret;
+
+    ret = do_lseek(dev->fd, 0, SEEK_END);
+    if (ret < 0) {
+        memset(dev->base_dirty, 0xff, NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+        return;
+    }
+    num_blocks = ((uint64_t)ret + dev->erase_size - 1) / dev->erase_size;
+    memset(dev->base_dirty, 0, NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+    for (block = 0; block < num_blocks && block < dev->num_blocks; block++)
+        nand_bitmap_set(dev->base_dirty, block);
+}
+
+/* Copies the erase blocks touched by [addr, addr+len) from the base image
+ * to the overlay, unless they are already stored there. Blocks that are
+ * entirely inside the range are not copied if 'overwrite' is set. */
+static int nand_dev_overlay_copy(nand_dev *dev, uint64_t addr, uint32_t len, int overwrite)
+{
+    uint32_t  block, last;
+
+    if (len == 0)
+        return 0;
+
+    block = addr / dev->erase_size;
+    last  = (addr + len - 1) / dev->erase_size;
+
+    for ( ; block <= last && block < dev->num_blocks; block++) {
+        uint64_t  start = (uint64_t)block * dev->erase_size;
+
+        if (nand_bitmap_test(dev->base_dirty, block))
+            continue;
+        if (overwrite && start >= addr && start + dev->erase_size <= addr + len)
+            continue;
+
+        if (nand_dev_read_block(dev, dev->base_fd, block, dev->erase_size) < 0 ||
+            nand_dev_write_block(dev, block, dev->erase_size) < 0) {
+            XLOG("%s, copy of block %d failed: %s\n", __FUNCTION__, block, strerror(errno));
+            return -1;
+        }
+        nand_bitmap_set(dev->base_dirty, block);
+    }
+    return 0;
+}
+
+/* Returns 1 if all erase blocks touched by [addr, addr+len) are stored in
+ * the overlay image */
+static int nand_dev_overlay_contains(nand_dev *dev, uint64_t addr, uint32_t len)
+{
+    uint32_t  block, last;
+
+    if (len == 0)
+        return 1;
+
+    block = addr / dev->erase_size;
+    last  = (addr + len - 1) / dev->erase_size;
+
+    for ( ; block <= last; block++) {
+        if (!nand_bitmap_test(dev->base_dirty, block))
+            return 0;
+    }
+    return 1;
+}
 
 /**
  * Copies the current contents of a disk image into the snapshot file.
  *
- * TODO optimize this using some kind of copy-on-write mechanism for
- *      unchanged disk sections.
+ * Only the erase blocks that differ from the base image are stored. Images
+ * that were not initialized from a base image are stored as a delta from
+ * erased flash, so the snapshot stays self-contained but doesn't carry the
+ * blocks that were never written or have been erased since.
  */
 static void  nand_dev_save_disk_state(QEMUFile *f, nand_dev *dev)
 {
-    int buf_size = NAND_DEV_SAVE_DISK_BUF_SIZE;
-    uint8_t buffer[NAND_DEV_SAVE_DISK_BUF_SIZE] = {0};
-    int ret;
-    uint64_t total_copied = 0;
-
-    /* Size of file to restore, hence size of data block following.
-     * TODO Work out whether to use lseek64 here. */
+    int       ret;
+    int       erased = (dev->base_fd < 0);
+    uint32_t  num_blocks, count, block;
+    uint64_t  sync_id;
 
+    /* Size of file to restore, hence size of data blocks following. */
     ret = do_lseek(dev->fd, 0, SEEK_END);
     if (ret < 0) {
       XLOG("%s EOF seek failed: %s\n", __FUNCTION__, strerror(errno));
       qemu_file_set_error(f);
       return;
     }
-    const uint64_t total_size = ret;
+    uint64_t total_size = ret;
+    if (total_size > dev->max_size)
+        total_size = dev->max_size;
+    num_blocks = (total_size + dev->erase_size - 1) / dev->erase_size;
+
+    /* Blocks modified since the last snapshot may have been erased. Those
+     * that were not were already checked when that snapshot was taken. */
+    if (erased) {
+        for (block = 0; block < num_blocks; block++) {
+            uint32_t  len;
+
+            if (!nand_bitmap_test(dev->base_dirty, block))
+                continue;
+            if (dev->sync_id != 0 && !nand_bitmap_test(dev->sync_dirty, block))
+                continue;
+
+            len = nand_dev_block_len(dev, block, total_size);
+            if (nand_dev_read_block(dev, dev->fd, block, len) < 0) {
+                XLOG("%s read failed: %s\n", __FUNCTION__, strerror(errno));
+                qemu_file_set_error(f);
+                return;
+            }
+            if (nand_dev_data_erased(dev, len))
+                nand_bitmap_clear(dev->base_dirty, block);
+        }
+    }
+
     qemu_put_be64(f, total_size);
+    qemu_put_be32(f, NAND_SNAPSHOT_DELTA | (erased ? NAND_SNAPSHOT_ERASED : 0));
+    if (!erased) {
+        qemu_put_be64(f, dev->base_size);
+        qemu_put_be64(f, dev->base_mtime);
+    }
+    sync_id = nand_dev_new_sync_id();
+    qemu_put_be64(f, sync_id);
 
-    /* copy all data from the stream to the stored image */
-    ret = do_lseek(dev->fd, 0, SEEK_SET);
-    if (ret < 0) {
-        XLOG("%s seek failed: %s\n", __FUNCTION__, strerror(errno));
-        qemu_file_set_error(f);
-        return;
+    count = 0;
+    for (block = 0; block < num_blocks; block++) {
+        if (nand_bitmap_test(dev->base_dirty, block))
+            count++;
     }
-    do {
-        ret = do_read(dev->fd, buffer, buf_size);
-        if (ret < 0) {
+    qemu_put_be32(f, count);
+
+    for (block = 0; block < num_blocks; block++) {
+        uint32_t  len;
+
+        if (!nand_bitmap_test(dev->base_dirty, block))
+            continue;
+
+        len = nand_dev_block_len(dev, block, total_size);
+        if (nand_dev_read_block(dev, dev->fd, block, len) < 0) {
             XLOG("%s read failed: %s\n", __FUNCTION__, strerror(errno));
             qemu_file_set_error(f);
             return;
         }
-        qemu_put_buffer(f, buffer, ret);
-
-        total_copied += ret;
+        qemu_put_be32(f, block);
+        qemu_put_buffer(f, dev->data, len);
     }
-    while (ret == buf_size && total_copied < dev->max_size);
 
-    /* TODO Maybe check that we've written total_size bytes */
+    /* The image now matches the snapshot being written */
+    memset(dev->sync_dirty, 0, NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+    dev->sync_id = sync_id;
 }
 
 
@@ -257,12 +619,20 @@ static void nand_dev_save_disks(QEMUFile *f)
 /**
  * Overwrites the contents of the disk image managed by this device with the
  * contents as they were at the point the snapshot was made.
+ *
+ * Only the blocks that can differ from the snapshot are written: if the
+ * snapshot is the last one saved or loaded for this device, that is the
+ * blocks modified since then; otherwise, the blocks stored in the snapshot
+ * plus the modified blocks that must be reverted to the base image.
  */
 static int  nand_dev_load_disk_state(QEMUFile *f, nand_dev *dev)
 {
-    int buf_size = NAND_DEV_SAVE_DISK_BUF_SIZE;
-    uint8_t buffer[NAND_DEV_SAVE_DISK_BUF_SIZE] = {0};
-    int ret;
+    int       ret;
+    int       delta, erased, in_sync;
+    uint32_t  flags, count, num_blocks, block, i;
+    int64_t   prev_block = -1;
+    uint64_t  sync_id, old_size;
+    uint32_t* restored;
 
     /* File size for restore and truncate */
     uint64_t total_size = qemu_get_be64(f);
@@ -272,42 +642,139 @@ static int  nand_dev_load_disk_state(QEMUFile *f, nand_dev *dev)
         return -EIO;
     }
 
-    /* overwrite disk contents with snapshot contents */
-    uint64_t next_offset = 0;
-    ret = do_lseek(dev->fd, 0, SEEK_SET);
+    flags = qemu_get_be32(f);
+    delta  = (flags & NAND_SNAPSHOT_DELTA) != 0;
+    erased = (flags & NAND_SNAPSHOT_ERASED) != 0;
+    if (erased) {
+        if (dev->base_fd >= 0) {
+            XLOG("%s, restore failed: '%.*s' now has a base image\n",
+                 __FUNCTION__, dev->devname_len, dev->devname);
+            return -EIO;
+        }
+    } else if (delta) {
+        uint64_t  base_size  = qemu_get_be64(f);
+        uint64_t  base_mtime = qemu_get_be64(f);
+
+        if (dev->base_fd < 0 ||
+            base_size != dev->base_size || base_mtime != dev->base_mtime) {
+            XLOG("%s, restore failed: base image of '%.*s' has changed\n",
+                 __FUNCTION__, dev->devname_len, dev->devname);
+            return -EIO;
+        }
+    }
+    sync_id = qemu_get_be64(f);
+    in_sync = (sync_id != 0 && sync_id == dev->sync_id);
+    count   = qemu_get_be32(f);
+
+    num_blocks = (total_size + dev->erase_size - 1) / dev->erase_size;
+    if (count > num_blocks) {
+        XLOG("%s, restore failed: invalid block count %d\n", __FUNCTION__, count);
+        return -EIO;
+    }
+    ret = do_lseek(dev->fd, 0, SEEK_END);
     if (ret < 0) {
-        XLOG("%s seek failed: %s\n", __FUNCTION__, strerror(errno));
+        XLOG("%s EOF seek failed: %s\n", __FUNCTION__, strerror(errno));
         return -EIO;
     }
-    while (next_offset < total_size) {
-        /* snapshot buffer may not be an exact multiple of buf_size
-         * if necessary, adjust buffer size for last copy operation */
-        if (total_size - next_offset < buf_size) {
-            buf_size = total_size - next_offset;
+    old_size = ret;
+    restored = qemu_mallocz(NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+
+    /* overwrite disk contents with snapshot contents */
+    ret = -EIO;
+    for (i = 0; i < count; i++) {
+        uint32_t  len;
+
+        block = qemu_get_be32(f);
+        if (block >= num_blocks || (int64_t)block <= prev_block) {
+            XLOG("%s, restore failed: invalid block index %d\n", __FUNCTION__, block);
+            goto out;
         }
+        prev_block = block;
 
-        ret = qemu_get_buffer(f, buffer, buf_size);
-        if (ret != buf_size) {
-            XLOG("%s read failed: expected %d bytes but got %d\n",
-                 __FUNCTION__, buf_size, ret);
-            return -EIO;
+        len = nand_dev_block_len(dev, block, total_size);
+        if (qemu_get_buffer(f, dev->data, len) != (int)len) {
+            XLOG("%s read failed: expected %d bytes\n", __FUNCTION__, len);
+            goto out;
         }
-        ret = do_write(dev->fd, buffer, buf_size);
-        if (ret != buf_size) {
+        nand_bitmap_set(restored, block);
+
+        if (in_sync && !nand_bitmap_test(dev->sync_dirty, block))
+            continue;
+
+        if (nand_dev_write_block(dev, block, len) < 0) {
             XLOG("%s, write failed: %s\n", __FUNCTION__, strerror(errno));
-            return -EIO;
+            goto out;
         }
+    }
+
+    /* revert modified blocks that are not in the snapshot to the base image */
+    if (delta) {
+        for (block = 0; block < num_blocks; block++) {
+            uint32_t  len;
+
+            if (nand_bitmap_test(restored, block) ||
+                !nand_bitmap_test(dev->base_dirty, block))
+                continue;
 
-        next_offset += buf_size;
+            if (in_sync && !nand_bitmap_test(dev->sync_dirty, block))
+                continue;
+
+            len = nand_dev_block_len(dev, block, total_size);
+            if (nand_dev_read_base_block(dev, block, len) < 0 ||
+                nand_dev_write_block(dev, block, len) < 0) {
+                XLOG("%s, revert failed: %s\n", __FUNCTION__, strerror(errno));
+                goto out;
+            }
+        }
     }
 
-    ret = do_ftruncate(dev->fd, total_size);
-    if (ret < 0) {
+    if (do_ftruncate(dev->fd, total_size) < 0) {
         XLOG("%s ftruncate failed: %s\n", __FUNCTION__, strerror(errno));
-        return -EIO;
+        goto out;
     }
 
-    return 0;
+    /* Growing the file added zeros where the blocks that are not in the
+     * snapshot must read as the base image, or erased flash. An overlay
+     * always spans the whole device and reads those from the base. */
+    if (!dev->overlay && total_size > old_size) {
+        for (block = old_size / dev->erase_size; block < num_blocks; block++) {
+            uint32_t  len;
+
+            if (nand_bitmap_test(restored, block))
+                continue;
+
+            len = nand_dev_block_len(dev, block, total_size);
+            if (nand_dev_read_base_block(dev, block, len) < 0 ||
+                nand_dev_write_block(dev, block, len) < 0) {
+                XLOG("%s, erase failed: %s\n", __FUNCTION__, strerror(errno));
+                goto out;
+            }
+        }
+    }
+
+    /* Blocks past the end of the restored file read as erased flash, which
+     * differs from the base image wherever the latter has data. */
+    for (block = num_blocks; block < dev->num_blocks; block++) {
+        if ((uint64_t)block * dev->erase_size < dev->base_size)
+            nand_bitmap_set(restored, block);
+    }
+
+    memcpy(dev->base_dirty, restored, NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+    memset(dev->sync_dirty, 0, NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+    dev->sync_id = sync_id;
+    ret = 0;
+
+out:
+    if (ret < 0) {
+        /* The image is now in an unknown state; make sure a later restore
+         * rewrites everything it can. An overlay must keep reading the
+         * blocks it doesn't store from the base image. */
+        if (!dev->overlay || nand_dev_overlay_scan(dev) < 0)
+            memset(dev->base_dirty, 0xff, NAND_BITMAP_WORDS(dev->num_blocks) * sizeof(uint32_t));
+        dev->sync_id = 0;
+    }
+    qemu_free(restored);
+    return ret;
 }
 
 /**
@@ -348,12 +815,48 @@ static int   nand_dev_controller_state_load(QEMUFile *f, void  *opaque, int  ver
 
     if ((ret = qemu_get_struct(f, nand_dev_controller_state_fields, s)))
         return ret;
+    qemu_set_irq(s->irq, s->irq_status != 0);
     if ((ret = nand_dev_load_disks(f)))
         return ret;
 
     return 0;
 }
 
+/* Reads from an overlay image, taking each erase block from the overlay or
+ * the base image */
+static uint32_t nand_dev_read_overlay(nand_dev *dev, uint32_t data, uint64_t addr, uint32_t total_len)
+{
+    uint32_t len = total_len;
+
+    while(len > 0) {
+        uint32_t block = addr / dev->erase_size;
+        uint32_t read_len = dev->erase_size - addr % dev->erase_size;
+        uint32_t done = 0;
+        int fd = nand_bitmap_test(dev->base_dirty, block) ? dev->fd : dev->base_fd;
+        int ret;
+
+        if(read_len > len)
+            read_len = len;
+
+        if(lseek(fd, addr, SEEK_SET) >= 0) {
+            while(done < read_len) {
+                ret = do_read(fd, dev->data + done, read_len - done);
+                if(ret <= 0)
+                    break;
+                done += ret;
+            }
+        }
+        if(done < read_len)
+            memset(dev->data + done, 0xff, read_len - done);
+
+        cpu_memory_rw_debug(cpu_single_env, data, dev->data, read_len, 1);
+        data += read_len;
+        addr += read_len;
+        len -= read_len;
+    }
+    return total_len;
+}
+
 static uint32_t nand_dev_read_file(nand_dev *dev, uint32_t data, uint64_t addr, uint32_t total_len)
 {
     uint32_t len = total_len;
@@ -362,6 +865,9 @@ static uint32_t nand_dev_read_file(nand_dev *dev, uint32_t data, uint64_t addr,
 
     NAND_UPDATE_READ_THRESHOLD(total_len);
 
+    if (dev->overlay)
+        return nand_dev_read_overlay(dev, data, addr, total_len);
+
     do_lseek(dev->fd, addr, SEEK_SET);
     while(len > 0) {
         if(read_len < dev->erase_size) {
@@ -389,6 +895,9 @@ static uint32_t nand_dev_write_file(nand_dev *dev, uint32_t data, uint64_t addr,
 
     NAND_UPDATE_WRITE_THRESHOLD(total_len);
 
+    if (dev->overlay && nand_dev_overlay_copy(dev, addr, total_len, 0) < 0)
+        return 0;
+    nand_dev_mark_dirty(dev, addr, total_len);
     do_lseek(dev->fd, addr, SEEK_SET);
     while(len > 0) {
         if(len < write_len)
@@ -411,6 +920,9 @@ static uint32_t nand_dev_erase_file(nand_dev *dev, uint64_t addr, uint32_t total
     size_t write_len = dev->erase_size;
     int ret;
 
+    if (dev->overlay && nand_dev_overlay_copy(dev, addr, total_len, 1) < 0)
+        return 0;
+    nand_dev_mark_dirty(dev, addr, total_len);
     do_lseek(dev->fd, addr, SEEK_SET);
     memset(dev->data, 0xff, dev->erase_size);
     while(len > 0) {
@@ -500,6 +1012,217 @@ uint32_t nand_dev_do_cmd(nand_dev_controller_state *s, uint32_t cmd)
     }
 }
 
+/* Signals the completion of an async command to the guest */
+static void nand_dev_async_done(nand_dev_controller_state *s, uint32_t result)
+{
+    s->result = result;
+    s->irq_status |= NAND_IRQ_DONE;
+    qemu_irq_raise(s->irq);
+}
+
+#ifndef _WIN32
+
+/* Releases the guest memory mapped for an async request. 'access_len' is
+ * the number of bytes actually transferred. */
+static void nand_dev_async_unmap(nand_dev_async_req *req, uint32_t access_len)
+{
+    int i;
+
+    for (i = 0; i < req->mapped.niov; i++) {
+        struct iovec*  iov = &req->mapped.iov[i];
+        uint32_t       len = iov->iov_len;
+
+        if (len > access_len)
+            len = access_len;
+        cpu_physical_memory_unmap(iov->iov_base, iov->iov_len, !req->is_write, len);
+        access_len -= len;
+    }
+    qemu_iovec_destroy(&req->mapped);
+    qemu_iovec_destroy(&req->io);
+}
+
+static void nand_dev_async_cb(void *opaque, int ret)
+{
+    nand_dev_controller_state*  s   = opaque;
+    nand_dev_async_req*         req = &s->req;
+    uint32_t                    done = req->len;
+
+    if (ret < 0) {
+        XLOG("%s: %s failed: %s\n", __FUNCTION__,
+             req->is_write ? "write" : "read", strerror(-ret));
+        done = 0;
+    } else if (req->file_len < req->len) {
+        /* data beyond the end of the file reads as erased flash */
+        uint32_t  skip = req->file_len;
+        int       i;
+
+        for (i = 0; i < req->mapped.niov; i++) {
+            struct iovec*  iov = &req->mapped.iov[i];
+
+            if (skip >= iov->iov_len) {
+                skip -= iov->iov_len;
+                continue;
+            }
+            memset((uint8_t*)iov->iov_base + skip, 0xff, iov->iov_len - skip);
+            skip = 0;
+        }
+    }
+
+    nand_dev_async_unmap(req, done);
+    req->acb = NULL;
+
+    nand_dev_async_done(s, done);
+}
+
+/* Maps the guest buffer at virtual address 's->data' and submits the
+ * transfer to the posix-aio thread pool. Returns 0 on success, or -1 if the
+ * request must be performed synchronously instead (e.g. because the buffer
+ * is not entirely backed by guest RAM). */
+static int nand_dev_async_start(nand_dev_controller_state *s, int is_write)
+{
+    nand_dev_async_req*  req = &s->req;
+    nand_dev*            dev;
+    uint64_t             addr;
+    uint32_t             size, file_len, remaining;
+    target_ulong         vaddr;
+    struct stat          st;
+
+    if (!nand_dev_async_enabled || s->dev >= nand_dev_count)
+        return -1;
+    dev = nand_devs + s->dev;
+    if (dev->fd < 0)
+        return -1;
+    if (is_write && (dev->flags & NAND_DEV_FLAG_READ_ONLY))
+        return -1;
+
+    addr = s->addr_low | ((uint64_t)s->addr_high << 32);
+    size = s->transfer_size;
+    if (addr >= dev->max_size)
+        return -1;
+    if (size > dev->max_size - addr)
+        size = dev->max_size - addr;
+
+    /* blocks that are still in the base image of an overlay are read
+     * synchronously, and copied to the overlay before being written */
+    if (dev->overlay) {
+        if (is_write) {
+            if (nand_dev_overlay_copy(dev, addr, size, 0) < 0)
+                return -1;
+        } else if (!nand_dev_overlay_contains(dev, addr, size)) {
+            return -1;
+        }
+    }
+
+    file_len = size;
+    if (!is_write) {
+        if (fstat(dev->fd, &st) < 0 || (uint64_t)st.st_size <= addr)
+            return -1;
+        if ((uint64_t)st.st_size - addr < size)
+            file_len = st.st_size - addr;
+    }
+    if (file_len == 0)
+        return -1;
+
+    /* Translate the guest buffer page by page, and map each page into host
+     * memory, merging physically contiguous pages into a single iovec. */
+    qemu_iovec_init(&req->mapped, 1);
+    req->is_write = is_write;
+    vaddr = s->data;
+    remaining = size;
+    while (remaining > 0) {
+        target_phys_addr_t  paddr, plen;
+        uint32_t            l = TARGET_PAGE_SIZE - (vaddr & ~TARGET_PAGE_MASK);
+        void*               host;
+
+        if (l > remaining)
+            l = remaining;
+
+        paddr = cpu_get_phys_page_debug(cpu_single_env, vaddr & TARGET_PAGE_MASK);
+        if (paddr == -1 ||
+            (cpu_get_physical_page_desc(paddr) & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+            goto fail;
+        paddr += vaddr & ~TARGET_PAGE_MASK;
+
+        plen = l;
+        host = cpu_physical_memory_map(paddr, &plen, !is_write);
+        if (host == NULL)
+            goto fail;
+        if (plen < l) {
+            cpu_physical_memory_unmap(host, plen, !is_write, 0);
+            goto fail;
+        }
+
+        if (req->mapped.niov > 0) {
+            struct iovec*  last = &req->mapped.iov[req->mapped.niov - 1];
+
+            if ((uint8_t*)last->iov_base + last->iov_len == host) {
+                last->iov_len += l;
+                req->mapped.size += l;
+                goto next;
+            }
+            if (req->mapped.niov >= NAND_ASYNC_MAX_IOV)
+                goto fail;
+        }
+        qemu_iovec_add(&req->mapped, host, l);
+    next:
+        vaddr += l;
+        remaining -= l;
+    }
+
+    req->len = size;
+    req->file_len = file_len;
+    qemu_iovec_init(&req->io, req->mapped.niov);
+    qemu_iovec_concat(&req->io, &req->mapped, file_len);
+
+    if (is_write) {
+        NAND_UPDATE_WRITE_THRESHOLD(size);
+        nand_dev_mark_dirty(dev, addr, size);
+    } else {
+        NAND_UPDATE_READ_THRESHOLD(size);
+    }
+
+    req->acb = paio_submit_bytes(NULL, dev->fd, addr, &req->io, file_len,
+                                 nand_dev_async_cb, s,
+                                 is_write ? QEMU_AIO_WRITE : QEMU_AIO_READ);
+    if (req->acb == NULL) {
+        nand_dev_async_unmap(req, 0);
+        return -1;
+    }
+    return 0;
+
+fail:
+    req->len = 0;
+    nand_dev_async_unmap(req, 0);
+    return -1;
+}
+
+/* Waits for the completion of the in-flight async request, if any */
+static void nand_dev_async_wait(nand_dev_controller_state *s)
+{
+    while (s->req.acb != NULL)
+        qemu_aio_wait();
+}
+
+#else /* _WIN32 */
+
+#define nand_dev_async_start(s, is_write)  (-1)
+#define nand_dev_async_wait(s)             do {} while (0)
+
+#endif /* _WIN32 */
+
+/* Starts an async read or write. If the transfer cannot be offloaded, it is
+ * performed synchronously and completion is signaled immediately. */
+static void nand_dev_do_async_cmd(nand_dev_controller_state *s, uint32_t cmd)
+{
+    int  is_write = (cmd == NAND_CMD_WRITE_ASYNC);
+
+    s->result = 0;
+    if (nand_dev_async_start(s, is_write) == 0)
+        return;
+
+    nand_dev_async_done(s, nand_dev_do_cmd(s, is_write ? NAND_CMD_WRITE : NAND_CMD_READ));
+}
+
 /* I/O write */
 static void nand_dev_write(void *opaque, target_phys_addr_t offset, uint32_t value)
 {
@@ -525,7 +1248,17 @@ static void nand_dev_write(void *opaque, target_phys_addr_t offset, uint32_t val
         s->data = value;
         break;
     case NAND_COMMAND:
-        s->result = nand_dev_do_cmd(s, value);
+        /* commands are processed in order */
+        nand_dev_async_wait(s);
+        if (value == NAND_CMD_READ_ASYNC || value == NAND_CMD_WRITE_ASYNC)
+            nand_dev_do_async_cmd(s, value);
+        else
+            s->result = nand_dev_do_cmd(s, value);
+        break;
+    case NAND_IRQ_STATUS:
+        s->irq_status &= ~value;
+        if (s->irq_status == 0)
+            qemu_irq_lower(s->irq);
         break;
     default:
         cpu_abort(cpu_single_env, "nand_dev_write: Bad offset %x\n", offset);
@@ -546,6 +1279,10 @@ static uint32_t nand_dev_read(void *opaque, target_phys_addr_t offset)
         return nand_dev_count;
     case NAND_RESULT:
         return s->result;
+    case NAND_FEATURES:
+        return NAND_FEATURE_ASYNC;
+    case NAND_IRQ_STATUS:
+        return s->irq_status;
     }
 
     if(s->dev >= nand_dev_count)
@@ -594,7 +1331,7 @@ static CPUWriteMemoryFunc *nand_dev_writefn[] = {
 };
 
 /* initialize the QFB device */
-void nand_dev_init(uint32_t base)
+void nand_dev_init(uint32_t base, qemu_irq irq)
 {
     int iomemtype;
     static int  instance_id = 0;
@@ -604,6 +1341,14 @@ void nand_dev_init(uint32_t base)
     iomemtype = cpu_register_io_memory(nand_dev_readfn, nand_dev_writefn, s);
     cpu_register_physical_memory(base, 0x00000fff, iomemtype);
     s->base = base;
+    s->irq = irq;
+
+#ifndef _WIN32
+    if (paio_init() == 0)
+        nand_dev_async_enabled = 1;
+    else
+        XLOG("could not initialize async I/O, async commands will be synchronous\n");
+#endif
 
     register_savevm( "nand_dev", instance_id++, NAND_DEV_STATE_SAVE_VERSION,
                       nand_dev_controller_state_save, nand_dev_controller_state_load, s);
@@ -629,7 +1374,9 @@ void nand_add_dev(const char *arg)
     size_t devname_len = 0;
     char *initfilename = NULL;
     char *rwfilename = NULL;
+    char *basefilename = NULL;
     int initfd = -1;
+    int basefd = -1;
     int rwfd = -1;
     int read_only = 0;
     int pad;
@@ -637,6 +1384,7 @@ void nand_add_dev(const char *arg)
     uint32_t page_size = 2048;
     uint32_t extra_size = 64;
     uint32_t erase_pages = 64;
+    struct stat st;
 
     while(arg) {
         next_arg = strchr(arg, ',');
@@ -708,6 +1456,13 @@ void nand_add_dev(const char *arg)
                 memcpy(initfilename, value, value_len);
                 initfilename[value_len] = '\0';
             }
+            else if(arg_match("basefile", arg, arg_len)) {
+                basefilename = malloc(value_len + 1);
+                if(basefilename == NULL)
+                    goto out_of_memory;
+                memcpy(basefilename, value, value_len);
+                basefilename[value_len] = '\0';
+            }
             else if(arg_match("file", arg, arg_len)) {
                 rwfilename = malloc(value_len + 1);
                 if(rwfilename == NULL)
@@ -723,6 +1478,11 @@ void nand_add_dev(const char *arg)
         arg = next_arg;
     }
 
+    if (basefilename != NULL && (rwfilename == NULL || initfilename != NULL)) {
+        XLOG("basefile= requires file=, and can't be used with initfile=\n");
+        exit(1);
+    }
+
     if (rwfilename == NULL) {
         /* we create a temporary file to store everything */
         TempFile*    tmp = tempfile_create();
@@ -750,6 +1510,16 @@ void nand_add_dev(const char *arg)
             atexit_close_fd(rwfd);
     }
 
+    if(basefilename) {
+        basefd = open(basefilename, O_BINARY | O_RDONLY);
+        if(basefd < 0) {
+            XLOG("could not open file %s, %s\n", basefilename, strerror(errno));
+            exit(1);
+        }
+        if(dev_size == 0)
+            dev_size = lseek(basefd, 0, SEEK_END);
+    }
+
     if(initfilename) {
         initfd = open(initfilename, O_BINARY | O_RDONLY);
         if(initfd < 0) {
@@ -784,6 +1554,27 @@ void nand_add_dev(const char *arg)
         goto out_of_memory;
     dev->flags = read_only ? NAND_DEV_FLAG_READ_ONLY : 0;
 
+    dev->num_blocks = dev_size / dev->erase_size;
+    dev->base_dirty = calloc(NAND_BITMAP_WORDS(dev->num_blocks) + 1, sizeof(uint32_t));
+    dev->sync_dirty = calloc(NAND_BITMAP_WORDS(dev->num_blocks) + 1, sizeof(uint32_t));
+    if(dev->base_dirty == NULL || dev->sync_dirty == NULL)
+        goto out_of_memory;
+    dev->sync_id = 0;
+    dev->base_fd = -1;
+    dev->base_size = 0;
+    dev->base_mtime = 0;
+    dev->overlay = 0;
+    dev->fd = rwfd;
+
+    if (basefd >= 0) {
+        if (nand_dev_overlay_init(dev, basefd) < 0) {
+            XLOG("could not use %s as an overlay of %s: %s\n",
+                 rwfilename, basefilename, strerror(errno));
+            exit(1);
+        }
+        D("using %s as an overlay of %s", rwfilename, basefilename);
+    }
+
     if (initfd >= 0) {
         do {
             read_size = do_read(initfd, dev->data, dev->erase_size);
@@ -796,9 +1587,20 @@ void nand_add_dev(const char *arg)
                 exit(1);
             }
         } while(read_size == dev->erase_size);
-        close(initfd);
+
+        /* The init file is not modified by the emulator, keep it around as
+         * the base image that snapshots are computed against. */
+        if (fstat(initfd, &st) == 0) {
+            dev->base_fd = initfd;
+            dev->base_size = st.st_size;
+            dev->base_mtime = st.st_mtime;
+        } else {
+            close(initfd);
+        }
     }
-    dev->fd = rwfd;
+
+    if (dev->base_fd < 0)
+        nand_dev_erased_base_init(dev);
 
     nand_dev_count++;
 
@@ -12,7 +12,7 @@
 #ifndef NAND_DEVICE_H
 #define NAND_DEVICE_H
 
-void nand_dev_init(uint32_t base);
+void nand_dev_init(uint32_t base, qemu_irq irq);
 void nand_add_dev(const char *arg);
 void parse_nand_limits(char*  limits);
 
@@ -18,13 +18,24 @@ enum nand_cmd {
 	NAND_CMD_WRITE,
 	NAND_CMD_ERASE,
 	NAND_CMD_BLOCK_BAD_GET, // NAND_RESULT is 1 if block is bad, 0 if it is not
-	NAND_CMD_BLOCK_BAD_SET
+	NAND_CMD_BLOCK_BAD_SET,
+	NAND_CMD_READ_ASYNC,    // Same as NAND_CMD_READ/WRITE, but the command returns
+	NAND_CMD_WRITE_ASYNC    // immediately. NAND_RESULT is updated and NAND_IRQ_DONE
+	                        // is raised when the transfer completes.
 };
 
 enum nand_dev_flags {
 	NAND_DEV_FLAG_READ_ONLY = 0x00000001
 };
 
+enum nand_features {
+	NAND_FEATURE_ASYNC      = 0x00000001  // NAND_CMD_READ_ASYNC/WRITE_ASYNC supported
+};
+
+enum nand_irq_status {
+	NAND_IRQ_DONE           = 0x00000001  // an async command has completed
+};
+
 #define NAND_VERSION_CURRENT (1)
 
 enum nand_reg {
@@ -49,6 +60,10 @@ enum nand_reg {
 	NAND_TRANSFER_SIZE  = 0x04c,
 	NAND_ADDR_LOW       = 0x050,
 	NAND_ADDR_HIGH      = 0x054,
+
+	// Async commands
+	NAND_FEATURES       = 0x058,
+	NAND_IRQ_STATUS     = 0x05c, // write 1s to clear
 };
 
 #endif
@@ -0,0 +1,603 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "qemu_file.h"
+#include "qemu-timer.h"
+#include "net.h"
+#include "goldfish_device.h"
+#include "android/utils/debug.h"
+
+#define  D(...)    VERBOSE_PRINT(init,__VA_ARGS__)
+
+/* A paravirtual network device. Frames are exchanged through two rings
+ * of descriptors in guest memory, so sending a batch of frames costs a
+ * single register write, and receiving doesn't cost any. Interrupts can
+ * be coalesced by frame count and delay. See docs/ANDROID-GOLDFISH-NIC.TXT
+ * for the guest-visible protocol.
+ */
+enum {
+    NIC_REG_INT_STATUS   = 0x00,  /* read: pending interrupts, write: ack them */
+    NIC_REG_INT_ENABLE   = 0x04,  /* read/write: interrupt mask */
+    NIC_REG_COMMAND      = 0x08,  /* write: NIC_CMD_XXX */
+    NIC_REG_STATUS       = 0x0c,  /* read: NIC_STATUS_XXX */
+    NIC_REG_MAC_LOW      = 0x10,  /* read: MAC address bytes 0-3 */
+    NIC_REG_MAC_HIGH     = 0x14,  /* read: MAC address bytes 4-5 */
+    NIC_REG_TX_RING_ADDR = 0x18,  /* read/write: TX ring physical address */
+    NIC_REG_TX_RING_SIZE = 0x1c,  /* read/write: TX ring entries */
+    NIC_REG_TX_HEAD      = 0x20,  /* write: TX frames posted by guest */
+    NIC_REG_TX_TAIL      = 0x24,  /* read: TX descriptors completed */
+    NIC_REG_RX_RING_ADDR = 0x28,  /* read/write: RX ring physical address */
+    NIC_REG_RX_RING_SIZE = 0x2c,  /* read/write: RX ring entries */
+    NIC_REG_RX_HEAD      = 0x30,  /* write: RX buffers posted by guest */
+    NIC_REG_RX_TAIL      = 0x34,  /* read: RX descriptors filled */
+    NIC_REG_INT_FRAMES   = 0x38,  /* read/write: frames per interrupt */
+    NIC_REG_INT_DELAY    = 0x3c,  /* read/write: max interrupt delay (us) */
+};
+
+enum {
+    NIC_CMD_RESET   = 1,
+    NIC_CMD_ENABLE  = 2,
+    NIC_CMD_DISABLE = 3,
+};
+
+enum {
+    NIC_STATUS_ENABLED = (1 << 0),
+    NIC_STATUS_LINK_UP = (1 << 1),
+};
+
+enum {
+    NIC_INT_TX   = (1 << 0),  /* TX descriptors were completed */
+    NIC_INT_RX   = (1 << 1),  /* RX descriptors were filled */
+    NIC_INT_LINK = (1 << 2),  /* link status changed */
+};
+
+/* A descriptor is made of four 32-bit words in guest byte order */
+enum {
+    NIC_DESC_ADDR  = 0,   /* buffer physical address */
+    NIC_DESC_LEN   = 4,   /* TX: frame bytes, RX: buffer size, then frame size */
+    NIC_DESC_FLAGS = 8,   /* NIC_DESC_F_XXX */
+    NIC_DESC_SIZE  = 16
+};
+
+enum {
+    NIC_DESC_F_DONE  = (1 << 0),  /* set by the device when completed */
+    NIC_DESC_F_MORE  = (1 << 1),  /* TX: frame continues in next descriptor */
+    NIC_DESC_F_ERROR = (1 << 2),  /* set by the device with F_DONE */
+};
+
+#define  NIC_MAX_RING_SIZE  4096
+
+/* Maximum number of descriptors, and host chunks, for a single TX frame */
+#define  NIC_MAX_FRAGS      16
+
+/* Maximum size of a TX frame, larger ones are completed with an error */
+#define  NIC_MAX_FRAME_SIZE 65535
+
+#define  NIC_SAVE_VERSION   1
+
+typedef struct {
+    uint32_t  addr;
+    uint32_t  size;   /* number of entries, a power of 2 */
+    uint32_t  head;   /* free-running index of the last entry posted + 1 */
+    uint32_t  tail;   /* free-running index of the next entry to process */
+} NicRing;
+
+typedef struct {
+    struct goldfish_device  dev;
+    VLANClientState*        vc;
+    uint8_t                 macaddr[6];
+
+    uint32_t    enabled;
+    uint32_t    int_status;   /* interrupts reported to the guest */
+    uint32_t    int_enable;
+    uint32_t    int_pending;  /* interrupts delayed by coalescing */
+    uint32_t    int_count;    /* frames since the last interrupt */
+    uint32_t    int_frames;
+    uint32_t    int_delay;
+    QEMUTimer*  int_timer;
+    int         int_timer_armed;
+
+    NicRing     tx;
+    NicRing     rx;
+    int         tx_waiting;   /* the VLAN queued a frame, wait for nic_tx_sent */
+    int         tx_busy;      /* in nic_tx_process */
+} NicDevice;
+
+static void
+nic_update_irq( NicDevice*  s )
+{
+    goldfish_device_set_irq(&s->dev, 0, (s->int_status & s->int_enable) != 0);
+}
+
+/* Reports all pending events to the guest */
+static void
+nic_raise( NicDevice*  s )
+{
+    s->int_status |= s->int_pending;
+    s->int_pending = 0;
+    s->int_count   = 0;
+    if (s->int_timer_armed) {
+        qemu_del_timer(s->int_timer);
+        s->int_timer_armed = 0;
+    }
+    nic_update_irq(s);
+}
+
+static void
+nic_int_timer_expired( void*  opaque )
+{
+    NicDevice*  s = opaque;
+
+    s->int_timer_armed = 0;
+    nic_raise(s);
+}
+
+/* Records that 'frames' frames were completed. The interrupt is raised
+ * once int_frames frames are pending, or int_delay microseconds after the
+ * first one, whichever comes first. */
+static void
+nic_event( NicDevice*  s, uint32_t  bits, uint32_t  frames )
+{
+    s->int_pending |= bits;
+    s->int_count   += frames;
+
+    if (s->int_delay == 0 || s->int_count >= s->int_frames) {
+        nic_raise(s);
+    } else if (!s->int_timer_armed) {
+        qemu_mod_timer(s->int_timer, qemu_get_clock(vm_clock) +
+                       muldiv64(s->int_delay, get_ticks_per_sec(), 1000000));
+        s->int_timer_armed = 1;
+    }
+}
+
+static void
+nic_reset( NicDevice*  s )
+{
+    s->enabled     = 0;
+    s->int_status  = 0;
+    s->int_enable  = 0;
+    s->int_pending = 0;
+    s->int_count   = 0;
+    s->int_frames  = 1;
+    s->int_delay   = 0;
+    s->tx_waiting  = 0;
+    s->tx_busy     = 0;
+    memset(&s->tx, 0, sizeof(s->tx));
+    memset(&s->rx, 0, sizeof(s->rx));
+    if (s->int_timer_armed) {
+        qemu_del_timer(s->int_timer);
+        s->int_timer_armed = 0;
+    }
+    nic_update_irq(s);
+}
+
+/* Number of entries posted by the guest and not processed yet */
+static uint32_t
+nic_ring_avail( NicRing*  ring )
+{
+    uint32_t  avail = ring->head - ring->tail;
+
+    /* ignore bogus indices from the guest */
+    if (ring->size == 0 || avail > ring->size)
+        return 0;
+    return avail;
+}
+
+static target_phys_addr_t
+nic_ring_desc( NicRing*  ring, uint32_t  index )
+{
+    return ring->addr + (index & (ring->size - 1)) * NIC_DESC_SIZE;
+}
+
+static void nic_tx_process( NicDevice*  s );
+
+static void
+nic_tx_sent( VLANClientState*  vc )
+{
+    NicDevice*  s = vc->opaque;
+
+    s->tx_waiting = 0;
+    nic_tx_process(s);
+}
+
+/* Sends the frame described by the 'count' descriptors at the TX ring's
+ * tail. Guest buffers are mapped and passed to the VLAN without copying. */
+static void
+nic_tx_frame( NicDevice*  s, uint32_t  count )
+{
+    struct iovec  iov[NIC_MAX_FRAGS];
+    int           niov = 0, error = 0;
+    uint32_t      nn, total = 0;
+    ssize_t       ret;
+
+    for (nn = 0; nn < count; nn++) {
+        target_phys_addr_t  desc = nic_ring_desc(&s->tx, s->tx.tail + nn);
+        target_phys_addr_t  addr = ldl_phys(desc + NIC_DESC_ADDR);
+        target_phys_addr_t  len  = ldl_phys(desc + NIC_DESC_LEN);
+
+        /* 'len' is set by the guest, don't map more than a frame */
+        if (len > NIC_MAX_FRAME_SIZE - total) {
+            error = 1;
+            break;
+        }
+        total += len;
+
+        while (len > 0 && !error) {
+            target_phys_addr_t  plen = len;
+            void*               host;
+
+            if (niov == NIC_MAX_FRAGS) {
+                error = 1;
+                break;
+            }
+            host = cpu_physical_memory_map(addr, &plen, 0);
+            if (host == NULL) {
+                error = 1;
+                break;
+            }
+            iov[niov].iov_base = host;
+            iov[niov].iov_len  = plen;
+            niov++;
+            addr += plen;
+            len  -= plen;
+        }
+    }
+
+    /* a frame without data is a descriptor error, and frames can't be
+     * sent once the device is detached from its VLAN by nic_cleanup() */
+    if (niov == 0 || s->vc == NULL)
+        error = 1;
+
+    if (!error) {
+        ret = qemu_sendv_packet_async(s->vc, iov, niov, nic_tx_sent);
+        /* the frame was copied to the VLAN queue, send the next
+         * ones when it is delivered */
+        if (ret == 0)
+            s->tx_waiting = 1;
+    }
+
+    for (nn = 0; nn < (uint32_t)niov; nn++)
+        cpu_physical_memory_unmap(iov[nn].iov_base, iov[nn].iov_len, 0,
+                                  iov[nn].iov_len);
+
+    for (nn = 0; nn < count; nn++) {
+        target_phys_addr_t  desc  = nic_ring_desc(&s->tx, s->tx.tail + nn);
+        uint32_t            flags = ldl_phys(desc + NIC_DESC_FLAGS);
+
+        flags |= NIC_DESC_F_DONE;
+        if (error)
+            flags |= NIC_DESC_F_ERROR;
+        stl_phys(desc + NIC_DESC_FLAGS, flags);
+    }
+    s->tx.tail += count;
+}
+
+/* Sends all complete frames posted in the TX ring */
+static void
+nic_tx_process( NicDevice*  s )
+{
+    uint32_t  frames = 0;
+
+    /* sending a frame can deliver queued ones and call nic_tx_sent(),
+     * the loop below takes care of it */
+    if (s->tx_busy)
+        return;
+    s->tx_busy = 1;
+
+    while (s->enabled && !s->tx_waiting) {
+        uint32_t  avail = nic_ring_avail(&s->tx);
+        uint32_t  count;
+
+        if (avail == 0)
+            break;
+
+        /* find the descriptors of the next frame */
+        for (count = 1; count <= avail; count++) {
+            target_phys_addr_t  desc = nic_ring_desc(&s->tx, s->tx.tail + count - 1);
+            if (!(ldl_phys(desc + NIC_DESC_FLAGS) & NIC_DESC_F_MORE))
+                break;
+        }
+        if (count > avail)  /* the rest of the frame wasn't posted yet */
+            break;
+
+        nic_tx_frame(s, count);
+        frames++;
+    }
+    s->tx_busy = 0;
+
+    if (frames > 0)
+        nic_event(s, NIC_INT_TX, frames);
+}
+
+static int
+nic_can_receive( VLANClientState*  vc )
+{
+    NicDevice*  s = vc->opaque;
+
+    /* frames are dropped while the device is disabled */
+    if (!s->enabled)
+        return 1;
+
+    return nic_ring_avail(&s->rx) > 0;
+}
+
+static ssize_t
+nic_receive( VLANClientState*  vc, const uint8_t*  buf, size_t  size )
+{
+    NicDevice*          s = vc->opaque;
+    target_phys_addr_t  desc;
+    uint32_t            addr, len, flags;
+
+    if (!s->enabled || nic_ring_avail(&s->rx) == 0)
+        return -1;
+
+    desc  = nic_ring_desc(&s->rx, s->rx.tail);
+    addr  = ldl_phys(desc + NIC_DESC_ADDR);
+    len   = ldl_phys(desc + NIC_DESC_LEN);
+    flags = ldl_phys(desc + NIC_DESC_FLAGS) | NIC_DESC_F_DONE;
+
+    if (size > len) {
+        D("%s: dropping %d bytes frame, buffer is %d bytes", __FUNCTION__,
+          (int)size, len);
+        flags |= NIC_DESC_F_ERROR;
+        len    = 0;
+    } else {
+        cpu_physical_memory_write(addr, buf, size);
+        len = size;
+    }
+    stl_phys(desc + NIC_DESC_LEN, len);
+    stl_phys(desc + NIC_DESC_FLAGS, flags);
+    s->rx.tail++;
+
+    nic_event(s, NIC_INT_RX, 1);
+    return size;
+}
+
+static void
+nic_link_status_changed( VLANClientState*  vc )
+{
+    NicDevice*  s = vc->opaque;
+
+    s->int_pending |= NIC_INT_LINK;
+    nic_raise(s);
+}
+
+static void
+nic_cleanup( VLANClientState*  vc )
+{
+    NicDevice*  s = vc->opaque;
+
+    s->vc = NULL;
+}
+
+/* Ring sizes must be a power of 2 */
+static uint32_t
+nic_ring_size( uint32_t  value )
+{
+    if (value == 0 || value > NIC_MAX_RING_SIZE || (value & (value - 1)) != 0)
+        return 0;
+    return value;
+}
+
+static uint32_t
+nic_dev_read( void*  opaque, target_phys_addr_t  offset )
+{
+    NicDevice*  s = opaque;
+
+    switch (offset) {
+    case NIC_REG_INT_STATUS:
+        return s->int_status;
+    case NIC_REG_INT_ENABLE:
+        return s->int_enable;
+    case NIC_REG_STATUS:
+        return (s->enabled ? NIC_STATUS_ENABLED : 0) |
+               ((s->vc && !s->vc->link_down) ? NIC_STATUS_LINK_UP : 0);
+    case NIC_REG_MAC_LOW:
+        return s->macaddr[0] | (s->macaddr[1] << 8) |
+               (s->macaddr[2] << 16) | (s->macaddr[3] << 24);
+    case NIC_REG_MAC_HIGH:
+        return s->macaddr[4] | (s->macaddr[5] << 8);
+    case NIC_REG_TX_RING_ADDR:
+        return s->tx.addr;
+    case NIC_REG_TX_RING_SIZE:
+        return s->tx.size;
+    case NIC_REG_TX_HEAD:
+        return s->tx.head;
+    case NIC_REG_TX_TAIL:
+        return s->tx.tail;
+    case NIC_REG_RX_RING_ADDR:
+        return s->rx.addr;
+    case NIC_REG_RX_RING_SIZE:
+        return s->rx.size;
+    case NIC_REG_RX_HEAD:
+        return s->rx.head;
+    case NIC_REG_RX_TAIL:
+        return s->rx.tail;
+    case NIC_REG_INT_FRAMES:
+        return s->int_frames;
+    case NIC_REG_INT_DELAY:
+        return s->int_delay;
+    default:
+        cpu_abort(cpu_single_env, "goldfish_nic_read: Bad offset %x\n", offset);
+        return 0;
+    }
+}
+
+static void
+nic_dev_write( void*  opaque, target_phys_addr_t  offset, uint32_t  value )
+{
+    NicDevice*  s = opaque;
+
+    switch (offset) {
+    case NIC_REG_INT_STATUS:
+        s->int_status &= ~value;
+        nic_update_irq(s);
+        break;
+
+    case NIC_REG_INT_ENABLE:
+        s->int_enable = value;
+        nic_update_irq(s);
+        break;
+
+    case NIC_REG_COMMAND:
+        switch (value) {
+        case NIC_CMD_RESET:
+            nic_reset(s);
+            break;
+        case NIC_CMD_ENABLE:
+            s->enabled = 1;
+            nic_tx_process(s);
+            if (s->vc)
+                qemu_flush_queued_packets(s->vc);
+            break;
+        case NIC_CMD_DISABLE:
+            s->enabled = 0;
+            break;
+        default:
+            D("%s: unknown command %d", __FUNCTION__, value);
+        }
+        break;
+
+    case NIC_REG_TX_RING_ADDR:
+        s->tx.addr = value;
+        break;
+    case NIC_REG_TX_RING_SIZE:
+        s->tx.size = nic_ring_size(value);
+        break;
+    case NIC_REG_TX_HEAD:
+        s->tx.head = value;
+        nic_tx_process(s);
+        break;
+
+    case NIC_REG_RX_RING_ADDR:
+        s->rx.addr = value;
+        break;
+    case NIC_REG_RX_RING_SIZE:
+        s->rx.size = nic_ring_size(value);
+        break;
+    case NIC_REG_RX_HEAD:
+        s->rx.head = value;
+        if (s->vc)
+            qemu_flush_queued_packets(s->vc);
+        break;
+
+    case NIC_REG_INT_FRAMES:
+        s->int_frames = value ? value : 1;
+        break;
+    case NIC_REG_INT_DELAY:
+        s->int_delay = value;
+        break;
+
+    default:
+        cpu_abort(cpu_single_env, "goldfish_nic_write: Bad offset %x\n", offset);
+    }
+}
+
+static CPUReadMemoryFunc*  nic_dev_readfn[] = {
+    nic_dev_read,
+    nic_dev_read,
+    nic_dev_read
+};
+
+static CPUWriteMemoryFunc*  nic_dev_writefn[] = {
+    nic_dev_write,
+    nic_dev_write,
+    nic_dev_write
+};
+
+static void
+nic_ring_save( QEMUFile*  f, NicRing*  ring )
+{
+    qemu_put_be32(f, ring->addr);
+    qemu_put_be32(f, ring->size);
+    qemu_put_be32(f, ring->head);
+    qemu_put_be32(f, ring->tail);
+}
+
+static void
+nic_ring_load( QEMUFile*  f, NicRing*  ring )
+{
+    ring->addr = qemu_get_be32(f);
+    ring->size = nic_ring_size(qemu_get_be32(f));
+    ring->head = qemu_get_be32(f);
+    ring->tail = qemu_get_be32(f);
+}
+
+static void
+nic_dev_save( QEMUFile*  f, void*  opaque )
+{
+    NicDevice*  s = opaque;
+
+    qemu_put_be32(f, s->enabled);
+    qemu_put_be32(f, s->int_status);
+    qemu_put_be32(f, s->int_enable);
+    qemu_put_be32(f, s->int_pending);
+    qemu_put_be32(f, s->int_frames);
+    qemu_put_be32(f, s->int_delay);
+    nic_ring_save(f, &s->tx);
+    nic_ring_save(f, &s->rx);
+}
+
+static int
+nic_dev_load( QEMUFile*  f, void*  opaque, int  version_id )
+{
+    NicDevice*  s = opaque;
+
+    if (version_id != NIC_SAVE_VERSION)
+        return -1;
+
+    nic_reset(s);
+
+    s->enabled     = qemu_get_be32(f);
+    s->int_status  = qemu_get_be32(f);
+    s->int_enable  = qemu_get_be32(f);
+    s->int_pending = qemu_get_be32(f);
+    s->int_frames  = qemu_get_be32(f);
+    s->int_delay   = qemu_get_be32(f);
+    nic_ring_load(f, &s->tx);
+    nic_ring_load(f, &s->rx);
+
+    if (s->int_frames == 0)
+        s->int_frames = 1;
+
+    /* report coalesced events right away, and send the frames that
+     * were still in the TX ring */
+    nic_raise(s);
+    nic_tx_process(s);
+    return 0;
+}
+
+void
+goldfish_nic_init( NICInfo*  nd, int  id )
+{
+    NicDevice*  s = qemu_mallocz(sizeof(*s));
+
+    s->dev.name      = "goldfish_nic";
+    s->dev.id        = id;
+    s->dev.base      = 0;    // will be allocated dynamically
+    s->dev.size      = 0x1000;
+    s->dev.irq_count = 1;
+
+    memcpy(s->macaddr, nd->macaddr, sizeof(s->macaddr));
+    s->int_timer = qemu_new_timer(vm_clock, nic_int_timer_expired, s);
+
+    goldfish_device_add(&s->dev, nic_dev_readfn, nic_dev_writefn, s);
+    nic_reset(s);
+
+    s->vc = qemu_new_vlan_client(nd->vlan, nd->model, nd->name,
+                                 nic_can_receive, nic_receive, NULL,
+                                 nic_cleanup, s);
+    s->vc->link_status_changed = nic_link_status_changed;
+    qemu_format_nic_info_str(s->vc, s->macaddr);
+
+    register_savevm( "goldfish_nic", id, NIC_SAVE_VERSION,
+                     nic_dev_save, nic_dev_load, s);
+}
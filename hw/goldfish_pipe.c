@@ -0,0 +1,827 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "qemu_file.h"
+#include "goldfish_device.h"
+#include "goldfish_pipe.h"
+#include "android/utils/debug.h"
+
+#define  D(...)    VERBOSE_PRINT(qemud,__VA_ARGS__)
+
+/* The device registers. A transfer is done by writing the channel, size
+ * and address registers, then the command register, and reading the
+ * status register. The guest can also write the address of a parameter
+ * block (see below) to PIPE_REG_PARAMS_ADDR to do all of this with a
+ * single register access.
+ */
+enum {
+    PIPE_REG_COMMAND     = 0x00,  /* write: command to execute */
+    PIPE_REG_STATUS      = 0x04,  /* read: result of last command */
+    PIPE_REG_CHANNEL     = 0x08,  /* read/write: channel id */
+    PIPE_REG_SIZE        = 0x0c,  /* read/write: buffer size */
+    PIPE_REG_ADDRESS     = 0x10,  /* write: buffer address */
+    PIPE_REG_WAKES       = 0x14,  /* read: wake flags of last channel */
+    PIPE_REG_PARAMS_ADDR = 0x18,  /* write: run command from parameter block */
+};
+
+enum {
+    PIPE_CMD_OPEN          = 1,  /* guest opens a new channel */
+    PIPE_CMD_CLOSE         = 2,  /* guest closes a channel */
+    PIPE_CMD_POLL          = 3,  /* status = PIPE_POLL_XXX flags */
+    PIPE_CMD_WRITE_BUFFER  = 4,  /* guest -> service */
+    PIPE_CMD_WAKE_ON_WRITE = 5,  /* signal when channel can be written */
+    PIPE_CMD_READ_BUFFER   = 6,  /* service -> guest */
+    PIPE_CMD_WAKE_ON_READ  = 7,  /* signal when channel can be read */
+};
+
+/* The parameter block is made of 32-bit words in guest byte order */
+enum {
+    PIPE_PARAM_CHANNEL = 0,
+    PIPE_PARAM_SIZE,
+    PIPE_PARAM_ADDRESS,
+    PIPE_PARAM_CMD,
+    PIPE_PARAM_RESULT,   /* written back by the device */
+    PIPE_PARAM_COUNT
+};
+
+/* Maximum number of contiguous host chunks for a single transfer. Larger
+ * transfers are truncated, and the guest gets a short count. */
+#define  PIPE_MAX_BUFFERS     64
+
+/* Maximum size of the "pipe:<name>[:<args>]" connection string */
+#define  PIPE_MAX_NAME        256
+
+#define  PIPE_MAX_TYPES       8
+
+#define  PIPE_SAVE_VERSION    1
+
+typedef struct PipeType {
+    const char*               name;
+    void*                     opaque;
+    const GoldfishPipeFuncs*  funcs;
+} PipeType;
+
+static PipeType  pipe_types[PIPE_MAX_TYPES];
+static int       pipe_types_count;
+
+typedef struct PipeDevice  PipeDevice;
+
+typedef struct Pipe {
+    struct Pipe*              next;         /* in device's pipe list */
+    struct Pipe*              next_waked;   /* in device's signaled list */
+    PipeDevice*               device;
+    uint32_t                  channel;
+    void*                     opaque;       /* service pipe */
+    const GoldfishPipeFuncs*  funcs;        /* NULL until connected */
+    unsigned char             wanted;       /* PIPE_WAKE_XXX asked by guest */
+    unsigned char             wakes;        /* PIPE_WAKE_XXX not yet reported */
+    unsigned char             signaled;     /* 1 if in signaled list */
+    unsigned char             closed;       /* 1 if closed by the service */
+    int                       name_len;
+    char*                     name;         /* connection string, while connecting */
+} Pipe;
+
+struct PipeDevice {
+    struct goldfish_device  dev;
+
+    /* register values */
+    uint32_t  status;
+    uint32_t  channel;
+    uint32_t  size;
+    uint32_t  address;
+    uint32_t  wakes;
+
+    Pipe*     pipes;
+    Pipe*     signaled_first;
+    Pipe*     signaled_last;
+};
+
+static PipeDevice*  pipe_device;
+
+void
+goldfish_pipe_add_type( const char*               pipeName,
+                        void*                     pipeOpaque,
+                        const GoldfishPipeFuncs*  pipeFuncs )
+{
+    PipeType*  type;
+
+    if (pipe_types_count >= PIPE_MAX_TYPES) {
+        derror("Too many goldfish pipe types, ignoring '%s'", pipeName);
+        return;
+    }
+    type = &pipe_types[pipe_types_count++];
+    type->name   = pipeName;
+    type->opaque = pipeOpaque;
+    type->funcs  = pipeFuncs;
+}
+
+static const PipeType*
+pipe_type_find( const char*  name, int  namelen )
+{
+    int  nn;
+
+    for (nn = 0; nn < pipe_types_count; nn++) {
+        const PipeType*  type = &pipe_types[nn];
+        if ((int)strlen(type->name) == namelen &&
+            !memcmp(type->name, name, namelen))
+            return type;
+    }
+    return NULL;
+}
+
+/* Adds a pipe to the list of pipes reported on the next interrupt. All
+ * events that happen before the guest reads the list are coalesced
+ * into a single interrupt. */
+static void
+pipe_signal( Pipe*  pipe, unsigned  flags )
+{
+    PipeDevice*  dev = pipe->device;
+
+    pipe->wakes  |= flags;
+    pipe->wanted &= ~flags;
+
+    if (pipe->signaled)
+        return;
+
+    pipe->signaled   = 1;
+    pipe->next_waked = NULL;
+    if (dev->signaled_last)
+        dev->signaled_last->next_waked = pipe;
+    else
+        dev->signaled_first = pipe;
+    dev->signaled_last = pipe;
+
+    goldfish_device_set_irq(&dev->dev, 0, 1);
+}
+
+static void
+pipe_unsignal( Pipe*  pipe )
+{
+    PipeDevice*  dev  = pipe->device;
+    Pipe**       pnode = &dev->signaled_first;
+    Pipe*        prev  = NULL;
+
+    if (!pipe->signaled)
+        return;
+
+    while (*pnode != pipe) {
+        prev  = *pnode;
+        pnode = &prev->next_waked;
+    }
+    *pnode = pipe->next_waked;
+    if (dev->signaled_last == pipe)
+        dev->signaled_last = prev;
+
+    pipe->signaled   = 0;
+    pipe->next_waked = NULL;
+
+    if (dev->signaled_first == NULL)
+        goldfish_device_set_irq(&dev->dev, 0, 0);
+}
+
+void
+goldfish_pipe_wake( void*  hwpipe, unsigned  flags )
+{
+    Pipe*  pipe = hwpipe;
+
+    /* only report the events the guest is waiting for */
+    flags &= pipe->wanted | PIPE_WAKE_CLOSED;
+    if (flags)
+        pipe_signal(pipe, flags);
+}
+
+void
+goldfish_pipe_close( void*  hwpipe )
+{
+    Pipe*  pipe = hwpipe;
+
+    if (pipe->closed)
+        return;
+
+    pipe->closed = 1;
+    pipe_signal(pipe, PIPE_WAKE_CLOSED);
+}
+
+static Pipe*
+pipe_new( PipeDevice*  dev, uint32_t  channel )
+{
+    Pipe*  pipe = qemu_mallocz(sizeof(*pipe));
+
+    pipe->device  = dev;
+    pipe->channel = channel;
+    pipe->next    = dev->pipes;
+    dev->pipes    = pipe;
+    return pipe;
+}
+
+static Pipe*
+pipe_find( PipeDevice*  dev, uint32_t  channel )
+{
+    Pipe*  pipe;
+
+    for (pipe = dev->pipes; pipe; pipe = pipe->next)
+        if (pipe->channel == channel)
+            break;
+    return pipe;
+}
+
+/* Removes a pipe from the device, and lets its service free its state */
+static void
+pipe_free( Pipe*  pipe )
+{
+    PipeDevice*  dev = pipe->device;
+    Pipe**       pnode;
+
+    for (pnode = &dev->pipes; *pnode; pnode = &(*pnode)->next) {
+        if (*pnode == pipe) {
+            *pnode = pipe->next;
+            break;
+        }
+    }
+    pipe_unsignal(pipe);
+
+    if (pipe->funcs)
+        pipe->funcs->close(pipe->opaque);
+
+    qemu_free(pipe->name);
+    qemu_free(pipe);
+}
+
+/* Parses the "pipe:<name>[:<args>]" connection string and connects the
+ * pipe to the corresponding service. */
+static int
+pipe_connect( Pipe*  pipe )
+{
+    const char*      name = pipe->name;
+    const char*      args;
+    const PipeType*  type;
+
+    if (memcmp(name, "pipe:", 5) != 0) {
+        D("%s: invalid connection string '%s'", __FUNCTION__, name);
+        return PIPE_ERROR_INVAL;
+    }
+    name += 5;
+    args  = strchr(name, ':');
+
+    type = pipe_type_find(name, args ? args - name : (int)strlen(name));
+    if (type == NULL) {
+        D("%s: unknown pipe service '%s'", __FUNCTION__, name);
+        return PIPE_ERROR_INVAL;
+    }
+    if (args)
+        args++;
+
+    pipe->opaque = type->funcs->init(pipe, type->opaque, args);
+    if (pipe->opaque == NULL)
+        return PIPE_ERROR_IO;
+
+    pipe->funcs = type->funcs;
+    qemu_free(pipe->name);
+    pipe->name     = NULL;
+    pipe->name_len = 0;
+    return 0;
+}
+
+/* Receives the connection string, which is the first zero-terminated
+ * string written by the guest to a new pipe. */
+static int
+pipe_connector_send( Pipe*  pipe, const GoldfishPipeBuffer*  buffers, int  count )
+{
+    int  total = 0;
+
+    if (pipe->name == NULL)
+        pipe->name = qemu_malloc(PIPE_MAX_NAME);
+
+    for ( ; count > 0; count--, buffers++ ) {
+        const uint8_t*  p   = buffers->data;
+        const uint8_t*  end = p + buffers->size;
+
+        for ( ; p < end; p++ ) {
+            if (pipe->name_len >= PIPE_MAX_NAME)
+                return PIPE_ERROR_INVAL;
+
+            pipe->name[pipe->name_len++] = *p;
+            total++;
+
+            if (*p == 0) {
+                int  ret = pipe_connect(pipe);
+                if (ret < 0)
+                    return ret;
+                /* pass the rest of the data to the service */
+                if (p+1 < end || count > 1) {
+                    GoldfishPipeBuffer  rest[PIPE_MAX_BUFFERS];
+                    int                 nn, ret2;
+
+                    rest[0].data = (uint8_t*)(p+1);
+                    rest[0].size = end - (p+1);
+                    for (nn = 1; nn < count; nn++)
+                        rest[nn] = buffers[nn];
+                    ret2 = pipe->funcs->sendBuffers(pipe->opaque, rest, count);
+                    if (ret2 > 0)
+                        total += ret2;
+                }
+                return total;
+            }
+        }
+    }
+    return total;
+}
+
+/* Maps 'size' bytes of guest virtual memory at 'address' into a list of
+ * host buffers. Returns the number of buffers, or a negative error code.
+ * Guest pages that are physically contiguous are merged. */
+static int
+pipe_map_buffers( target_ulong  address, uint32_t  size, int  is_write,
+                  GoldfishPipeBuffer*  buffers )
+{
+    int  count = 0;
+
+    while (size > 0) {
+        target_phys_addr_t  paddr, plen;
+        uint32_t            l = TARGET_PAGE_SIZE - (address & ~TARGET_PAGE_MASK);
+        uint8_t*            host;
+
+        if (l > size)
+            l = size;
+
+        paddr = cpu_get_phys_page_debug(cpu_single_env, address & TARGET_PAGE_MASK);
+        if (paddr == -1 ||
+            (cpu_get_physical_page_desc(paddr) & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+            break;
+        paddr += address & ~TARGET_PAGE_MASK;
+
+        plen = l;
+        host = cpu_physical_memory_map(paddr, &plen, is_write);
+        if (host == NULL)
+            break;
+        if (plen < l) {
+            cpu_physical_memory_unmap(host, plen, is_write, 0);
+            break;
+        }
+
+        if (count > 0 && buffers[count-1].data + buffers[count-1].size == host) {
+            buffers[count-1].size += l;
+        } else {
+            if (count == PIPE_MAX_BUFFERS) {
+                cpu_physical_memory_unmap(host, plen, is_write, 0);
+                break;
+            }
+            buffers[count].data = host;
+            buffers[count].size = l;
+            count++;
+        }
+        address += l;
+        size    -= l;
+    }
+
+    if (count == 0)
+        return PIPE_ERROR_INVAL;
+
+    return count;
+}
+
+/* Unmaps the buffers, marking the first 'len' bytes as accessed */
+static void
+pipe_unmap_buffers( GoldfishPipeBuffer*  buffers, int  count,
+                    int  is_write, int  len )
+{
+    int  nn;
+
+    for (nn = 0; nn < count; nn++) {
+        int  access = buffers[nn].size;
+        if (access > len)
+            access = len;
+        if (access < 0)
+            access = 0;
+        cpu_physical_memory_unmap(buffers[nn].data, buffers[nn].size,
+                                  is_write, access);
+        len -= access;
+    }
+}
+
+static int
+pipe_transfer( Pipe*  pipe, int  is_read, uint32_t  address, uint32_t  size )
+{
+    GoldfishPipeBuffer  buffers[PIPE_MAX_BUFFERS];
+    int                 count, ret;
+
+    if (pipe->closed)
+        return PIPE_ERROR_IO;
+
+    if (is_read && pipe->funcs == NULL)
+        return PIPE_ERROR_AGAIN;
+
+    if (size == 0)
+        return 0;
+
+    count = pipe_map_buffers(address, size, is_read, buffers);
+    if (count < 0)
+        return count;
+
+    if (is_read)
+        ret = pipe->funcs->recvBuffers(pipe->opaque, buffers, count);
+    else if (pipe->funcs == NULL)
+        ret = pipe_connector_send(pipe, buffers, count);
+    else
+        ret = pipe->funcs->sendBuffers(pipe->opaque, buffers, count);
+
+    pipe_unmap_buffers(buffers, count, is_read, ret);
+    return ret;
+}
+
+static uint32_t
+pipe_command( PipeDevice*  dev, uint32_t  cmd, uint32_t  channel,
+              uint32_t  size, uint32_t  address )
+{
+    Pipe*  pipe;
+
+    if (cmd == PIPE_CMD_OPEN) {
+        if (channel == 0 || pipe_find(dev, channel) != NULL)
+            return (uint32_t)PIPE_ERROR_INVAL;
+        pipe_new(dev, channel);
+        return 0;
+    }
+
+    pipe = pipe_find(dev, channel);
+    if (pipe == NULL) {
+        D("%s: command %d on unknown channel %x", __FUNCTION__, cmd, channel);
+        return (uint32_t)PIPE_ERROR_INVAL;
+    }
+
+    switch (cmd) {
+    case PIPE_CMD_CLOSE:
+        pipe_free(pipe);
+        return 0;
+
+    case PIPE_CMD_POLL:
+        if (pipe->closed)
+            return PIPE_POLL_HUP;
+        if (pipe->funcs == NULL)
+            return PIPE_POLL_OUT;
+        return pipe->funcs->poll(pipe->opaque);
+
+    case PIPE_CMD_WRITE_BUFFER:
+        return (uint32_t)pipe_transfer(pipe, 0, address, size);
+
+    case PIPE_CMD_READ_BUFFER:
+        return (uint32_t)pipe_transfer(pipe, 1, address, size);
+
+    case PIPE_CMD_WAKE_ON_WRITE:
+    case PIPE_CMD_WAKE_ON_READ:
+        {
+            int  flags = (cmd == PIPE_CMD_WAKE_ON_READ) ? PIPE_WAKE_READ
+                                                        : PIPE_WAKE_WRITE;
+            if (pipe->closed) {
+                pipe_signal(pipe, PIPE_WAKE_CLOSED);
+                return 0;
+            }
+            pipe->wanted |= flags;
+            if (pipe->funcs != NULL)
+                pipe->funcs->wakeOn(pipe->opaque, flags);
+            else if (flags == PIPE_WAKE_WRITE)
+                pipe_signal(pipe, PIPE_WAKE_WRITE);
+            return 0;
+        }
+
+    default:
+        D("%s: unknown command %d", __FUNCTION__, cmd);
+        return (uint32_t)PIPE_ERROR_INVAL;
+    }
+}
+
+/* Executes the command described by the parameter block at 'address' */
+static void
+pipe_command_params( PipeDevice*  dev, uint32_t  address )
+{
+    uint8_t   block[PIPE_PARAM_COUNT*4];
+    uint32_t  result;
+
+    if (cpu_memory_rw_debug(cpu_single_env, address, block, sizeof(block), 0) < 0)
+        return;
+
+    result = pipe_command(dev, ldl_p(block + 4*PIPE_PARAM_CMD),
+                               ldl_p(block + 4*PIPE_PARAM_CHANNEL),
+                               ldl_p(block + 4*PIPE_PARAM_SIZE),
+                               ldl_p(block + 4*PIPE_PARAM_ADDRESS));
+
+    stl_p(block + 4*PIPE_PARAM_RESULT, result);
+    cpu_memory_rw_debug(cpu_single_env, address + 4*PIPE_PARAM_RESULT,
+                        block + 4*PIPE_PARAM_RESULT, 4, 1);
+}
+
+static uint32_t
+pipe_dev_read( void*  opaque, target_phys_addr_t  offset )
+{
+    PipeDevice*  dev = opaque;
+
+    switch (offset) {
+    case PIPE_REG_STATUS:
+        return dev->status;
+
+    case PIPE_REG_CHANNEL:
+        /* report the next signaled pipe, or 0 if there are no more.
+         * the corresponding wake flags are then read from PIPE_REG_WAKES */
+        {
+            Pipe*  pipe = dev->signaled_first;
+
+            if (pipe == NULL) {
+                dev->wakes = 0;
+                goldfish_device_set_irq(&dev->dev, 0, 0);
+                return 0;
+            }
+            dev->wakes  = pipe->wakes;
+            pipe->wakes = 0;
+            pipe_unsignal(pipe);
+            return pipe->channel;
+        }
+
+    case PIPE_REG_SIZE:
+        return dev->size;
+
+    case PIPE_REG_WAKES:
+        return dev->wakes;
+
+    default:
+        cpu_abort(cpu_single_env, "goldfish_pipe_read: Bad offset %x\n", offset);
+        return 0;
+    }
+}
+
+static void
+pipe_dev_write( void*  opaque, target_phys_addr_t  offset, uint32_t  value )
+{
+    PipeDevice*  dev = opaque;
+
+    switch (offset) {
+    case PIPE_REG_COMMAND:
+        dev->status = pipe_command(dev, value, dev->channel,
+                                   dev->size, dev->address);
+        break;
+
+    case PIPE_REG_CHANNEL:
+        dev->channel = value;
+        break;
+
+    case PIPE_REG_SIZE:
+        dev->size = value;
+        break;
+
+    case PIPE_REG_ADDRESS:
+        dev->address = value;
+        break;
+
+    case PIPE_REG_PARAMS_ADDR:
+        pipe_command_params(dev, value);
+        break;
+
+    default:
+        cpu_abort(cpu_single_env, "goldfish_pipe_write: Bad offset %x\n", offset);
+    }
+}
+
+static CPUReadMemoryFunc*  pipe_dev_readfn[] = {
+    pipe_dev_read,
+    pipe_dev_read,
+    pipe_dev_read
+};
+
+static CPUWriteMemoryFunc*  pipe_dev_writefn[] = {
+    pipe_dev_write,
+    pipe_dev_write,
+    pipe_dev_write
+};
+
+/* Only the channel ids are saved. Service connections cannot be carried
+ * across a snapshot, so all pipes are restored in the closed state and
+ * the guest is told about it on the next interrupt. */
+static void
+pipe_dev_save( QEMUFile*  f, void*  opaque )
+{
+    PipeDevice*  dev = opaque;
+    Pipe*        pipe;
+    uint32_t     count = 0;
+
+    qemu_put_be32(f, dev->status);
+    qemu_put_be32(f, dev->channel);
+    qemu_put_be32(f, dev->size);
+    qemu_put_be32(f, dev->address);
+    qemu_put_be32(f, dev->wakes);
+
+    for (pipe = dev->pipes; pipe; pipe = pipe->next)
+        count++;
+
+    qemu_put_be32(f, count);
+    for (pipe = dev->pipes; pipe; pipe = pipe->next)
+        qemu_put_be32(f, pipe->channel);
+}
+
+static int
+pipe_dev_load( QEMUFile*  f, void*  opaque, int  version_id )
+{
+    PipeDevice*  dev = opaque;
+    uint32_t     count;
+
+    if (version_id != PIPE_SAVE_VERSION)
+        return -1;
+
+    while (dev->pipes)
+        pipe_free(dev->pipes);
+
+    dev->status  = qemu_get_be32(f);
+    dev->channel = qemu_get_be32(f);
+    dev->size    = qemu_get_be32(f);
+    dev->address = qemu_get_be32(f);
+    dev->wakes   = qemu_get_be32(f);
+
+    count = qemu_get_be32(f);
+    while (count-- > 0) {
+        Pipe*  pipe = pipe_new(dev, qemu_get_be32(f));
+        goldfish_pipe_close(pipe);
+    }
+    return 0;
+}
+
+/** PINGPONG SERVICE
+ **
+ ** A loopback service that sends back everything the guest writes to it.
+ ** It is used to measure the raw throughput of the pipe device.
+ **/
+
+#define  PINGPONG_SIZE  65536
+
+typedef struct PingPongPipe {
+    void*     hwpipe;
+    uint8_t*  buffer;
+    uint32_t  pos;      /* read position in ring buffer */
+    uint32_t  count;    /* bytes in ring buffer */
+    int       flags;    /* PIPE_WAKE_XXX wanted by guest */
+} PingPongPipe;
+
+static void*
+pingPongPipe_init( void*  hwpipe, void*  svcOpaque, const char*  args )
+{
+    PingPongPipe*  ppipe = qemu_mallocz(sizeof(*ppipe));
+
+    ppipe->hwpipe = hwpipe;
+    ppipe->buffer = qemu_malloc(PINGPONG_SIZE);
+    return ppipe;
+}
+
+static void
+pingPongPipe_close( void*  opaque )
+{
+    PingPongPipe*  ppipe = opaque;
+
+    qemu_free(ppipe->buffer);
+    qemu_free(ppipe);
+}
+
+static void
+pingPongPipe_wake( PingPongPipe*  ppipe, int  flags )
+{
+    flags &= ppipe->flags;
+    if (flags) {
+        ppipe->flags &= ~flags;
+        goldfish_pipe_wake(ppipe->hwpipe, flags);
+    }
+}
+
+static int
+pingPongPipe_sendBuffers( void*  opaque, const GoldfishPipeBuffer*  buffers, int  numBuffers )
+{
+    PingPongPipe*  ppipe = opaque;
+    int            total = 0;
+
+    for ( ; numBuffers > 0; numBuffers--, buffers++ ) {
+        const uint8_t*  data = buffers->data;
+        uint32_t        size = buffers->size;
+
+        while (size > 0 && ppipe->count < PINGPONG_SIZE) {
+            uint32_t  wpos  = (ppipe->pos + ppipe->count) % PINGPONG_SIZE;
+            uint32_t  avail = PINGPONG_SIZE - ppipe->count;
+
+            if (avail > PINGPONG_SIZE - wpos)
+                avail = PINGPONG_SIZE - wpos;
+            if (avail > size)
+                avail = size;
+
+            memcpy(ppipe->buffer + wpos, data, avail);
+            ppipe->count += avail;
+            data  += avail;
+            size  -= avail;
+            total += avail;
+        }
+    }
+
+    if (total == 0)
+        return PIPE_ERROR_AGAIN;
+
+    pingPongPipe_wake(ppipe, PIPE_WAKE_READ);
+    return total;
+}
+
+static int
+pingPongPipe_recvBuffers( void*  opaque, GoldfishPipeBuffer*  buffers, int  numBuffers )
+{
+    PingPongPipe*  ppipe = opaque;
+    int            total = 0;
+
+    for ( ; numBuffers > 0; numBuffers--, buffers++ ) {
+        uint8_t*  data = buffers->data;
+        uint32_t  size = buffers->size;
+
+        while (size > 0 && ppipe->count > 0) {
+            uint32_t  avail = ppipe->count;
+
+            if (avail > PINGPONG_SIZE - ppipe->pos)
+                avail = PINGPONG_SIZE - ppipe->pos;
+            if (avail > size)
+                avail = size;
+
+            memcpy(data, ppipe->buffer + ppipe->pos, avail);
+            ppipe->pos    = (ppipe->pos + avail) % PINGPONG_SIZE;
+            ppipe->count -= avail;
+            data  += avail;
+            size  -= avail;
+            total += avail;
+        }
+    }
+
+    if (total == 0)
+        return PIPE_ERROR_AGAIN;
+
+    pingPongPipe_wake(ppipe, PIPE_WAKE_WRITE);
+    return total;
+}
+
+static unsigned
+pingPongPipe_poll( void*  opaque )
+{
+    PingPongPipe*  ppipe = opaque;
+    unsigned       ret   = 0;
+
+    if (ppipe->count < PINGPONG_SIZE)
+        ret |= PIPE_POLL_OUT;
+    if (ppipe->count > 0)
+        ret |= PIPE_POLL_IN;
+
+    return ret;
+}
+
+static void
+pingPongPipe_wakeOn( void*  opaque, int  flags )
+{
+    PingPongPipe*  ppipe = opaque;
+
+    ppipe->flags |= flags;
+
+    /* wake up immediately if the condition is already met */
+    flags = 0;
+    if (ppipe->count > 0)
+        flags |= PIPE_WAKE_READ;
+    if (ppipe->count < PINGPONG_SIZE)
+        flags |= PIPE_WAKE_WRITE;
+    pingPongPipe_wake(ppipe, flags);
+}
+
+static const GoldfishPipeFuncs  pingPongPipe_funcs = {
+    pingPongPipe_init,
+    pingPongPipe_close,
+    pingPongPipe_sendBuffers,
+    pingPongPipe_recvBuffers,
+    pingPongPipe_poll,
+    pingPongPipe_wakeOn,
+};
+
+void
+goldfish_pipe_init( void )
+{
+    PipeDevice*  dev;
+
+    if (pipe_device != NULL)
+        return;
+
+    dev = qemu_mallocz(sizeof(*dev));
+    dev->dev.name      = "qemu_pipe";
+    dev->dev.id        = -1;
+    dev->dev.base      = 0;    // will be allocated dynamically
+    dev->dev.size      = 0x1000;
+    dev->dev.irq_count = 1;
+
+    pipe_device = dev;
+
+    goldfish_device_add(&dev->dev, pipe_dev_readfn, pipe_dev_writefn, dev);
+
+    register_savevm( "goldfish_pipe", 0, PIPE_SAVE_VERSION,
+                     pipe_dev_save, pipe_dev_load, dev);
+
+    goldfish_pipe_add_type("pingpong", NULL, &pingPongPipe_funcs);
+}
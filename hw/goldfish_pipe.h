@@ -0,0 +1,97 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _HW_GOLDFISH_PIPE_H
+#define _HW_GOLDFISH_PIPE_H
+
+#include <stdint.h>
+
+/* The goldfish pipe device ("qemu_pipe") gives the guest fast, named
+ * channels to services running in the emulator. Data is copied directly
+ * between guest memory and the service, without going through a serial
+ * port. See docs/ANDROID-QEMU-PIPE.TXT for the guest-visible protocol.
+ *
+ * A service registers a pipe type with goldfish_pipe_add_type(). When the
+ * guest connects to "pipe:<name>[:<args>]", the device calls the type's
+ * init() callback with an opaque 'hwpipe' handle, that the service uses
+ * to signal events with goldfish_pipe_wake() or goldfish_pipe_close().
+ */
+
+/* Error codes returned by the callbacks below, and to the guest */
+#define PIPE_ERROR_INVAL  -1
+#define PIPE_ERROR_AGAIN  -2
+#define PIPE_ERROR_NOMEM  -3
+#define PIPE_ERROR_IO     -4
+
+/* Flags returned by the poll() callback */
+#define PIPE_POLL_IN   (1 << 0)
+#define PIPE_POLL_PRI  (1 << 1)
+#define PIPE_POLL_OUT  (1 << 2)
+#define PIPE_POLL_ERR  (1 << 3)
+#define PIPE_POLL_HUP  (1 << 4)
+
+/* Flags passed to wakeOn() and goldfish_pipe_wake() */
+#define PIPE_WAKE_CLOSED  (1 << 0)
+#define PIPE_WAKE_READ    (1 << 1)
+#define PIPE_WAKE_WRITE   (1 << 2)
+
+/* A chunk of guest memory, mapped in the emulator's address space */
+typedef struct GoldfishPipeBuffer {
+    uint8_t*  data;
+    uint32_t  size;
+} GoldfishPipeBuffer;
+
+typedef struct GoldfishPipeFuncs {
+    /* Creates a new service pipe for 'hwpipe'. 'svcOpaque' is the value
+     * given to goldfish_pipe_add_type(), and 'args' is the text after the
+     * pipe name, or NULL. Returns NULL to refuse the connection. */
+    void*     (*init)( void* hwpipe, void* svcOpaque, const char* args );
+
+    /* Called when the guest closes the pipe. This is also called after
+     * goldfish_pipe_close(), to let the service free its state. */
+    void      (*close)( void* pipe );
+
+    /* Sends guest data to the service. Returns the number of bytes
+     * consumed, or one of the PIPE_ERROR_XXX codes.
+     *
+     * For both transfer callbacks, 'buffers' is the device's own list of
+     * guest mappings, which it unmaps after the call: write to the memory
+     * they point to, but don't modify the array itself. */
+    int       (*sendBuffers)( void* pipe, const GoldfishPipeBuffer* buffers, int numBuffers );
+
+    /* Fills guest buffers with service data. Returns the number of bytes
+     * written, or one of the PIPE_ERROR_XXX codes. PIPE_ERROR_AGAIN means
+     * no data is available yet. */
+    int       (*recvBuffers)( void* pipe, GoldfishPipeBuffer* buffers, int numBuffers );
+
+    /* Returns a combination of PIPE_POLL_XXX flags */
+    unsigned  (*poll)( void* pipe );
+
+    /* Asks the service to call goldfish_pipe_wake() when the guest can
+     * read or write again. 'flags' is a combination of PIPE_WAKE_READ
+     * and PIPE_WAKE_WRITE. */
+    void      (*wakeOn)( void* pipe, int flags );
+} GoldfishPipeFuncs;
+
+/* Registers a new pipe type named 'pipeName' */
+extern void  goldfish_pipe_add_type( const char*               pipeName,
+                                     void*                     pipeOpaque,
+                                     const GoldfishPipeFuncs*  pipeFuncs );
+
+/* Signals to the guest that the pipe can be read or written, or was
+ * closed. 'flags' is a combination of PIPE_WAKE_XXX flags. */
+extern void  goldfish_pipe_wake( void* hwpipe, unsigned flags );
+
+/* Closes the pipe from the service side. The guest sees an I/O error on
+ * its next transfer. */
+extern void  goldfish_pipe_close( void* hwpipe );
+
+#endif /* _HW_GOLDFISH_PIPE_H */
@@ -0,0 +1,451 @@
+#include "iolooper.h"
+#include "qemu-common.h"
+
+/* An implementation of iolooper.h based on Linux epoll.
+ *
+ * Unlike the select() implementation, descriptors stay registered with the
+ * kernel between waits: adding or removing a descriptor is a single
+ * epoll_ctl() call, and waiting only returns the descriptors that are ready,
+ * so the cost of a wait doesn't depend on the number of watched descriptors.
+ * The kernel interest list is level-triggered, matching select() semantics.
+ */
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+/* Internal flag for descriptors that epoll refuses to watch (regular files
+ * and the like). select() reports them as always ready, and so do we. */
+#define IOLOOPER_ALWAYS  (1<<7)
+
+#define IOLOOPER_MASK  (IOLOOPER_READ|IOLOOPER_WRITE|IOLOOPER_EXCEPT)
+
+struct IoLooper {
+    int                  epoll_fd;    /* -1 if select() is used instead */
+    uint8_t*             wanted;      /* IOLOOPER_XXX flags per descriptor */
+    uint8_t*             ready;       /* flags reported by the last wait */
+    int                  max_fds;     /* size of 'wanted' and 'ready' */
+    int                  num_wanted;  /* descriptors with non-zero flags */
+    int*                 ready_fds;   /* descriptors with non-zero 'ready' */
+    int                  num_ready;
+    int                  num_always;  /* descriptors with IOLOOPER_ALWAYS */
+    struct epoll_event*  events;
+    int                  max_events;
+};
+
+IoLooper*
+iolooper_new(void)
+{
+    IoLooper*  iol = calloc(1, sizeof(*iol));
+
+    /* If the kernel can't give us an epoll instance (out of descriptors,
+     * or an old kernel without epoll), the descriptors are only tracked in
+     * 'wanted', and waits fall back to select() */
+    iol->epoll_fd = epoll_create(64);
+    if (iol->epoll_fd >= 0) {
+        fcntl(iol->epoll_fd, F_SETFD, FD_CLOEXEC);
+    }
+    iol->max_events = 64;
+    iol->events = malloc(iol->max_events * sizeof(iol->events[0]));
+    return iol;
+}
+
+void
+iolooper_free( IoLooper*  iol )
+{
+    if (iol->epoll_fd >= 0) {
+        close(iol->epoll_fd);
+    }
+    free(iol->wanted);
+    free(iol->ready);
+    free(iol->ready_fds);
+    free(iol->events);
+    free(iol);
+}
+
+/* Makes sure that the per-descriptor arrays can hold 'fd' */
+static void
+iolooper_grow( IoLooper*  iol, int  fd )
+{
+    int  old_max = iol->max_fds;
+    int  new_max = old_max ? old_max : 64;
+
+    if (fd < old_max)
+        return;
+
+    while (new_max <= fd)
+        new_max *= 2;
+
+    iol->wanted    = realloc(iol->wanted, new_max);
+    iol->ready     = realloc(iol->ready, new_max);
+    iol->ready_fds = realloc(iol->ready_fds, new_max * sizeof(int));
+    memset(iol->wanted + old_max, 0, new_max - old_max);
+    memset(iol->ready + old_max, 0, new_max - old_max);
+    iol->max_fds = new_max;
+}
+
+static uint32_t
+iolooper_epoll_events( int  flags )
+{
+    uint32_t  events = 0;
+
+    if (flags & IOLOOPER_READ)
+        events |= EPOLLIN;
+    if (flags & IOLOOPER_WRITE)
+        events |= EPOLLOUT;
+    if (flags & IOLOOPER_EXCEPT)
+        events |= EPOLLPRI;
+    return events;
+}
+
+/* Updates the set of events watched for a descriptor */
+static void
+iolooper_set_flags( IoLooper*  iol, int  fd, int  flags )
+{
+    struct epoll_event  ev;
+    int                 old;
+
+    if (fd < 0)
+        return;
+
+    iolooper_grow(iol, fd);
+    old = iol->wanted[fd];
+    if ((old & IOLOOPER_MASK) == flags)
+        return;
+
+    if (old == 0)
+        iol->num_wanted++;
+    else if (flags == 0)
+        iol->num_wanted--;
+
+    if (iol->epoll_fd < 0) {
+        iol->wanted[fd] = flags;
+        return;
+    }
+
+    if (old & IOLOOPER_ALWAYS) {
+        if (flags == 0) {
+            iol->num_always--;
+            iol->wanted[fd] = 0;
+        } else {
+            iol->wanted[fd] = flags | IOLOOPER_ALWAYS;
+        }
+        return;
+    }
+    iol->wanted[fd] = flags;
+
+    if (flags == 0) {
+        /* This fails harmlessly if the descriptor has been closed already */
+        epoll_ctl(iol->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = iolooper_epoll_events(flags);
+    ev.data.fd = fd;
+    if (epoll_ctl(iol->epoll_fd, old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  fd, &ev) == 0)
+        return;
+
+    if (errno == EEXIST) {
+        /* still registered from a previous life of the descriptor */
+        epoll_ctl(iol->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    } else if (errno == ENOENT) {
+        /* closed and reopened since it was registered */
+        epoll_ctl(iol->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    } else if (errno == EPERM) {
+        iol->wanted[fd] |= IOLOOPER_ALWAYS;
+        iol->num_always++;
+    }
+}
+
+void
+iolooper_reset( IoLooper*  iol )
+{
+    int  fd;
+
+    for (fd = 0; fd < iol->max_fds && iol->num_wanted > 0; fd++) {
+        if (iol->wanted[fd])
+            iolooper_set_flags(iol, fd, 0);
+    }
+    iol->num_ready = 0;
+    if (iol->ready)
+        memset(iol->ready, 0, iol->max_fds);
+}
+
+void
+iolooper_modify( IoLooper* iol, int fd, int oldflags, int newflags )
+{
+    int  changed = (oldflags ^ newflags) & IOLOOPER_MASK;
+    int  flags;
+
+    if (fd < 0 || !changed)
+        return;
+
+    iolooper_grow(iol, fd);
+    flags = iol->wanted[fd] & IOLOOPER_MASK;
+    flags = (flags & ~changed) | (newflags & changed);
+    iolooper_set_flags(iol, fd, flags);
+}
+
+static void
+iolooper_add( IoLooper*  iol, int  fd, int  flag )
+{
+    if (fd >= 0) {
+        iolooper_grow(iol, fd);
+        iolooper_set_flags(iol, fd, (iol->wanted[fd] & IOLOOPER_MASK) | flag);
+    }
+}
+
+static void
+iolooper_del( IoLooper*  iol, int  fd, int  flag )
+{
+    if (fd >= 0 && fd < iol->max_fds) {
+        iolooper_set_flags(iol, fd, iol->wanted[fd] & IOLOOPER_MASK & ~flag);
+    }
+}
+
+void
+iolooper_add_read( IoLooper*  iol, int  fd )
+{
+    iolooper_add(iol, fd, IOLOOPER_READ);
+}
+
+void
+iolooper_add_write( IoLooper*  iol, int  fd )
+{
+    iolooper_add(iol, fd, IOLOOPER_WRITE);
+}
+
+void
+iolooper_add_except( IoLooper*  iol, int  fd )
+{
+    iolooper_add(iol, fd, IOLOOPER_EXCEPT);
+}
+
+void
+iolooper_del_read( IoLooper*  iol, int  fd )
+{
+    iolooper_del(iol, fd, IOLOOPER_READ);
+}
+
+void
+iolooper_del_write( IoLooper*  iol, int  fd )
+{
+    iolooper_del(iol, fd, IOLOOPER_WRITE);
+}
+
+void
+iolooper_del_except( IoLooper*  iol, int  fd )
+{
+    iolooper_del(iol, fd, IOLOOPER_EXCEPT);
+}
+
+static void
+iolooper_set_ready( IoLooper*  iol, int  fd, int  flags )
+{
+    if (flags == 0)
+        return;
+
+    if (iol->ready[fd] == 0)
+        iol->ready_fds[iol->num_ready++] = fd;
+    iol->ready[fd] |= flags;
+}
+
+/* Same as iolooper_epoll_wait() below, for when there is no epoll instance.
+ * Only the descriptors below FD_SETSIZE can be watched. */
+static int
+iolooper_select_wait( IoLooper*  iol, int  timeout )
+{
+    fd_set           fds[3];
+    struct timeval   tv, *ptv = NULL;
+    int              n, fd, max_fd = -1;
+
+    FD_ZERO(&fds[0]);
+    FD_ZERO(&fds[1]);
+    FD_ZERO(&fds[2]);
+    for (fd = 0; fd < iol->max_fds && fd < FD_SETSIZE; fd++) {
+        int  flags = iol->wanted[fd];
+
+        if (flags == 0)
+            continue;
+        if (flags & IOLOOPER_READ)
+            FD_SET(fd, &fds[0]);
+        if (flags & IOLOOPER_WRITE)
+            FD_SET(fd, &fds[1]);
+        if (flags & IOLOOPER_EXCEPT)
+            FD_SET(fd, &fds[2]);
+        max_fd = fd;
+    }
+
+    if (timeout >= 0) {
+        tv.tv_sec  = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ptv = &tv;
+    }
+
+    do {
+        n = select(max_fd + 1, &fds[0], &fds[1], &fds[2], ptv);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+        return n;
+
+    for (fd = 0; fd <= max_fd; fd++) {
+        int  flags = 0;
+
+        if (FD_ISSET(fd, &fds[0]))
+            flags |= IOLOOPER_READ;
+        if (FD_ISSET(fd, &fds[1]))
+            flags |= IOLOOPER_WRITE;
+        if (FD_ISSET(fd, &fds[2]))
+            flags |= IOLOOPER_EXCEPT;
+        iolooper_set_ready(iol, fd, flags);
+    }
+    return iol->num_ready;
+}
+
+/* Waits for events for up to 'timeout' milliseconds (-1 for infinite),
+ * and records them into the ready list. */
+static int
+iolooper_epoll_wait( IoLooper*  iol, int  timeout )
+{
+    int  n, nn, fd;
+
+    /* Forget the results of the previous wait */
+    for (nn = 0; nn < iol->num_ready; nn++)
+        iol->ready[iol->ready_fds[nn]] = 0;
+    iol->num_ready = 0;
+
+    if (iol->num_wanted == 0)
+        return 0;
+
+    if (iol->epoll_fd < 0)
+        return iolooper_select_wait(iol, timeout);
+
+    if (iol->num_always > 0)
+        timeout = 0;
+
+    do {
+        n = epoll_wait(iol->epoll_fd, iol->events, iol->max_events, timeout);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        return -1;
+
+    for (nn = 0; nn < n; nn++) {
+        uint32_t  events = iol->events[nn].events;
+        int       flags  = 0;
+
+        fd = iol->events[nn].data.fd;
+        if (fd >= iol->max_fds)
+            continue;
+
+        /* Report errors and hang-ups the way select() does */
+        if (events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+            flags |= IOLOOPER_READ;
+        if (events & (EPOLLOUT|EPOLLERR))
+            flags |= IOLOOPER_WRITE;
+        if (events & EPOLLPRI)
+            flags |= IOLOOPER_EXCEPT;
+
+        iolooper_set_ready(iol, fd, flags & iol->wanted[fd]);
+    }
+
+    /* If all event slots were used, there may be more: grow for next time */
+    if (n == iol->max_events) {
+        iol->max_events *= 2;
+        iol->events = realloc(iol->events,
+                                   iol->max_events * sizeof(iol->events[0]));
+    }
+
+    if (iol->num_always > 0) {
+        for (fd = 0; fd < iol->max_fds; fd++) {
+            if (iol->wanted[fd] & IOLOOPER_ALWAYS)
+                iolooper_set_ready(iol, fd, iol->wanted[fd] &
+                                            (IOLOOPER_READ|IOLOOPER_WRITE));
+        }
+    }
+
+    return iol->num_ready;
+}
+
+int
+iolooper_poll( IoLooper*  iol )
+{
+    return iolooper_epoll_wait(iol, 0);
+}
+
+int
+iolooper_wait( IoLooper*  iol, int64_t  duration )
+{
+    int  ret;
+
+    if (duration > INT_MAX)
+        duration = INT_MAX;
+    else if (duration < 0)
+        duration = -1;
+
+    ret = iolooper_epoll_wait(iol, (int)duration);
+    if (ret == 0) {
+        // Indicates timeout
+        errno = ETIMEDOUT;
+    }
+    return ret;
+}
+
+int
+iolooper_is_read( IoLooper*  iol, int  fd )
+{
+    return fd >= 0 && fd < iol->max_fds && (iol->ready[fd] & IOLOOPER_READ);
+}
+
+int
+iolooper_is_write( IoLooper*  iol, int  fd )
+{
+    return fd >= 0 && fd < iol->max_fds && (iol->ready[fd] & IOLOOPER_WRITE);
+}
+
+int
+iolooper_is_except( IoLooper*  iol, int  fd )
+{
+    return fd >= 0 && fd < iol->max_fds && (iol->ready[fd] & IOLOOPER_EXCEPT);
+}
+
+int
+iolooper_ready_count( IoLooper*  iol )
+{
+    return iol->num_ready;
+}
+
+int
+iolooper_ready_fd( IoLooper*  iol, int  index )
+{
+    return iol->ready_fds[index];
+}
+
+int
+iolooper_has_operations( IoLooper* iol )
+{
+    return iol->num_wanted > 0;
+}
+
+int64_t
+iolooper_now(void)
+{
+    struct timeval time_now;
+    return gettimeofday(&time_now, NULL) ? -1 : (int64_t)time_now.tv_sec * 1000LL +
+                                                time_now.tv_usec / 1000;
+}
+
+int
+iolooper_wait_absolute(IoLooper* iol, int64_t deadline)
+{
+    int64_t timeout = deadline - iolooper_now();
+
+    /* If the deadline has passed, set the timeout to 0, this allows us
+     * to poll the file descriptor nonetheless */
+    if (timeout < 0)
+        timeout = 0;
+
+    return iolooper_wait(iol, timeout);
+}
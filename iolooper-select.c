@@ -13,10 +13,14 @@
 struct IoLooper {
     fd_set   reads[1];
     fd_set   writes[1];
+    fd_set   excepts[1];
     fd_set   reads_result[1];
     fd_set   writes_result[1];
+    fd_set   excepts_result[1];
     int      max_fd;
     int      max_fd_valid;
+    int      ready_fds[FD_SETSIZE];
+    int      num_ready;
 };
 
 IoLooper*
@@ -38,8 +42,13 @@ iolooper_reset( IoLooper*  iol )
 {
     FD_ZERO(iol->reads);
     FD_ZERO(iol->writes);
+    FD_ZERO(iol->excepts);
+    FD_ZERO(iol->reads_result);
+    FD_ZERO(iol->writes_result);
+    FD_ZERO(iol->excepts_result);
     iol->max_fd = -1;
     iol->max_fd_valid = 1;
+    iol->num_ready = 0;
 }
 
 static void
@@ -77,6 +86,12 @@ iolooper_modify( IoLooper* iol, int fd, int oldflags, int newflags )
         else
             iolooper_del_write(iol, fd);
     }
+    if ((changed & IOLOOPER_EXCEPT) != 0) {
+        if ((newflags & IOLOOPER_EXCEPT) != 0)
+            iolooper_add_except(iol, fd);
+        else
+            iolooper_del_except(iol, fd);
+    }
 }
 
 
@@ -91,7 +106,8 @@ iolooper_fd_count( IoLooper*  iol )
 
     /* recompute max fd */
     for (fd = 0; fd < FD_SETSIZE; fd++) {
-        if (!FD_ISSET(fd, iol->reads) && !FD_ISSET(fd, iol->writes))
+        if (!FD_ISSET(fd, iol->reads) && !FD_ISSET(fd, iol->writes) &&
+            !FD_ISSET(fd, iol->excepts))
             continue;
 
         max_fd = fd;
@@ -120,6 +136,15 @@ iolooper_add_write( IoLooper*  iol, int  fd )
     }
 }
 
+void
+iolooper_add_except( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0) {
+        iolooper_add_fd(iol, fd);
+        FD_SET(fd, iol->excepts);
+    }
+}
+
 void
 iolooper_del_read( IoLooper*  iol, int  fd )
 {
@@ -138,29 +163,55 @@ iolooper_del_write( IoLooper*  iol, int  fd )
     }
 }
 
+void
+iolooper_del_except( IoLooper*  iol, int  fd )
+{
+    if (fd >= 0) {
+        iolooper_del_fd(iol, fd);
+        FD_CLR(fd, iol->excepts);
+    }
+}
+
+/* Collects the descriptors that had an event into the ready list */
+static void
+iolooper_collect_ready( IoLooper*  iol, int  count, int  ret )
+{
+    int  fd;
+
+    iol->num_ready = 0;
+    for (fd = 0; fd < count && ret > 0 && iol->num_ready < FD_SETSIZE; fd++) {
+        if (FD_ISSET(fd, iol->reads_result) ||
+            FD_ISSET(fd, iol->writes_result) ||
+            FD_ISSET(fd, iol->excepts_result)) {
+            iol->ready_fds[iol->num_ready++] = fd;
+        }
+    }
+}
+
 int
 iolooper_poll( IoLooper*  iol )
 {
     int     count = iolooper_fd_count(iol);
     int     ret;
-    fd_set  errs;
 
+    iol->num_ready = 0;
     if (count == 0)
         return 0;
 
-    FD_ZERO(&errs);
-
     do {
         struct timeval  tv;
 
         tv.tv_sec = tv.tv_usec = 0;
 
-        iol->reads_result[0]  = iol->reads[0];
-        iol->writes_result[0] = iol->writes[0];
+        iol->reads_result[0]   = iol->reads[0];
+        iol->writes_result[0]  = iol->writes[0];
+        iol->excepts_result[0] = iol->excepts[0];
 
-        ret = select( count, iol->reads_result, iol->writes_result, &errs, &tv);
+        ret = select( count, iol->reads_result, iol->writes_result,
+                      iol->excepts_result, &tv);
     } while (ret < 0 && errno == EINTR);
 
+    iolooper_collect_ready(iol, count, ret);
     return ret;
 }
 
@@ -169,9 +220,9 @@ iolooper_wait( IoLooper*  iol, int64_t  duration )
 {
     int     count = iolooper_fd_count(iol);
     int     ret;
-    fd_set  errs;
     struct timeval tm0, *tm = NULL;
 
+    iol->num_ready = 0;
     if (count == 0)
         return 0;
 
@@ -183,19 +234,20 @@ iolooper_wait( IoLooper*  iol, int64_t  duration )
         tm->tv_usec = (duration - 1000*tm->tv_sec) * 1000;
     }
 
-    FD_ZERO(&errs);
-
     do {
-        iol->reads_result[0]  = iol->reads[0];
-        iol->writes_result[0] = iol->writes[0];
+        iol->reads_result[0]   = iol->reads[0];
+        iol->writes_result[0]  = iol->writes[0];
+        iol->excepts_result[0] = iol->excepts[0];
 
-        ret = select( count, iol->reads_result, iol->writes_result, &errs, tm);
+        ret = select( count, iol->reads_result, iol->writes_result,
+                      iol->excepts_result, tm);
         if (ret == 0) {
             // Indicates timeout
             errno = ETIMEDOUT;
         }
     } while (ret < 0 && errno == EINTR);
 
+    iolooper_collect_ready(iol, count, ret);
     return ret;
 }
 
@@ -212,6 +264,24 @@ iolooper_is_write( IoLooper*  iol, int  fd )
     return FD_ISSET(fd, iol->writes_result);
 }
 
+int
+iolooper_is_except( IoLooper*  iol, int  fd )
+{
+    return FD_ISSET(fd, iol->excepts_result);
+}
+
+int
+iolooper_ready_count( IoLooper*  iol )
+{
+    return iol->num_ready;
+}
+
+int
+iolooper_ready_fd( IoLooper*  iol, int  index )
+{
+    return iol->ready_fds[index];
+}
+
 int
 iolooper_has_operations( IoLooper* iol )
 {
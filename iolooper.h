@@ -3,7 +3,9 @@
 
 #include <stdint.h>
 
-/* An IOLooper is an abstraction for select() */
+/* An IOLooper is an abstraction for select(). On Linux it is implemented
+ * with epoll (see iolooper-epoll.c), where descriptors stay registered with
+ * the kernel between waits. */
 
 typedef struct IoLooper  IoLooper;
 
@@ -16,9 +18,14 @@ void       iolooper_add_write( IoLooper*  iol, int  fd );
 void       iolooper_del_read( IoLooper*  iol, int  fd );
 void       iolooper_del_write( IoLooper*  iol, int  fd );
 
+/* Exceptional conditions, i.e. out-of-band data on sockets */
+void       iolooper_add_except( IoLooper*  iol, int  fd );
+void       iolooper_del_except( IoLooper*  iol, int  fd );
+
 enum {
     IOLOOPER_READ = (1<<0),
     IOLOOPER_WRITE = (1<<1),
+    IOLOOPER_EXCEPT = (1<<2),
 };
 void       iolooper_modify( IoLooper*  iol, int fd, int oldflags, int newflags);
 
@@ -32,6 +39,13 @@ int        iolooper_wait( IoLooper*  iol, int64_t  duration );
 
 int        iolooper_is_read( IoLooper*  iol, int  fd );
 int        iolooper_is_write( IoLooper*  iol, int  fd );
+int        iolooper_is_except( IoLooper*  iol, int  fd );
+
+/* Number of descriptors that had an event in the last poll/wait, and the
+ * descriptors themselves. This lets callers look at the ready descriptors
+ * only, rather than check every descriptor they watch. */
+int        iolooper_ready_count( IoLooper*  iol );
+int        iolooper_ready_fd( IoLooper*  iol, int  index );
 /* Returns 1 if this IoLooper has one or more file descriptor to interact with */
 int        iolooper_has_operations( IoLooper*  iol );
 /* Gets current time in milliseconds.
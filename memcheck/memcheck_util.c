@@ -190,6 +190,8 @@ invalidate_tlb_cache(target_ulong start, target_ulong end)
 {
     target_ulong index = (start >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     const target_ulong to = ((end - 1) >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE-1);
+    const target_ulong first_page = start & TARGET_PAGE_MASK;
+    const target_ulong last_page = (end - 1) & TARGET_PAGE_MASK;
     for (; index <= to; index++, start += TARGET_PAGE_SIZE) {
         target_ulong tlb_addr = cpu_single_env->tlb_table[1][index].addr_write;
         if ((start & TARGET_PAGE_MASK) ==
@@ -202,6 +204,18 @@ invalidate_tlb_cache(target_ulong start, target_ulong end)
             cpu_single_env->tlb_table[1][index].addr_read ^= TARGET_PAGE_MASK;
         }
     }
+    // Pages of the range may also be cached in the victim TLB.
+    for (index = 0; index < CPU_VTLB_SIZE; index++) {
+        CPUTLBEntry* vte = &cpu_single_env->tlb_v_table[1][index];
+        target_ulong page = vte->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK);
+        if (page >= first_page && page <= last_page) {
+            vte->addr_write ^= TARGET_PAGE_MASK;
+        }
+        page = vte->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK);
+        if (page >= first_page && page <= last_page) {
+            vte->addr_read ^= TARGET_PAGE_MASK;
+        }
+    }
 }
 
 void
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Measures the sequential throughput of the two I/O patterns used by
+# hw/goldfish_mmc.c, through the real block layer, with qemu-io:
+#
+#  - per-sector: one synchronous 512-byte bdrv_read/bdrv_write per sector,
+#    which is what the device did before it used dma_bdrv_read/write.
+#
+#  - multi-sector: one asynchronous request for the whole transfer, waited
+#    for before the next one, like the guest driver waits for END_OF_CMD.
+#
+# usage: mmc-bench.sh [-q qemu-io] [-s size] [-t transfer] [-n] [image]
+#
+#   -q  path to qemu-io (default: objs/qemu-io)
+#   -s  amount of data to read and write, in MB (default: 64)
+#   -t  transfer size of the multi-sector pattern, in KB (default: 64)
+#   -n  open the image with -n (O_DIRECT), to take the host page cache out
+#
+# A raw image is created in a temporary directory if none is given, any
+# format supported by the block layer can be used otherwise. The image is
+# overwritten.
+
+QEMU_IO=objs/qemu-io
+SIZE_MB=64
+XFER_KB=64
+NOCACHE=
+IMAGE=
+
+while getopts "q:s:t:n" OPT; do
+    case $OPT in
+        q) QEMU_IO=$OPTARG ;;
+        s) SIZE_MB=$OPTARG ;;
+        t) XFER_KB=$OPTARG ;;
+        n) NOCACHE=-n ;;
+        *) sed -n 's/^# usage: /usage: /p' $0; exit 1 ;;
+    esac
+done
+shift $(($OPTIND - 1))
+IMAGE=$1
+
+if [ ! -x "$QEMU_IO" ]; then
+    echo "$QEMU_IO not found, build the emulator first or use -q" >&2
+    exit 1
+fi
+
+TMPDIR=$(mktemp -d /tmp/mmc-bench.XXXXXX) || exit 1
+trap 'rm -rf $TMPDIR' EXIT
+
+if [ -z "$IMAGE" ]; then
+    IMAGE=$TMPDIR/sdcard.img
+    dd if=/dev/zero of=$IMAGE bs=1048576 count=$SIZE_MB 2>/dev/null
+fi
+
+SECTORS=$(($SIZE_MB * 2048))
+XFERS=$(($SIZE_MB * 1024 / $XFER_KB))
+
+# writes the qemu-io commands of one pattern to stdout
+# $1: read or write, $2: per-sector or multi-sector
+gen_commands ()
+{
+    if [ "$2" = per-sector ]; then
+        awk -v n=$SECTORS -v op=$1 \
+            'BEGIN { for (i = 0; i < n; i++) print op, "-q", i * 512, 512 }'
+    else
+        awk -v n=$XFERS -v op=aio_$1 -v len=$(($XFER_KB * 1024)) \
+            'BEGIN { for (i = 0; i < n; i++) { print op, "-q", i * len, len; print "aio_flush" } }'
+    fi
+}
+
+# prints the throughput of one pattern in MB/s
+# $1: read or write, $2: per-sector or multi-sector
+run ()
+{
+    gen_commands $1 $2 > $TMPDIR/commands
+    START=$(date +%s%N)
+    $QEMU_IO $NOCACHE $IMAGE < $TMPDIR/commands > /dev/null || exit 1
+    END=$(date +%s%N)
+    awk -v mb=$SIZE_MB -v ns=$(($END - $START)) -v op=$1 -v p=$2 \
+        'BEGIN { printf "%-6s %-13s %8.1f MB/s\n", op, p, mb * 1e9 / ns }'
+}
+
+echo "$SIZE_MB MB, $XFER_KB KB transfers ${NOCACHE:+(O_DIRECT)}"
+for OP in write read; do
+    run $OP per-sector
+    run $OP multi-sector
+done
@@ -29,6 +29,7 @@
 #include "hw/pc.h"
 #include "hw/pci.h"
 #include "hw/watchdog.h"
+#include "hw/goldfish_device.h"
 #include "gdbstub.h"
 #include "net.h"
 #include "qemu-char.h"
@@ -1709,6 +1710,8 @@ static const mon_cmd_t info_cmds[] = {
       "", "show balloon information" },
     { "qtree", "", do_info_qtree,
       "", "show device tree" },
+    { "events", "", events_dev_info,
+      "", "show the input event queue" },
     MON_CMD_T_INITIALIZER
 };
 
@@ -0,0 +1,151 @@
+#!/bin/sh
+#
+# Checks that savevm/loadvm restore the contents of a NAND image that has
+# no base image (file= without initfile=), which hw/goldfish_nand.c saves
+# as a delta from erased flash:
+#
+#  - save, load, save smaller, load larger: the blocks of the larger
+#    snapshot that were not stored because they were erased must read as
+#    erased flash (0xff) once the image grows back, not as zeros.
+#
+#  - holes: a block that is a hole in the image reads as zeros, so it must
+#    be stored and restored like any other data.
+#
+# The guest is an idle loop. The image is changed from the host between
+# monitor commands; the emulator reads it directly, but doesn't see these
+# changes as writes, so a snapshot is saved after each of them before the
+# one under test is loaded. A scratch disk opened with -snapshot holds the
+# snapshots.
+#
+# usage: nand-snapshot-test.sh [-q emulator]
+#
+#   -q  path to the emulator (default: objs/qemu-android)
+
+EMULATOR=objs/qemu-android
+
+while getopts "q:" OPT; do
+    case $OPT in
+        q) EMULATOR=$OPTARG ;;
+        *) sed -n 's/^# usage: /usage: /p' $0; exit 1 ;;
+    esac
+done
+
+if [ ! -x "$EMULATOR" ]; then
+    echo "$EMULATOR not found, build the emulator first or use -q" >&2
+    exit 1
+fi
+
+TMPDIR=$(mktemp -d /tmp/nand-snapshot-test.XXXXXX) || exit 1
+trap 'exec 3>&-; rm -rf $TMPDIR' EXIT
+
+# 4 KB erase blocks, 16 of them
+BLOCK=4096
+NAND_OPTS=userdata,size=65536,pagesize=512,extrasize=0,erasepages=8
+IMAGE=$TMPDIR/nand.img
+FAILED=0
+
+# an ARM 'b .'
+printf '\376\377\377\352' > $TMPDIR/kernel.bin
+dd if=/dev/zero of=$TMPDIR/disk.img bs=65536 count=16 2>/dev/null
+
+# writes one erase block of byte $2 (octal) at block $1 of the image
+fill_block ()
+{
+    tr '\000' "\\$2" < /dev/zero | dd of=$IMAGE bs=$BLOCK seek=$1 count=1 \
+        conv=notrunc iflag=fullblock 2>/dev/null
+}
+
+# appends one erase block of byte $1 (octal) to the file $2
+expect_block ()
+{
+    tr '\000' "\\$1" < /dev/zero | dd bs=$BLOCK count=1 iflag=fullblock \
+        2>/dev/null >> $2
+}
+
+start_emulator ()
+{
+    rm -f $TMPDIR/monitor $TMPDIR/output
+    mkfifo $TMPDIR/monitor
+    $EMULATOR -kernel $TMPDIR/kernel.bin -nographic -serial null \
+        -monitor stdio -hda $TMPDIR/disk.img -snapshot \
+        -nand $NAND_OPTS,file=$IMAGE \
+        < $TMPDIR/monitor > $TMPDIR/output 2>&1 &
+    exec 3> $TMPDIR/monitor
+    PROMPTS=1
+    wait_prompt
+}
+
+# waits until the monitor printed $PROMPTS prompts
+wait_prompt ()
+{
+    TRIES=0
+    while [ $(grep -o '(qemu)' $TMPDIR/output | wc -l) -lt $PROMPTS ]; do
+        TRIES=$(($TRIES + 1))
+        if [ $TRIES -gt 300 ]; then
+            echo "the emulator doesn't respond:" >&2
+            cat $TMPDIR/output >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+# runs a monitor command and waits for it to complete
+monitor ()
+{
+    echo "$*" >&3
+    PROMPTS=$(($PROMPTS + 1))
+    wait_prompt
+}
+
+stop_emulator ()
+{
+    echo quit >&3
+    exec 3>&-
+    wait
+}
+
+# $1: test name, $2: expected image
+check_image ()
+{
+    if cmp -s $IMAGE $2; then
+        echo "$1: ok"
+    else
+        echo "$1: FAILED"
+        FAILED=1
+    fi
+}
+
+# Blocks 0-1 hold data and 2-3 are erased, so only 0-1 are stored.
+rm -f $IMAGE $TMPDIR/large
+fill_block 0 125
+fill_block 1 125
+fill_block 2 377
+fill_block 3 377
+cp $IMAGE $TMPDIR/large
+start_emulator
+monitor savevm large
+monitor loadvm large
+check_image "save/load" $TMPDIR/large
+truncate -s $BLOCK $IMAGE
+monitor savevm small
+monitor loadvm large
+check_image "save smaller/load larger" $TMPDIR/large
+stop_emulator
+
+# Block 1 is a hole, it must come back as zeros after the host wrote it.
+rm -f $IMAGE $TMPDIR/holes
+fill_block 0 125
+fill_block 2 125
+expect_block 125 $TMPDIR/holes
+expect_block 000 $TMPDIR/holes
+expect_block 125 $TMPDIR/holes
+start_emulator
+monitor savevm holes
+fill_block 1 252
+monitor savevm written
+monitor loadvm holes
+check_image "holes" $TMPDIR/holes
+stop_emulator
+
+exit $FAILED
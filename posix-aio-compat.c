@@ -562,6 +562,14 @@ static AIOPool raw_aio_pool = {
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    return paio_submit_bytes(bs, fd, sector_num * 512, qiov,
+                             (size_t)nb_sectors * 512, cb, opaque, type);
+}
+
+BlockDriverAIOCB *paio_submit_bytes(BlockDriverState *bs, int fd,
+        int64_t offset, QEMUIOVector *qiov, size_t nbytes,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
     struct qemu_paiocb *acb;
 
@@ -577,8 +585,8 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         acb->aio_iov = qiov->iov;
         acb->aio_niov = qiov->niov;
     }
-    acb->aio_nbytes = nb_sectors * 512;
-    acb->aio_offset = sector_num * 512;
+    acb->aio_nbytes = nbytes;
+    acb->aio_offset = offset;
 
     acb->next = posix_aio_state->first_aio;
     posix_aio_state->first_aio = acb;
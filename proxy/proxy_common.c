@@ -370,6 +370,69 @@ proxy_manager_del( void*  ev_opaque )
     }
 }
 
+/** Descriptors registered with the IoLooper
+ **/
+
+typedef struct {
+    int       fd;
+    unsigned  flags;
+} ProxyWatch;
+
+typedef struct {
+    ProxyWatch*  watches;
+    int          count;
+    int          max;
+} ProxyWatchList;
+
+/* s_registered holds what is currently registered with s_looper, and
+ * s_wanted what the connections asked for during the last fill */
+static ProxyWatchList   s_watch_lists[2];
+static ProxyWatchList*  s_registered = &s_watch_lists[0];
+static ProxyWatchList*  s_wanted     = &s_watch_lists[1];
+static IoLooper*        s_looper;
+
+static ProxyWatch*
+proxy_watch_find( ProxyWatchList*  list, int  fd )
+{
+    int  nn;
+
+    for (nn = 0; nn < list->count; nn++) {
+        if (list->watches[nn].fd == fd)
+            return &list->watches[nn];
+    }
+    return NULL;
+}
+
+static void
+proxy_watch_set( ProxyWatchList*  list, int  fd, unsigned  flags )
+{
+    ProxyWatch*  w = proxy_watch_find(list, fd);
+
+    if (w == NULL) {
+        if (list->count == list->max) {
+            list->max += 8;
+            AARRAY_RENEW(list->watches, list->max);
+        }
+        w = &list->watches[list->count++];
+        w->fd = fd;
+    }
+    w->flags = flags;
+}
+
+static int
+proxy_watch_looper_flags( unsigned  flags )
+{
+    int  result = 0;
+
+    if (flags & PROXY_SELECT_READ)
+        result |= IOLOOPER_READ;
+    if (flags & PROXY_SELECT_WRITE)
+        result |= IOLOOPER_WRITE;
+    if (flags & PROXY_SELECT_ERROR)
+        result |= IOLOOPER_EXCEPT;
+    return result;
+}
+
 void
 proxy_select_set( ProxySelect*  sel,
                   int           fd,
@@ -378,6 +441,11 @@ proxy_select_set( ProxySelect*  sel,
     if (fd < 0 || !flags)
         return;
 
+    if (sel->looper) {
+        proxy_watch_set(s_wanted, fd, flags);
+        return;
+    }
+
     if (*sel->pcount < fd+1)
         *sel->pcount = fd+1;
 
@@ -403,7 +471,14 @@ proxy_select_poll( ProxySelect*  sel, int  fd )
 {
     unsigned  flags = 0;
 
-    if (fd >= 0) {
+    if (fd >= 0 && sel->looper) {
+        if ( iolooper_is_read(sel->looper, fd) )
+            flags |= PROXY_SELECT_READ;
+        if ( iolooper_is_write(sel->looper, fd) )
+            flags |= PROXY_SELECT_WRITE;
+        if ( iolooper_is_except(sel->looper, fd) )
+            flags |= PROXY_SELECT_ERROR;
+    } else if (fd >= 0) {
         if ( FD_ISSET(fd, sel->reads) )
             flags |= PROXY_SELECT_READ;
         if ( FD_ISSET(fd, sel->writes) )
@@ -429,6 +504,7 @@ proxy_manager_select_fill( int  *pcount, fd_set*  read_fds, fd_set*  write_fds,
     sel->reads  = read_fds;
     sel->writes = write_fds;
     sel->errors = err_fds;
+    sel->looper = NULL;
 
     conn = s_connections->next;
     while (conn != s_connections) {
@@ -438,6 +514,88 @@ proxy_manager_select_fill( int  *pcount, fd_set*  read_fds, fd_set*  write_fds,
     }
 }
 
+void
+proxy_manager_looper_fill( IoLooper*  looper )
+{
+    ProxyConnection*  conn;
+    ProxySelect       sel[1];
+    ProxyWatchList*   list;
+    int               nn;
+
+    if (!s_init)
+        proxy_manager_init();
+
+    if (s_connections->next == s_connections && s_registered->count == 0)
+        return;
+
+    sel->pcount = NULL;
+    sel->reads  = NULL;
+    sel->writes = NULL;
+    sel->errors = NULL;
+    sel->looper = looper;
+
+    s_looper = looper;
+    s_wanted->count = 0;
+
+    conn = s_connections->next;
+    while (conn != s_connections) {
+        ProxyConnection*  next = conn->next;
+        conn->conn_select(conn, sel);
+        conn = next;
+    }
+
+    /* only tell the looper about the events that changed */
+    for (nn = 0; nn < s_registered->count; nn++) {
+        ProxyWatch*  reg = &s_registered->watches[nn];
+        ProxyWatch*  want = proxy_watch_find(s_wanted, reg->fd);
+
+        iolooper_modify(looper, reg->fd,
+                        proxy_watch_looper_flags(reg->flags),
+                        proxy_watch_looper_flags(want ? want->flags : 0));
+    }
+    for (nn = 0; nn < s_wanted->count; nn++) {
+        ProxyWatch*  want = &s_wanted->watches[nn];
+
+        if (proxy_watch_find(s_registered, want->fd) == NULL)
+            iolooper_modify(looper, want->fd, 0,
+                            proxy_watch_looper_flags(want->flags));
+    }
+
+    list         = s_registered;
+    s_registered = s_wanted;
+    s_wanted     = list;
+}
+
+void
+proxy_manager_looper_poll( IoLooper*  looper )
+{
+    ProxyConnection*  conn = s_connections->next;
+    ProxySelect       sel[1];
+
+    sel->pcount = NULL;
+    sel->reads  = NULL;
+    sel->writes = NULL;
+    sel->errors = NULL;
+    sel->looper = looper;
+
+    while (conn != s_connections) {
+        ProxyConnection*  next  = conn->next;
+        conn->conn_poll( conn, sel );
+        conn = next;
+    }
+}
+
+void
+proxy_manager_fd_closed( int  fd )
+{
+    ProxyWatch*  w = proxy_watch_find(s_registered, fd);
+
+    if (w != NULL) {
+        iolooper_modify(s_looper, fd, proxy_watch_looper_flags(w->flags), 0);
+        *w = s_registered->watches[--s_registered->count];
+    }
+}
+
 /* this function is called to act on proxified connection sockets when network events arrive */
 void
 proxy_manager_poll( fd_set*  read_fds, fd_set*  write_fds, fd_set*  err_fds )
@@ -449,6 +607,7 @@ proxy_manager_poll( fd_set*  read_fds, fd_set*  write_fds, fd_set*  err_fds )
     sel->reads  = read_fds;
     sel->writes = write_fds;
     sel->errors = err_fds;
+    sel->looper = NULL;
 
     while (conn != s_connections) {
         ProxyConnection*  next  = conn->next;
@@ -13,6 +13,7 @@
 #define _PROXY_COMMON_H_
 
 #include "sockets.h"
+#include "iolooper.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -85,6 +86,16 @@ extern void  proxy_manager_poll( fd_set*  read_fds,
                                  fd_set*  write_fds, 
                                  fd_set*  err_fds );
 
+/* same as proxy_manager_select_fill() and proxy_manager_poll(), but the
+ * sockets stay registered with an IoLooper, which is only updated for the
+ * sockets whose events changed since the previous call */
+extern void  proxy_manager_looper_fill( IoLooper*  looper );
+extern void  proxy_manager_looper_poll( IoLooper*  looper );
+
+/* this function must be called when a descriptor is closed while it may be
+ * registered by proxy_manager_looper_fill() */
+extern void  proxy_manager_fd_closed( int  fd );
+
 /* this function checks that one can connect to a given proxy. It will simply try to connect()
  * to it, for a specified timeout, in milliseconds, then close the connection.
  *
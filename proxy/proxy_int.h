@@ -14,6 +14,7 @@
 
 #include "proxy_common.h"
 #include "sockets.h"
+#include "iolooper.h"
 #include "android/utils/stralloc.h"
 
 extern int  proxy_log;
@@ -33,11 +34,14 @@ enum {
     PROXY_SELECT_ERROR = (1 << 2)
 };
 
+/* When 'looper' is not NULL, the fd_sets are unused: the events come from,
+ * and are registered with, the IoLooper instead */
 typedef struct {
-    int*     pcount;
-    fd_set*  reads;
-    fd_set*  writes;
-    fd_set*  errors;
+    int*       pcount;
+    fd_set*    reads;
+    fd_set*    writes;
+    fd_set*    errors;
+    IoLooper*  looper;
 } ProxySelect;
 
 extern void     proxy_select_set( ProxySelect*  sel,
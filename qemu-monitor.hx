@@ -93,6 +93,8 @@ show migration status
 show balloon information
 @item info qtree
 show device tree
+@item info events
+show the input event queue and the number of events lost
 @end table
 ETEXI
 
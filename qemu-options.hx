@@ -195,6 +195,18 @@ qemu -hda a -hdb b
 @end example
 ETEXI
 
+DEF("qcow2-cache", HAS_ARG, QEMU_OPTION_qcow2_cache, \
+    "-qcow2-cache size\n"
+    "                cache 'size' KB of metadata per qcow2 image [default=16 L2 tables]\n")
+STEXI
+@item -qcow2-cache @var{size}
+Cache up to @var{size} kilobytes of L2 tables and refcount blocks for each
+qcow2 image, instead of 16 L2 tables and 4 refcount blocks. Optionally, a
+suffix of ``K'' or ``M'' can be used to signify a value in kilobytes or
+megabytes respectively. Larger caches help with large images that are
+accessed randomly.
+ETEXI
+
 DEF("mtdblock", HAS_ARG, QEMU_OPTION_mtdblock,
     "-mtdblock file  use 'file' as on-board Flash memory image\n")
 STEXI
@@ -1542,6 +1554,15 @@ DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
 STEXI
 ETEXI
 
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  keep translated code in 'file' across runs\n")
+STEXI
+@item -tb-cache @var{file}
+Save the translated code to @var{file} on exit, and reuse it on the next
+runs for guest code that did not change. The file is ignored if it was
+written by a different emulator binary or configuration.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n")
 STEXI
@@ -1608,6 +1629,14 @@ STEXI
 Save state automatically on exit (as @code{savevm} in monitor)
 ETEXI
 
+DEF("lazy-restore", 0, QEMU_OPTION_lazy_restore, \
+    "-lazy-restore   restore the RAM of snapshots on demand after loadvm\n")
+STEXI
+@item -lazy-restore
+Restore the RAM of snapshots on first access after @code{loadvm}, and in
+the background, instead of reading all of it before resuming
+ETEXI
+
 DEF("mic", HAS_ARG, QEMU_OPTION_mic, \
     "-mic <file>     read audio input from wav file\n")
 
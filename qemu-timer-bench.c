@@ -0,0 +1,162 @@
+/*
+ * Micro-benchmark of the QEMU timer queues
+ *
+ * Copyright (c) 2011 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/* Arms and cancels millions of timers through qemu_mod_timer() and
+ * qemu_del_timer(), with a varying number of timers pending on the clock,
+ * and reports the cost of each operation.
+ *
+ * qemu-timer.c is linked as is. The alarm timer is started, but it is left
+ * pending, as it is while the main loop runs the expired timers, so the
+ * host timer is never re-armed and only the queue operations are measured.
+ *
+ * usage: qemu-timer-bench [operations]
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "sysemu.h"
+#include "hw/hw.h"
+#include <sys/time.h>
+
+/* qemu-timer.c is linked without the rest of the emulator, these replace
+ * the few symbols it needs from it */
+
+CPUState *cpu_single_env;
+QEMUClock *rtc_clock;
+int vm_running = 1;
+int use_icount;
+int64_t qemu_icount;
+
+int tcg_has_work(void)
+{
+    return 0;
+}
+
+void qemu_notify_event(void)
+{
+}
+
+int fcntl_setfl(int fd, int flag)
+{
+    return 0;
+}
+
+void hw_error(const char *fmt, ...)
+{
+    abort();
+}
+
+VMChangeStateEntry *qemu_add_vm_change_state_handler(VMChangeStateHandler *cb,
+                                                     void *opaque)
+{
+    return NULL;
+}
+
+int register_savevm(const char *idstr, int instance_id, int version_id,
+                    SaveStateHandler *save_state,
+                    LoadStateHandler *load_state, void *opaque)
+{
+    return 0;
+}
+
+void qemu_put_be64(QEMUFile *f, uint64_t v)
+{
+}
+
+uint64_t qemu_get_be64(QEMUFile *f)
+{
+    return 0;
+}
+
+static void bench_timer_cb(void *opaque)
+{
+}
+
+static double now_ns(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+/* xorshift, so that the expiration times don't depend on the libc */
+static uint32_t bench_rand(void)
+{
+    static uint32_t x = 2463534242u;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+int main(int argc, char **argv)
+{
+    static const int pending_counts[] = { 1, 16, 256, 4096, 65536 };
+    int ops = 4000000;
+    int pp;
+
+    if (argc > 2 || (argc == 2 && (ops = atoi(argv[1])) < 2)) {
+        fprintf(stderr, "usage: qemu-timer-bench [operations]\n");
+        return 1;
+    }
+
+    init_clocks();
+    if (init_timer_alarm() < 0) {
+        fprintf(stderr, "could not initialize alarm timer\n");
+        return 1;
+    }
+
+    printf("%d operations per run\n", ops);
+    printf("pending  mod ns/op  mod+del ns/op\n");
+
+    for (pp = 0; pp < ARRAY_SIZE(pending_counts); pp++) {
+        int pending = pending_counts[pp];
+        QEMUTimer **timers = qemu_malloc(pending * sizeof(timers[0]));
+        /* far enough in the future for the alarm timer to never fire */
+        int64_t base = qemu_get_clock(vm_clock) + 3600 * 1000000000LL;
+        double start, mod_ns, del_ns;
+        int nn;
+
+        for (nn = 0; nn < pending; nn++) {
+            timers[nn] = qemu_new_timer(vm_clock, bench_timer_cb, NULL);
+            qemu_mod_timer(timers[nn], base + bench_rand());
+        }
+
+        /* re-arm pending timers to a new expiration time, the common case
+         * of a device timer being pushed back */
+        start = now_ns();
+        for (nn = 0; nn < ops; nn++) {
+            qemu_mod_timer(timers[bench_rand() % pending],
+                           base + bench_rand());
+        }
+        mod_ns = (now_ns() - start) / ops;
+
+        /* cancel a timer, and arm it again */
+        start = now_ns();
+        for (nn = 0; nn < ops / 2; nn++) {
+            QEMUTimer *ts = timers[bench_rand() % pending];
+            qemu_del_timer(ts);
+            qemu_mod_timer(ts, base + bench_rand());
+        }
+        del_ns = (now_ns() - start) / (ops / 2);
+
+        printf("%7d  %9.1f  %13.1f\n", pending, mod_ns, del_ns);
+
+        for (nn = 0; nn < pending; nn++) {
+            qemu_del_timer(timers[nn]);
+            qemu_free_timer(timers[nn]);
+        }
+        qemu_free(timers);
+    }
+
+    quit_timers();
+    return 0;
+}
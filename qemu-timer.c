@@ -267,7 +267,11 @@ struct QEMUTimer {
     int64_t expire_time;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    /* position in the clock's timer heap (starting at 1), 0 if not pending */
+    int heap_index;
+    /* insertion sequence number, to fire timers with the same expiration
+       time in the order they were armed */
+    uint64_t heap_seq;
 };
 
 struct qemu_alarm_timer {
@@ -481,7 +485,108 @@ QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 QEMUClock *host_clock;
 
-static QEMUTimer *active_timers[QEMU_NUM_CLOCKS];
+/* The pending timers of each clock are kept in a binary min-heap, ordered by
+   expiration time, so that arming and cancelling a timer are O(log n).
+
+   The heap itself is never looked at from the alarm signal handler. Instead,
+   active_timers[] always points to the timer that expires first (or is NULL),
+   and is only updated once the heap is consistent again. A timer which is
+   being re-armed is removed from the heap, and active_timers[] updated,
+   before its expiration time is changed, so qemu_timer_expired() only ever
+   sees valid, unchanging timers. */
+typedef struct {
+    QEMUTimer **timers;     /* timers[1] .. timers[count] */
+    int count;
+    int size;
+} QEMUTimerHeap;
+
+static QEMUTimerHeap timer_heaps[QEMU_NUM_CLOCKS];
+static QEMUTimer * volatile active_timers[QEMU_NUM_CLOCKS];
+static uint64_t timer_heap_seq;
+
+static inline int timer_heap_before(QEMUTimer *a, QEMUTimer *b)
+{
+    if (a->expire_time != b->expire_time)
+        return a->expire_time < b->expire_time;
+    return a->heap_seq < b->heap_seq;
+}
+
+static inline void timer_heap_set(QEMUTimerHeap *heap, int index,
+                                  QEMUTimer *ts)
+{
+    heap->timers[index] = ts;
+    ts->heap_index = index;
+}
+
+static void timer_heap_sift_up(QEMUTimerHeap *heap, int index)
+{
+    QEMUTimer *ts = heap->timers[index];
+
+    while (index > 1) {
+        QEMUTimer *parent = heap->timers[index >> 1];
+        if (!timer_heap_before(ts, parent))
+            break;
+        timer_heap_set(heap, index, parent);
+        index >>= 1;
+    }
+    timer_heap_set(heap, index, ts);
+}
+
+static void timer_heap_sift_down(QEMUTimerHeap *heap, int index)
+{
+    QEMUTimer *ts = heap->timers[index];
+
+    for (;;) {
+        int child = index << 1;
+        if (child > heap->count)
+            break;
+        if (child < heap->count &&
+            timer_heap_before(heap->timers[child + 1], heap->timers[child]))
+            child++;
+        if (!timer_heap_before(heap->timers[child], ts))
+            break;
+        timer_heap_set(heap, index, heap->timers[child]);
+        index = child;
+    }
+    timer_heap_set(heap, index, ts);
+}
+
+static void timer_heap_insert(QEMUTimerHeap *heap, QEMUTimer *ts)
+{
+    if (heap->count + 1 >= heap->size) {
+        heap->size = heap->size ? heap->size * 2 : 64;
+        heap->timers = qemu_realloc(heap->timers,
+                                    heap->size * sizeof(heap->timers[0]));
+    }
+    ts->heap_seq = timer_heap_seq++;
+    heap->count++;
+    heap->timers[heap->count] = ts;
+    timer_heap_sift_up(heap, heap->count);
+}
+
+static void timer_heap_remove(QEMUTimerHeap *heap, QEMUTimer *ts)
+{
+    int index = ts->heap_index;
+    QEMUTimer *last = heap->timers[heap->count--];
+
+    ts->heap_index = 0;
+    if (last == ts)
+        return;
+
+    timer_heap_set(heap, index, last);
+    if (index > 1 && timer_heap_before(last, heap->timers[index >> 1]))
+        timer_heap_sift_up(heap, index);
+    else
+        timer_heap_sift_down(heap, index);
+}
+
+/* publish the first timer to expire, for the alarm signal handler */
+static inline void timer_heap_publish(int type)
+{
+    QEMUTimerHeap *heap = &timer_heaps[type];
+
+    active_timers[type] = heap->count ? heap->timers[1] : NULL;
+}
 
 static QEMUClock *qemu_new_clock(int type)
 {
@@ -516,49 +621,33 @@ void qemu_free_timer(QEMUTimer *ts)
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    int type = ts->clock->type;
 
     /* NOTE: this code must be signal safe because
        qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
-    }
+    if (!ts->heap_index)
+        return;
+    timer_heap_remove(&timer_heaps[type], ts);
+    timer_heap_publish(type);
 }
 
 /* modify the current timer so that it will be fired when current_time
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    int type = ts->clock->type;
 
     qemu_del_timer(ts);
 
-    /* add the timer in the sorted list */
+    /* add the timer in the heap */
     /* NOTE: this code must be signal safe because
        qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t->expire_time > expire_time)
-            break;
-        pt = &t->next;
-    }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    timer_heap_insert(&timer_heaps[type], ts);
+    timer_heap_publish(type);
 
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
+    if (ts->heap_index == 1) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -570,12 +659,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->heap_index != 0;
 }
 
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -587,21 +671,19 @@ int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 static void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimer *ts;
     int64_t current_time;
 
     if (!clock->enabled)
         return;
 
     current_time = qemu_get_clock (clock);
-    ptimer_head = &active_timers[clock->type];
     for(;;) {
-        ts = *ptimer_head;
+        ts = active_timers[clock->type];
         if (!ts || ts->expire_time > current_time)
             break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_del_timer(ts);
 
         /* run the callback (the timer list can be modified) */
         ts->cb(ts->opaque);
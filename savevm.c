@@ -548,6 +548,9 @@ int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence)
     if (f->put_buffer) {
         qemu_fflush(f);
         f->buf_offset = pos;
+    } else if (pos >= f->buf_offset - f->buf_size && pos <= f->buf_offset) {
+        /* still in the read buffer */
+        f->buf_index = pos - (f->buf_offset - f->buf_size);
     } else {
         f->buf_offset = pos;
         f->buf_index = 0;
@@ -1192,6 +1195,9 @@ void do_savevm_oc(OutputChannel *err, const char *name)
     saved_vm_running = vm_running;
     vm_stop(0);
 
+    /* the VM state area is about to be overwritten */
+    ram_lazy_finish();
+
     must_delete = 0;
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -1297,8 +1303,10 @@ void do_loadvm_oc(OutputChannel *err, const char *name)
     saved_vm_running = vm_running;
     vm_stop(0);
 
+    ram_lazy_finish();
+
     bs1 = NULL;
-    while ((bs1 = bdrv_next(bs))) {
+    while ((bs1 = bdrv_next(bs1))) {
         if (bdrv_can_snapshot(bs1)) {
             ret = bdrv_snapshot_goto(bs1, name);
             if (ret < 0) {
@@ -1344,7 +1352,9 @@ void do_loadvm_oc(OutputChannel *err, const char *name)
         output_channel_printf(err, "Could not open VM state file\n");
         goto the_end;
     }
+    ram_lazy_begin(bs);
     ret = qemu_loadvm_state(f);
+    ram_lazy_end();
     qemu_fclose(f);
     if (ret < 0) {
         output_channel_printf(err, "Error %d while loading VM state\n", ret);
@@ -1371,6 +1381,8 @@ void do_delvm_oc(OutputChannel *err, const char *name)
         return;
     }
 
+    ram_lazy_finish();
+
     bs1 = NULL;
     while ((bs1 = bdrv_next(bs1))) {
         if (bdrv_can_snapshot(bs1)) {
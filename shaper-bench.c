@@ -0,0 +1,255 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* Micro-benchmark of the network shaper and delay line of shaper.c.
+ *
+ * shaper.c is linked as is, against the simulated clock and timers below,
+ * which replace qemu-timer.c. Time only advances when the benchmark says
+ * so, one millisecond at a time, so the runs don't depend on the host and
+ * only the CPU time spent in shaper.c is measured.
+ *
+ * - shaper: bursts of 1000 packets of 64 to 1463 bytes are sent every
+ *   second through a 8 Mbit/s shaper, which queues most of them.
+ *
+ * - delay: TCP sessions are opened through a delay line with a latency of
+ *   5 to 50 ms, with 'sessions' of them open at any time. Every step opens
+ *   one, sends 20 data packets, and closes the oldest one.
+ *
+ * Each test prints a checksum of the packets it received, with the time
+ * at which they were received, to compare the output of two versions of
+ * shaper.c.
+ *
+ * usage: shaper-bench [-n packets] [-s sessions]
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "shaper.h"
+#include <sys/time.h>
+
+/* the simulated clock, in milliseconds */
+
+static int64_t  bench_now;
+
+QEMUClock *rt_clock;
+
+struct QEMUTimer {
+    QEMUTimerCB*  cb;
+    void*         opaque;
+    int64_t       expire;   /* -1 if not pending */
+    QEMUTimer*    next;
+};
+
+static QEMUTimer*  bench_timers;
+
+int64_t qemu_get_clock(QEMUClock *clock)
+{
+    return bench_now;
+}
+
+QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
+{
+    QEMUTimer *ts = qemu_mallocz(sizeof(*ts));
+
+    ts->cb     = cb;
+    ts->opaque = opaque;
+    ts->expire = -1;
+    ts->next   = bench_timers;
+    bench_timers = ts;
+    return ts;
+}
+
+void qemu_free_timer(QEMUTimer *ts)
+{
+    QEMUTimer **pt;
+
+    for (pt = &bench_timers; *pt != NULL; pt = &(*pt)->next) {
+        if (*pt == ts) {
+            *pt = ts->next;
+            break;
+        }
+    }
+    qemu_free(ts);
+}
+
+void qemu_del_timer(QEMUTimer *ts)
+{
+    ts->expire = -1;
+}
+
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+    ts->expire = expire_time;
+}
+
+/* Advances the clock by one millisecond, and runs the expired timers. */
+static void bench_tick(void)
+{
+    QEMUTimer *ts;
+
+    bench_now++;
+    for (ts = bench_timers; ts != NULL; ts = ts->next) {
+        if (ts->expire >= 0 && ts->expire <= bench_now) {
+            ts->expire = -1;
+            ts->cb(ts->opaque);
+        }
+    }
+}
+
+static long      bench_received;
+static uint32_t  bench_sum;
+
+static void bench_receive(void *data, size_t size, void *opaque)
+{
+    const uint8_t *p = data;
+
+    bench_received++;
+    bench_sum = bench_sum * 31 + (uint32_t)bench_now;
+    bench_sum = bench_sum * 31 + (p[18] << 8) + p[19] + (uint32_t)size;
+}
+
+static double now_s(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* Builds an Ethernet frame holding a TCP segment from 192.168.0.1 to
+ * 10.0.2.15, so that the delay line doesn't see it as internal traffic. */
+static void bench_packet(uint8_t *pkt, unsigned id, unsigned port, int flags)
+{
+    uint8_t *ip = pkt + 14;
+    uint8_t *tcp = ip + 20;
+
+    memset(pkt, 0, 14 + 20 + 20);
+    pkt[12] = 0x08;
+    ip[0]   = 0x45;
+    ip[4]   = id >> 8;    /* identification */
+    ip[5]   = id;
+    ip[8]   = 64;
+    ip[9]   = 6;
+    ip[12]  = 192;
+    ip[13]  = 168;
+    ip[15]  = 1;
+    ip[16]  = 10;
+    ip[18]  = 2;
+    ip[19]  = 15;
+    tcp[0]  = port >> 8;
+    tcp[1]  = port;
+    tcp[3]  = 80;
+    tcp[13] = flags;
+}
+
+#define  TCP_FIN  0x01
+#define  TCP_SYN  0x02
+#define  TCP_ACK  0x10
+
+static void bench_shaper(long packets)
+{
+    static uint8_t pkt[1500];
+    NetShaper shaper = netshaper_create(1, bench_receive);
+    double start, elapsed;
+    long nn = 0;
+
+    netshaper_set_rate(shaper, 8e6);
+    bench_now = 0;
+    bench_received = 0;
+    bench_sum = 0;
+
+    start = now_s();
+    while (nn < packets || bench_received < nn) {
+        if (bench_now % 1000 == 0) {
+            int burst;
+
+            for (burst = 0; burst < 1000 && nn < packets; burst++, nn++) {
+                bench_packet(pkt, nn, 1024, TCP_ACK);
+                netshaper_send(shaper, pkt, 64 + (nn * 37) % 1400);
+            }
+        }
+        bench_tick();
+    }
+    elapsed = now_s() - start;
+    printf("shaper: %ld packets in %.2f s, %.2f Mpkt/s, %ld ms simulated, "
+           "checksum %08x\n", packets, elapsed, packets / elapsed / 1e6,
+           (long)bench_now, bench_sum);
+
+    netshaper_destroy(shaper);
+}
+
+static void bench_delay(long packets, int sessions)
+{
+    static uint8_t pkt[80];
+    NetDelay delay = netdelay_create(bench_receive);
+    double start, elapsed;
+    long opened, sent = 0;
+
+    netdelay_set_latency(delay, 5, 50);
+    srand(1);
+    bench_now = 0;
+    bench_received = 0;
+    bench_sum = 0;
+
+    start = now_s();
+    for (opened = 0; sent < packets; opened++) {
+        int nn;
+
+        bench_packet(pkt, sent++, opened, TCP_SYN);
+        netdelay_send(delay, pkt, sizeof(pkt));
+        for (nn = 0; nn < 20; nn++) {
+            bench_packet(pkt, sent++, opened, TCP_ACK);
+            netdelay_send(delay, pkt, sizeof(pkt));
+        }
+        if (opened >= sessions) {
+            bench_packet(pkt, sent++, opened - sessions, TCP_FIN);
+            netdelay_send(delay, pkt, sizeof(pkt));
+        }
+        bench_tick();
+    }
+    elapsed = now_s() - start;
+    printf("delay:  %ld packets in %.2f s, %.2f Mpkt/s, %d sessions, "
+           "checksum %08x\n", sent, elapsed, sent / elapsed / 1e6,
+           sessions, bench_sum);
+
+    netdelay_destroy(delay);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: shaper-bench [-n packets] [-s sessions]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long packets = 4000000;
+    int sessions = 4000;
+    int nn;
+
+    for (nn = 1; nn < argc; nn++) {
+        if (nn + 1 == argc)
+            usage();
+        if (!strcmp(argv[nn], "-n"))
+            packets = atol(argv[++nn]);
+        else if (!strcmp(argv[nn], "-s"))
+            sessions = atoi(argv[++nn]);
+        else
+            usage();
+    }
+    if (packets <= 0 || sessions <= 0 || sessions > 65535)
+        usage();
+
+    bench_shaper(packets);
+    bench_delay(packets / 8, sessions);
+    return 0;
+}
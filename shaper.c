@@ -17,6 +17,9 @@
 #define  SHAPER_CLOCK        rt_clock
 #define  SHAPER_CLOCK_UNIT   1000.
 
+#define  QUEUED_PACKET_BUFFER_SIZE  2048
+#define  QUEUED_PACKET_POOL_GROW    64
+
 static int
 _packet_is_internal( const uint8_t*  data, size_t  size )
 {
@@ -57,8 +60,29 @@ typedef struct QueuedPacketRec_ {
     size_t                     size;
     void*                      opaque;
     void*                      data;
+    int                        heap_data;  /* data was allocated with qemu_malloc() */
+    uint8_t                    buffer[ QUEUED_PACKET_BUFFER_SIZE ];
 } QueuedPacketRec, *QueuedPacket;
 
+/* deferred packets are taken from a pool of records that are never given
+ * back to the heap, so queuing a packet doesn't allocate memory once the
+ * pool has grown to the peak number of packets in flight. copies of
+ * packets larger than QUEUED_PACKET_BUFFER_SIZE (which slirp never
+ * produces) are allocated separately.
+ */
+static QueuedPacket  _packet_pool;
+
+static void
+queued_packet_pool_grow( void )
+{
+    QueuedPacket  packets = qemu_malloc( QUEUED_PACKET_POOL_GROW*sizeof(packets[0]) );
+    int           nn;
+
+    for (nn = 0; nn < QUEUED_PACKET_POOL_GROW; nn++) {
+        packets[nn].next = _packet_pool;
+        _packet_pool     = &packets[nn];
+    }
+}
 
 static QueuedPacket
 queued_packet_create( const void*   data,
@@ -67,19 +91,26 @@ queued_packet_create( const void*   data,
                       int           do_copy )
 {
     QueuedPacket   packet;
-    size_t         packet_size = sizeof(*packet);
 
-    if (do_copy)
-        packet_size += size;
+    if (_packet_pool == NULL)
+        queued_packet_pool_grow();
+
+    packet       = _packet_pool;
+    _packet_pool = packet->next;
 
-    packet = qemu_malloc(packet_size);
     packet->next       = NULL;
     packet->expiration = 0;
     packet->size       = (size_t)size;
     packet->opaque     = opaque;
+    packet->heap_data  = 0;
 
     if (do_copy) {
-        packet->data = (void*)(packet+1);
+        if (size <= sizeof(packet->buffer)) {
+            packet->data = packet->buffer;
+        } else {
+            packet->data      = qemu_malloc(size);
+            packet->heap_data = 1;
+        }
         memcpy( (char*)packet->data, (char*)data, packet->size );
     } else {
         packet->data = (void*)data;
@@ -91,12 +122,19 @@ static void
 queued_packet_free( QueuedPacket  packet )
 {
     if (packet) {
-        qemu_free( packet );
+        if (packet->heap_data) {
+            qemu_free( packet->data );
+            packet->heap_data = 0;
+        }
+        packet->data = NULL;
+        packet->next = _packet_pool;
+        _packet_pool = packet;
     }
 }
 
 typedef struct NetShaperRec_ {
-    QueuedPacket   packets;   /* list of queued packets, ordered by expiration date */
+    QueuedPacket   packets;   /* FIFO of queued packets, ordered by expiration date */
+    QueuedPacket   last;      /* last packet in the FIFO */
     int            num_packets;
     int            active;    /* is this shaper active ? */
     int64_t        block_until;
@@ -110,18 +148,29 @@ typedef struct NetShaperRec_ {
 } NetShaperRec;
 
 
+/* removes the first packet from the shaper's queue */
+static QueuedPacket
+netshaper_pop( NetShaper  shaper )
+{
+    QueuedPacket  packet = shaper->packets;
+
+    shaper->packets = packet->next;
+    if (shaper->packets == NULL)
+        shaper->last = NULL;
+
+    packet->next = NULL;
+    shaper->num_packets--;
+    return packet;
+}
+
 void
 netshaper_destroy( NetShaper  shaper )
 {
     if (shaper) {
         shaper->active = 0;
 
-        while (shaper->packets) {
-            QueuedPacket  packet = shaper->packets;
-            shaper->packets = packet->next;
-            packet->next    = NULL;
-            queued_packet_free(packet);
-        }
+        while (shaper->packets)
+            queued_packet_free( netshaper_pop(shaper) );
 
         qemu_del_timer(shaper->timer);
         qemu_free_timer(shaper->timer);
@@ -135,26 +184,21 @@ static void
 netshaper_expires( NetShaper  shaper )
 {
     QueuedPacket  packet;
+    int64_t       now = qemu_get_clock( SHAPER_CLOCK );
 
     while ((packet = shaper->packets) != NULL) {
-        int64_t   now = qemu_get_clock( SHAPER_CLOCK );
-
-       if (packet->expiration > now)
-           break;
-
-       shaper->packets = packet->next;
-       shaper->send_func( packet->data, packet->size, packet->opaque );
-       queued_packet_free(packet);
-       shaper->num_packets--;
-   }
-
-   /* reprogram timer if needed */
-   if (shaper->packets) {
-       shaper->block_until = shaper->packets->expiration;
-       qemu_mod_timer( shaper->timer, shaper->block_until );
-   } else {
-       shaper->block_until = -1;
-   }
+        if (packet->expiration > now)
+            break;
+
+        netshaper_pop(shaper);
+        shaper->send_func( packet->data, packet->size, packet->opaque );
+        queued_packet_free(packet);
+    }
+
+    /* reprogram timer if needed. block_until is left untouched, it is
+     * already past the expiration of the last queued packet */
+    if (shaper->packets)
+        qemu_mod_timer( shaper->timer, shaper->packets->expiration );
 }
 
 
@@ -166,16 +210,21 @@ netshaper_create( int                do_copy,
 
     shaper->active = 0;
     shaper->packets = NULL;
+    shaper->last    = NULL;
     shaper->num_packets = 0;
     shaper->timer   = qemu_new_timer( SHAPER_CLOCK,
                                       (QEMUTimerCB*) netshaper_expires,
                                       shaper );
+    shaper->do_copy   = do_copy;
     shaper->send_func = send_func;
     shaper->max_rate  = 1e6;
     shaper->inv_rate  = 0.;
 
     shaper->block_until = -1; /* magic value, means to not block */
 
+    if (_packet_pool == NULL)
+        queued_packet_pool_grow();
+
     return shaper;
 }
 
@@ -185,11 +234,9 @@ netshaper_set_rate( NetShaper  shaper,
 {
     /* send all current packets when changing the rate */
     while (shaper->packets) {
-        QueuedPacket  packet = shaper->packets;
-        shaper->packets = packet->next;
+        QueuedPacket  packet = netshaper_pop(shaper);
         shaper->send_func(packet->data, packet->size, packet->opaque);
-        qemu_free(packet);
-        shaper->num_packets = 0;
+        queued_packet_free(packet);
     }
 
     shaper->max_rate = rate;
@@ -217,14 +264,17 @@ netshaper_send_aux( NetShaper  shaper,
     }
 
     now = qemu_get_clock( SHAPER_CLOCK );
-    if (now >= shaper->block_until) {
+    if (now >= shaper->block_until && shaper->packets == NULL) {
         shaper->send_func( data, size, opaque );
         shaper->block_until = now + size*shaper->inv_rate;
         //fprintf(stderr, "NETSHAPER: block for %.2fms\n", (shaper->block_until - now)*1.0 );
         return;
     }
 
-    /* create new packet, add it to the queue */
+    /* add the packet to the end of the queue. expiration dates only grow
+     * since they are taken from block_until, so the queue stays sorted */
+    if (shaper->block_until < now)
+        shaper->block_until = now;  /* timer is late, don't send a burst */
     {
         QueuedPacket   packet;
 
@@ -232,22 +282,13 @@ netshaper_send_aux( NetShaper  shaper,
 
         packet->expiration = shaper->block_until;
 
-        {
-            QueuedPacket  *pnode, node;
-
-            pnode = &shaper->packets;
-            for (;;) {
-                node = *pnode;
-                if (node == NULL || node->expiration > packet->expiration )
-                    break;
-                pnode = &node->next;
-            }
-            packet->next = *pnode;
-            *pnode       = packet;
-
-            if (packet == shaper->packets)
-                qemu_mod_timer( shaper->timer, packet->expiration );
+        if (shaper->last == NULL) {
+            shaper->packets = packet;
+            qemu_mod_timer( shaper->timer, packet->expiration );
+        } else {
+            shaper->last->next = packet;
         }
+        shaper->last = packet;
         shaper->num_packets += 1;
     }
     shaper->block_until += size*shaper->inv_rate;
@@ -288,7 +329,8 @@ netshaper_can_send( NetShaper  shaper )
  */
 typedef struct SessionRec_ {
     int64_t               expiration;
-    struct SessionRec_*   next;
+    struct SessionRec_*   next;          /* next session in hash bucket */
+    struct SessionRec_*   pending_next;  /* next session with a delayed packet */
     unsigned              src_ip;
     unsigned              dst_ip;
     unsigned short        src_port;
@@ -380,10 +422,19 @@ _packet_SYN_flags( const void*  _data, size_t   size, Session  info )
 }
 
 
+/* sessions are stored in a hash table indexed by their address/port
+ * tuple, so that looking up the session of a FIN/RST/SYN packet doesn't
+ * depend on the number of open connections. sessions whose SYN packet is
+ * still delayed are also linked in a separate 'pending' list, which is
+ * the only one walked by the delay's timer.
+ */
+#define  NETDELAY_HASH_SIZE  256
+
 typedef struct NetDelayRec_
 {
-    Session     sessions;
+    Session     sessions[ NETDELAY_HASH_SIZE ];
     int         num_sessions;
+    Session     pending;
     QEMUTimer*  timer;
     int         active;
     int         min_ms;
@@ -394,10 +445,21 @@ typedef struct NetDelayRec_
 } NetDelayRec;
 
 
+static unsigned
+session_hash( Session  info )
+{
+    unsigned  h = info->src_ip ^ (info->dst_ip * 31) ^ info->protocol;
+
+    h ^= ((unsigned)info->src_port << 16) | info->dst_port;
+    h ^= (h >> 16);
+    h ^= (h >> 8);
+    return h & (NETDELAY_HASH_SIZE-1);
+}
+
 static Session*
 netdelay_lookup_session( NetDelay  delay, Session  info )
 {
-    Session*  pnode = &delay->sessions;
+    Session*  pnode = &delay->sessions[ session_hash(info) ];
     Session   node;
 
     for (;;) {
@@ -417,29 +479,47 @@ netdelay_lookup_session( NetDelay  delay, Session  info )
     return pnode;
 }
 
+/* removes a session from the pending list, if it is there */
+static void
+netdelay_unlink_pending( NetDelay  delay, Session  session )
+{
+    Session*  pnode = &delay->pending;
+
+    if (session->packet == NULL)
+        return;
+
+    while (*pnode != NULL) {
+        if (*pnode == session) {
+            *pnode = session->pending_next;
+            break;
+        }
+        pnode = &(*pnode)->pending_next;
+    }
+    session->pending_next = NULL;
+}
 
 
 /* called by the delay's timer on expiration */
 static void
 netdelay_expires( NetDelay  delay )
 {
-    Session  session;
-    int64_t  now = qemu_get_clock( SHAPER_CLOCK );
-    int      rearm = 0;
-    int64_t  rearm_time = 0;
+    Session*  pnode = &delay->pending;
+    Session   session;
+    int64_t   now = qemu_get_clock( SHAPER_CLOCK );
+    int       rearm = 0;
+    int64_t   rearm_time = 0;
 
-    for (session = delay->sessions; session != NULL; session = session->next)
+    while ((session = *pnode) != NULL)
     {
         QueuedPacket  packet = session->packet;
 
-        if (packet == NULL)
-            continue;
-
         if (session->expiration <= now) {
             /* send the SYN packet now */
                     //fprintf(stderr, "NetDelay:RST: sending creation for %s\n", session_to_string(session) );
+            *pnode = session->pending_next;
+            session->pending_next = NULL;
+            session->packet       = NULL;
             delay->send_func( packet->data, packet->size, packet->opaque );
-            session->packet = NULL;
             queued_packet_free( packet );
         } else {
             if (!rearm) {
@@ -448,6 +528,8 @@ netdelay_expires( NetDelay  delay )
             }
             else if ( session->expiration < rearm_time )
                 rearm_time = session->expiration;
+
+            pnode = &session->pending_next;
         }
     }
 
@@ -459,10 +541,10 @@ netdelay_expires( NetDelay  delay )
 NetDelay
 netdelay_create( NetShaperSendFunc  send_func )
 {
-    NetDelay  delay = qemu_malloc(sizeof(*delay));
+    NetDelay  delay = qemu_mallocz(sizeof(*delay));
 
-    delay->sessions     = NULL;
     delay->num_sessions = 0;
+    delay->pending      = NULL;
     delay->timer        = qemu_new_timer( SHAPER_CLOCK,
                                           (QEMUTimerCB*) netdelay_expires,
                                           delay );
@@ -476,21 +558,34 @@ netdelay_create( NetShaperSendFunc  send_func )
 }
 
 
+/* removes all sessions, sending their delayed packets if 'flush' is set */
+static void
+netdelay_clear( NetDelay  delay, int  flush )
+{
+    int  nn;
+
+    for (nn = 0; nn < NETDELAY_HASH_SIZE; nn++) {
+        while (delay->sessions[nn]) {
+            Session  session = delay->sessions[nn];
+            delay->sessions[nn] = session->next;
+            session->next = NULL;
+            if (flush && session->packet) {
+                QueuedPacket  packet = session->packet;
+                delay->send_func( packet->data, packet->size, packet->opaque );
+            }
+            session_free(session);
+            delay->num_sessions--;
+        }
+    }
+    delay->pending = NULL;
+}
+
+
 void
 netdelay_set_latency( NetDelay  delay, int  min_ms, int  max_ms )
 {
     /* when changing the latency, accept all sessions */
-    while (delay->sessions) {
-        Session  session = delay->sessions;
-        delay->sessions = session->next;
-        session->next = NULL;
-        if (session->packet) {
-            QueuedPacket  packet = session->packet;
-            delay->send_func( packet->data, packet->size, packet->opaque );
-        }
-        session_free(session);
-        delay->num_sessions--;
-    }
+    netdelay_clear( delay, 1 );
 
     delay->min_ms = min_ms;
     delay->max_ms = max_ms;
@@ -520,6 +615,7 @@ netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void* opaqu
                 //fprintf(stderr, "NetDelay:RST: dropping %s\n", session_to_string(info) );
 
                 *lookup = session->next;
+                netdelay_unlink_pending( delay, session );
                 session_free( session );
                 delay->num_sessions -= 1;
             }
@@ -549,8 +645,8 @@ netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void* opaqu
                     //fprintf(stderr, "NetDelay:RST: delay creation for %s\n", session_to_string(info) );
                 session = qemu_malloc( sizeof(*session) );
 
-                session->next        = delay->sessions;
-                delay->sessions      = session;
+                session->next        = NULL;
+                *lookup              = session;
                 delay->num_sessions += 1;
 
                 session->expiration = qemu_get_clock( SHAPER_CLOCK ) + latency;
@@ -563,6 +659,9 @@ netdelay_send_aux( NetDelay  delay, const void*  data, size_t  size, void* opaqu
 
                 session->packet = queued_packet_create( data, size, opaque, 1 );
 
+                session->pending_next = delay->pending;
+                delay->pending        = session;
+
                 netdelay_expires(delay);
                 return;
             }
@@ -577,14 +676,8 @@ void
 netdelay_destroy( NetDelay  delay )
 {
     if (delay) {
-        while (delay->sessions) {
-            Session  session = delay->sessions;
-            delay->sessions = session->next;
-            session_free(session);
-            delay->num_sessions -= 1;
-        }
+        netdelay_clear( delay, 0 );
         delay->active = 0;
         qemu_free( delay );
     }
 }
-
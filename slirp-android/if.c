@@ -196,6 +196,7 @@ diddit:
 		/* Update *_queued */
 		so->so_queued++;
 		so->so_nqueued++;
+		sopoll_changed(so);
 		/*
 		 * Check if the interactive session should be downgraded to
 		 * the batchq.  A session is downgraded if it has queued 6
@@ -284,6 +285,7 @@ if_start(void)
 		if (--ifm->ifq_so->so_queued == 0)
 		   /* If there's no more queued, reset nqueued */
 		   ifm->ifq_so->so_nqueued = 0;
+		sopoll_changed(ifm->ifq_so);
 	}
 
 	/* Encapsulate the packet for sending */
@@ -132,6 +132,7 @@ icmp_input(struct mbuf *m, int hlen)
       so->so_faddr_port = 7;
       so->so_laddr_ip   = ip_geth(ip->ip_src);
       so->so_laddr_port = 9;
+      sohash(&udb, so);
       so->so_iptos = ip->ip_tos;
       so->so_type = IPPROTO_ICMP;
       so->so_state = SS_ISFCONNECTED;
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "sockets.h"
+#include "iolooper.h"
 #ifdef _WIN32
 #  define WIN32_LEAN_AND_MEAN
 #  define socket_close  winsock2_socket_close3
@@ -26,6 +27,16 @@ void slirp_select_fill(int *pnfds,
 
 void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds);
 
+/* Alternative to slirp_select_fill()/slirp_select_poll(): the slirp
+ * sockets stay registered with the looper, and only the sockets whose
+ * state changed are updated before each wait. After the wait,
+ * slirp_looper_poll() only looks at the ready descriptors.
+ * slirp_looper_fd_closed() must be called when a descriptor registered
+ * with the looper is closed. */
+void slirp_looper_fill(IoLooper *looper);
+void slirp_looper_poll(IoLooper *looper);
+void slirp_looper_fd_closed(int fd);
+
 void slirp_input(const uint8_t *pkt, int pkt_len);
 
 /* you must provide the following functions: */
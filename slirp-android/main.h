@@ -35,6 +35,9 @@ extern char *slirp_tty;
 extern char *exec_shell;
 extern u_int curtime;
 extern fd_set *global_readfds, *global_writefds, *global_xfds;
+/* The socket being dispatched by slirp_looper_poll(), and its events */
+extern struct socket *looper_so;
+extern int looper_so_flags;
 extern uint32_t ctl_addr_ip;
 extern uint32_t special_addr_ip;
 extern uint32_t alias_addr_ip;
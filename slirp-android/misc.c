@@ -356,6 +356,7 @@ fork_exec(struct socket *so, const char *ex, int do_pty)
              socket_set_oobinline(so->s);
 		}
 		socket_set_nonblock(so->s);
+		sopoll_changed(so);
 
 		/* Append the telnet options now */
                 if (so->so_m != NULL && do_pty == 1)  {
@@ -62,6 +62,36 @@ sbreserve(struct sbuf *sb, int size)
 	}
 }
 
+/*
+ * Grow the buffer to size bytes, keeping its contents
+ * (unlike sbreserve, which empties it)
+ */
+void
+sbgrow(struct sbuf *sb, int size)
+{
+	char *data;
+	int n;
+
+	if (size <= sb->sb_datalen)
+		return;
+
+	data = (char *)malloc(size);
+	if (data == NULL)
+		return;
+
+	/* copy the data to the start of the new buffer */
+	n = (sb->sb_data + sb->sb_datalen) - sb->sb_rptr;
+	if (n > sb->sb_cc)
+		n = sb->sb_cc;
+	memcpy(data, sb->sb_rptr, n);
+	memcpy(data + n, sb->sb_data, sb->sb_cc - n);
+
+	free(sb->sb_data);
+	sb->sb_data = sb->sb_rptr = data;
+	sb->sb_wptr = data + sb->sb_cc;
+	sb->sb_datalen = size;
+}
+
 /*
  * Try and write() to the socket, whatever doesn't get written
  * append to the buffer... for a host with a fast net connection,
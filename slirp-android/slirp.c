@@ -71,6 +71,12 @@ struct ex_list *exec_list;
 /* XXX: suppress those select globals */
 fd_set *global_readfds, *global_writefds, *global_xfds;
 
+struct socket *looper_so;
+int looper_so_flags;
+
+/* Set when a UDP socket may expire, so that slowtimo has to run */
+static int udp_expiring;
+
 char slirp_hostname[33];
 
 int slirp_add_dns_server(const SockAddress*  new_dns_addr)
@@ -304,6 +310,13 @@ void slirp_select_fill(int *pnfds,
     global_xfds = NULL;
 
     nfds = *pnfds;
+
+	/*
+	 * Forget the sockets selected last time
+	 */
+	sopoll_clear(&tcp_poll_list);
+	sopoll_clear(&udp_poll_list);
+
 	/*
 	 * First, TCP sockets
 	 */
@@ -344,6 +357,7 @@ void slirp_select_fill(int *pnfds,
 			if (so->so_state & SS_FACCEPTCONN) {
                                 FD_SET(so->s, readfds);
 				UPD_NFDS(so->s);
+				sopoll_add(&tcp_poll_list, so);
 				continue;
 			}
 
@@ -353,6 +367,7 @@ void slirp_select_fill(int *pnfds,
 			if (so->so_state & SS_ISFCONNECTING) {
 				FD_SET(so->s, writefds);
 				UPD_NFDS(so->s);
+				sopoll_add(&tcp_poll_list, so);
 				continue;
 			}
 
@@ -363,6 +378,7 @@ void slirp_select_fill(int *pnfds,
 			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
 				FD_SET(so->s, writefds);
 				UPD_NFDS(so->s);
+				sopoll_add(&tcp_poll_list, so);
 			}
 
 			/*
@@ -373,6 +389,7 @@ void slirp_select_fill(int *pnfds,
 				FD_SET(so->s, readfds);
 				FD_SET(so->s, xfds);
 				UPD_NFDS(so->s);
+				sopoll_add(&tcp_poll_list, so);
 			}
 		}
 
@@ -409,6 +426,7 @@ void slirp_select_fill(int *pnfds,
 			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
 				FD_SET(so->s, readfds);
 				UPD_NFDS(so->s);
+				sopoll_add(&udp_poll_list, so);
 			}
 		}
 	}
@@ -454,10 +472,206 @@ void slirp_select_fill(int *pnfds,
         *pnfds = nfds;
 }
 
+/*
+ * Expire the UDP sockets that timed out, and queue all the other sockets
+ * for an update of their looper registration. Sockets are normally updated
+ * when slirp acts on them, this catches the changes made by the timers.
+ */
+static void slirp_looper_resync(void)
+{
+	struct socket *so, *so_next;
+
+	udp_expiring = 0;
+	for (so = udb.so_next; so != &udb; so = so_next) {
+		so_next = so->so_next;
+
+		if ((so->so_state & SS_PROXIFIED) == 0 && so->so_expire) {
+			if (so->so_expire <= curtime) {
+				udp_detach(so);
+				continue;
+			}
+			udp_expiring = 1;
+		}
+		sopoll_changed(so);
+	}
+	for (so = tcb.so_next; so != &tcb; so = so->so_next)
+		sopoll_changed(so);
+}
+
+static void slirp_timers(void)
+{
+	if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
+		tcp_fasttimo();
+		time_fasttimo = 0;
+	}
+	if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
+		ip_slowtimo();
+		tcp_slowtimo();
+		last_slowtimo = curtime;
+		if (so_looper != NULL)
+			slirp_looper_resync();
+	}
+}
+
+/*
+ * Whether a socket is ready for one of the IOLOOPER_XXX events, according
+ * to the fd_sets given to slirp_select_poll(), or to the IoLooper events
+ * given by slirp_looper_poll()
+ */
+static int slirp_so_ready(struct socket *so, int flag)
+{
+    if (looper_so != NULL)
+        return so == looper_so && (looper_so_flags & flag) != 0;
+
+    switch (flag) {
+    case IOLOOPER_READ:
+        return FD_ISSET(so->s, global_readfds);
+    case IOLOOPER_WRITE:
+        return FD_ISSET(so->s, global_writefds);
+    default:
+        return FD_ISSET(so->s, global_xfds);
+    }
+}
+
+/*
+ * Act on the events of a TCP socket
+ */
+static void slirp_poll_tcp(struct socket *so)
+{
+	int ret;
+
+	/*
+	 * FD_ISSET is meaningless on these sockets
+	 * (and they can crash the program)
+	 */
+	if (so->so_state & SS_NOFDREF || so->s == -1)
+	   return;
+
+	/*
+	 * proxified sockets are polled by the proxy manager
+	 */
+	if ((so->so_state & SS_PROXIFIED) != 0)
+		return;
+
+	/*
+	 * Check for URG data
+	 * This will soread as well, so no need to
+	 * test for readfds below if this succeeds
+	 */
+	if (slirp_so_ready(so, IOLOOPER_EXCEPT))
+	   sorecvoob(so);
+	/*
+	 * Check sockets for reading
+	 */
+	else if (slirp_so_ready(so, IOLOOPER_READ)) {
+		/*
+		 * Check for incoming connections
+		 */
+		if (so->so_state & SS_FACCEPTCONN) {
+			tcp_connect(so);
+			return;
+		} /* else */
+		ret = soread(so);
+
+		/* Output it if we read something */
+		if (ret > 0)
+		   tcp_output(sototcpcb(so));
+	}
+
+	/*
+	 * Check sockets for writing
+	 */
+	if (slirp_so_ready(so, IOLOOPER_WRITE)) {
+	  /*
+	   * Check for non-blocking, still-connecting sockets
+	   */
+	  if (so->so_state & SS_ISFCONNECTING) {
+	    /* Connected */
+	    so->so_state &= ~SS_ISFCONNECTING;
+
+	    ret = socket_send(so->s, (const void *)&ret, 0);
+	    if (ret < 0) {
+	      /* XXXXX Must fix, zero bytes is a NOP */
+	      if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		  errno == EINPROGRESS || errno == ENOTCONN)
+		return;
+
+	      /* else failed */
+	      so->so_state = SS_NOFDREF;
+	    }
+	    /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+	    /*
+	     * Continue tcp_input
+	     */
+	    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+	    /* continue; */
+	  } else {
+	    ret = sowrite(so);
+	    /*
+	     * If we wrote something, there could be a need
+	     * for a window update. tcp_output() only sends
+	     * one if the window opened enough.
+	     */
+	    if (ret > 0)
+	      tcp_output(sototcpcb(so));
+	  }
+	}
+
+	/*
+	 * Probe a still-connecting, non-blocking socket
+	 * to check if it's still alive
+ 	 	 */
+#ifdef PROBE_CONN
+	if (so->so_state & SS_ISFCONNECTING) {
+	  ret = socket_recv(so->s, (char *)&ret, 0);
+
+	  if (ret < 0) {
+	    /* XXX */
+	    if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		errno == EINPROGRESS || errno == ENOTCONN)
+	      return; /* Still connecting, continue */
+
+	    /* else failed */
+	    so->so_state = SS_NOFDREF;
+
+	    /* tcp_input will take care of it */
+	  } else {
+	    ret = socket_send(so->s, &ret, 0);
+	    if (ret < 0) {
+	      /* XXX */
+	      if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		  errno == EINPROGRESS || errno == ENOTCONN)
+		return;
+	      /* else failed */
+	      so->so_state = SS_NOFDREF;
+	    } else
+	      so->so_state &= ~SS_ISFCONNECTING;
+
+	  }
+	  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
+	} /* SS_ISFCONNECTING */
+#endif
+}
+
+/*
+ * Act on the events of a UDP socket.
+ * Incoming packets are sent straight away, they're not buffered.
+ * Incoming UDP data isn't buffered either.
+ */
+static void slirp_poll_udp(struct socket *so)
+{
+	if ((so->so_state & SS_PROXIFIED) != 0)
+		return;
+
+	if (so->s != -1 && slirp_so_ready(so, IOLOOPER_READ))
+		sorecvfrom(so);
+}
+
 void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
-    struct socket *so, *so_next;
-    int ret;
+    struct socket *so;
+    int i;
 
     global_readfds = readfds;
     global_writefds = writefds;
@@ -469,155 +683,33 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 	/*
 	 * See if anything has timed out
 	 */
-	if (link_up) {
-		if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
-			tcp_fasttimo();
-			time_fasttimo = 0;
-		}
-		if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
-			ip_slowtimo();
-			tcp_slowtimo();
-			last_slowtimo = curtime;
-		}
-	}
+	if (link_up)
+		slirp_timers();
 
 	/*
 	 * Check sockets
 	 */
 	if (link_up) {
 		/*
-		 * Check TCP sockets
+		 * Check TCP sockets selected by slirp_select_fill()
 		 */
-		for (so = tcb.so_next; so != &tcb; so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * FD_ISSET is meaningless on these sockets
-			 * (and they can crash the program)
-			 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
+		for (i = 0; i < tcp_poll_list.count; i++) {
+			so = tcp_poll_list.sockets[i];
+			if (so == NULL)
 			   continue;
 
-            /*
-             * proxified sockets are polled later in this
-             * function.
-             */
-            if ((so->so_state & SS_PROXIFIED) != 0)
-                continue;
-
-			/*
-			 * Check for URG data
-			 * This will soread as well, so no need to
-			 * test for readfds below if this succeeds
-			 */
-			if (FD_ISSET(so->s, xfds))
-			   sorecvoob(so);
-			/*
-			 * Check sockets for reading
-			 */
-			else if (FD_ISSET(so->s, readfds)) {
-				/*
-				 * Check for incoming connections
-				 */
-				if (so->so_state & SS_FACCEPTCONN) {
-					tcp_connect(so);
-					continue;
-				} /* else */
-				ret = soread(so);
-
-				/* Output it if we read something */
-				if (ret > 0)
-				   tcp_output(sototcpcb(so));
-			}
-
-			/*
-			 * Check sockets for writing
-			 */
-			if (FD_ISSET(so->s, writefds)) {
-			  /*
-			   * Check for non-blocking, still-connecting sockets
-			   */
-			  if (so->so_state & SS_ISFCONNECTING) {
-			    /* Connected */
-			    so->so_state &= ~SS_ISFCONNECTING;
-
-			    ret = socket_send(so->s, (const void *)&ret, 0);
-			    if (ret < 0) {
-			      /* XXXXX Must fix, zero bytes is a NOP */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-
-			      /* else failed */
-			      so->so_state = SS_NOFDREF;
-			    }
-			    /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-			    /*
-			     * Continue tcp_input
-			     */
-			    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-			    /* continue; */
-			  } else
-			    ret = sowrite(so);
-			  /*
-			   * XXXXX If we wrote something (a lot), there
-			   * could be a need for a window update.
-			   * In the worst case, the remote will send
-			   * a window probe to get things going again
-			   */
-			}
-
-			/*
-			 * Probe a still-connecting, non-blocking socket
-			 * to check if it's still alive
-	 	 	 */
-#ifdef PROBE_CONN
-			if (so->so_state & SS_ISFCONNECTING) {
-			  ret = socket_recv(so->s, (char *)&ret, 0);
-
-			  if (ret < 0) {
-			    /* XXX */
-			    if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				errno == EINPROGRESS || errno == ENOTCONN)
-			      continue; /* Still connecting, continue */
-
-			    /* else failed */
-			    so->so_state = SS_NOFDREF;
-
-			    /* tcp_input will take care of it */
-			  } else {
-			    ret = socket_send(so->s, &ret, 0);
-			    if (ret < 0) {
-			      /* XXX */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-			      /* else failed */
-			      so->so_state = SS_NOFDREF;
-			    } else
-			      so->so_state &= ~SS_ISFCONNECTING;
-
-			  }
-			  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
-			} /* SS_ISFCONNECTING */
-#endif
+			slirp_poll_tcp(so);
 		}
 
 		/*
 		 * Now UDP sockets.
-		 * Incoming packets are sent straight away, they're not buffered.
-		 * Incoming UDP data isn't buffered either.
 		 */
-		for (so = udb.so_next; so != &udb; so = so_next) {
-			so_next = so->so_next;
-
-            if ((so->so_state & SS_PROXIFIED) != 0)
-                continue;
+		for (i = 0; i < udp_poll_list.count; i++) {
+			so = udp_poll_list.sockets[i];
+			if (so == NULL)
+			   continue;
 
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                            sorecvfrom(so);
-                        }
+			slirp_poll_udp(so);
 		}
 	}
 
@@ -642,6 +734,134 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds)
 	 global_xfds = NULL;
 }
 
+/*
+ * The events slirp_select_fill() would select a socket for
+ */
+static int slirp_looper_flags(struct socket *so)
+{
+	int flags = 0;
+
+	if (!link_up || so->s == -1 || (so->so_state & SS_PROXIFIED) != 0)
+		return 0;
+
+	if (so->so_tcpcb == NULL) {
+		/* UDP, see slirp_select_fill() */
+		if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4)
+			flags |= IOLOOPER_READ;
+		return flags;
+	}
+
+	if (so->so_state & SS_NOFDREF)
+		return 0;
+	if (so->so_state & SS_FACCEPTCONN)
+		return IOLOOPER_READ;
+	if (so->so_state & SS_ISFCONNECTING)
+		return IOLOOPER_WRITE;
+
+	if (CONN_CANFSEND(so) && so->so_rcv.sb_cc)
+		flags |= IOLOOPER_WRITE;
+	if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2)))
+		flags |= IOLOOPER_READ | IOLOOPER_EXCEPT;
+	return flags;
+}
+
+void slirp_looper_fill(IoLooper *looper)
+{
+	struct socket *so;
+	int i;
+
+	if (so_looper != looper) {
+		/* Register all the sockets the first time */
+		so_looper = looper;
+		sopoll_clear(&tcp_poll_list);
+		sopoll_clear(&udp_poll_list);
+		slirp_looper_resync();
+	}
+
+	/*
+	 * The proxy manager goes first, since it may have handed over
+	 * descriptors that are now registered by slirp sockets
+	 */
+	proxy_manager_looper_fill(looper);
+
+	for (i = 0; i < so_changed_list.count; i++) {
+		so = so_changed_list.sockets[i];
+		if (so == NULL)
+		   continue;
+
+		if (so->so_tcpcb != NULL) {
+			/* See if we need a tcp_fasttimo */
+			if (link_up && time_fasttimo == 0 &&
+			    so->so_tcpcb->t_flags & TF_DELACK)
+			   time_fasttimo = curtime;
+		} else if (so->so_expire) {
+			udp_expiring = 1;
+		}
+		sopoll_watch(so, slirp_looper_flags(so));
+	}
+	sopoll_clear(&so_changed_list);
+
+	do_slowtimo = link_up && ((tcb.so_next != &tcb) || udp_expiring ||
+				  (&ipq.ip_link != ipq.ip_link.next));
+}
+
+void slirp_looper_poll(IoLooper *looper)
+{
+	struct socket *so;
+	int i, fd, count;
+
+	/* Update time */
+	updtime();
+
+	if (link_up) {
+		slirp_timers();
+
+		/*
+		 * Only look at the sockets whose descriptor is ready
+		 */
+		count = iolooper_ready_count(looper);
+		for (i = 0; i < count; i++) {
+			fd = iolooper_ready_fd(looper, i);
+			so = sopoll_lookup(fd);
+			if (so == NULL || so->s != fd)
+			   continue;
+
+			looper_so_flags = 0;
+			if (iolooper_is_read(looper, fd))
+				looper_so_flags |= IOLOOPER_READ;
+			if (iolooper_is_write(looper, fd))
+				looper_so_flags |= IOLOOPER_WRITE;
+			if (iolooper_is_except(looper, fd))
+				looper_so_flags |= IOLOOPER_EXCEPT;
+
+			sopoll_changed(so);
+			looper_so = so;
+			if (so->so_tcpcb != NULL)
+				slirp_poll_tcp(so);
+			else
+				slirp_poll_udp(so);
+			looper_so = NULL;
+		}
+	}
+
+	proxy_manager_looper_poll(looper);
+
+	/*
+	 * See if we can start outputting
+	 */
+	if (if_queued && link_up)
+	   if_start();
+}
+
+void slirp_looper_fd_closed(int fd)
+{
+	struct socket *so = sopoll_lookup(fd);
+
+	if (so != NULL)
+		sopoll_unwatch(so);
+	proxy_manager_fd_closed(fd);
+}
+
 #define ETH_ALEN 6
 #define ETH_HLEN 14
 
@@ -858,7 +1078,7 @@ int slirp_redir_rm(int is_udp, int host_port)
  loop_again:
     for (so = head->so_next; so != head; so = so->so_next) {
         if (so->so_faddr_port == host_port) {
-            close(so->s);
+            socket_close(so->s);
             sofree(so);
             n++;
             goto loop_again;
@@ -953,6 +1173,7 @@ void slirp_socket_recv(int addr_low_byte, int guest_port, const uint8_t *buf,
         return;
 
     ret = soreadbuf(so, (const char *)buf, size);
+    sopoll_changed(so);
 
     if (ret > 0)
         tcp_output(sototcpcb(so));
@@ -1132,6 +1353,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_laddr_ip = qemu_get_be32(f);
     so->so_faddr_port = qemu_get_be16(f);
     so->so_laddr_port = qemu_get_be16(f);
+    sohash(&tcb, so);
     so->so_iptos = qemu_get_byte(f);
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
@@ -1141,6 +1363,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     if (slirp_sbuf_load(f, &so->so_snd) < 0)
         return -ENOMEM;
     slirp_tcp_load(f, so->so_tcpcb);
+    sopoll_changed(so);
 
     return 0;
 }
@@ -16,6 +16,7 @@
 #define  SLIRP_COMPILATION 1
 #include "sockets.h"
 #include "proxy_common.h"
+#include "iolooper.h"
 
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
@@ -28,24 +29,228 @@ so_init()
 }
 #endif
 
+/*
+ * Sockets are hashed by their addresses, so that looking up the socket for
+ * an incoming segment or datagram doesn't have to walk the whole tcb/udb
+ * list. TCP sockets are hashed by the full 4-tuple. UDP sockets are hashed
+ * by the local address only, since their foreign address follows the last
+ * datagram sent.
+ */
+#define SO_HASH_SIZE	2048	/* Must be a power of 2 */
+
+static struct socket *tcb_hash[SO_HASH_SIZE];
+static struct socket *udb_hash[SO_HASH_SIZE];
+
+static inline u_int
+so_hashkey(uint32_t laddr, u_int lport, uint32_t faddr, u_int fport)
+{
+	uint32_t h = laddr ^ (faddr * 0x9e3779b1u) ^ ((lport << 16) | fport);
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h & (SO_HASH_SIZE - 1);
+}
+
+/*
+ * (Re)insert a socket into the hash of the list it belongs to.
+ * Must be called whenever the addresses of the socket change.
+ */
+void
+sohash(struct socket *head, struct socket *so)
+{
+	struct socket **bucket;
+
+	sounhash(so);
+	if (head == &udb)
+		bucket = &udb_hash[so_hashkey(so->so_laddr_ip, so->so_laddr_port,
+					      0, 0)];
+	else
+		bucket = &tcb_hash[so_hashkey(so->so_laddr_ip, so->so_laddr_port,
+					      so->so_faddr_ip, so->so_faddr_port)];
+
+	so->so_hash_next = *bucket;
+	if (*bucket)
+		(*bucket)->so_hash_pprev = &so->so_hash_next;
+	so->so_hash_pprev = bucket;
+	*bucket = so;
+}
+
+/*
+ * Remove a socket from the hash, if it is there
+ */
+void
+sounhash(struct socket *so)
+{
+	if (so->so_hash_pprev == NULL)
+		return;
+
+	*so->so_hash_pprev = so->so_hash_next;
+	if (so->so_hash_next)
+		so->so_hash_next->so_hash_pprev = so->so_hash_pprev;
+	so->so_hash_next = NULL;
+	so->so_hash_pprev = NULL;
+}
+
+/*
+ * Find the socket in the tcb or udb list with the given addresses.
+ * The foreign address is ignored for udb.
+ */
 struct socket *
 solookup(struct socket *head, uint32_t laddr, u_int lport,
          uint32_t faddr, u_int fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	if (head == &udb) {
+		so = udb_hash[so_hashkey(laddr, lport, 0, 0)];
+		for (; so != NULL; so = so->so_hash_next) {
+			if (so->so_laddr_port == lport &&
+			    so->so_laddr_ip   == laddr)
+			   break;
+		}
+		return so;
+	}
+
+	so = tcb_hash[so_hashkey(laddr, lport, faddr, fport)];
+	for (; so != NULL; so = so->so_hash_next) {
 		if (so->so_laddr_port == lport &&
 		    so->so_laddr_ip   == laddr &&
 		    so->so_faddr_ip   == faddr &&
 		    so->so_faddr_port == fport)
 		   break;
 	}
-
-	if (so == head)
-	   return (struct socket *)NULL;
 	return so;
+}
+
+/*
+ * Sockets selected by slirp_select_fill(), so that slirp_select_poll() only
+ * has to look at those rather than at every socket in tcb/udb.
+ */
+struct sopoll_list tcp_poll_list, udp_poll_list;
 
+/*
+ * Add a socket to a poll list
+ */
+void
+sopoll_add(struct sopoll_list *list, struct socket *so)
+{
+	if (so->so_poll_list != NULL)
+		return;
+
+	if (list->count == list->size) {
+		int size = list->size ? list->size * 2 : 64;
+		struct socket **sockets = realloc(list->sockets,
+						  size * sizeof(*sockets));
+		if (sockets == NULL)
+			return;
+		list->sockets = sockets;
+		list->size = size;
+	}
+	so->so_poll_list = list;
+	so->so_poll_index = list->count;
+	list->sockets[list->count++] = so;
+}
+
+/*
+ * Empty a poll list
+ */
+void
+sopoll_clear(struct sopoll_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (list->sockets[i])
+			list->sockets[i]->so_poll_list = NULL;
+	}
+	list->count = 0;
+}
+
+IoLooper *so_looper;
+struct sopoll_list so_changed_list;
+
+/* Sockets registered with so_looper, indexed by descriptor */
+static struct socket **so_looper_sockets;
+static int so_looper_sockets_size;
+
+/*
+ * Queue a socket for an update of its so_looper registration.
+ * Must be called whenever something slirp_looper_flags() looks at may
+ * have changed.
+ */
+void
+sopoll_changed(struct socket *so)
+{
+	if (so_looper != NULL)
+		sopoll_add(&so_changed_list, so);
+}
+
+/*
+ * Watch the descriptor of a socket for the given IOLOOPER_XXX events,
+ * or stop watching it if flags is 0
+ */
+void
+sopoll_watch(struct socket *so, int flags)
+{
+	struct socket *old;
+
+	if (so->so_looper_fd >= 0 && (so->so_looper_fd != so->s || flags == 0))
+		sopoll_unwatch(so);
+	if (flags == 0 || so->s < 0)
+		return;
+
+	if (so->so_looper_fd < 0) {
+		if (so->s >= so_looper_sockets_size) {
+			int size = so_looper_sockets_size ? so_looper_sockets_size : 64;
+			struct socket **sockets;
+
+			while (size <= so->s)
+				size *= 2;
+			sockets = realloc(so_looper_sockets, size * sizeof(*sockets));
+			if (sockets == NULL)
+				return;
+			memset(sockets + so_looper_sockets_size, 0,
+			       (size - so_looper_sockets_size) * sizeof(*sockets));
+			so_looper_sockets = sockets;
+			so_looper_sockets_size = size;
+		}
+		/* The descriptor may have been closed without socket_close() */
+		old = so_looper_sockets[so->s];
+		if (old != NULL)
+			sopoll_unwatch(old);
+		so_looper_sockets[so->s] = so;
+		so->so_looper_fd = so->s;
+	}
+	if (so->so_looper_flags != flags) {
+		iolooper_modify(so_looper, so->s, so->so_looper_flags, flags);
+		so->so_looper_flags = flags;
+	}
+}
+
+void
+sopoll_unwatch(struct socket *so)
+{
+	int fd = so->so_looper_fd;
+
+	if (fd < 0)
+		return;
+
+	iolooper_modify(so_looper, fd, so->so_looper_flags, 0);
+	so_looper_sockets[fd] = NULL;
+	so->so_looper_fd = -1;
+	so->so_looper_flags = 0;
+}
+
+/*
+ * Find the socket whose descriptor is registered with so_looper
+ */
+struct socket *
+sopoll_lookup(int fd)
+{
+	if (fd < 0 || fd >= so_looper_sockets_size)
+		return NULL;
+	return so_looper_sockets[fd];
 }
 
 /*
@@ -63,6 +268,7 @@ socreate(void)
     memset(so, 0, sizeof(struct socket));
     so->so_state = SS_NOFDREF;
     so->s = -1;
+    so->so_looper_fd = -1;
   }
   return(so);
 }
@@ -85,6 +291,14 @@ sofree(struct socket *so)
   else if (so == udp_last_so)
     udp_last_so = &udb;
 
+  sounhash(so);
+  sopoll_unwatch(so);
+  /* Make sure slirp_select_poll() doesn't see it anymore */
+  if (so->so_poll_list) {
+    so->so_poll_list->sockets[so->so_poll_index] = NULL;
+    so->so_poll_list = NULL;
+  }
+
   m_free(so->so_m);
 
   if(so->so_next && so->so_prev)
@@ -162,7 +376,7 @@ size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np)
 int
 soread(struct socket *so)
 {
-	int n, nn;
+	int n, nn, len;
 	struct sbuf *sb = &so->so_snd;
 	struct iovec iov[2];
 
@@ -173,7 +387,7 @@ soread(struct socket *so)
 	 * No need to check if there's enough room to read.
 	 * soread wouldn't have been called if there weren't
 	 */
-	sopreprbuf(so, iov, &n);
+	len = sopreprbuf(so, iov, &n);
 
 #ifdef HAVE_READV
 	nn = readv(so->s, (struct iovec *)iov, n);
@@ -217,6 +431,16 @@ soread(struct socket *so)
 	sb->sb_wptr += nn;
 	if (sb->sb_wptr >= (sb->sb_data + sb->sb_datalen))
 		sb->sb_wptr -= sb->sb_datalen;
+
+	/*
+	 * If the host had more data than we could take, and the guest's
+	 * window can hold more than the whole buffer, the buffer is what
+	 * limits the transfer: grow it.
+	 */
+	if (nn == len && sb->sb_datalen < TCP_SNDSPACE_MAX &&
+	    so->so_tcpcb->snd_wnd >= sb->sb_datalen)
+		sbgrow(sb, min(sb->sb_datalen * 2, TCP_SNDSPACE_MAX));
+
 	return nn;
 }
 
@@ -643,8 +867,10 @@ solisten(u_int port, u_int32_t laddr, u_int lport, int flags)
         so->so_faddr_ip = alias_addr_ip;
     else
         so->so_faddr_ip = addr_ip;
+    sohash(&tcb, so);
 
 	so->s = s;
+	sopoll_changed(so);
 	return so;
 }
 
@@ -666,7 +892,7 @@ sounlisten(u_int  port)
 
     sofcantrcvmore( so );
     sofcantsendmore( so );
-    close( so->s );
+    socket_close( so->s );
     so->s = -1;
     sofree( so );
     return 0;
@@ -729,6 +955,8 @@ sofcantrcvmore(struct socket *so)
 		if(global_writefds) {
 		  FD_CLR(so->s,global_writefds);
 		}
+		if (so == looper_so)
+		  looper_so_flags &= ~IOLOOPER_WRITE;
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTSENDMORE)
@@ -748,6 +976,8 @@ sofcantsendmore(struct socket *so)
             if (global_xfds) {
                 FD_CLR(so->s,global_xfds);
             }
+            if (so == looper_so)
+                looper_so_flags &= ~(IOLOOPER_READ|IOLOOPER_EXCEPT);
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTRCVMORE)
@@ -17,8 +17,16 @@
  * Our socket structure
  */
 
+struct sopoll_list;
+
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket *so_hash_next;		/* For the address hash chain */
+  struct socket **so_hash_pprev;
+  struct sopoll_list *so_poll_list;	/* Poll list this socket is in, if any */
+  int so_poll_index;			/* and its index there */
+  int so_looper_fd;			/* Descriptor registered with so_looper, or -1 */
+  int so_looper_flags;			/* and the IOLOOPER_XXX events it is watched for */
 
   int s;                           /* The actual socket */
 
@@ -76,8 +84,37 @@ struct socket {
 
 extern struct socket tcb;
 
+/*
+ * List of sockets that slirp_select_fill() has selected, and that
+ * slirp_select_poll() needs to check. Freed sockets are replaced by NULL.
+ */
+struct sopoll_list {
+  struct socket **sockets;
+  int count;
+  int size;
+};
+
+extern struct sopoll_list tcp_poll_list, udp_poll_list;
+
+/*
+ * When slirp is driven by an IoLooper (see slirp_looper_fill()), socket
+ * descriptors stay registered with it, and the sockets whose events may
+ * have changed are queued in so_changed_list until the next update.
+ */
+struct IoLooper;
+extern struct IoLooper *so_looper;
+extern struct sopoll_list so_changed_list;
+
 void so_init _P((void));
 struct socket * solookup _P((struct socket *, uint32_t, u_int, uint32_t, u_int));
+void sohash _P((struct socket *, struct socket *));
+void sounhash _P((struct socket *));
+void sopoll_add _P((struct sopoll_list *, struct socket *));
+void sopoll_clear _P((struct sopoll_list *));
+void sopoll_changed _P((struct socket *));
+void sopoll_watch _P((struct socket *, int));
+void sopoll_unwatch _P((struct socket *));
+struct socket * sopoll_lookup _P((int));
 struct socket * socreate _P((void));
 void sofree _P((struct socket *));
 int soread _P((struct socket *));
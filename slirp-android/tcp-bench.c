@@ -0,0 +1,201 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* A minimal iperf: measures the TCP throughput of one connection.
+ *
+ * usage: tcp-bench -s [-d] [-p port] [-t seconds] [address]
+ *        tcp-bench -c host [-d] [-p port] [-t seconds]
+ *
+ * The server (-s) listens on 'address' (default: 127.0.0.1) and 'port'
+ * (default: 5001), and accepts a single connection. By default the client
+ * (-c) sends data for 'seconds' (default: 5), and the server receives it;
+ * with -d, the server sends and the client receives. The receiving side
+ * prints the throughput.
+ *
+ * slirp-bench.sh uses it to measure the throughput of guest connections
+ * through the user mode network stack, in both directions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define  BENCH_BUFFER_SIZE  65536
+
+static char  _buffer[BENCH_BUFFER_SIZE];
+
+static double
+now_s(void)
+{
+    struct timeval  tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: tcp-bench -s [-d] [-p port] [-t seconds] [address]\n"
+                    "       tcp-bench -c host [-d] [-p port] [-t seconds]\n");
+    exit(1);
+}
+
+static int
+resolve(const char* host, int port, struct sockaddr_in* addr)
+{
+    struct hostent*  he = gethostbyname(host);
+
+    if (he == NULL || he->h_addrtype != AF_INET) {
+        fprintf(stderr, "unknown host: %s\n", host);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port   = htons(port);
+    memcpy(&addr->sin_addr, he->h_addr_list[0], sizeof(addr->sin_addr));
+    return 0;
+}
+
+/* Sends data until 'seconds' have elapsed, or the peer goes away. */
+static int
+send_data(int fd, double seconds)
+{
+    double  end = now_s() + seconds;
+
+    memset(_buffer, 'x', sizeof(_buffer));
+    while (now_s() < end) {
+        ssize_t  ret = send(fd, _buffer, sizeof(_buffer), 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Receives data until the peer closes the connection, and prints the
+ * throughput, measured from the first byte received. */
+static int
+receive_data(int fd, const char* what)
+{
+    long long  total = 0;
+    double     start = 0, elapsed;
+
+    for (;;) {
+        ssize_t  ret = recv(fd, _buffer, sizeof(_buffer), 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        if (total == 0)
+            start = now_s();
+        total += ret;
+    }
+    elapsed = now_s() - start;
+    if (total == 0 || elapsed <= 0) {
+        fprintf(stderr, "%s: no data received\n", what);
+        return -1;
+    }
+    printf("%s: %lld bytes in %.2f s, %.1f Mbit/s\n",
+           what, total, elapsed, total * 8 / elapsed / 1e6);
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char*         host     = NULL;
+    const char*         address  = "127.0.0.1";
+    int                 server   = 0;
+    int                 download = 0;
+    int                 port     = 5001;
+    double              seconds  = 5;
+    struct sockaddr_in  addr;
+    int                 fd, nn, ret;
+
+    for (nn = 1; nn < argc; nn++) {
+        if (!strcmp(argv[nn], "-s")) {
+            server = 1;
+        } else if (!strcmp(argv[nn], "-d")) {
+            download = 1;
+        } else if (argv[nn][0] != '-') {
+            address = argv[nn];
+        } else if (nn + 1 == argc) {
+            usage();
+        } else if (!strcmp(argv[nn], "-c")) {
+            host = argv[++nn];
+        } else if (!strcmp(argv[nn], "-p")) {
+            port = atoi(argv[++nn]);
+        } else if (!strcmp(argv[nn], "-t")) {
+            seconds = atof(argv[++nn]);
+        } else {
+            usage();
+        }
+    }
+    if (server == (host != NULL) || port <= 0 || port > 65535 || seconds <= 0)
+        usage();
+
+    /* the receiving side reports the error when the connection is reset */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (resolve(server ? address : host, port, &addr) < 0)
+        return 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    if (server) {
+        int  on = 1, conn;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(fd, 1) < 0) {
+            perror("bind");
+            return 1;
+        }
+        conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            perror("accept");
+            return 1;
+        }
+        close(fd);
+        fd = conn;
+    } else if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 1;
+    }
+
+    if (server == download)
+        ret = send_data(fd, seconds);
+    else
+        ret = receive_data(fd, download ? "download" : "upload");
+
+    close(fd);
+    return ret < 0;
+}
@@ -49,6 +49,11 @@ extern struct socket *tcp_last_so;
 #define TCP_SNDSPACE 8192
 #define TCP_RCVSPACE 8192
 
+/* socket buffers start at TCP_SNDSPACE/TCP_RCVSPACE and grow up to these
+ * when the buffer is what limits the transfer (see sbgrow() callers) */
+#define TCP_SNDSPACE_MAX (1024*1024)
+#define TCP_RCVSPACE_MAX (1024*1024)
+
 /*
  * TCP header.
  * Per RFC 793, September, 1981.
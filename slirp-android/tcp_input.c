@@ -257,6 +257,7 @@ tcp_input(struct mbuf *m, int iphlen, struct socket *inso)
 	 */
 	if (m == NULL) {
 		so = inso;
+		sopoll_changed(so);
 
 		/* Re-set a few variables */
 		tp = sototcpcb(so);
@@ -266,6 +267,12 @@ tcp_input(struct mbuf *m, int iphlen, struct socket *inso)
 		tiwin = ti->ti_win;
 		tiflags = ti->ti_flags;
 
+		/* The SYN options are still in the mbuf, after the header */
+		if (ti->ti_off > (sizeof (struct tcphdr) >> 2)) {
+			optlen = (ti->ti_off << 2) - sizeof (struct tcphdr);
+			optp = (caddr_t)(ti + 1);
+		}
+
 		goto cont_conn;
 	}
 
@@ -422,6 +429,7 @@ findso:
 	  so->so_laddr_port = port_geth(ti->ti_sport);
 	  so->so_faddr_ip   = ip_geth(ti->ti_dst);
 	  so->so_faddr_port = port_geth(ti->ti_dport);
+	  sohash(&tcb, so);
 
 	  if ((so->so_iptos = tcp_tos(so)) == 0)
 	    so->so_iptos = ((struct ip *)ti)->ip_tos;
@@ -430,6 +438,9 @@ findso:
 	  tp->t_state = TCPS_LISTEN;
 	}
 
+	/* The segment may change what the socket has to be polled for */
+	sopoll_changed(so);
+
         /*
          * If this is a still-connecting socket, this probably
          * a retransmit of the SYN.  Whether it's a retransmit SYN
@@ -447,10 +458,9 @@ findso:
 		goto drop;
 
 	/* Unscale the window into a 32-bit value. */
-/*	if ((tiflags & TH_SYN) == 0)
- *		tiwin = ti->ti_win << tp->snd_scale;
- *	else
- */
+	if ((tiflags & TH_SYN) == 0)
+		tiwin = ti->ti_win << tp->snd_scale;
+	else
 		tiwin = ti->ti_win;
 
 	/*
@@ -567,6 +577,17 @@ findso:
 			 * we have enough buffer space to take it.
 			 */
 			STAT(tcpstat.tcps_preddat++);
+			/*
+			 * If the guest filled the whole window we offered
+			 * while the host keeps up with the data, the window
+			 * is what limits the transfer: grow the buffer.
+			 */
+			if (SEQ_GEQ(ti->ti_seq + ti->ti_len, tp->rcv_adv) &&
+			    so->so_rcv.sb_cc < so->so_rcv.sb_datalen / 2 &&
+			    so->so_rcv.sb_datalen < TCP_RCVSPACE_MAX &&
+			    ((u_int32_t)TCP_MAXWIN << tp->rcv_scale) > so->so_rcv.sb_datalen)
+				sbgrow(&so->so_rcv, min(so->so_rcv.sb_datalen * 2,
+							TCP_RCVSPACE_MAX));
 			tp->rcv_nxt += ti->ti_len;
 			STAT(tcpstat.tcps_rcvpack++);
 			STAT(tcpstat.tcps_rcvbyte += ti->ti_len);
@@ -782,12 +803,11 @@ findso:
 			tp->t_state = TCPS_ESTABLISHED;
 
 			/* Do window scaling on this connection? */
-/*			if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
- *				(TF_RCVD_SCALE|TF_REQ_SCALE)) {
- * 				tp->snd_scale = tp->requested_s_scale;
- *				tp->rcv_scale = tp->request_r_scale;
- *			}
- */
+			if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+				(TF_RCVD_SCALE|TF_REQ_SCALE)) {
+				tp->snd_scale = tp->requested_s_scale;
+				tp->rcv_scale = tp->request_r_scale;
+			}
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
 			/*
@@ -1052,12 +1072,14 @@ trimthenstep6:
 		}
 
 		/* Do window scaling? */
-/*		if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
- *			(TF_RCVD_SCALE|TF_REQ_SCALE)) {
- *			tp->snd_scale = tp->requested_s_scale;
- *			tp->rcv_scale = tp->request_r_scale;
- *		}
- */
+		if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+			(TF_RCVD_SCALE|TF_REQ_SCALE)) {
+			tp->snd_scale = tp->requested_s_scale;
+			tp->rcv_scale = tp->request_r_scale;
+			/* this ACK's window was unscaled above, before
+			 * snd_scale was known */
+			tiwin = ti->ti_win << tp->snd_scale;
+		}
 		(void) tcp_reass(tp, (struct tcpiphdr *)0, (struct mbuf *)0);
 		tp->snd_wl1 = ti->ti_seq - 1;
 		/* Avoid ack processing; snd_una==ti_ack  =>  dup ack */
@@ -1535,15 +1557,15 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
 
-/*		case TCPOPT_WINDOW:
- *			if (optlen != TCPOLEN_WINDOW)
- *				continue;
- *			if (!(ti->ti_flags & TH_SYN))
- *				continue;
- *			tp->t_flags |= TF_RCVD_SCALE;
- *			tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
- *			break;
- */
+		case TCPOPT_WINDOW:
+			if (optlen != TCPOLEN_WINDOW)
+				continue;
+			if (!(ti->ti_flags & TH_SYN))
+				continue;
+			tp->t_flags |= TF_RCVD_SCALE;
+			tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
+			break;
+
 /*		case TCPOPT_TIMESTAMP:
  *			if (optlen != TCPOLEN_TIMESTAMP)
  *				continue;
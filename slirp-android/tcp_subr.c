@@ -43,8 +43,8 @@
 #include "proxy_common.h"
 
 /* patchable/settable parameters for tcp */
-/* Don't do rfc1323 performance enhancements */
-#define TCP_DO_RFC1323 0
+/* Do rfc1323 window scaling, but not timestamps */
+#define TCP_DO_RFC1323 1
 
 /*
  * Tcp initialization
@@ -190,9 +190,14 @@ tcp_newtcpcb(struct socket *so)
 	tp->seg_next = tp->seg_prev = (struct tcpiphdr*)tp;
 	tp->t_maxseg = TCP_MSS;
 
-	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
+	tp->t_flags = TCP_DO_RFC1323 ? TF_REQ_SCALE : 0;
 	tp->t_socket = so;
 
+	/* Request a window scale that covers the largest receive buffer */
+	while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+	       (TCP_MAXWIN << tp->request_r_scale) < TCP_RCVSPACE_MAX)
+		tp->request_r_scale++;
+
 	/*
 	 * Init srtt to TCPTV_SRTTBASE (0), so we can tell that we have no
 	 * rtt estimate.  Set rttvar so that srtt + 2 * rttvar gives
@@ -511,6 +516,7 @@ tcp_connect(struct socket *inso)
 	/* Translate connections from localhost to the real hostname */
 	if (addr_ip == 0 || addr_ip == loopback_addr_ip)
 	   so->so_faddr_ip = alias_addr_ip;
+	sohash(&tcb, so);
 
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
@@ -519,6 +525,7 @@ tcp_connect(struct socket *inso)
 					   /* if it's not FACCEPTONCE, it's already NOFDREF */
 	}
 	so->s = s;
+	sopoll_changed(so);
 
 	so->so_iptos = tcp_tos(so);
 	tp = sototcpcb(so);
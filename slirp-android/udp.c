@@ -170,20 +170,9 @@ udp_input(register struct mbuf *m, int iphlen)
 	so = udp_last_so;
 	if (so->so_laddr_port != port_geth(uh->uh_sport) ||
 	    so->so_laddr_ip   != ip_geth(ip->ip_src)) {
-		struct socket *tmp;
-
-		for (tmp = udb.so_next; tmp != &udb; tmp = tmp->so_next) {
-			if (tmp->so_laddr_port == port_geth(uh->uh_sport) &&
-			    tmp->so_laddr_ip   == ip_geth(ip->ip_src)) {
-				tmp->so_faddr_ip   = ip_geth(ip->ip_dst);
-				tmp->so_faddr_port = port_geth(uh->uh_dport);
-				so = tmp;
-				break;
-			}
-		}
-		if (tmp == &udb) {
-		  so = NULL;
-		} else {
+		so = solookup(&udb, ip_geth(ip->ip_src), port_geth(uh->uh_sport),
+			      0, 0);
+		if (so) {
 		  STAT(udpstat.udpps_pcbcachemiss++);
 		  udp_last_so = so;
 		}
@@ -208,6 +197,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	  /* udp_last_so = so; */
 	  so->so_laddr_ip   = ip_geth(ip->ip_src);
 	  so->so_laddr_port = port_geth(uh->uh_sport);
+	  sohash(&udb, so);
 
 	  if ((so->so_iptos = udp_tos(so)) == 0)
 	    so->so_iptos = ip->ip_tos;
@@ -217,6 +207,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	   * and if it is, do the fork_exec() etc.
 	   */
 	}
+	sopoll_changed(so);
 
         so->so_faddr_ip   = ip_geth(ip->ip_dst); /* XXX */
         so->so_faddr_port = port_geth(uh->uh_dport); /* XXX */
@@ -344,6 +335,7 @@ udp_attach(struct socket *so)
       /* success, insert in queue */
       so->so_expire = curtime + SO_EXPIRE;
       insque(so,&udb);
+      sopoll_changed(so);
   }
   return(so->s);
 }
@@ -460,10 +452,12 @@ udp_listen(u_int port, u_int32_t laddr, u_int lport, int flags)
 
 	so->so_laddr_port = lport;
 	so->so_laddr_ip   = laddr;
+	sohash(&udb, so);
 	if (flags != SS_FACCEPTONCE)
 	   so->so_expire = 0;
 
 	so->so_state = SS_ISFCONNECTED;
+	sopoll_changed(so);
 
 	return so;
 }
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Measures the TCP throughput of guest connections through the user mode
+# network stack (slirp-android), in both directions, with tcp-bench:
+#
+#  - upload: the guest sends to a listener on the host's 127.0.0.1.
+#  - download: a sender on the host's 127.0.0.1 sends to the guest.
+#
+# The guest TCP stack is the host's own: the emulator runs with both
+# '-net user' and '-net tap' on the same VLAN, in a private network
+# namespace, and the tap interface is configured as the guest, 10.0.2.15.
+# Connections to 10.0.2.2 go through slirp, which connects to 127.0.0.1 in
+# the same namespace. The kernel image is only needed to start the
+# emulator, the guest doesn't use the network.
+#
+# This must run as root, to create the namespace and the tap interface.
+#
+# usage: slirp-bench.sh [-q emulator] [-b tcp-bench] [-t seconds] kernel
+#
+#   -q  path to the emulator (default: objs/qemu-android)
+#   -b  path to tcp-bench (default: objs/tcp-bench)
+#   -t  duration of each transfer, in seconds (default: 5)
+#
+# The window scale option of the namespace's SYNs follows the host's
+# net.ipv4.tcp_window_scaling setting.
+
+EMULATOR=objs/qemu-android
+TCP_BENCH=objs/tcp-bench
+SECONDS_=5
+NETNS=slirp-bench.$$
+
+while getopts "q:b:t:" OPT; do
+    case $OPT in
+        q) EMULATOR=$OPTARG ;;
+        b) TCP_BENCH=$OPTARG ;;
+        t) SECONDS_=$OPTARG ;;
+        *) sed -n 's/^# usage: /usage: /p' $0; exit 1 ;;
+    esac
+done
+shift $(($OPTIND - 1))
+KERNEL=$1
+
+if [ -z "$KERNEL" ]; then
+    sed -n 's/^# usage: /usage: /p' $0
+    exit 1
+fi
+for BIN in $EMULATOR $TCP_BENCH; do
+    if [ ! -x "$BIN" ]; then
+        echo "$BIN not found, build the emulator first or use -q/-b" >&2
+        exit 1
+    fi
+done
+
+ip netns add $NETNS || exit 1
+trap 'kill $EMULATOR_PID 2>/dev/null; wait; ip netns del $NETNS' EXIT
+ip netns exec $NETNS ip link set lo up
+
+ip netns exec $NETNS $EMULATOR -kernel $KERNEL -nographic \
+    -net user -net tap,ifname=tap-bench,script=no \
+    < /dev/null > /dev/null 2>&1 &
+EMULATOR_PID=$!
+
+# wait for the emulator to create the tap interface
+TRIES=0
+while ! ip netns exec $NETNS ip link show tap-bench > /dev/null 2>&1; do
+    TRIES=$(($TRIES + 1))
+    if [ $TRIES -gt 50 ]; then
+        echo "the emulator did not create its tap interface" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+ip netns exec $NETNS ip addr add 10.0.2.15/24 dev tap-bench
+ip netns exec $NETNS ip link set tap-bench up
+
+# $1: -d for a download, nothing for an upload
+run ()
+{
+    ip netns exec $NETNS $TCP_BENCH -s $1 -p 5001 -t $SECONDS_ &
+    sleep 0.5
+    ip netns exec $NETNS $TCP_BENCH -c 10.0.2.2 $1 -p 5001 -t $SECONDS_
+    wait $!
+}
+
+run
+run -d
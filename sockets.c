@@ -1219,6 +1219,14 @@ int socket_init(void)
 
 #endif /* !_WIN32 */
 
+static void (*_socket_close_hook)( int  fd );
+
+void
+socket_set_close_hook( void (*hook)( int  fd ) )
+{
+    _socket_close_hook = hook;
+}
+
 #ifdef _WIN32
 
 static void
@@ -1245,6 +1253,9 @@ socket_close( int  fd )
 {
     int  old_errno = errno;
 
+    if (_socket_close_hook)
+        _socket_close_hook(fd);
+
     shutdown( fd, SD_BOTH );
     /* we want to drain the socket before closing it */
     qemu_set_fd_handler( fd, socket_close_handler, NULL, (void*)fd );
@@ -1261,6 +1272,9 @@ socket_close( int  fd )
 {
     int  old_errno = errno;
 
+    if (_socket_close_hook)
+        _socket_close_hook(fd);
+
     shutdown( fd, SHUT_RDWR );
     close( fd );
 
@@ -357,6 +357,12 @@ int  socket_get_error(int  fd);
  */
 void  socket_close( int  fd );
 
+/* set a function that socket_close() calls with the descriptor it is about
+ * to close. this is used by event loops that keep descriptors registered
+ * between waits (e.g. with epoll), and need to know when a descriptor number
+ * may be recycled. */
+void  socket_set_close_hook( void (*hook)( int  fd ) );
+
 /* the following functions are equivalent to the BSD sockets ones
  */
 int   socket_recv    ( int  fd, void*  buf, int  buflen );
@@ -80,6 +80,12 @@ int qemu_savevm_state_complete(QEMUFile *f);
 int qemu_savevm_state(QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
 
+/* Lazy restore of the RAM of snapshots, see vl-android.c */
+extern int ram_lazy_restore;
+void ram_lazy_begin(BlockDriverState *bs);
+void ram_lazy_end(void);
+void ram_lazy_finish(void);
+
 void qemu_errors_to_file(FILE *fp);
 void qemu_errors_to_mon(Monitor *mon);
 void qemu_errors_to_previous(void);
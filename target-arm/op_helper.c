@@ -287,6 +287,11 @@ void HELPER(wfi)(void)
     cpu_loop_exit();
 }
 
+void *HELPER(lookup_tb_ptr)(void)
+{
+    return tb_lookup_ptr();
+}
+
 void HELPER(exception)(uint32_t excp)
 {
     env->exception_index = excp;
@@ -836,7 +836,7 @@ static inline void gen_bx(DisasContext *s, TCGv var)
 {
     TCGv tmp;
 
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tmp = new_tmp();
     tcg_gen_andi_i32(tmp, var, 1);
     store_cpu_field(tmp, thumb);
@@ -9062,8 +9062,18 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+#ifdef TCG_TARGET_HAS_goto_ptr
+            {
+                /* look the next TB up without leaving the generated code */
+                TCGv_ptr ptr = tcg_temp_new_ptr();
+                gen_helper_lookup_tb_ptr(ptr);
+                tcg_gen_goto_ptr(ptr);
+                tcg_temp_free_ptr(ptr);
+            }
+            break;
+#endif
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -0,0 +1,469 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#include "tb-cache.h"
+#ifdef CONFIG_TRACE
+#include "trace.h"
+#endif
+#ifdef CONFIG_MEMCHECK
+#include "memcheck/memcheck_api.h"
+#endif
+
+#ifdef TCG_TARGET_HAS_TB_RELOCS
+
+#define TB_CACHE_MAGIC      0x43425451  /* 'QTBC' */
+#define TB_CACHE_VERSION    1
+
+#define TB_CACHE_HASH_BITS  14
+#define TB_CACHE_HASH_SIZE  (1 << TB_CACHE_HASH_BITS)
+
+/* maximum total size of the entries, in memory and on disk */
+#define TB_CACHE_MAX_BYTES  (64 * 1024 * 1024)
+
+/* maximum number of versions of a block (same pc and flags, different
+   guest code) kept in the cache */
+#define TB_CACHE_MAX_VERSIONS  4
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+    uint32_t count;
+    uint32_t reserved;
+} TBCacheHeader;
+
+typedef struct {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    uint32_t icount;
+    uint16_t cflags;
+    uint16_t size;              /* size of the guest code */
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[4];
+    uint32_t code_size;         /* size of the host code */
+    uint32_t nb_relocs;
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    struct TBCacheEntry *hash_next;
+    TBCacheRecord rec;
+    /* followed by the guest code, then the host code. The value of
+       TCG_TB_RELOC_TB relocations is relative to the TB address. */
+    TCGTBReloc relocs[0];
+} TBCacheEntry;
+
+static char *tb_cache_path;
+static int tb_cache_loaded;
+static int tb_cache_dirty;
+static uint64_t tb_cache_fingerprint;
+static unsigned long tb_cache_bytes;
+static TBCacheEntry *tb_cache_hash[TB_CACHE_HASH_SIZE];
+
+static inline unsigned int tb_cache_hash_func(target_ulong pc, uint64_t flags)
+{
+    uint64_t h = (pc >> 1) ^ (flags * 0x9e3779b97f4a7c15ULL);
+    return (h ^ (h >> 14) ^ (h >> 28) ^ (h >> 42)) & (TB_CACHE_HASH_SIZE - 1);
+}
+
+static inline unsigned long tb_cache_entry_size(const TBCacheRecord *rec)
+{
+    return sizeof(TBCacheEntry) + rec->nb_relocs * sizeof(TCGTBReloc) +
+           rec->size + rec->code_size;
+}
+
+static inline uint8_t *tb_cache_guest_code(TBCacheEntry *e)
+{
+    return (uint8_t *)(e->relocs + e->rec.nb_relocs);
+}
+
+static inline uint8_t *tb_cache_host_code(TBCacheEntry *e)
+{
+    return tb_cache_guest_code(e) + e->rec.size;
+}
+
+static inline int tb_cache_same_block(const TBCacheRecord *rec,
+                                      target_ulong pc, target_ulong cs_base,
+                                      uint64_t flags, int cflags)
+{
+    return rec->pc == pc && rec->cs_base == cs_base &&
+           rec->flags == flags && rec->cflags == cflags;
+}
+
+static inline uint64_t tb_cache_mix(uint64_t h, uint64_t value)
+{
+    int n;
+
+    /* FNV-1a, one byte at a time */
+    for (n = 0; n < 8; n++) {
+        h ^= (value >> (n * 8)) & 0xff;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* The generated code refers to helpers and to the prologue by address,
+   and depends on the cpu model and on the translation options. The cache
+   can only be reused by the same binary, with the same configuration. */
+static uint64_t tb_cache_compute_fingerprint(CPUState *env)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t helpers = 0;
+    int n;
+
+    h = tb_cache_mix(h, TB_CACHE_VERSION);
+    h = tb_cache_mix(h, sizeof(CPUState));
+    h = tb_cache_mix(h, TARGET_PAGE_BITS);
+    h = tb_cache_mix(h, use_icount);
+    h = tb_cache_mix(h, (unsigned long)tb_gen_code);
+    h = tb_cache_mix(h, (unsigned long)code_gen_prologue);
+#ifdef TARGET_ARM
+    h = tb_cache_mix(h, env->cp15.c0_cpuid);
+    h = tb_cache_mix(h, env->features);
+#endif
+    /* the helper table is sorted lazily, don't depend on its order */
+    for (n = 0; n < tcg_ctx.nb_helpers; n++) {
+        helpers += tb_cache_mix(0xcbf29ce484222325ULL,
+                                tcg_ctx.helpers[n].func);
+    }
+    return tb_cache_mix(h, helpers);
+}
+
+/* The translator output also depends on debugging and tracing state that
+   is not part of the TB flags. Don't use the cache while they're active. */
+static int tb_cache_usable(CPUState *env)
+{
+    if (!tb_cache_path || singlestep || env->singlestep_enabled)
+        return 0;
+    if (!QTAILQ_EMPTY(&env->breakpoints))
+        return 0;
+#ifdef CONFIG_TRACE
+    if (tracing)
+        return 0;
+#endif
+#ifdef CONFIG_MEMCHECK
+    if (memcheck_enabled)
+        return 0;
+#endif
+    return 1;
+}
+
+static void tb_cache_remove(TBCacheEntry **pe)
+{
+    TBCacheEntry *e = *pe;
+
+    *pe = e->hash_next;
+    tb_cache_bytes -= tb_cache_entry_size(&e->rec);
+    qemu_free(e);
+}
+
+static void tb_cache_insert(TBCacheEntry *e)
+{
+    TBCacheEntry **pe = &tb_cache_hash[tb_cache_hash_func(e->rec.pc,
+                                                          e->rec.flags)];
+    int versions = 0;
+
+    e->hash_next = *pe;
+    *pe = e;
+    tb_cache_bytes += tb_cache_entry_size(&e->rec);
+
+    /* drop the oldest version if there are too many */
+    for (pe = &e->hash_next; *pe != NULL; ) {
+        TBCacheRecord *rec = &(*pe)->rec;
+        if (tb_cache_same_block(rec, e->rec.pc, e->rec.cs_base,
+                                e->rec.flags, e->rec.cflags) &&
+            ++versions >= TB_CACHE_MAX_VERSIONS) {
+            tb_cache_remove(pe);
+            continue;
+        }
+        pe = &(*pe)->hash_next;
+    }
+}
+
+/* The relocations and jump offsets of an entry read from the file are
+   applied to the code buffer as is. Check that they point inside the host
+   code of the entry. */
+static int tb_cache_entry_valid(TBCacheEntry *e)
+{
+    const TBCacheRecord *rec = &e->rec;
+    uint32_t n;
+
+    for (n = 0; n < rec->nb_relocs; n++) {
+        const TCGTBReloc *r = &e->relocs[n];
+
+        if ((uint32_t)r->offset + 4 > rec->code_size)
+            return 0;
+        if (r->type == TCG_TB_RELOC_TB) {
+            if ((unsigned long)r->value > 3)
+                return 0;
+        } else if (r->type != TCG_TB_RELOC_PC32) {
+            return 0;
+        }
+    }
+    for (n = 0; n < 2; n++) {
+        if (rec->tb_next_offset[n] == 0xffff)
+            continue;
+        if (rec->tb_next_offset[n] >= rec->code_size)
+            return 0;
+#ifdef USE_DIRECT_JUMP
+        if ((uint32_t)rec->tb_jmp_offset[n] + 4 > rec->code_size)
+            return 0;
+        if (rec->tb_jmp_offset[n + 2] != 0xffff &&
+            (uint32_t)rec->tb_jmp_offset[n + 2] + 4 > rec->code_size)
+            return 0;
+#endif
+    }
+    return 1;
+}
+
+static void tb_cache_read(CPUState *env)
+{
+    TBCacheHeader header;
+    TBCacheRecord rec;
+    FILE *f;
+    uint32_t n;
+
+    tb_cache_loaded = 1;
+    tb_cache_fingerprint = tb_cache_compute_fingerprint(env);
+
+    f = fopen(tb_cache_path, "rb");
+    if (f == NULL)
+        return;
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != TB_CACHE_MAGIC ||
+        header.version != TB_CACHE_VERSION ||
+        header.fingerprint != tb_cache_fingerprint) {
+        /* written by another binary or configuration, start over */
+        fclose(f);
+        return;
+    }
+
+    for (n = 0; n < header.count; n++) {
+        TBCacheEntry *e;
+        unsigned long size;
+
+        if (fread(&rec, sizeof(rec), 1, f) != 1)
+            break;
+        if (rec.nb_relocs > TCG_MAX_TB_RELOCS ||
+            rec.size == 0 || rec.size > TARGET_PAGE_SIZE ||
+            rec.code_size > code_gen_max_block_size())
+            break;
+        size = tb_cache_entry_size(&rec);
+        if (tb_cache_bytes + size > TB_CACHE_MAX_BYTES)
+            break;
+
+        e = qemu_malloc(size);
+        e->rec = rec;
+        if (fread(e->relocs, size - sizeof(*e), 1, f) != 1) {
+            qemu_free(e);
+            break;
+        }
+        if (!tb_cache_entry_valid(e)) {
+            qemu_free(e);
+            continue;
+        }
+        tb_cache_insert(e);
+    }
+    fclose(f);
+}
+
+int tb_cache_init(const char *path)
+{
+    tb_cache_path = qemu_strdup(path);
+    return 0;
+}
+
+void tb_cache_close(void)
+{
+    TBCacheHeader header;
+    FILE *f;
+    int n;
+
+    if (!tb_cache_path || !tb_cache_loaded)
+        return;
+
+    if (tb_cache_dirty) {
+        f = fopen(tb_cache_path, "wb");
+        if (f == NULL) {
+            fprintf(stderr, "Could not write TB cache file '%s'\n",
+                    tb_cache_path);
+        } else {
+            TBCacheEntry *e;
+
+            memset(&header, 0, sizeof(header));
+            header.magic = TB_CACHE_MAGIC;
+            header.version = TB_CACHE_VERSION;
+            header.fingerprint = tb_cache_fingerprint;
+            for (n = 0; n < TB_CACHE_HASH_SIZE; n++) {
+                for (e = tb_cache_hash[n]; e != NULL; e = e->hash_next)
+                    header.count++;
+            }
+            fwrite(&header, sizeof(header), 1, f);
+            for (n = 0; n < TB_CACHE_HASH_SIZE; n++) {
+                for (e = tb_cache_hash[n]; e != NULL; e = e->hash_next) {
+                    fwrite(&e->rec, tb_cache_entry_size(&e->rec) -
+                           offsetof(TBCacheEntry, rec), 1, f);
+                }
+            }
+            fclose(f);
+        }
+    }
+
+    for (n = 0; n < TB_CACHE_HASH_SIZE; n++) {
+        while (tb_cache_hash[n] != NULL)
+            tb_cache_remove(&tb_cache_hash[n]);
+    }
+    qemu_free(tb_cache_path);
+    tb_cache_path = NULL;
+    tb_cache_loaded = 0;
+    tb_cache_dirty = 0;
+}
+
+int tb_cache_load(CPUState *env, TranslationBlock *tb,
+                  target_ulong phys_pc, int *code_size)
+{
+    TBCacheEntry *e;
+    uint8_t *guest_code;
+
+    if (!tb_cache_usable(env))
+        return 0;
+    if (!tb_cache_loaded)
+        tb_cache_read(env);
+
+    e = tb_cache_hash[tb_cache_hash_func(tb->pc, tb->flags)];
+    if (e == NULL)
+        return 0;
+
+    guest_code = qemu_get_ram_ptr(phys_pc);
+    for (; e != NULL; e = e->hash_next) {
+        TBCacheRecord *rec = &e->rec;
+        uint32_t n;
+
+        if (!tb_cache_same_block(rec, tb->pc, tb->cs_base,
+                                 tb->flags, tb->cflags))
+            continue;
+        if (memcmp(guest_code, tb_cache_guest_code(e), rec->size))
+            continue;
+
+        memcpy(tb->tc_ptr, tb_cache_host_code(e), rec->code_size);
+        for (n = 0; n < rec->nb_relocs; n++) {
+            TCGTBReloc *r = &e->relocs[n];
+            uint8_t *ptr = tb->tc_ptr + r->offset;
+
+            switch (r->type) {
+            case TCG_TB_RELOC_PC32:
+                *(uint32_t *)ptr = r->value - (tcg_target_long)ptr - 4;
+                break;
+            case TCG_TB_RELOC_TB:
+                *(uint32_t *)ptr = (tcg_target_long)tb + r->value;
+                break;
+            }
+        }
+
+        tb->size = rec->size;
+        tb->icount = rec->icount;
+        tb->tb_next_offset[0] = rec->tb_next_offset[0];
+        tb->tb_next_offset[1] = rec->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+        memcpy(tb->tb_jmp_offset, rec->tb_jmp_offset,
+               sizeof(tb->tb_jmp_offset));
+#endif
+        *code_size = rec->code_size;
+        return 1;
+    }
+    return 0;
+}
+
+void tb_cache_store(CPUState *env, TranslationBlock *tb,
+                    target_ulong phys_pc, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheRecord rec;
+    TBCacheEntry *e;
+    unsigned long size;
+    int n;
+
+    if (!tb_cache_usable(env) || !tb_cache_loaded)
+        return;
+
+    /* only cache blocks contained in a single page, whose code can be
+       relocated */
+    if (s->nb_tb_relocs > TCG_MAX_TB_RELOCS || tb->size == 0 ||
+        (tb->pc & ~TARGET_PAGE_MASK) + tb->size > TARGET_PAGE_SIZE)
+        return;
+    for (n = 0; n < s->nb_tb_relocs; n++) {
+        if (s->tb_relocs[n].type == TCG_TB_RELOC_TB &&
+            (unsigned long)(s->tb_relocs[n].value - (tcg_target_long)tb) > 3)
+            return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.pc = tb->pc;
+    rec.cs_base = tb->cs_base;
+    rec.flags = tb->flags;
+    rec.cflags = tb->cflags;
+    rec.icount = tb->icount;
+    rec.size = tb->size;
+    rec.tb_next_offset[0] = tb->tb_next_offset[0];
+    rec.tb_next_offset[1] = tb->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    memcpy(rec.tb_jmp_offset, tb->tb_jmp_offset, sizeof(rec.tb_jmp_offset));
+#endif
+    rec.code_size = code_size;
+    rec.nb_relocs = s->nb_tb_relocs;
+
+    size = tb_cache_entry_size(&rec);
+    if (tb_cache_bytes + size > TB_CACHE_MAX_BYTES)
+        return;
+
+    e = qemu_malloc(size);
+    e->rec = rec;
+    for (n = 0; n < s->nb_tb_relocs; n++) {
+        e->relocs[n] = s->tb_relocs[n];
+        if (e->relocs[n].type == TCG_TB_RELOC_TB)
+            e->relocs[n].value -= (tcg_target_long)tb;
+    }
+    memcpy(tb_cache_guest_code(e), qemu_get_ram_ptr(phys_pc), tb->size);
+    memcpy(tb_cache_host_code(e), tb->tc_ptr, code_size);
+    tb_cache_insert(e);
+    tb_cache_dirty = 1;
+}
+
+#else /* !TCG_TARGET_HAS_TB_RELOCS */
+
+int tb_cache_init(const char *path)
+{
+    return -1;
+}
+
+void tb_cache_close(void)
+{
+}
+
+int tb_cache_load(CPUState *env, TranslationBlock *tb,
+                  target_ulong phys_pc, int *code_size)
+{
+    return 0;
+}
+
+void tb_cache_store(CPUState *env, TranslationBlock *tb,
+                    target_ulong phys_pc, int code_size)
+{
+}
+
+#endif /* !TCG_TARGET_HAS_TB_RELOCS */
@@ -0,0 +1,56 @@
+/* Copyright (C) 2011 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+/* A persistent cache of translated blocks.
+ *
+ * When enabled with -tb-cache <file>, the host code generated for each
+ * translated block is recorded along with the guest code it was generated
+ * from. On the next run, a block whose guest code is unchanged is copied
+ * from the cache instead of being translated again.
+ *
+ * Entries are looked up by guest virtual pc and cpu flags, and only used
+ * when the guest bytes at the current physical location are identical to
+ * the ones they were translated from. Blocks loaded from the cache are
+ * registered like freshly translated ones, so tb_phys_invalidate() and the
+ * self-modifying code checks keep handling them.
+ *
+ * The cache file is only valid for the emulator binary and configuration
+ * that wrote it. It is silently ignored otherwise. It is only supported
+ * with TCG backends that record the relocations of their generated code
+ * (currently x86 hosts).
+ */
+
+/* Enables the cache, backed by the file at 'path'. Returns 0 on success,
+ * or -1 if the cache is not supported on this host. The file is read on
+ * first use. */
+extern int  tb_cache_init(const char *path);
+
+/* Writes the cache file, if the cache is enabled, and disables the cache.
+ * Called on exit, through atexit() so that it also runs when the emulator
+ * exits without leaving the main loop. Does nothing if called again. */
+extern void tb_cache_close(void);
+
+/* Tries to fill 'tb' (whose pc, cs_base, flags, cflags and tc_ptr fields
+ * are set) from the cache. 'phys_pc' is the ram offset of tb->pc. On
+ * success, returns 1 and sets '*code_size' to the size of the host code
+ * copied at tb->tc_ptr. Returns 0 if the block must be translated. */
+extern int  tb_cache_load(CPUState *env, TranslationBlock *tb,
+                          target_ulong phys_pc, int *code_size);
+
+/* Records the block 'tb' that was just translated into 'code_size' bytes
+ * of host code. */
+extern void tb_cache_store(CPUState *env, TranslationBlock *tb,
+                           target_ulong phys_pc, int code_size);
+
+#endif /* TB_CACHE_H */
@@ -50,6 +50,12 @@ static const int tcg_target_call_oarg_regs[2] = { TCG_REG_EAX, TCG_REG_EDX };
 
 static uint8_t *tb_ret_addr;
 
+/* record a pc-relative reference to 'target', emitted at s->code_ptr */
+static inline void tcg_out_pc32_reloc(TCGContext *s, tcg_target_long target)
+{
+    tcg_out_tb_reloc(s, TCG_TB_RELOC_PC32, target);
+}
+
 static void patch_reloc(uint8_t *code_ptr, int type, 
                         tcg_target_long value, tcg_target_long addend)
 {
@@ -293,6 +299,10 @@ static inline void tgen_arithi(TCGContext *s, int c, int r0, int32_t val, int cf
     } else if (c == ARITH_AND && val == 0xffffu) {
         /* movzwl */
         tcg_out_modrm(s, 0xb7 | P_EXT, r0, r0);
+    } else if (r0 == TCG_REG_EAX) {
+        /* short form for %eax */
+        tcg_out8(s, 0x05 | (c << 3));
+        tcg_out32(s, val);
     } else {
         tcg_out_modrm(s, 0x81, c, r0);
         tcg_out32(s, val);
@@ -437,6 +447,160 @@ static void *qemu_st_helpers[4] = {
     __stl_mmu,
     __stq_mmu,
 };
+
+/* thunks emitted with the prologue: they load the helper arguments that
+   don't depend on the address and jump to the MMU helper, which returns
+   directly into the calling slow path. The store thunks also move the
+   data, so there is one per data register. The helpers that take the mmu
+   index on the stack are called directly. */
+static uint8_t *qemu_ld_thunks[4][NB_MMU_MODES];
+#if TARGET_LONG_BITS == 32
+static uint8_t *qemu_st_thunks[3][TCG_TARGET_NB_REGS][NB_MMU_MODES];
+
+static void tcg_out_qemu_st_thunk(TCGContext *s, int opc, int data_reg,
+                                  int mem_index)
+{
+    switch(opc) {
+    case 0:
+        /* movzbl */
+        tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_EDX, data_reg);
+        break;
+    case 1:
+        /* movzwl */
+        tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_EDX, data_reg);
+        break;
+    case 2:
+        tcg_out_mov(s, TCG_REG_EDX, data_reg);
+        break;
+    }
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
+    tcg_out8(s, 0xe9);
+    tcg_out32(s, (tcg_target_long)qemu_st_helpers[opc] -
+              (tcg_target_long)s->code_ptr - 4);
+}
+#endif
+
+/* Emits the TLB miss path of a qemu_ld/st op after the end of the TB: call
+   the MMU helper, then jump back after the inline TLB hit path. */
+static void tcg_out_ldst_slow_path(TCGContext *s, TCGLdstSlowPath *l)
+{
+    int s_bits = l->opc & 3;
+    uint8_t *thunk;
+    int32_t disp;
+
+    /* slow_path: */
+    *(int32_t *)l->label_ptr[0] = s->code_ptr - l->label_ptr[0] - 4;
+#if TARGET_LONG_BITS == 64
+    *(int32_t *)l->label_ptr[1] = s->code_ptr - l->label_ptr[1] - 4;
+#endif
+
+    if (l->is_ld) {
+#if TARGET_LONG_BITS == 64
+        tcg_out_mov(s, TCG_REG_EDX, l->addr_reg2);
+#endif
+        thunk = qemu_ld_thunks[s_bits][l->mem_index];
+        tcg_out8(s, 0xe8);
+        tcg_out_pc32_reloc(s, (tcg_target_long)thunk);
+        tcg_out32(s, (tcg_target_long)thunk - (tcg_target_long)s->code_ptr - 4);
+
+        switch(l->opc) {
+        case 0 | 4:
+            /* movsbl */
+            tcg_out_modrm(s, 0xbe | P_EXT, l->data_reg, TCG_REG_EAX);
+            break;
+        case 1 | 4:
+            /* movswl */
+            tcg_out_modrm(s, 0xbf | P_EXT, l->data_reg, TCG_REG_EAX);
+            break;
+        case 0:
+            /* movzbl */
+            tcg_out_modrm(s, 0xb6 | P_EXT, l->data_reg, TCG_REG_EAX);
+            break;
+        case 1:
+            /* movzwl */
+            tcg_out_modrm(s, 0xb7 | P_EXT, l->data_reg, TCG_REG_EAX);
+            break;
+        case 2:
+        default:
+            tcg_out_mov(s, l->data_reg, TCG_REG_EAX);
+            break;
+        case 3:
+            if (l->data_reg == TCG_REG_EDX) {
+                tcg_out_opc(s, 0x90 + TCG_REG_EDX); /* xchg %edx, %eax */
+                tcg_out_mov(s, l->data_reg2, TCG_REG_EAX);
+            } else {
+                tcg_out_mov(s, l->data_reg, TCG_REG_EAX);
+                tcg_out_mov(s, l->data_reg2, TCG_REG_EDX);
+            }
+            break;
+        }
+    } else {
+#if TARGET_LONG_BITS == 32
+        if (l->opc == 3) {
+            tcg_out_mov(s, TCG_REG_EDX, l->data_reg);
+            tcg_out_mov(s, TCG_REG_ECX, l->data_reg2);
+            tcg_out8(s, 0x6a); /* push Ib */
+            tcg_out8(s, l->mem_index);
+            tcg_out8(s, 0xe8);
+            tcg_out_pc32_reloc(s, (tcg_target_long)qemu_st_helpers[s_bits]);
+            tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
+                      (tcg_target_long)s->code_ptr - 4);
+            tcg_out_addi(s, TCG_REG_ESP, 4);
+        } else {
+            thunk = qemu_st_thunks[s_bits][l->data_reg][l->mem_index];
+            tcg_out8(s, 0xe8);
+            tcg_out_pc32_reloc(s, (tcg_target_long)thunk);
+            tcg_out32(s, (tcg_target_long)thunk -
+                      (tcg_target_long)s->code_ptr - 4);
+        }
+#else
+        if (l->opc == 3) {
+            tcg_out_mov(s, TCG_REG_EDX, l->addr_reg2);
+            tcg_out8(s, 0x6a); /* push Ib */
+            tcg_out8(s, l->mem_index);
+            tcg_out_opc(s, 0x50 + l->data_reg2); /* push */
+            tcg_out_opc(s, 0x50 + l->data_reg); /* push */
+            tcg_out8(s, 0xe8);
+            tcg_out_pc32_reloc(s, (tcg_target_long)qemu_st_helpers[s_bits]);
+            tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
+                      (tcg_target_long)s->code_ptr - 4);
+            tcg_out_addi(s, TCG_REG_ESP, 12);
+        } else {
+            tcg_out_mov(s, TCG_REG_EDX, l->addr_reg2);
+            switch(l->opc) {
+            case 0:
+                /* movzbl */
+                tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_ECX, l->data_reg);
+                break;
+            case 1:
+                /* movzwl */
+                tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_ECX, l->data_reg);
+                break;
+            case 2:
+                tcg_out_mov(s, TCG_REG_ECX, l->data_reg);
+                break;
+            }
+            tcg_out8(s, 0x6a); /* push Ib */
+            tcg_out8(s, l->mem_index);
+            tcg_out8(s, 0xe8);
+            tcg_out_pc32_reloc(s, (tcg_target_long)qemu_st_helpers[s_bits]);
+            tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
+                      (tcg_target_long)s->code_ptr - 4);
+            tcg_out_addi(s, TCG_REG_ESP, 4);
+        }
+#endif
+    }
+
+    /* jmp raddr */
+    disp = l->raddr - s->code_ptr - 2;
+    if (disp == (int8_t)disp) {
+        tcg_out8(s, 0xeb);
+        tcg_out8(s, disp);
+    } else {
+        tcg_out8(s, 0xe9);
+        tcg_out32(s, l->raddr - s->code_ptr - 4);
+    }
+}
 #endif
 
 #ifndef CONFIG_USER_ONLY
@@ -446,17 +610,30 @@ static void *qemu_st_helpers[4] = {
 /* XXX: qemu_ld and qemu_st could be modified to clobber only EDX and
    EAX. It will be useful once fixed registers globals are less
    common. */
+#if defined(CONFIG_SOFTMMU) && defined(CONFIG_PROFILER)
+/* count a TLB hit, for 'info jit' */
+static void tcg_out_tlb_hit_count(TCGContext *s)
+{
+    /* addl $1, tlb_hit_count(env) */
+    tcg_out_modrm_offset(s, 0x83, 0, TCG_AREG0,
+                         offsetof(CPUState, tlb_hit_count));
+    tcg_out8(s, 1);
+    /* adcl $0, tlb_hit_count+4(env) */
+    tcg_out_modrm_offset(s, 0x83, 2, TCG_AREG0,
+                         offsetof(CPUState, tlb_hit_count) + 4);
+    tcg_out8(s, 0);
+}
+#endif
+
 static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
                             int opc)
 {
     int addr_reg, data_reg, data_reg2, r0, r1, mem_index, s_bits, bswap;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    uint8_t *label_ptr[2];
+    TCGLdstSlowPath *l;
 #endif
 #if TARGET_LONG_BITS == 64
-#if defined(CONFIG_SOFTMMU)
-    uint8_t *label3_ptr;
-#endif
     int addr_reg2;
 #endif
 
@@ -483,8 +660,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0xc1, 5, r1); /* shr $x, r1 */
     tcg_out8(s, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS); 
     
-    tcg_out_modrm(s, 0x81, 4, r0); /* andl $x, r0 */
-    tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
+    /* andl $x, r0 */
+    tgen_arithi(s, ARITH_AND, r0, TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
     
     tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
     tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
@@ -500,78 +677,31 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_mov(s, r0, addr_reg);
     
 #if TARGET_LONG_BITS == 32
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
 #else
-    /* jne label3 */
-    tcg_out8(s, 0x70 + JCC_JNE);
-    label3_ptr = s->code_ptr;
-    s->code_ptr++;
-    
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
+
     /* cmp 4(r1), addr_reg2 */
     tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1, 4);
 
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label3: */
-    *label3_ptr = s->code_ptr - label3_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr[1] = s->code_ptr;
+    s->code_ptr += 4;
 #endif
 
-    /* XXX: move that code at the end of the TB */
-#if TARGET_LONG_BITS == 32
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_EDX, mem_index);
-#else
-    tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
+#ifdef CONFIG_PROFILER
+    tcg_out_tlb_hit_count(s);
 #endif
-    tcg_out8(s, 0xe8);
-    tcg_out32(s, (tcg_target_long)qemu_ld_helpers[s_bits] - 
-              (tcg_target_long)s->code_ptr - 4);
-
-    switch(opc) {
-    case 0 | 4:
-        /* movsbl */
-        tcg_out_modrm(s, 0xbe | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 1 | 4:
-        /* movswl */
-        tcg_out_modrm(s, 0xbf | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 0:
-        /* movzbl */
-        tcg_out_modrm(s, 0xb6 | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 1:
-        /* movzwl */
-        tcg_out_modrm(s, 0xb7 | P_EXT, data_reg, TCG_REG_EAX);
-        break;
-    case 2:
-    default:
-        tcg_out_mov(s, data_reg, TCG_REG_EAX);
-        break;
-    case 3:
-        if (data_reg == TCG_REG_EDX) {
-            tcg_out_opc(s, 0x90 + TCG_REG_EDX); /* xchg %edx, %eax */
-            tcg_out_mov(s, data_reg2, TCG_REG_EAX);
-        } else {
-            tcg_out_mov(s, data_reg, TCG_REG_EAX);
-            tcg_out_mov(s, data_reg2, TCG_REG_EDX);
-        }
-        break;
-    }
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -651,8 +781,18 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    l = tcg_new_ldst_slow_path(s);
+    l->is_ld = 1;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->data_reg2 = data_reg2;
+    l->label_ptr[0] = label_ptr[0];
+#if TARGET_LONG_BITS == 64
+    l->addr_reg2 = addr_reg2;
+    l->label_ptr[1] = label_ptr[1];
+#endif
+    l->raddr = s->code_ptr;
 #endif
 }
 
@@ -662,12 +802,10 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 {
     int addr_reg, data_reg, data_reg2, r0, r1, mem_index, s_bits, bswap;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    uint8_t *label_ptr[2];
+    TCGLdstSlowPath *l;
 #endif
 #if TARGET_LONG_BITS == 64
-#if defined(CONFIG_SOFTMMU)
-    uint8_t *label3_ptr;
-#endif
     int addr_reg2;
 #endif
 
@@ -695,8 +833,8 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0xc1, 5, r1); /* shr $x, r1 */
     tcg_out8(s, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS); 
     
-    tcg_out_modrm(s, 0x81, 4, r0); /* andl $x, r0 */
-    tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
+    /* andl $x, r0 */
+    tgen_arithi(s, ARITH_AND, r0, TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
     
     tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
     tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
@@ -712,100 +850,31 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_mov(s, r0, addr_reg);
     
 #if TARGET_LONG_BITS == 32
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
 #else
-    /* jne label3 */
-    tcg_out8(s, 0x70 + JCC_JNE);
-    label3_ptr = s->code_ptr;
-    s->code_ptr++;
-    
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr[0] = s->code_ptr;
+    s->code_ptr += 4;
+
     /* cmp 4(r1), addr_reg2 */
     tcg_out_modrm_offset(s, 0x3b, addr_reg2, r1, 4);
 
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label3: */
-    *label3_ptr = s->code_ptr - label3_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr[1] = s->code_ptr;
+    s->code_ptr += 4;
 #endif
 
-    /* XXX: move that code at the end of the TB */
-#if TARGET_LONG_BITS == 32
-    if (opc == 3) {
-        tcg_out_mov(s, TCG_REG_EDX, data_reg);
-        tcg_out_mov(s, TCG_REG_ECX, data_reg2);
-        tcg_out8(s, 0x6a); /* push Ib */
-        tcg_out8(s, mem_index);
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-        tcg_out_addi(s, TCG_REG_ESP, 4);
-    } else {
-        switch(opc) {
-        case 0:
-            /* movzbl */
-            tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_EDX, data_reg);
-            break;
-        case 1:
-            /* movzwl */
-            tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_EDX, data_reg);
-            break;
-        case 2:
-            tcg_out_mov(s, TCG_REG_EDX, data_reg);
-            break;
-        }
-        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-    }
-#else
-    if (opc == 3) {
-        tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
-        tcg_out8(s, 0x6a); /* push Ib */
-        tcg_out8(s, mem_index);
-        tcg_out_opc(s, 0x50 + data_reg2); /* push */
-        tcg_out_opc(s, 0x50 + data_reg); /* push */
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-        tcg_out_addi(s, TCG_REG_ESP, 12);
-    } else {
-        tcg_out_mov(s, TCG_REG_EDX, addr_reg2);
-        switch(opc) {
-        case 0:
-            /* movzbl */
-            tcg_out_modrm(s, 0xb6 | P_EXT, TCG_REG_ECX, data_reg);
-            break;
-        case 1:
-            /* movzwl */
-            tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_ECX, data_reg);
-            break;
-        case 2:
-            tcg_out_mov(s, TCG_REG_ECX, data_reg);
-            break;
-        }
-        tcg_out8(s, 0x6a); /* push Ib */
-        tcg_out8(s, mem_index);
-        tcg_out8(s, 0xe8);
-        tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-                  (tcg_target_long)s->code_ptr - 4);
-        tcg_out_addi(s, TCG_REG_ESP, 4);
-    }
+#ifdef CONFIG_PROFILER
+    tcg_out_tlb_hit_count(s);
 #endif
-    
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -814,6 +883,21 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     r0 = addr_reg;
 #endif
 
+#if defined(CONFIG_SOFTMMU)
+    /* before the byte swap below can replace data_reg */
+    l = tcg_new_ldst_slow_path(s);
+    l->is_ld = 0;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->data_reg2 = data_reg2;
+    l->label_ptr[0] = label_ptr[0];
+#if TARGET_LONG_BITS == 64
+    l->addr_reg2 = addr_reg2;
+    l->label_ptr[1] = label_ptr[1];
+#endif
+#endif
+
 #ifdef TARGET_WORDS_BIGENDIAN
     bswap = 1;
 #else
@@ -866,8 +950,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    l->raddr = s->code_ptr;
 #endif
 }
 
@@ -878,8 +961,16 @@ static inline void tcg_out_op(TCGContext *s, int opc,
     
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_EAX, args[0]);
+        if (args[0]) {
+            /* the value returned is the TB address plus the jump index */
+            tcg_out8(s, 0xb8 + TCG_REG_EAX); /* movl $args[0], %eax */
+            tcg_out_tb_reloc(s, TCG_TB_RELOC_TB, args[0]);
+            tcg_out32(s, args[0]);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_EAX, 0);
+        }
         tcg_out8(s, 0xe9); /* jmp tb_ret_addr */
+        tcg_out_pc32_reloc(s, (tcg_target_long)tb_ret_addr);
         tcg_out32(s, tb_ret_addr - s->code_ptr - 4);
         break;
     case INDEX_op_goto_tb:
@@ -896,9 +987,19 @@ static inline void tcg_out_op(TCGContext *s, int opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* the pointer is in %eax: if it is NULL, return it to cpu_exec() */
+        tcg_out_modrm(s, 0x85, args[0], args[0]);
+        tcg_out8(s, 0x0f); /* je tb_ret_addr */
+        tcg_out8(s, 0x80 + JCC_JE);
+        tcg_out_pc32_reloc(s, (tcg_target_long)tb_ret_addr);
+        tcg_out32(s, tb_ret_addr - s->code_ptr - 4);
+        tcg_out_modrm(s, 0xff, 4, args[0]); /* jmp *%eax */
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out8(s, 0xe8);
+            tcg_out_pc32_reloc(s, args[0]);
             tcg_out32(s, args[0] - (tcg_target_long)s->code_ptr - 4);
         } else {
             tcg_out_modrm(s, 0xff, 2, args[0]);
@@ -907,6 +1008,7 @@ static inline void tcg_out_op(TCGContext *s, int opc,
     case INDEX_op_jmp:
         if (const_args[0]) {
             tcg_out8(s, 0xe9);
+            tcg_out_pc32_reloc(s, args[0]);
             tcg_out32(s, args[0] - (tcg_target_long)s->code_ptr - 4);
         } else {
             tcg_out_modrm(s, 0xff, 4, args[0]);
@@ -1120,6 +1222,7 @@ static inline void tcg_out_op(TCGContext *s, int opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "a" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_jmp, { "ri" } },
     { INDEX_op_br, { } },
@@ -1218,6 +1321,12 @@ static inline void tcg_out_pop(TCGContext *s, int reg)
 void tcg_target_qemu_prologue(TCGContext *s)
 {
     int i, frame_size, push_size, stack_addend;
+#if defined(CONFIG_SOFTMMU)
+    int mem_index;
+#if TARGET_LONG_BITS == 32
+    int reg;
+#endif
+#endif
     
     /* TB prologue */
     /* save all callee saved registers */
@@ -1241,6 +1350,35 @@ void tcg_target_qemu_prologue(TCGContext *s)
         tcg_out_pop(s, tcg_target_callee_save_regs[i]);
     }
     tcg_out8(s, 0xc3); /* ret */
+
+#if defined(CONFIG_SOFTMMU)
+    /* TLB miss thunks */
+    for(i = 0; i < 4; i++) {
+        for(mem_index = 0; mem_index < NB_MMU_MODES; mem_index++) {
+            qemu_ld_thunks[i][mem_index] = s->code_ptr;
+#if TARGET_LONG_BITS == 32
+            tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_EDX, mem_index);
+#else
+            tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
+#endif
+            tcg_out8(s, 0xe9);
+            tcg_out32(s, (tcg_target_long)qemu_ld_helpers[i] -
+                      (tcg_target_long)s->code_ptr - 4);
+
+#if TARGET_LONG_BITS == 32
+            for(reg = 0; reg < TCG_TARGET_NB_REGS && i < 3; reg++) {
+                /* the 'L' constraint excludes these, 'cb' all but two */
+                if (reg == TCG_REG_ESP || reg == TCG_REG_EAX ||
+                    reg == TCG_REG_EDX ||
+                    (i == 0 && reg != TCG_REG_ECX && reg != TCG_REG_EBX))
+                    continue;
+                qemu_st_thunks[i][reg][mem_index] = s->code_ptr;
+                tcg_out_qemu_st_thunk(s, i, reg, mem_index);
+            }
+#endif
+        }
+    }
+#endif
 }
 
 void tcg_target_init(TCGContext *s)
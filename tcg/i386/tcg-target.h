@@ -59,6 +59,16 @@ enum {
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
+/* the backend records the references that must be patched when the code
+   of a translated block is moved (see tcg_out_tb_reloc) */
+#define TCG_TARGET_HAS_TB_RELOCS
+
+/* the TLB miss paths of qemu_ld/st are emitted after the end of the TB */
+#define TCG_TARGET_HAS_LDST_SLOW_PATHS
+
+/* generated code can jump to a TB whose address is only known at run time */
+#define TCG_TARGET_HAS_goto_ptr
+
 /* Note: must be synced with dyngen-exec.h */
 #define TCG_AREG0 TCG_REG_EBP
 #define TCG_AREG1 TCG_REG_EBX
@@ -0,0 +1,801 @@
+/*
+ * Optimizations for Tiny Code Generator for QEMU
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "qemu-common.h"
+#include "tcg-op.h"
+
+/* The optimizer works on the opcode stream of a TB, before the liveness
+   analysis. It rewrites the operations in place, one basic block at a
+   time:
+
+   - operations whose inputs are all constant are replaced by a movi, and
+     trivial operations (x + 0, x & 0, ...) by a mov or a movi,
+   - inputs which are copies of another temporary are replaced by that
+     temporary, so that the mov becomes dead,
+   - a store to the CPU state which is overwritten by another store to the
+     same location, with no possible read in between, is removed.
+
+   Operations are never moved: the opcode at a given index stays the one
+   generated for the same guest instruction (or becomes a nop), which is
+   required by gen_opc_instr_start[] and tcg_gen_code_search_pc(). The
+   parameters of each operation can only shrink, so they are compacted in
+   place. Operations made dead are removed by the liveness analysis. */
+
+#if TCG_TARGET_REG_BITS == 64
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32):    \
+        glue(glue(case INDEX_op_, x), _i64)
+#else
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32)
+#endif
+
+typedef enum {
+    TCG_TEMP_UNDEF = 0,
+    TCG_TEMP_CONST,
+    TCG_TEMP_COPY,
+} tcg_temp_state;
+
+struct tcg_temp_info {
+    tcg_temp_state state;
+    int num_copies;         /* number of temps which are copies of this one */
+    tcg_target_ulong val;   /* constant value, or index of the copied temp */
+};
+
+/* Stores to the CPU state that may still be removed */
+#define MAX_PENDING_STORES 16
+
+struct tcg_pending_store {
+    TCGArg base;
+    tcg_target_long offset;
+    int size;
+    uint16_t *opc_ptr;
+};
+
+static struct tcg_temp_info *temps;
+static int nb_temps;
+
+static struct tcg_pending_store pending_stores[MAX_PENDING_STORES];
+static int nb_pending_stores;
+/* stores can only be removed if no global is backed by the CPU state, as
+   globals are loaded from memory implicitly */
+static int remove_dead_stores;
+
+static void reset_temp(TCGArg temp)
+{
+    int i;
+
+    if (temps[temp].state == TCG_TEMP_COPY) {
+        temps[temps[temp].val].num_copies--;
+    }
+    temps[temp].state = TCG_TEMP_UNDEF;
+
+    /* the temps which were copies of this one keep the old value */
+    if (temps[temp].num_copies > 0) {
+        for (i = 0; i < nb_temps; i++) {
+            if (temps[i].state == TCG_TEMP_COPY && temps[i].val == temp) {
+                temps[i].state = TCG_TEMP_UNDEF;
+            }
+        }
+        temps[temp].num_copies = 0;
+    }
+}
+
+static void reset_all_temps(void)
+{
+    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+}
+
+static void reset_globals(TCGContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        reset_temp(i);
+    }
+}
+
+static void set_const(TCGArg temp, tcg_target_ulong val)
+{
+    reset_temp(temp);
+    temps[temp].state = TCG_TEMP_CONST;
+    temps[temp].val = val;
+}
+
+static void set_copy(TCGArg dst, TCGArg src)
+{
+    reset_temp(dst);
+    temps[dst].state = TCG_TEMP_COPY;
+    temps[dst].val = src;
+    temps[src].num_copies++;
+}
+
+static inline int is_const(TCGArg temp)
+{
+    return temps[temp].state == TCG_TEMP_CONST;
+}
+
+static int op_bits(int op)
+{
+    switch (op) {
+    case INDEX_op_mov_i32:
+    case INDEX_op_movi_i32:
+    case INDEX_op_setcond_i32:
+    case INDEX_op_brcond_i32:
+    case INDEX_op_add_i32:
+    case INDEX_op_sub_i32:
+    case INDEX_op_mul_i32:
+    case INDEX_op_and_i32:
+    case INDEX_op_or_i32:
+    case INDEX_op_xor_i32:
+    case INDEX_op_shl_i32:
+    case INDEX_op_shr_i32:
+    case INDEX_op_sar_i32:
+#ifdef TCG_TARGET_HAS_rot_i32
+    case INDEX_op_rotl_i32:
+    case INDEX_op_rotr_i32:
+#endif
+#ifdef TCG_TARGET_HAS_not_i32
+    case INDEX_op_not_i32:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i32
+    case INDEX_op_neg_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i32
+    case INDEX_op_ext8s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i32
+    case INDEX_op_ext16s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i32
+    case INDEX_op_ext8u_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i32
+    case INDEX_op_ext16u_i32:
+#endif
+        return 32;
+    default:
+        return 64;
+    }
+}
+
+static int op_to_movi(int op)
+{
+#if TCG_TARGET_REG_BITS == 64
+    if (op_bits(op) == 64)
+        return INDEX_op_movi_i64;
+#endif
+    return INDEX_op_movi_i32;
+}
+
+static int op_to_mov(int op)
+{
+#if TCG_TARGET_REG_BITS == 64
+    if (op_bits(op) == 64)
+        return INDEX_op_mov_i64;
+#endif
+    return INDEX_op_mov_i32;
+}
+
+/* Evaluates an operation. Returns 0 if it can't be folded. */
+static int do_constant_folding_2(int op, tcg_target_ulong x,
+                                 tcg_target_ulong y, tcg_target_ulong *res)
+{
+    int bits = op_bits(op);
+
+    switch (op) {
+    CASE_OP_32_64(add):
+        *res = x + y;
+        break;
+    CASE_OP_32_64(sub):
+        *res = x - y;
+        break;
+    CASE_OP_32_64(mul):
+        *res = x * y;
+        break;
+    CASE_OP_32_64(and):
+        *res = x & y;
+        break;
+    CASE_OP_32_64(or):
+        *res = x | y;
+        break;
+    CASE_OP_32_64(xor):
+        *res = x ^ y;
+        break;
+    /* shifts by the operand size or more are undefined, keep them */
+    case INDEX_op_shl_i32:
+        if (y >= 32)
+            return 0;
+        *res = (uint32_t)x << y;
+        break;
+    case INDEX_op_shr_i32:
+        if (y >= 32)
+            return 0;
+        *res = (uint32_t)x >> y;
+        break;
+    case INDEX_op_sar_i32:
+        if (y >= 32)
+            return 0;
+        *res = (int32_t)x >> y;
+        break;
+#ifdef TCG_TARGET_HAS_rot_i32
+    case INDEX_op_rotl_i32:
+        y &= 31;
+        *res = y ? ((uint32_t)x << y) | ((uint32_t)x >> (32 - y)) : x;
+        break;
+    case INDEX_op_rotr_i32:
+        y &= 31;
+        *res = y ? ((uint32_t)x >> y) | ((uint32_t)x << (32 - y)) : x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_not_i32
+    case INDEX_op_not_i32:
+        *res = ~x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_neg_i32
+    case INDEX_op_neg_i32:
+        *res = -x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i32
+    case INDEX_op_ext8s_i32:
+        *res = (int8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i32
+    case INDEX_op_ext16s_i32:
+        *res = (int16_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i32
+    case INDEX_op_ext8u_i32:
+        *res = (uint8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i32
+    case INDEX_op_ext16u_i32:
+        *res = (uint16_t)x;
+        break;
+#endif
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_shl_i64:
+        if (y >= 64)
+            return 0;
+        *res = x << y;
+        break;
+    case INDEX_op_shr_i64:
+        if (y >= 64)
+            return 0;
+        *res = x >> y;
+        break;
+    case INDEX_op_sar_i64:
+        if (y >= 64)
+            return 0;
+        *res = (int64_t)x >> y;
+        break;
+#ifdef TCG_TARGET_HAS_rot_i64
+    case INDEX_op_rotl_i64:
+        y &= 63;
+        *res = y ? (x << y) | (x >> (64 - y)) : x;
+        break;
+    case INDEX_op_rotr_i64:
+        y &= 63;
+        *res = y ? (x >> y) | (x << (64 - y)) : x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_not_i64
+    case INDEX_op_not_i64:
+        *res = ~x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+    case INDEX_op_neg_i64:
+        *res = -x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+    case INDEX_op_ext8s_i64:
+        *res = (int8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+    case INDEX_op_ext16s_i64:
+        *res = (int16_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+    case INDEX_op_ext32s_i64:
+        *res = (int32_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i64
+    case INDEX_op_ext8u_i64:
+        *res = (uint8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i64
+    case INDEX_op_ext16u_i64:
+        *res = (uint16_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext32u_i64
+    case INDEX_op_ext32u_i64:
+        *res = (uint32_t)x;
+        break;
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+    default:
+        return 0;
+    }
+
+    /* 32 bit constants are kept sign extended, as done by tcg_gen_movi_i32 */
+    if (bits == 32) {
+        *res = (int32_t)*res;
+    }
+    return 1;
+}
+
+static int do_constant_folding_cond(int op, tcg_target_ulong x,
+                                    tcg_target_ulong y, TCGCond c)
+{
+    if (op_bits(op) == 32) {
+        x = (uint32_t)x;
+        y = (uint32_t)y;
+        switch (c) {
+        case TCG_COND_LT:
+            return (int32_t)x < (int32_t)y;
+        case TCG_COND_GE:
+            return (int32_t)x >= (int32_t)y;
+        case TCG_COND_LE:
+            return (int32_t)x <= (int32_t)y;
+        case TCG_COND_GT:
+            return (int32_t)x > (int32_t)y;
+        default:
+            break;
+        }
+    } else {
+        switch (c) {
+        case TCG_COND_LT:
+            return (int64_t)x < (int64_t)y;
+        case TCG_COND_GE:
+            return (int64_t)x >= (int64_t)y;
+        case TCG_COND_LE:
+            return (int64_t)x <= (int64_t)y;
+        case TCG_COND_GT:
+            return (int64_t)x > (int64_t)y;
+        default:
+            break;
+        }
+    }
+    switch (c) {
+    case TCG_COND_EQ:
+        return x == y;
+    case TCG_COND_NE:
+        return x != y;
+    case TCG_COND_LTU:
+        return x < y;
+    case TCG_COND_GEU:
+        return x >= y;
+    case TCG_COND_LEU:
+        return x <= y;
+    case TCG_COND_GTU:
+        return x > y;
+    default:
+        tcg_abort();
+    }
+}
+
+/* Returns the size in bytes of the CPU state access done by a load or
+   store operation, or 0 if it is not one */
+static int op_access_size(int op, int *is_store)
+{
+    *is_store = 0;
+    switch (op) {
+    case INDEX_op_st8_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st8_i64:
+#endif
+        *is_store = 1;
+        /* fall through */
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+        return 1;
+    case INDEX_op_st16_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st16_i64:
+#endif
+        *is_store = 1;
+        /* fall through */
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+        return 2;
+    case INDEX_op_st_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st32_i64:
+#endif
+        *is_store = 1;
+        /* fall through */
+    case INDEX_op_ld_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+#endif
+        return 4;
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st_i64:
+        *is_store = 1;
+        /* fall through */
+    case INDEX_op_ld_i64:
+        return 8;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static inline int ranges_overlap(tcg_target_long off1, int size1,
+                                 tcg_target_long off2, int size2)
+{
+    return off1 < off2 + size2 && off2 < off1 + size1;
+}
+
+/* Called for a store of 'size' bytes at 'offset' from 'base', which holds
+   the CPU state pointer. Removes the pending stores it overwrites. */
+static void record_store(TCGContext *s, TCGArg base, tcg_target_long offset,
+                         int size, uint16_t *opc_ptr)
+{
+    int i, n = 0;
+
+    for (i = 0; i < nb_pending_stores; i++) {
+        struct tcg_pending_store *st = &pending_stores[i];
+        if (st->base == base && st->offset >= offset &&
+            st->offset + st->size <= offset + size) {
+            /* completely overwritten, the previous store is dead. Its
+               three parameters are left in place. */
+            *st->opc_ptr = INDEX_op_nop3;
+#ifdef CONFIG_PROFILER
+            s->opt_dead_st_count++;
+#endif
+            continue;
+        }
+        pending_stores[n++] = *st;
+    }
+    nb_pending_stores = n;
+
+    if (nb_pending_stores == MAX_PENDING_STORES) {
+        memmove(pending_stores, pending_stores + 1,
+                (MAX_PENDING_STORES - 1) * sizeof(pending_stores[0]));
+        nb_pending_stores--;
+    }
+    pending_stores[nb_pending_stores].base = base;
+    pending_stores[nb_pending_stores].offset = offset;
+    pending_stores[nb_pending_stores].size = size;
+    pending_stores[nb_pending_stores].opc_ptr = opc_ptr;
+    nb_pending_stores++;
+}
+
+/* Called for a load: the pending stores it may read must be kept */
+static void record_load(TCGArg base, tcg_target_long offset, int size)
+{
+    int i, n = 0;
+
+    for (i = 0; i < nb_pending_stores; i++) {
+        struct tcg_pending_store *st = &pending_stores[i];
+        if (st->base == base &&
+            !ranges_overlap(st->offset, st->size, offset, size)) {
+            pending_stores[n++] = *st;
+        }
+    }
+    nb_pending_stores = n;
+}
+
+/* Optimizes the operations in [gen_opc_buf, tcg_opc_ptr[ whose parameters
+   start at 'args'. Returns the new end of the parameters. */
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
+                     TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int nb_ops, op_index, op, nb_oargs, nb_iargs, nb_cargs, nb_args, i;
+    const TCGOpDef *def;
+    TCGArg *gen_args;
+    tcg_target_ulong res;
+
+    nb_temps = s->nb_temps;
+    temps = tcg_malloc(nb_temps * sizeof(struct tcg_temp_info));
+    reset_all_temps();
+    nb_pending_stores = 0;
+    remove_dead_stores = 1;
+    for (i = 0; i < s->nb_globals; i++) {
+        if (!s->temps[i].fixed_reg)
+            remove_dead_stores = 0;
+    }
+
+    nb_ops = tcg_opc_ptr - gen_opc_buf;
+    gen_args = args;
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        uint16_t *opc_ptr = &gen_opc_buf[op_index];
+        int is_store, size;
+
+        op = *opc_ptr;
+        def = &tcg_op_defs[op];
+
+        /* find the arguments */
+        if (op == INDEX_op_call) {
+            nb_oargs = args[0] >> 16;
+            nb_iargs = args[0] & 0xffff;
+            nb_cargs = def->nb_cargs;
+            nb_args = nb_oargs + nb_iargs + nb_cargs + 1;
+        } else if (op == INDEX_op_nopn) {
+            nb_args = args[0];
+            memmove(gen_args, args, nb_args * sizeof(TCGArg));
+            gen_args += nb_args;
+            args += nb_args;
+            continue;
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_iargs = def->nb_iargs;
+            nb_cargs = def->nb_cargs;
+            nb_args = def->nb_args;
+        }
+
+        /* replace the inputs which are copies by the copied temp */
+        if (op == INDEX_op_call) {
+            for (i = nb_oargs + 1; i < nb_oargs + nb_iargs + 1; i++) {
+                if (args[i] != TCG_CALL_DUMMY_ARG &&
+                    temps[args[i]].state == TCG_TEMP_COPY) {
+                    args[i] = temps[args[i]].val;
+#ifdef CONFIG_PROFILER
+                    s->opt_copy_count++;
+#endif
+                }
+            }
+        } else if (op != INDEX_op_discard) {
+            for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+                if (temps[args[i]].state == TCG_TEMP_COPY) {
+                    args[i] = temps[args[i]].val;
+#ifdef CONFIG_PROFILER
+                    s->opt_copy_count++;
+#endif
+                }
+            }
+        }
+
+        /* put the constant operand of commutative operations second */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+            if (is_const(args[1]) && !is_const(args[2])) {
+                TCGArg tmp = args[1];
+                args[1] = args[2];
+                args[2] = tmp;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* simplify operations with a constant operand */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+#ifdef TCG_TARGET_HAS_rot_i32
+        case INDEX_op_rotl_i32:
+        case INDEX_op_rotr_i32:
+#endif
+#if TCG_TARGET_REG_BITS == 64 && defined(TCG_TARGET_HAS_rot_i64)
+        case INDEX_op_rotl_i64:
+        case INDEX_op_rotr_i64:
+#endif
+            if (is_const(args[2]) && temps[args[2]].val == 0 &&
+                !is_const(args[1])) {
+                /* x op 0 == x */
+                op = op_to_mov(op);
+                goto do_mov;
+            }
+            break;
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(mul):
+            if (is_const(args[2]) && temps[args[2]].val == 0) {
+                /* x & 0 == x * 0 == 0 */
+                op = op_to_movi(op);
+                args[1] = 0;
+                goto do_movi;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch (op) {
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+            if (args[1] == args[2] && !is_const(args[1])) {
+                /* x & x == x | x == x */
+                op = op_to_mov(op);
+                goto do_mov;
+            }
+            break;
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(xor):
+            if (args[1] == args[2]) {
+                /* x - x == x ^ x == 0 */
+                op = op_to_movi(op);
+                args[1] = 0;
+                goto do_movi;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch (op) {
+        CASE_OP_32_64(mov):
+        do_mov:
+            if (args[0] == args[1]) {
+                /* mov to itself */
+                *opc_ptr = INDEX_op_nop;
+                args += nb_args;
+                continue;
+            }
+            if (is_const(args[1])) {
+                args[1] = temps[args[1]].val;
+                op = op_to_movi(op);
+                goto do_movi;
+            }
+            set_copy(args[0], args[1]);
+            *opc_ptr = op;
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args += 2;
+            args += nb_args;
+            continue;
+
+        CASE_OP_32_64(movi):
+        do_movi:
+            set_const(args[0], args[1]);
+            *opc_ptr = op;
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args += 2;
+            args += nb_args;
+            continue;
+
+        CASE_OP_32_64(setcond):
+            if (is_const(args[1]) && is_const(args[2])) {
+                op = op_to_movi(op);
+                args[1] = do_constant_folding_cond(op, temps[args[1]].val,
+                                                   temps[args[2]].val,
+                                                   args[3]);
+#ifdef CONFIG_PROFILER
+                s->opt_folded_count++;
+#endif
+                goto do_movi;
+            }
+            break;
+
+        CASE_OP_32_64(brcond):
+            if (is_const(args[0]) && is_const(args[1])) {
+                int taken = do_constant_folding_cond(op, temps[args[0]].val,
+                                                     temps[args[1]].val,
+                                                     args[2]);
+#ifdef CONFIG_PROFILER
+                s->opt_folded_count++;
+#endif
+                reset_all_temps();
+                nb_pending_stores = 0;
+                if (taken) {
+                    *opc_ptr = INDEX_op_br;
+                    gen_args[0] = args[3];
+                    gen_args += 1;
+                } else {
+                    *opc_ptr = INDEX_op_nop;
+                }
+                args += nb_args;
+                continue;
+            }
+            break;
+
+        default:
+            if (nb_oargs == 1 && nb_cargs == 0 && op != INDEX_op_call &&
+                (nb_iargs == 1 || nb_iargs == 2) &&
+                is_const(args[1]) &&
+                (nb_iargs == 1 || is_const(args[2])) &&
+                do_constant_folding_2(op, temps[args[1]].val,
+                                      nb_iargs == 2 ? temps[args[2]].val : 0,
+                                      &res)) {
+                args[1] = res;
+#ifdef CONFIG_PROFILER
+                s->opt_folded_count++;
+#endif
+                op = op_to_movi(op);
+                goto do_movi;
+            }
+            break;
+        }
+
+        /* track the stores to the CPU state and the reads of it. Only
+           TCG_AREG0 is known to hold the same address for the whole block,
+           other fixed registers (like cpu_T[] on ARM) are plain values. */
+        size = op_access_size(op, &is_store);
+        if (size > 0 && s->temps[args[1]].fixed_reg &&
+            s->temps[args[1]].reg == TCG_AREG0) {
+            if (!is_store) {
+                record_load(args[1], args[2], size);
+            } else if (remove_dead_stores) {
+                record_store(s, args[1], args[2], size, opc_ptr);
+            }
+        } else if (size > 0 && !is_store) {
+            /* load from a computed address, may read anything */
+            nb_pending_stores = 0;
+        } else if (size == 0 &&
+                   (op == INDEX_op_call || op == INDEX_op_set_label ||
+                    (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                                   TCG_OPF_SIDE_EFFECTS)))) {
+            /* helpers, memory accesses (which may fault) and jumps may all
+               read the CPU state */
+            nb_pending_stores = 0;
+        }
+
+        /* update the state of the outputs */
+        if (op == INDEX_op_set_label || (def->flags & TCG_OPF_BB_END)) {
+            reset_all_temps();
+        } else if (op == INDEX_op_call) {
+            int flags = args[nb_oargs + nb_iargs + 1];
+            for (i = 0; i < nb_oargs; i++) {
+                reset_temp(args[i + 1]);
+            }
+            if (!(flags & (TCG_CALL_CONST | TCG_CALL_PURE))) {
+                reset_globals(s);
+            }
+        } else if (op == INDEX_op_discard) {
+            reset_temp(args[0]);
+        } else {
+            for (i = 0; i < nb_oargs; i++) {
+                reset_temp(args[i]);
+            }
+            if (def->flags & TCG_OPF_CALL_CLOBBER) {
+                reset_globals(s);
+            }
+        }
+
+        memmove(gen_args, args, nb_args * sizeof(TCGArg));
+        gen_args += nb_args;
+        args += nb_args;
+    }
+
+    return gen_args;
+}
@@ -1933,6 +1933,19 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+#ifdef TCG_TARGET_HAS_goto_ptr
+/* jump to the host code at 'ptr', or return 0 to cpu_exec() like
+   tcg_gen_exit_tb(0) if 'ptr' is NULL */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_op1_i32(INDEX_op_goto_ptr, ptr);
+#else
+    tcg_gen_op1_i64(INDEX_op_goto_ptr, ptr);
+#endif
+}
+#endif
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
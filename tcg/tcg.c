@@ -24,6 +24,8 @@
 
 /* define it to use liveness analysis (better code) */
 #define USE_LIVENESS_ANALYSIS
+/* define it to fold constants and propagate copies (see optimize.c) */
+#define USE_TCG_OPTIMIZATIONS
 
 #include "config.h"
 
@@ -166,6 +168,38 @@ int gen_new_label(void)
     return idx;
 }
 
+#ifdef TCG_TARGET_HAS_TB_RELOCS
+/* record a reference about to be emitted at s->code_ptr */
+static inline void tcg_out_tb_reloc(TCGContext *s, int type,
+                                    tcg_target_long value)
+{
+    if (s->nb_tb_relocs < TCG_MAX_TB_RELOCS) {
+        TCGTBReloc *r = &s->tb_relocs[s->nb_tb_relocs];
+        r->offset = s->code_ptr - s->code_buf;
+        r->type = type;
+        r->value = value;
+    }
+    s->nb_tb_relocs++;
+}
+#endif
+
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATHS
+/* queue the slow path of the current qemu_ld/st op. It is emitted by
+   tcg_out_ldst_slow_path() once the whole TB has been generated. The
+   queue is LIFO: the last accesses of the TB get the slow paths closest
+   to them, so that their jump back can use an 8 bit displacement. */
+static inline TCGLdstSlowPath *tcg_new_ldst_slow_path(TCGContext *s)
+{
+    TCGLdstSlowPath *l;
+
+    l = tcg_malloc(sizeof(TCGLdstSlowPath));
+    l->next = s->ldst_slow_paths;
+    l->op_index = s->cur_op_index;
+    s->ldst_slow_paths = l;
+    return l;
+}
+#endif
+
 #include "tcg-target.c"
 
 /* pool based memory allocation */
@@ -277,6 +311,9 @@ void tcg_func_start(TCGContext *s)
     s->labels = tcg_malloc(sizeof(TCGLabel) * TCG_MAX_LABELS);
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+#ifdef TCG_TARGET_HAS_TB_RELOCS
+    s->nb_tb_relocs = 0;
+#endif
 
     gen_opc_ptr = gen_opc_buf;
     gen_opparam_ptr = gen_opparam_buf;
@@ -1911,6 +1948,8 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
 #ifdef CONFIG_PROFILER
 
 static int64_t tcg_table_op_count[NB_OPS];
+/* same, before the optimizations */
+static int64_t tcg_table_op_count_in[NB_OPS];
 
 void dump_op_count(void)
 {
@@ -1918,7 +1957,8 @@ void dump_op_count(void)
     FILE *f;
     f = fopen("/tmp/op.log", "w");
     for(i = INDEX_op_end; i < NB_OPS; i++) {
-        fprintf(f, "%s %" PRId64 "\n", tcg_op_defs[i].name, tcg_table_op_count[i]);
+        fprintf(f, "%s %" PRId64 " %" PRId64 "\n", tcg_op_defs[i].name,
+                tcg_table_op_count[i], tcg_table_op_count_in[i]);
     }
     fclose(f);
 }
@@ -1944,6 +1984,22 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     }
 #endif
 
+#ifdef USE_TCG_OPTIMIZATIONS
+#ifdef CONFIG_PROFILER
+    {
+        uint16_t *opc_ptr;
+        for (opc_ptr = gen_opc_buf; opc_ptr < gen_opc_ptr; opc_ptr++)
+            tcg_table_op_count_in[*opc_ptr]++;
+    }
+    s->opt_time -= profile_getclock();
+#endif
+    gen_opparam_ptr =
+        tcg_optimize(s, gen_opc_ptr, gen_opparam_buf, tcg_op_defs);
+#ifdef CONFIG_PROFILER
+    s->opt_time += profile_getclock();
+#endif
+#endif
+
 #ifdef CONFIG_PROFILER
     s->la_time -= profile_getclock();
 #endif
@@ -1954,7 +2010,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
 #ifdef DEBUG_DISAS
     if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP_OPT))) {
-        qemu_log("OP after liveness analysis:\n");
+        qemu_log("OP after optimization and liveness analysis:\n");
         tcg_dump_ops(s, logfile);
         qemu_log("\n");
     }
@@ -1967,6 +2023,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     args = gen_opparam_buf;
     op_index = 0;
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATHS
+    s->ldst_slow_paths = NULL;
+#endif
 
 #ifdef CONFIG_MEMCHECK
     gen_opc_tpc2gpc_pairs = 0;
@@ -1992,6 +2051,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
         opc = gen_opc_buf[op_index];
 #ifdef CONFIG_PROFILER
         tcg_table_op_count[opc]++;
+#endif
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATHS
+        s->cur_op_index = op_index;
 #endif
         def = &tcg_op_defs[opc];
 #if 0
@@ -2065,6 +2127,33 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 #endif
     }
  the_end:
+#if defined(TCG_TARGET_HAS_LDST_SLOW_PATHS) && defined(CONFIG_SOFTMMU)
+    {
+        TCGLdstSlowPath *l;
+
+        for (l = s->ldst_slow_paths; l != NULL; l = l->next) {
+#ifdef CONFIG_MEMCHECK
+            /* attribute the slow path to the guest instruction of its op */
+            if (memcheck_enabled && search_pc < 0) {
+                int i = l->op_index;
+                while (i > 0 && !gen_opc_instr_start[i])
+                    i--;
+                gen_opc_tpc2gpc_ptr[tpc2gpc_index] = s->code_ptr;
+                tpc2gpc_index++;
+                gen_opc_tpc2gpc_ptr[tpc2gpc_index] = (void*)(ptrdiff_t)gen_opc_pc[i];
+                tpc2gpc_index++;
+                gen_opc_tpc2gpc_pairs++;
+            }
+#endif  // CONFIG_MEMCHECK
+            tcg_out_ldst_slow_path(s, l);
+            /* the helpers are called from the slow path: report the op
+               that owns it */
+            if (search_pc >= 0 && search_pc < s->code_ptr - gen_code_buf) {
+                return l->op_index;
+            }
+        }
+    }
+#endif
     return -1;
 }
 
@@ -2144,8 +2233,16 @@ void tcg_dump_info(FILE *f,
                 (double)s->interm_time / tot * 100.0);
     cpu_fprintf(f, "  gen_code time     %0.1f%%\n",
                 (double)s->code_time / tot * 100.0);
+    cpu_fprintf(f, "optim./code time    %0.1f%%\n",
+                (double)s->opt_time / (s->code_time ? s->code_time : 1) * 100.0);
     cpu_fprintf(f, "liveness/code time  %0.1f%%\n",
                 (double)s->la_time / (s->code_time ? s->code_time : 1) * 100.0);
+    cpu_fprintf(f, "folded ops/TB       %0.2f\n",
+                s->tb_count ? (double)s->opt_folded_count / s->tb_count : 0);
+    cpu_fprintf(f, "propagated copies/TB %0.2f\n",
+                s->tb_count ? (double)s->opt_copy_count / s->tb_count : 0);
+    cpu_fprintf(f, "dead stores/TB      %0.2f\n",
+                s->tb_count ? (double)s->opt_dead_st_count / s->tb_count : 0);
     cpu_fprintf(f, "cpu_restore count   %" PRId64 "\n",
                 s->restore_count);
     cpu_fprintf(f, "  avg cycles        %0.1f\n",
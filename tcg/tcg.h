@@ -254,6 +254,44 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+#ifdef TCG_TARGET_HAS_TB_RELOCS
+/* References from the code of a translated block to addresses outside of
+   it. They must be patched if the code is copied to another location, as
+   done by the persistent TB cache. */
+#define TCG_MAX_TB_RELOCS 128
+
+enum {
+    TCG_TB_RELOC_PC32,  /* 32 bit pc-relative reference to 'value' */
+    TCG_TB_RELOC_TB,    /* 32 bit absolute 'value', which is the address of
+                           the TB plus a small constant (see exit_tb) */
+};
+
+typedef struct TCGTBReloc {
+    uint16_t offset;    /* offset of the reference in the TB code */
+    uint16_t type;
+    tcg_target_long value;
+} TCGTBReloc;
+#endif
+
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATHS
+/* TLB miss path of a qemu_ld/st op. Only the TLB hit path is emitted
+   inline, the miss paths are emitted after the end of the TB so that
+   they don't dilute the hot code. */
+typedef struct TCGLdstSlowPath {
+    struct TCGLdstSlowPath *next;
+    int op_index;           /* op that generated it, for search_pc */
+    int is_ld;
+    int opc;                /* size and sign, as for tcg_out_qemu_ld/st */
+    int mem_index;
+    int data_reg;
+    int data_reg2;
+    int addr_reg;
+    int addr_reg2;
+    uint8_t *label_ptr[2];  /* 32 bit jumps to the slow path to patch */
+    uint8_t *raddr;         /* where to resume in the fast path */
+} TCGLdstSlowPath;
+#endif
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -272,6 +310,17 @@ struct TCGContext {
     unsigned long *tb_next;
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
+#ifdef TCG_TARGET_HAS_TB_RELOCS
+    /* references to patch when moving the code. If nb_tb_relocs is larger
+       than TCG_MAX_TB_RELOCS, some were not recorded */
+    TCGTBReloc tb_relocs[TCG_MAX_TB_RELOCS];
+    int nb_tb_relocs;
+#endif
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATHS
+    /* slow paths queued while generating the current TB */
+    TCGLdstSlowPath *ldst_slow_paths;
+    int cur_op_index;
+#endif
 
     /* liveness analysis */
     uint16_t *op_dead_iargs; /* for each operation, each bit tells if the
@@ -308,6 +357,10 @@ struct TCGContext {
     int64_t interm_time;
     int64_t code_time;
     int64_t la_time;
+    int64_t opt_time;
+    int64_t opt_folded_count;
+    int64_t opt_copy_count;
+    int64_t opt_dead_st_count;
     int64_t restore_count;
     int64_t restore_time;
 #endif
@@ -466,6 +519,9 @@ void tcg_register_helper(void *func, const char *name);
 const char *tcg_helper_get_name(TCGContext *s, void *func);
 void tcg_dump_ops(TCGContext *s, FILE *outfile);
 
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
+                     TCGOpDef *tcg_op_defs);
+
 void dump_ops(const uint16_t *opc_buf, const TCGArg *opparam_buf);
 TCGv_i32 tcg_const_i32(int32_t val);
 TCGv_i64 tcg_const_i64(int64_t val);
@@ -153,6 +153,7 @@ static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
         tcg_regset_set32(ct->u.regs, 0, 0xffff);
         tcg_regset_reset_reg(ct->u.regs, TCG_REG_RSI);
         tcg_regset_reset_reg(ct->u.regs, TCG_REG_RDI);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_RAX);
         break;
     case 'e':
         ct->ct |= TCG_CT_CONST_S32;
@@ -426,6 +427,10 @@ static inline void tgen_arithi32(TCGContext *s, int c, int r0, int32_t val)
     } else if (c == ARITH_AND && val == 0xffffu) {
         /* movzwl */
         tcg_out_modrm(s, 0xb7 | P_EXT, r0, r0);
+    } else if (r0 == TCG_REG_RAX) {
+        /* short form for %eax */
+        tcg_out8(s, 0x05 | (c << 3));
+        tcg_out32(s, val);
     } else {
         tcg_out_modrm(s, 0x81, c, r0);
         tcg_out32(s, val);
@@ -552,6 +557,105 @@ static void *qemu_st_helpers[4] = {
     __stl_mmu,
     __stq_mmu,
 };
+
+/* thunks emitted with the prologue: they load the helper arguments that
+   don't depend on the address and jump to the MMU helper, which returns
+   directly into the calling slow path. The store thunks also move the
+   data, so there is one per data register. */
+static uint8_t *qemu_ld_thunks[4][NB_MMU_MODES];
+static uint8_t *qemu_st_thunks[4][TCG_TARGET_NB_REGS][NB_MMU_MODES];
+
+static void tcg_out_qemu_st_thunk(TCGContext *s, int opc, int data_reg,
+                                  int mem_index)
+{
+    switch(opc) {
+    case 0:
+        /* movzbl */
+        tcg_out_modrm(s, 0xb6 | P_EXT | P_REXB_RM, TCG_REG_RSI, data_reg);
+        break;
+    case 1:
+        /* movzwl */
+        tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_RSI, data_reg);
+        break;
+    case 2:
+        /* movl */
+        tcg_out_modrm(s, 0x8b, TCG_REG_RSI, data_reg);
+        break;
+    default:
+    case 3:
+        tcg_out_mov(s, TCG_REG_RSI, data_reg);
+        break;
+    }
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
+    tcg_out_goto(s, 0, qemu_st_helpers[opc]);
+}
+
+/* Emits the TLB miss path of a qemu_ld/st op after the end of the TB: call
+   the MMU helper, then jump back after the inline TLB hit path. */
+static void tcg_out_ldst_slow_path(TCGContext *s, TCGLdstSlowPath *l)
+{
+    int32_t disp;
+
+    /* slow_path: */
+    *(int32_t *)l->label_ptr[0] = s->code_ptr - l->label_ptr[0] - 4;
+
+    if (l->is_ld) {
+        tcg_out_goto(s, 1, qemu_ld_thunks[l->opc & 3][l->mem_index]);
+
+        switch(l->opc) {
+        case 0 | 4:
+            /* movsbq */
+            tcg_out_modrm(s, 0xbe | P_EXT | P_REXW, l->data_reg, TCG_REG_RAX);
+            break;
+        case 1 | 4:
+            /* movswq */
+            tcg_out_modrm(s, 0xbf | P_EXT | P_REXW, l->data_reg, TCG_REG_RAX);
+            break;
+        case 2 | 4:
+            /* movslq */
+            tcg_out_modrm(s, 0x63 | P_REXW, l->data_reg, TCG_REG_RAX);
+            break;
+        case 0:
+            /* movzbl, also clears the high part */
+            tcg_out_modrm(s, 0xb6 | P_EXT, l->data_reg, TCG_REG_RAX);
+            break;
+        case 1:
+            /* movzwl, also clears the high part */
+            tcg_out_modrm(s, 0xb7 | P_EXT, l->data_reg, TCG_REG_RAX);
+            break;
+        case 2:
+        default:
+            /* movl */
+            tcg_out_modrm(s, 0x8b, l->data_reg, TCG_REG_RAX);
+            break;
+        case 3:
+            tcg_out_mov(s, l->data_reg, TCG_REG_RAX);
+            break;
+        }
+    } else {
+        tcg_out_goto(s, 1, qemu_st_thunks[l->opc][l->data_reg][l->mem_index]);
+    }
+
+    /* jmp raddr */
+    disp = l->raddr - s->code_ptr - 2;
+    if (disp == (int8_t)disp) {
+        tcg_out8(s, 0xeb);
+        tcg_out8(s, disp);
+    } else {
+        tcg_out_goto(s, 0, l->raddr);
+    }
+}
+#endif
+
+#if defined(CONFIG_SOFTMMU) && defined(CONFIG_PROFILER)
+/* count a TLB hit, for 'info jit' */
+static void tcg_out_tlb_hit_count(TCGContext *s)
+{
+    /* addq $1, tlb_hit_count(env) */
+    tcg_out_modrm_offset(s, 0x83 | P_REXW, 0, TCG_AREG0,
+                         offsetof(CPUState, tlb_hit_count));
+    tcg_out8(s, 1);
+}
 #endif
 
 static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
@@ -560,7 +664,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
     int32_t offset;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    uint8_t *label_ptr;
+    TCGLdstSlowPath *l;
 #endif
 
     data_reg = *args++;
@@ -569,7 +674,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     s_bits = opc & 3;
 
     r0 = TCG_REG_RDI;
-    r1 = TCG_REG_RSI;
+    r1 = TCG_REG_RAX;
 
 #if TARGET_LONG_BITS == 32
     rexw = 0;
@@ -589,8 +694,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0x81 | rexw, 4, r0); /* andl $x, r0 */
     tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     
-    tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
-    tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
+    /* andl $x, r1 */
+    tgen_arithi32(s, ARITH_AND, r1, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
 
     /* lea offset(r1, env), r1 */
     tcg_out_modrm_offset2(s, 0x8d | P_REXW, r1, r1, TCG_AREG0, 0,
@@ -602,53 +707,15 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
     
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-
-    /* XXX: move that code at the end of the TB */
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, mem_index);
-    tcg_out_goto(s, 1, qemu_ld_helpers[s_bits]);
-
-    switch(opc) {
-    case 0 | 4:
-        /* movsbq */
-        tcg_out_modrm(s, 0xbe | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 1 | 4:
-        /* movswq */
-        tcg_out_modrm(s, 0xbf | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 2 | 4:
-        /* movslq */
-        tcg_out_modrm(s, 0x63 | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 0:
-        /* movzbq */
-        tcg_out_modrm(s, 0xb6 | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 1:
-        /* movzwq */
-        tcg_out_modrm(s, 0xb7 | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 2:
-    default:
-        /* movl */
-        tcg_out_modrm(s, 0x8b, data_reg, TCG_REG_RAX);
-        break;
-    case 3:
-        tcg_out_mov(s, data_reg, TCG_REG_RAX);
-        break;
-    }
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr = s->code_ptr;
+    s->code_ptr += 4;
+
+#ifdef CONFIG_PROFILER
+    tcg_out_tlb_hit_count(s);
+#endif
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -743,8 +810,13 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    l = tcg_new_ldst_slow_path(s);
+    l->is_ld = 1;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->label_ptr[0] = label_ptr;
+    l->raddr = s->code_ptr;
 #endif
 }
 
@@ -754,7 +826,8 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
     int32_t offset;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    uint8_t *label_ptr;
+    TCGLdstSlowPath *l;
 #endif
 
     data_reg = *args++;
@@ -764,7 +837,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     s_bits = opc;
 
     r0 = TCG_REG_RDI;
-    r1 = TCG_REG_RSI;
+    r1 = TCG_REG_RAX;
 
 #if TARGET_LONG_BITS == 32
     rexw = 0;
@@ -784,8 +857,8 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_modrm(s, 0x81 | rexw, 4, r0); /* andl $x, r0 */
     tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     
-    tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
-    tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
+    /* andl $x, r1 */
+    tgen_arithi32(s, ARITH_AND, r1, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
 
     /* lea offset(r1, env), r1 */
     tcg_out_modrm_offset2(s, 0x8d | P_REXW, r1, r1, TCG_AREG0, 0,
@@ -797,40 +870,15 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
     
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-
-    /* XXX: move that code at the end of the TB */
-    switch(opc) {
-    case 0:
-        /* movzbl */
-        tcg_out_modrm(s, 0xb6 | P_EXT | P_REXB_RM, TCG_REG_RSI, data_reg);
-        break;
-    case 1:
-        /* movzwl */
-        tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_RSI, data_reg);
-        break;
-    case 2:
-        /* movl */
-        tcg_out_modrm(s, 0x8b, TCG_REG_RSI, data_reg);
-        break;
-    default:
-    case 3:
-        tcg_out_mov(s, TCG_REG_RSI, data_reg);
-        break;
-    }
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
-    tcg_out_goto(s, 1, qemu_st_helpers[s_bits]);
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr = s->code_ptr;
+    s->code_ptr += 4;
+
+#ifdef CONFIG_PROFILER
+    tcg_out_tlb_hit_count(s);
+#endif
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -851,6 +899,16 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
 #endif
 
+#if defined(CONFIG_SOFTMMU)
+    /* before the byte swap below can replace data_reg */
+    l = tcg_new_ldst_slow_path(s);
+    l->is_ld = 0;
+    l->opc = opc;
+    l->mem_index = mem_index;
+    l->data_reg = data_reg;
+    l->label_ptr[0] = label_ptr;
+#endif
+
 #ifdef TARGET_WORDS_BIGENDIAN
     bswap = 1;
 #else
@@ -898,8 +956,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    l->raddr = s->code_ptr;
 #endif
 }
 
@@ -907,6 +964,7 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
                               const int *const_args)
 {
     int c;
+    uint8_t *label_ptr;
     
     switch(opc) {
     case INDEX_op_exit_tb:
@@ -928,6 +986,16 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* the pointer is in %rax: if it is NULL, return it to cpu_exec() */
+        tcg_out_modrm(s, 0x85 | P_REXW, args[0], args[0]);
+        tcg_out8(s, 0x70 + JCC_JNE);
+        label_ptr = s->code_ptr;
+        s->code_ptr++;
+        tcg_out_goto(s, 0, tb_ret_addr);
+        *label_ptr = s->code_ptr - label_ptr - 1;
+        tcg_out_modrm(s, 0xff, 4, args[0]); /* jmp *%rax */
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_goto(s, 1, (void *) args[0]);
@@ -1290,6 +1358,9 @@ static inline void tcg_out_pop(TCGContext *s, int reg)
 void tcg_target_qemu_prologue(TCGContext *s)
 {
     int i, frame_size, push_size, stack_addend;
+#if defined(CONFIG_SOFTMMU)
+    int mem_index, reg;
+#endif
 
     /* TB prologue */
     /* save all callee saved registers */
@@ -1314,11 +1385,32 @@ void tcg_target_qemu_prologue(TCGContext *s)
         tcg_out_pop(s, tcg_target_callee_save_regs[i]);
     }
     tcg_out8(s, 0xc3); /* ret */
+
+#if defined(CONFIG_SOFTMMU)
+    /* TLB miss thunks */
+    for(i = 0; i < 4; i++) {
+        for(mem_index = 0; mem_index < NB_MMU_MODES; mem_index++) {
+            qemu_ld_thunks[i][mem_index] = s->code_ptr;
+            tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, mem_index);
+            tcg_out_goto(s, 0, qemu_ld_helpers[i]);
+
+            for(reg = 0; reg < TCG_TARGET_NB_REGS; reg++) {
+                /* the 'L' constraint excludes these */
+                if (reg == TCG_REG_RSP || reg == TCG_REG_RAX ||
+                    reg == TCG_REG_RSI || reg == TCG_REG_RDI)
+                    continue;
+                qemu_st_thunks[i][reg][mem_index] = s->code_ptr;
+                tcg_out_qemu_st_thunk(s, i, reg, mem_index);
+            }
+        }
+    }
+#endif
 }
 
 static const TCGTargetOpDef x86_64_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "a" } },
     { INDEX_op_call, { "ri" } }, /* XXX: might need a specific constant constraint */
     { INDEX_op_jmp, { "ri" } }, /* XXX: might need a specific constant constraint */
     { INDEX_op_br, { } },
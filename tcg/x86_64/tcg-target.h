@@ -85,6 +85,12 @@ enum {
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
+/* the TLB miss paths of qemu_ld/st are emitted after the end of the TB */
+#define TCG_TARGET_HAS_LDST_SLOW_PATHS
+
+/* generated code can jump to a TB whose address is only known at run time */
+#define TCG_TARGET_HAS_goto_ptr
+
 /* Note: must be synced with dyngen-exec.h */
 #define TCG_AREG0 TCG_REG_R14
 #define TCG_AREG1 TCG_REG_R15
@@ -20,6 +20,9 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "cpu.h"
 #include "exec-all.h"
 #include "trace.h"
@@ -118,6 +121,179 @@ uint64 Now() {
     return val;
 }
 
+// The rings of all the trace files, and the thread that writes them out.
+// The cpu thread fills the buffers without locking; 'lock' only protects
+// the head and tail of the rings while buffers are handed over.
+#define kMaxTraceRings 8
+
+static struct {
+    TraceRing	*rings[kMaxTraceRings];
+    int		num_rings;
+#ifndef _WIN32
+    pthread_t	thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;	// signaled when a buffer is handed over
+    pthread_cond_t space;	// signaled when a buffer is written out
+    int		started;
+    int		quit;
+#endif
+} trace_writer;
+
+static void trace_ring_init(TraceRing *ring, const char *filename,
+                            uint32_t buffer_size,
+                            void (*write)(TraceRing *, char *, uint32_t),
+                            void *opaque)
+{
+    int ii;
+
+    memset(ring, 0, sizeof(*ring));
+    for (ii = 0; ii < kTraceNumBuffers; ++ii) {
+        ring->buffers[ii] = malloc(buffer_size);
+        if (ring->buffers[ii] == NULL) {
+            perror(filename);
+            exit(1);
+        }
+    }
+    ring->filename = filename;
+    ring->write = write;
+    ring->opaque = opaque;
+    trace_writer.rings[trace_writer.num_rings++] = ring;
+}
+
+// Writes out encoded trace data.  After an error, the rest of the file is
+// dropped instead of stopping the emulator from the writer thread.
+static void trace_ring_fwrite(TraceRing *ring, FILE *fstream,
+                              const char *buf, uint32_t size)
+{
+    if (ring->error || size == 0)
+        return;
+    if (fwrite(buf, sizeof(char), size, fstream) != size) {
+        fprintf(stderr, "fwrite() failed\n");
+        perror(ring->filename);
+        ring->error = 1;
+    }
+}
+
+// Hands the 'size' bytes of records at the start of the current buffer of
+// 'ring' over to the writer thread, and returns the next buffer to fill.
+char *trace_ring_push(TraceRing *ring, uint32_t size)
+{
+#ifdef _WIN32
+    ring->write(ring, ring->buffers[0], size);
+    ring->head += 1;
+    ring->tail += 1;
+    return ring->buffers[0];
+#else
+    pthread_mutex_lock(&trace_writer.lock);
+    ring->sizes[ring->head % kTraceNumBuffers] = size;
+    ring->head += 1;
+    pthread_cond_signal(&trace_writer.work);
+    if (ring->head - ring->tail == kTraceNumBuffers) {
+        uint64_t start = Now();
+        ring->stalls += 1;
+        while (ring->head - ring->tail == kTraceNumBuffers)
+            pthread_cond_wait(&trace_writer.space, &trace_writer.lock);
+        ring->stall_usecs += Now() - start;
+    }
+    pthread_mutex_unlock(&trace_writer.lock);
+    return ring->buffers[ring->head % kTraceNumBuffers];
+#endif
+}
+
+#ifndef _WIN32
+static void *trace_writer_thread(void *arg)
+{
+    pthread_mutex_lock(&trace_writer.lock);
+    for (;;) {
+        int ii, busy = 0;
+        for (ii = 0; ii < trace_writer.num_rings; ++ii) {
+            TraceRing *ring = trace_writer.rings[ii];
+            if (ring->tail == ring->head)
+                continue;
+            int slot = ring->tail % kTraceNumBuffers;
+            pthread_mutex_unlock(&trace_writer.lock);
+            ring->write(ring, ring->buffers[slot], ring->sizes[slot]);
+            pthread_mutex_lock(&trace_writer.lock);
+            ring->tail += 1;
+            pthread_cond_signal(&trace_writer.space);
+            busy = 1;
+        }
+        if (busy)
+            continue;
+        if (trace_writer.quit)
+            break;
+        pthread_cond_wait(&trace_writer.work, &trace_writer.lock);
+    }
+    pthread_mutex_unlock(&trace_writer.lock);
+    return NULL;
+}
+#endif
+
+static void trace_writer_start()
+{
+#ifndef _WIN32
+    pthread_mutex_init(&trace_writer.lock, NULL);
+    pthread_cond_init(&trace_writer.work, NULL);
+    pthread_cond_init(&trace_writer.space, NULL);
+    if (pthread_create(&trace_writer.thread, NULL, trace_writer_thread,
+                       NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    trace_writer.started = 1;
+#endif
+}
+
+// Waits until all the buffers handed over have been written out, and
+// stops the writer thread.
+static void trace_writer_stop()
+{
+#ifndef _WIN32
+    if (!trace_writer.started)
+        return;
+    pthread_mutex_lock(&trace_writer.lock);
+    trace_writer.quit = 1;
+    pthread_cond_signal(&trace_writer.work);
+    pthread_mutex_unlock(&trace_writer.lock);
+    pthread_join(trace_writer.thread, NULL);
+    trace_writer.started = 0;
+#endif
+}
+
+// Reports how often the cpu had to wait for the writer thread.  Not async
+// signal safe: call it from the main loop or at exit.
+void trace_report_writer()
+{
+    int ii;
+
+    for (ii = 0; ii < trace_writer.num_rings; ++ii) {
+        TraceRing *ring = trace_writer.rings[ii];
+        uint32_t head;
+        uint64_t stalls, stall_usecs;
+        int error;
+
+        // the counters change under the lock while the cpu runs
+#ifndef _WIN32
+        if (trace_writer.started)
+            pthread_mutex_lock(&trace_writer.lock);
+#endif
+        head = ring->head;
+        stalls = ring->stalls;
+        stall_usecs = ring->stall_usecs;
+        error = ring->error;
+#ifndef _WIN32
+        if (trace_writer.started)
+            pthread_mutex_unlock(&trace_writer.lock);
+#endif
+        if (stalls == 0 && !error)
+            continue;
+        fprintf(stderr, "%s: %u buffers, cpu waited %" PRIu64
+                " times (%.3f secs) for the writer%s\n",
+                ring->filename, head, stalls, stall_usecs / 1000000.0,
+                error ? ", write error" : "");
+    }
+}
+
 static void create_trace_dir(const char *dirname)
 {
     int err;
@@ -239,6 +415,36 @@ void write_trace_header(TraceHeader *header)
     fwrite(&swappedHeader, sizeof(TraceHeader), 1, trace_static.fstream);
 }
 
+// Compresses basic block records, on the writer thread.
+static void write_trace_bb(TraceRing *ring, char *buf, uint32_t size)
+{
+    BBRec *ptr = (BBRec *)buf;
+    BBRec *end = (BBRec *)(buf + size);
+    char *comp_ptr = trace_bb.compressed_ptr;
+    int64_t prev_bb_num = trace_bb.prev_bb_num;
+    uint64_t prev_bb_time = trace_bb.prev_bb_time;
+    for (; ptr != end; ++ptr) {
+        if (comp_ptr >= trace_bb.high_water_ptr) {
+            uint32_t size = comp_ptr - trace_bb.compressed;
+            trace_ring_fwrite(ring, trace_bb.fstream, trace_bb.compressed,
+                              size);
+            comp_ptr = trace_bb.compressed;
+        }
+        int64_t bb_diff = ptr->bb_num - prev_bb_num;
+        prev_bb_num = ptr->bb_num;
+        uint64_t time_diff = ptr->start_time - prev_bb_time;
+        prev_bb_time = ptr->start_time;
+        comp_ptr = varint_encode_signed(bb_diff, comp_ptr);
+        comp_ptr = varint_encode(time_diff, comp_ptr);
+        comp_ptr = varint_encode(ptr->repeat, comp_ptr);
+        if (ptr->repeat)
+            comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
+    }
+    trace_bb.compressed_ptr = comp_ptr;
+    trace_bb.prev_bb_num = prev_bb_num;
+    trace_bb.prev_bb_time = prev_bb_time;
+}
+
 void create_trace_bb(const char *filename)
 {
     char *fname = create_trace_path(filename, ".bb");
@@ -250,7 +456,10 @@ void create_trace_bb(const char *filename)
         exit(1);
     }
     trace_bb.fstream = fstream;
-    trace_bb.next = &trace_bb.buffer[0];
+    trace_ring_init(&trace_bb.ring, fname,
+                    kMaxNumBasicBlocks * sizeof(BBRec), write_trace_bb, NULL);
+    trace_bb.buffer = (BBRec *)trace_bb.ring.buffers[0];
+    trace_bb.next = trace_bb.buffer;
     trace_bb.flush_time = 0;
     trace_bb.compressed_ptr = trace_bb.compressed;
     trace_bb.high_water_ptr = &trace_bb.compressed[kCompressedSize] - kMaxBBCompressed;
@@ -260,6 +469,26 @@ void create_trace_bb(const char *filename)
     trace_bb.recnum = 0;
 }
 
+// Compresses instruction time records, on the writer thread.
+static void write_trace_insn(TraceRing *ring, char *buf, uint32_t size)
+{
+    // Skip the unused first record of the buffer.
+    InsnRec *ptr = (InsnRec *)buf + 1;
+    InsnRec *end = (InsnRec *)(buf + size);
+    char *comp_ptr = trace_insn.compressed_ptr;
+    for (; ptr < end; ++ptr) {
+        if (comp_ptr >= trace_insn.high_water_ptr) {
+            uint32_t size = comp_ptr - trace_insn.compressed;
+            trace_ring_fwrite(ring, trace_insn.fstream, trace_insn.compressed,
+                              size);
+            comp_ptr = trace_insn.compressed;
+        }
+        comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
+        comp_ptr = varint_encode(ptr->repeat, comp_ptr);
+    }
+    trace_insn.compressed_ptr = comp_ptr;
+}
+
 void create_trace_insn(const char *filename)
 {
     // Create the instruction time trace file
@@ -272,14 +501,25 @@ void create_trace_insn(const char *filename)
         exit(1);
     }
     trace_insn.fstream = fstream;
-    trace_insn.current = &trace_insn.dummy;
-    trace_insn.dummy.time_diff = 0;
-    trace_insn.dummy.repeat = 0;
+    trace_ring_init(&trace_insn.ring, fname,
+                    (kInsnBufferSize + 1) * sizeof(InsnRec), write_trace_insn,
+                    NULL);
+    trace_insn.buffer = (InsnRec *)trace_insn.ring.buffers[0] + 1;
+    trace_insn.current = &trace_insn.buffer[-1];
+    trace_insn.current->time_diff = 0;
+    trace_insn.current->repeat = 0;
     trace_insn.prev_time = 0;
     trace_insn.compressed_ptr = trace_insn.compressed;
     trace_insn.high_water_ptr = &trace_insn.compressed[kCompressedSize] - kMaxInsnCompressed;
 }
 
+// Writes out records that are already in their file format, on the
+// writer thread.
+static void write_trace_raw(TraceRing *ring, char *buf, uint32_t size)
+{
+    trace_ring_fwrite(ring, *(FILE **)ring->opaque, buf, size);
+}
+
 void create_trace_static(const char *filename)
 {
     // Create the static basic block trace file
@@ -292,6 +532,10 @@ void create_trace_static(const char *filename)
         exit(1);
     }
     trace_static.fstream = fstream;
+    trace_ring_init(&trace_static.ring, fname, kTraceStaticBufferSize,
+                    write_trace_raw, &trace_static.fstream);
+    trace_static.buffer = trace_static.ring.buffers[0];
+    trace_static.next = trace_static.buffer;
     trace_static.next_insn = 0;
     trace_static.bb_num = 1;
     trace_static.bb_addr = 0;
@@ -321,6 +565,45 @@ void create_trace_static(const char *filename)
     fwrite(&zero, sizeof(uint32_t), 1, trace_static.fstream);	// num_insns
 }
 
+// Compresses load or store address records, on the writer thread.
+static void write_trace_addr(TraceRing *ring, char *buf, uint32_t size)
+{
+    TraceAddr *trace_addr = ring->opaque;
+    AddrRec *ptr = (AddrRec *)buf;
+    AddrRec *end = (AddrRec *)(buf + size);
+    char *comp_ptr = trace_addr->compressed_ptr;
+    uint32_t prev_addr = trace_addr->prev_addr;
+    uint64_t prev_time = trace_addr->prev_time;
+    for (; ptr != end; ++ptr) {
+        if (comp_ptr >= trace_addr->high_water_ptr) {
+            uint32_t size = comp_ptr - trace_addr->compressed;
+            trace_ring_fwrite(ring, trace_addr->fstream, trace_addr->compressed,
+                              size);
+            comp_ptr = trace_addr->compressed;
+        }
+
+        int addr_diff = ptr->addr - prev_addr;
+        uint64_t time_diff = ptr->time - prev_time;
+        prev_addr = ptr->addr;
+        prev_time = ptr->time;
+
+        comp_ptr = varint_encode_signed(addr_diff, comp_ptr);
+        comp_ptr = varint_encode(time_diff, comp_ptr);
+    }
+    trace_addr->compressed_ptr = comp_ptr;
+    trace_addr->prev_addr = prev_addr;
+    trace_addr->prev_time = prev_time;
+}
+
+// Hands the full buffer of load or store addresses over to the writer
+// thread, and returns the next one.
+AddrRec *trace_flush_addr(TraceAddr *trace_addr)
+{
+    trace_addr->buffer = (AddrRec *)trace_ring_push(&trace_addr->ring,
+                                        kMaxNumAddrs * sizeof(AddrRec));
+    return trace_addr->buffer;
+}
+
 void create_trace_addr(const char *filename)
 {
     // The "qtrace.load" and "qtrace.store" files are optional
@@ -337,7 +620,11 @@ void create_trace_addr(const char *filename)
             exit(1);
         }
         trace_load.fstream = fstream;
-        trace_load.next = &trace_load.buffer[0];
+        trace_ring_init(&trace_load.ring, fname,
+                        kMaxNumAddrs * sizeof(AddrRec), write_trace_addr,
+                        &trace_load);
+        trace_load.buffer = (AddrRec *)trace_load.ring.buffers[0];
+        trace_load.next = trace_load.buffer;
         trace_load.compressed_ptr = trace_load.compressed;
         trace_load.high_water_ptr = &trace_load.compressed[kCompressedSize] - kMaxAddrCompressed;
         trace_load.prev_addr = 0;
@@ -353,7 +640,11 @@ void create_trace_addr(const char *filename)
             exit(1);
         }
         trace_store.fstream = fstream;
-        trace_store.next = &trace_store.buffer[0];
+        trace_ring_init(&trace_store.ring, fname,
+                        kMaxNumAddrs * sizeof(AddrRec), write_trace_addr,
+                        &trace_store);
+        trace_store.buffer = (AddrRec *)trace_store.ring.buffers[0];
+        trace_store.next = trace_store.buffer;
         trace_store.compressed_ptr = trace_store.compressed;
         trace_store.high_water_ptr = &trace_store.compressed[kCompressedSize] - kMaxAddrCompressed;
         trace_store.prev_addr = 0;
@@ -373,6 +664,9 @@ void create_trace_exc(const char *filename)
         exit(1);
     }
     trace_exc.fstream = fstream;
+    trace_ring_init(&trace_exc.ring, fname, kCompressedSize, write_trace_raw,
+                    &trace_exc.fstream);
+    trace_exc.compressed = trace_exc.ring.buffers[0];
     trace_exc.compressed_ptr = trace_exc.compressed;
     trace_exc.high_water_ptr = &trace_exc.compressed[kCompressedSize] - kMaxExcCompressed;
     trace_exc.prev_time = 0;
@@ -391,6 +685,9 @@ void create_trace_pid(const char *filename)
         exit(1);
     }
     trace_pid.fstream = fstream;
+    trace_ring_init(&trace_pid.ring, fname, kCompressedSize, write_trace_raw,
+                    &trace_pid.fstream);
+    trace_pid.compressed = trace_pid.ring.buffers[0];
     trace_pid.compressed_ptr = trace_pid.compressed;
     trace_pid.prev_time = 0;
 }
@@ -407,6 +704,9 @@ void create_trace_method(const char *filename)
         exit(1);
     }
     trace_method.fstream = fstream;
+    trace_ring_init(&trace_method.ring, fname, kCompressedSize,
+                    write_trace_raw, &trace_method.fstream);
+    trace_method.compressed = trace_method.ring.buffers[0];
     trace_method.compressed_ptr = trace_method.compressed;
     trace_method.prev_time = 0;
     trace_method.prev_addr = 0;
@@ -435,6 +735,7 @@ void trace_init(const char *filename)
 #else
     ftrace_debug = NULL;
 #endif
+    trace_writer_start();
     atexit(trace_cleanup);
 
     // If tracing is on, then start timing the simulator
@@ -503,6 +804,14 @@ void trace_bb_end()
 {
     int		ii, num_insns;
     uint32_t	insn;
+    char	*next = trace_static.next;
+    uint32_t	size = sizeof(uint64_t) + 2 * sizeof(uint32_t) +
+                       trace_static.next_insn * sizeof(uint32_t);
+
+    if (next + size > trace_static.buffer + kTraceStaticBufferSize) {
+        next = trace_static.buffer =
+            trace_ring_push(&trace_static.ring, next - trace_static.buffer);
+    }
 
     uint64_t bb_num = hostToLE64(trace_static.bb_num);
     // If these are Thumb instructions, then encode that fact by setting
@@ -510,13 +819,18 @@ void trace_bb_end()
     uint32_t bb_addr = trace_static.bb_addr | trace_static.is_thumb;
     bb_addr = hostToLE32(bb_addr);
     num_insns = hostToLE32(trace_static.next_insn);
-    fwrite(&bb_num, sizeof(bb_num), 1, trace_static.fstream);
-    fwrite(&bb_addr, sizeof(bb_addr), 1, trace_static.fstream);
-    fwrite(&num_insns, sizeof(num_insns), 1, trace_static.fstream);
+    memcpy(next, &bb_num, sizeof(bb_num));
+    next += sizeof(bb_num);
+    memcpy(next, &bb_addr, sizeof(bb_addr));
+    next += sizeof(bb_addr);
+    memcpy(next, &num_insns, sizeof(num_insns));
+    next += sizeof(num_insns);
     for (ii = 0; ii < trace_static.next_insn; ++ii) {
         insn = hostToLE32(trace_static.insns[ii]);
-        fwrite(&insn, sizeof(insn), 1, trace_static.fstream);
+        memcpy(next, &insn, sizeof(insn));
+        next += sizeof(insn);
     }
+    trace_static.next = next;
 
     trace_static.bb_num += 1;
     trace_static.next_insn = 0;
@@ -543,29 +857,48 @@ void trace_cleanup()
     }
     printf("Elapsed seconds: %.2f, simulated cycles/sec: %.1f%s\n",
            elapsed_secs, cycles_per_sec, suffix);
+    // Hand the partially filled buffers over to the writer thread, and wait
+    // until everything has been written out.
+    if (trace_bb.fstream) {
+        trace_ring_push(&trace_bb.ring,
+                        (char *)trace_bb.next - (char *)trace_bb.buffer);
+    }
+    if (trace_insn.fstream) {
+        trace_ring_push(&trace_insn.ring,
+                        (char *)(trace_insn.current + 1) -
+                        (char *)(trace_insn.buffer - 1));
+    }
+    if (trace_static.fstream) {
+        trace_ring_push(&trace_static.ring,
+                        trace_static.next - trace_static.buffer);
+    }
+    if (trace_load.fstream) {
+        trace_ring_push(&trace_load.ring,
+                        (char *)trace_load.next - (char *)trace_load.buffer);
+    }
+    if (trace_store.fstream) {
+        trace_ring_push(&trace_store.ring,
+                        (char *)trace_store.next - (char *)trace_store.buffer);
+    }
+    if (trace_exc.fstream) {
+        trace_ring_push(&trace_exc.ring,
+                        trace_exc.compressed_ptr - trace_exc.compressed);
+    }
+    if (trace_pid.fstream) {
+        trace_ring_push(&trace_pid.ring,
+                        trace_pid.compressed_ptr - trace_pid.compressed);
+    }
+    if (trace_method.fstream) {
+        trace_ring_push(&trace_method.ring,
+                        trace_method.compressed_ptr - trace_method.compressed);
+    }
+    trace_writer_stop();
+    trace_report_writer();
+
     if (trace_bb.fstream) {
-        BBRec *ptr;
-        BBRec *next = trace_bb.next;
         char *comp_ptr = trace_bb.compressed_ptr;
         int64_t prev_bb_num = trace_bb.prev_bb_num;
         uint64_t prev_bb_time = trace_bb.prev_bb_time;
-        for (ptr = trace_bb.buffer; ptr != next; ++ptr) {
-            if (comp_ptr >= trace_bb.high_water_ptr) {
-                uint32_t size = comp_ptr - trace_bb.compressed;
-                fwrite(trace_bb.compressed, sizeof(char), size,
-                       trace_bb.fstream);
-                comp_ptr = trace_bb.compressed;
-            }
-            int64_t bb_diff = ptr->bb_num - prev_bb_num;
-            prev_bb_num = ptr->bb_num;
-            uint64_t time_diff = ptr->start_time - prev_bb_time;
-            prev_bb_time = ptr->start_time;
-            comp_ptr = varint_encode_signed(bb_diff, comp_ptr);
-            comp_ptr = varint_encode(time_diff, comp_ptr);
-            comp_ptr = varint_encode(ptr->repeat, comp_ptr);
-            if (ptr->repeat)
-                comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
-        }
 
         // Add an extra record at the end containing the ending simulation
         // time and a basic block number of 0.
@@ -578,8 +911,8 @@ void trace_cleanup()
         }
 
         uint32_t size = comp_ptr - trace_bb.compressed;
-        if (size)
-            fwrite(trace_bb.compressed, sizeof(char), size, trace_bb.fstream);
+        trace_ring_fwrite(&trace_bb.ring, trace_bb.fstream,
+                          trace_bb.compressed, size);
 
         // Terminate the file with three zeros so that we can detect
         // the end of file quickly.
@@ -589,35 +922,9 @@ void trace_cleanup()
     }
 
     if (trace_insn.fstream) {
-        InsnRec *ptr;
-        InsnRec *current = trace_insn.current + 1;
-        char *comp_ptr = trace_insn.compressed_ptr;
-        for (ptr = trace_insn.buffer; ptr != current; ++ptr) {
-            if (comp_ptr >= trace_insn.high_water_ptr) {
-                uint32_t size = comp_ptr - trace_insn.compressed;
-                uint32_t rval = fwrite(trace_insn.compressed, sizeof(char),
-                                       size, trace_insn.fstream);
-                if (rval != size) {
-                    fprintf(stderr, "fwrite() failed\n");
-                    perror(trace_insn.filename);
-                    exit(1);
-                }
-                comp_ptr = trace_insn.compressed;
-            }
-            comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
-            comp_ptr = varint_encode(ptr->repeat, comp_ptr);
-        }
-
-        uint32_t size = comp_ptr - trace_insn.compressed;
-        if (size) {
-            uint32_t rval = fwrite(trace_insn.compressed, sizeof(char), size,
-                                   trace_insn.fstream);
-            if (rval != size) {
-                fprintf(stderr, "fwrite() failed\n");
-                perror(trace_insn.filename);
-                exit(1);
-            }
-        }
+        uint32_t size = trace_insn.compressed_ptr - trace_insn.compressed;
+        trace_ring_fwrite(&trace_insn.ring, trace_insn.fstream,
+                          trace_insn.compressed, size);
         fclose(trace_insn.fstream);
     }
 
@@ -628,33 +935,9 @@ void trace_cleanup()
     }
 
     if (trace_load.fstream) {
-        AddrRec *ptr;
-        char *comp_ptr = trace_load.compressed_ptr;
-        AddrRec *next = trace_load.next;
-        uint32_t prev_addr = trace_load.prev_addr;
-        uint64_t prev_time = trace_load.prev_time;
-        for (ptr = trace_load.buffer; ptr != next; ++ptr) {
-            if (comp_ptr >= trace_load.high_water_ptr) {
-                uint32_t size = comp_ptr - trace_load.compressed;
-                fwrite(trace_load.compressed, sizeof(char), size,
-                       trace_load.fstream);
-                comp_ptr = trace_load.compressed;
-            }
-
-            int addr_diff = ptr->addr - prev_addr;
-            uint64_t time_diff = ptr->time - prev_time;
-            prev_addr = ptr->addr;
-            prev_time = ptr->time;
-
-            comp_ptr = varint_encode_signed(addr_diff, comp_ptr);
-            comp_ptr = varint_encode(time_diff, comp_ptr);
-        }
-
-        uint32_t size = comp_ptr - trace_load.compressed;
-        if (size) {
-            fwrite(trace_load.compressed, sizeof(char), size,
-                   trace_load.fstream);
-        }
+        uint32_t size = trace_load.compressed_ptr - trace_load.compressed;
+        trace_ring_fwrite(&trace_load.ring, trace_load.fstream,
+                          trace_load.compressed, size);
 
         // Terminate the file with two zeros so that we can detect
         // the end of file quickly.
@@ -664,33 +947,9 @@ void trace_cleanup()
     }
 
     if (trace_store.fstream) {
-        AddrRec *ptr;
-        char *comp_ptr = trace_store.compressed_ptr;
-        AddrRec *next = trace_store.next;
-        uint32_t prev_addr = trace_store.prev_addr;
-        uint64_t prev_time = trace_store.prev_time;
-        for (ptr = trace_store.buffer; ptr != next; ++ptr) {
-            if (comp_ptr >= trace_store.high_water_ptr) {
-                uint32_t size = comp_ptr - trace_store.compressed;
-                fwrite(trace_store.compressed, sizeof(char), size,
-                       trace_store.fstream);
-                comp_ptr = trace_store.compressed;
-            }
-
-            int addr_diff = ptr->addr - prev_addr;
-            uint64_t time_diff = ptr->time - prev_time;
-            prev_addr = ptr->addr;
-            prev_time = ptr->time;
-
-            comp_ptr = varint_encode_signed(addr_diff, comp_ptr);
-            comp_ptr = varint_encode(time_diff, comp_ptr);
-        }
-
-        uint32_t size = comp_ptr - trace_store.compressed;
-        if (size) {
-            fwrite(trace_store.compressed, sizeof(char), size,
-                   trace_store.fstream);
-        }
+        uint32_t size = trace_store.compressed_ptr - trace_store.compressed;
+        trace_ring_fwrite(&trace_store.ring, trace_store.fstream,
+                          trace_store.compressed, size);
 
         // Terminate the file with two zeros so that we can detect
         // the end of file quickly.
@@ -700,12 +959,6 @@ void trace_cleanup()
     }
 
     if (trace_exc.fstream) {
-        uint32_t size = trace_exc.compressed_ptr - trace_exc.compressed;
-        if (size) {
-            fwrite(trace_exc.compressed, sizeof(char), size,
-                   trace_exc.fstream);
-        }
-
         // Terminate the file with 7 zeros so that we can detect
         // the end of file quickly.
         uint64_t zeros = 0;
@@ -713,12 +966,6 @@ void trace_cleanup()
         fclose(trace_exc.fstream);
     }
     if (trace_pid.fstream) {
-        uint32_t size = trace_pid.compressed_ptr - trace_pid.compressed;
-        if (size) {
-            fwrite(trace_pid.compressed, sizeof(char), size,
-                   trace_pid.fstream);
-        }
-
         // Terminate the file with 2 zeros so that we can detect
         // the end of file quickly.
         uint64_t zeros = 0;
@@ -726,12 +973,6 @@ void trace_cleanup()
         fclose(trace_pid.fstream);
     }
     if (trace_method.fstream) {
-        uint32_t size = trace_method.compressed_ptr - trace_method.compressed;
-        if (size) {
-            fwrite(trace_method.compressed, sizeof(char), size,
-                   trace_method.fstream);
-        }
-
         // Terminate the file with 2 zeros so that we can detect
         // the end of file quickly.
         uint64_t zeros = 0;
@@ -1399,9 +1640,9 @@ void trace_exception(uint32 target_pc)
 #endif
     char *comp_ptr = trace_exc.compressed_ptr;
     if (comp_ptr >= trace_exc.high_water_ptr) {
-        uint32_t size = comp_ptr - trace_exc.compressed;
-        fwrite(trace_exc.compressed, sizeof(char), size, trace_exc.fstream);
-        comp_ptr = trace_exc.compressed;
+        comp_ptr = trace_exc.compressed =
+            trace_ring_push(&trace_exc.ring, comp_ptr - trace_exc.compressed);
+        trace_exc.high_water_ptr = &comp_ptr[kCompressedSize] - kMaxExcCompressed;
     }
     uint64_t time_diff = sim_time - trace_exc.prev_time;
     trace_exc.prev_time = sim_time;
@@ -1424,9 +1665,8 @@ void trace_pid_1arg(int pid, int rec_type)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + kMaxPidCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1443,9 +1683,8 @@ void trace_pid_2arg(int tgid, int pid, int rec_type)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + kMaxPid2Compressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1507,9 +1746,8 @@ void trace_name(char *name)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + len + kMaxNameCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1557,9 +1795,8 @@ void trace_execve(const char *argv, int len)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + len + 5 * argc + kMaxExecArgsCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1593,9 +1830,8 @@ void trace_mmap(unsigned long vstart, unsigned long vend,
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + len + kMaxMmapCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1622,9 +1858,8 @@ void trace_munmap(unsigned long vstart, unsigned long vend)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + kMaxMunmapCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1648,9 +1883,8 @@ void trace_dynamic_symbol_add(unsigned long vaddr, const char *name)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + len + kMaxSymbolCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1674,9 +1908,8 @@ void trace_dynamic_symbol_remove(unsigned long vaddr)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + kMaxSymbolCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1699,9 +1932,8 @@ void trace_init_name(int tgid, int pid, const char *name)
     char *comp_ptr = trace_pid.compressed_ptr;
     char *max_end_ptr = comp_ptr + len + kMaxKthreadNameCompressed;
     if (max_end_ptr >= &trace_pid.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_pid.compressed;
-        fwrite(trace_pid.compressed, sizeof(char), size, trace_pid.fstream);
-        comp_ptr = trace_pid.compressed;
+        comp_ptr = trace_pid.compressed =
+            trace_ring_push(&trace_pid.ring, comp_ptr - trace_pid.compressed);
     }
     uint64_t time_diff = sim_time - trace_pid.prev_time;
     trace_pid.prev_time = sim_time;
@@ -1752,31 +1984,8 @@ void trace_bb_helper(uint64_t bb_num, TranslationBlock *tb)
 
     BBRec *next = trace_bb.next;
     if (next == &trace_bb.buffer[kMaxNumBasicBlocks]) {
-        BBRec *ptr;
-        char *comp_ptr = trace_bb.compressed_ptr;
-        int64_t prev_bb_num = trace_bb.prev_bb_num;
-        uint64_t prev_bb_time = trace_bb.prev_bb_time;
-        for (ptr = trace_bb.buffer; ptr != next; ++ptr) {
-            if (comp_ptr >= trace_bb.high_water_ptr) {
-                uint32_t size = comp_ptr - trace_bb.compressed;
-                fwrite(trace_bb.compressed, sizeof(char), size, trace_bb.fstream);
-                comp_ptr = trace_bb.compressed;
-            }
-            int64_t bb_diff = ptr->bb_num - prev_bb_num;
-            prev_bb_num = ptr->bb_num;
-            uint64_t time_diff = ptr->start_time - prev_bb_time;
-            prev_bb_time = ptr->start_time;
-            comp_ptr = varint_encode_signed(bb_diff, comp_ptr);
-            comp_ptr = varint_encode(time_diff, comp_ptr);
-            comp_ptr = varint_encode(ptr->repeat, comp_ptr);
-            if (ptr->repeat)
-                comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
-        }
-        trace_bb.compressed_ptr = comp_ptr;
-        trace_bb.prev_bb_num = prev_bb_num;
-        trace_bb.prev_bb_time = prev_bb_time;
-
-        next = trace_bb.buffer;
+        next = trace_bb.buffer = (BBRec *)trace_ring_push(&trace_bb.ring,
+                                        kMaxNumBasicBlocks * sizeof(BBRec));
         trace_bb.flush_time = sim_time;
     }
     tb->bb_rec = next;
@@ -1819,25 +2028,9 @@ void trace_insn_helper()
     current += 1;
 
     if (current == &trace_insn.buffer[kInsnBufferSize]) {
-        InsnRec *ptr;
-        char *comp_ptr = trace_insn.compressed_ptr;
-        for (ptr = trace_insn.buffer; ptr != current; ++ptr) {
-            if (comp_ptr >= trace_insn.high_water_ptr) {
-                uint32_t size = comp_ptr - trace_insn.compressed;
-                uint32_t rval = fwrite(trace_insn.compressed, sizeof(char),
-                                       size, trace_insn.fstream);
-                if (rval != size) {
-                    fprintf(stderr, "fwrite() failed\n");
-                    perror(trace_insn.filename);
-                    exit(1);
-                }
-                comp_ptr = trace_insn.compressed;
-            }
-            comp_ptr = varint_encode(ptr->time_diff, comp_ptr);
-            comp_ptr = varint_encode(ptr->repeat, comp_ptr);
-        }
-        trace_insn.compressed_ptr = comp_ptr;
-        current = trace_insn.buffer;
+        char *buf = trace_ring_push(&trace_insn.ring,
+                                    (kInsnBufferSize + 1) * sizeof(InsnRec));
+        current = trace_insn.buffer = (InsnRec *)buf + 1;
     }
     current->time_diff = time_diff;
     current->repeat = 0;
@@ -1859,9 +2052,8 @@ void trace_interpreted_method(uint32_t addr, int call_type)
     char *comp_ptr = trace_method.compressed_ptr;
     char *max_end_ptr = comp_ptr + kMaxMethodCompressed;
     if (max_end_ptr >= &trace_method.compressed[kCompressedSize]) {
-        uint32_t size = comp_ptr - trace_method.compressed;
-        fwrite(trace_method.compressed, sizeof(char), size, trace_method.fstream);
-        comp_ptr = trace_method.compressed;
+        comp_ptr = trace_method.compressed =
+            trace_ring_push(&trace_method.ring, comp_ptr - trace_method.compressed);
     }
     uint64_t time_diff = sim_time - trace_method.prev_time;
     trace_method.prev_time = sim_time;
@@ -22,13 +22,40 @@ extern uint64 Now();
 
 struct TranslationBlock;
 
+// The number of buffers in the ring of each trace file.
+#define kTraceNumBuffers 8
+
+// The size of the buffers of the static basic block trace.
+#define kTraceStaticBufferSize 65536
+
+// The records of each trace file are appended by the cpu thread to one
+// buffer of a ring.  Full buffers are handed over to a writer thread that
+// encodes them and writes them to the file, while the cpu thread moves on
+// to the next buffer.  The cpu thread only waits for the writer when all
+// the buffers of a ring are full.
+typedef struct TraceRing {
+    const char	*filename;
+    char	*buffers[kTraceNumBuffers];
+    uint32_t	sizes[kTraceNumBuffers];
+    uint32_t	head;		// number of buffers handed over
+    uint32_t	tail;		// number of buffers written out
+    // Encodes and writes out 'size' bytes of records from 'buf'.
+    void	(*write)(struct TraceRing *ring, char *buf, uint32_t size);
+    void	*opaque;
+    uint64_t	stalls;		// times the cpu waited for a free buffer
+    uint64_t	stall_usecs;	// time spent waiting
+    int		error;		// set after a write error
+} TraceRing;
+
 // For tracing dynamic execution of basic blocks
 typedef struct TraceBB {
     char	*filename;
     FILE	*fstream;
-    BBRec	buffer[kMaxNumBasicBlocks];
+    TraceRing	ring;
+    BBRec	*buffer;	// the buffer of the ring being filled
     BBRec	*next;		// points to next record in buffer
     uint64_t	flush_time;	// time of last buffer flush
+    // The encoder state below belongs to the writer thread.
     char	compressed[kCompressedSize];
     char	*compressed_ptr;
     char	*high_water_ptr;
@@ -45,10 +72,13 @@ typedef struct TraceBB {
 typedef struct TraceInsn {
     char	*filename;
     FILE	*fstream;
-    InsnRec	dummy;		// this is here so we can use buffer[-1]
-    InsnRec	buffer[kInsnBufferSize];
+    TraceRing	ring;
+    // The first record of each buffer of the ring is not written out, so
+    // that the buffer being filled starts at buffer[-1].
+    InsnRec	*buffer;
     InsnRec	*current;
     uint64_t	prev_time;	// time of last instruction start
+    // The encoder state below belongs to the writer thread.
     char	compressed[kCompressedSize];
     char	*compressed_ptr;
     char	*high_water_ptr;
@@ -58,6 +88,9 @@ typedef struct TraceInsn {
 typedef struct TraceStatic {
     char	*filename;
     FILE	*fstream;
+    TraceRing	ring;
+    char	*buffer;	// the buffer of the ring being filled
+    char	*next;		// where the next record goes in buffer
     uint32_t	insns[kMaxInsnPerBB];
     int		next_insn;
     uint64_t	bb_num;
@@ -69,8 +102,10 @@ typedef struct TraceStatic {
 typedef struct TraceAddr {
     char	*filename;
     FILE	*fstream;
-    AddrRec	buffer[kMaxNumAddrs];
+    TraceRing	ring;
+    AddrRec	*buffer;	// the buffer of the ring being filled
     AddrRec	*next;
+    // The encoder state below belongs to the writer thread.
     char	compressed[kCompressedSize];
     char	*compressed_ptr;
     char	*high_water_ptr;
@@ -78,11 +113,13 @@ typedef struct TraceAddr {
     uint64_t	prev_time;
 } TraceAddr;
 
-// For tracing exceptions
+// For tracing exceptions.  The records are compressed by the cpu thread
+// directly into the buffers of the ring.
 typedef struct TraceExc {
     char	*filename;
     FILE	*fstream;
-    char	compressed[kCompressedSize];
+    TraceRing	ring;
+    char	*compressed;
     char	*compressed_ptr;
     char	*high_water_ptr;
     uint64_t	prev_time;
@@ -93,7 +130,8 @@ typedef struct TraceExc {
 typedef struct TracePid {
     char	*filename;
     FILE	*fstream;
-    char	compressed[kCompressedSize];
+    TraceRing	ring;
+    char	*compressed;
     char	*compressed_ptr;
     uint64_t	prev_time;
 } TracePid;
@@ -102,7 +140,8 @@ typedef struct TracePid {
 typedef struct TraceMethod {
     char	*filename;
     FILE	*fstream;
-    char	compressed[kCompressedSize];
+    TraceRing	ring;
+    char	*compressed;
     char	*compressed_ptr;
     uint64_t	prev_time;
     uint32_t	prev_addr;
@@ -132,6 +171,9 @@ extern void trace_init(const char *filename);
 extern void trace_bb_start(uint32_t bb_addr);
 extern void trace_add_insn(uint32_t insn, int is_thumb);
 extern void trace_bb_end();
+extern char *trace_ring_push(TraceRing *ring, uint32_t size);
+extern AddrRec *trace_flush_addr(TraceAddr *trace_addr);
+extern void trace_report_writer();
 
 extern int get_insn_ticks_arm(uint32_t insn);
 extern int get_insn_ticks_thumb(uint32_t  insn);
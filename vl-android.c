@@ -72,6 +72,27 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <zlib.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+/* is_dup_page() uses SSE2 when the compiler targets it (x86_64). 32-bit
+ * x86 builds compile the SSE2 check with a target attribute and use it
+ * when cpuid reports SSE2, like the framebuffer scan does.
+ */
+#if defined(__SSE2__)
+#define DUP_PAGE_SSE2           1
+#define DUP_PAGE_SSE2_DISPATCH  0
+#elif (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__) && \
+    !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define DUP_PAGE_SSE2           1
+#define DUP_PAGE_SSE2_DISPATCH  1
+#else
+#define DUP_PAGE_SSE2           0
+#define DUP_PAGE_SSE2_DISPATCH  0
+#endif
+#if DUP_PAGE_SSE2
+#include <emmintrin.h>
+#endif
 
 /* Needed early for CONFIG_BSD etc. */
 #include "config-host.h"
@@ -212,6 +233,7 @@ extern void  android_emulator_set_base_port(int  port);
 #include "disas.h"
 
 #include "exec-all.h"
+#include "tb-cache.h"
 
 #ifdef CONFIG_TRACE
 #include "trace.h"
@@ -224,6 +246,10 @@ extern void  android_emulator_set_base_port(int  port);
 #include "libslirp.h"
 #endif
 
+#ifdef CONFIG_EPOLL
+#include "iolooper.h"
+#include "sockets.h"
+#endif
 
 
 #define DEFAULT_RAM_SIZE 128
@@ -660,6 +686,9 @@ int qemu_timedate_diff(struct tm *tm)
 #ifdef CONFIG_TRACE
 static int tbflush_requested;
 static int exit_requested;
+/* the writer report is printed from the main loop, as stop_tracing() can
+   run in a signal handler */
+static int trace_report_requested;
 
 void start_tracing()
 {
@@ -682,6 +711,7 @@ void stop_tracing()
     end_time = Now();
     elapsed_usecs += end_time - start_time;
     fprintf(stderr,"-- stop tracing --\n");
+    trace_report_requested = 1;
   }
   tracing = 0;
   tbflush_requested = 1;
@@ -1740,10 +1770,101 @@ typedef struct IOHandlerRecord {
     /* temporary data */
     struct pollfd *ufd;
     struct IOHandlerRecord *next;
+#ifdef CONFIG_EPOLL
+    /* IOLOOPER_XXX flags the fd is registered with in main_iolooper */
+    int iol_flags;
+    /* next handler with a fd_read_poll callback */
+    struct IOHandlerRecord *next_polled;
+#endif
 } IOHandlerRecord;
 
 static IOHandlerRecord *first_io_handler;
 
+#ifdef CONFIG_EPOLL
+/* With epoll, file descriptors stay registered between main loop iterations.
+ * IO handlers update their registration in qemu_set_fd_handler2(), so that
+ * a wakeup only costs in proportion to the number of ready descriptors. */
+static IoLooper *main_iolooper;
+
+/* IO handlers indexed by their fd, to dispatch ready descriptors */
+static IOHandlerRecord **io_handlers_by_fd;
+static int io_handlers_by_fd_size;
+
+/* Handlers with a fd_read_poll callback have to be asked whether they can
+ * read on every iteration. They are kept in a separate list. */
+static IOHandlerRecord *first_polled_io_handler;
+static int polled_io_handlers_changed;
+
+/* Set when some handlers have been deleted, and need to be freed */
+static int io_handlers_deleted;
+
+static void io_handler_set_flags(IOHandlerRecord *ioh, int flags)
+{
+    if (ioh->iol_flags != flags) {
+        iolooper_modify(main_iolooper, ioh->fd, ioh->iol_flags, flags);
+        ioh->iol_flags = flags;
+    }
+}
+
+/* Called by socket_close(). The registration of a closed descriptor has to
+ * be dropped, or a new descriptor with the same number wouldn't be
+ * registered with the kernel. */
+static void main_iolooper_fd_closed(int fd)
+{
+    if (fd < 0)
+        return;
+
+    if (fd < io_handlers_by_fd_size && io_handlers_by_fd[fd])
+        io_handler_set_flags(io_handlers_by_fd[fd], 0);
+
+#if defined(CONFIG_SLIRP)
+    if (slirp_is_inited())
+        slirp_looper_fd_closed(fd);
+#endif
+}
+
+static void main_iolooper_init(void)
+{
+    if (main_iolooper == NULL) {
+        main_iolooper = iolooper_new();
+        socket_set_close_hook(main_iolooper_fd_closed);
+    }
+}
+
+static void io_handler_register(IOHandlerRecord *ioh)
+{
+    int flags = 0;
+
+    main_iolooper_init();
+    if (ioh->fd >= io_handlers_by_fd_size) {
+        int size = io_handlers_by_fd_size ? io_handlers_by_fd_size : 64;
+        while (size <= ioh->fd)
+            size *= 2;
+        io_handlers_by_fd = qemu_realloc(io_handlers_by_fd,
+                                         size * sizeof(*io_handlers_by_fd));
+        memset(io_handlers_by_fd + io_handlers_by_fd_size, 0,
+               (size - io_handlers_by_fd_size) * sizeof(*io_handlers_by_fd));
+        io_handlers_by_fd_size = size;
+    }
+
+    if (ioh->deleted) {
+        if (io_handlers_by_fd[ioh->fd] == ioh)
+            io_handlers_by_fd[ioh->fd] = NULL;
+        io_handlers_deleted = 1;
+    } else {
+        io_handlers_by_fd[ioh->fd] = ioh;
+        /* the read flag of polled handlers is updated by main_loop_wait() */
+        if (ioh->fd_read && (!ioh->fd_read_poll ||
+                             (ioh->iol_flags & IOLOOPER_READ)))
+            flags |= IOLOOPER_READ;
+        if (ioh->fd_write)
+            flags |= IOLOOPER_WRITE;
+    }
+    io_handler_set_flags(ioh, flags);
+    polled_io_handlers_changed = 1;
+}
+#endif /* CONFIG_EPOLL */
+
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
 int qemu_set_fd_handler2(int fd,
@@ -1762,6 +1883,9 @@ int qemu_set_fd_handler2(int fd,
                 break;
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+#ifdef CONFIG_EPOLL
+                io_handler_register(ioh);
+#endif
                 break;
             }
             pioh = &ioh->next;
@@ -1781,6 +1905,9 @@ int qemu_set_fd_handler2(int fd,
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+#ifdef CONFIG_EPOLL
+        io_handler_register(ioh);
+#endif
     }
     return 0;
 }
@@ -1971,66 +2098,489 @@ static void ram_decompress_close(RamDecompressState *s)
 #define RAM_SAVE_FLAG_MEM_SIZE	0x04
 #define RAM_SAVE_FLAG_PAGE	0x08
 #define RAM_SAVE_FLAG_EOS	0x10
+#define RAM_SAVE_FLAG_BATCH	0x20
+
+/* Returns 1 if all the bytes of 'page' are equal to its first byte.
+ * Guest RAM pages are page aligned. */
+#if DUP_PAGE_SSE2
+#if DUP_PAGE_SSE2_DISPATCH
+static int has_sse2(void)
+{
+    static int sse2 = -1;
+
+    if (sse2 < 0) {
+        __builtin_cpu_init();
+        sse2 = __builtin_cpu_supports("sse2") != 0;
+    }
+    return sse2;
+}
 
-static int is_dup_page(uint8_t *page, uint8_t ch)
+__attribute__((target("sse2")))
+#endif
+static int is_dup_page_sse2(uint8_t *page)
 {
-    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
-    uint32_t *array = (uint32_t *)page;
+    const __m128i *array = (const __m128i *)page;
+    __m128i val = _mm_set1_epi8(page[0]);
     int i;
 
-    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
-        if (array[i] != val)
+    for (i = 0; i < (TARGET_PAGE_SIZE / 16); i += 4) {
+        __m128i c0 = _mm_cmpeq_epi8(array[i], val);
+        __m128i c1 = _mm_cmpeq_epi8(array[i + 1], val);
+        __m128i c2 = _mm_cmpeq_epi8(array[i + 2], val);
+        __m128i c3 = _mm_cmpeq_epi8(array[i + 3], val);
+        c0 = _mm_and_si128(_mm_and_si128(c0, c1), _mm_and_si128(c2, c3));
+        if (_mm_movemask_epi8(c0) != 0xffff)
             return 0;
     }
+    return 1;
+}
+#endif
+
+static int is_dup_page(uint8_t *page)
+{
+    unsigned long val = ((unsigned long)-1 / 0xff) * page[0];
+    unsigned long *array = (unsigned long *)page;
+    int i;
 
+#if DUP_PAGE_SSE2_DISPATCH
+    if (has_sse2())
+        return is_dup_page_sse2(page);
+#elif DUP_PAGE_SSE2
+    return is_dup_page_sse2(page);
+#endif
+    for (i = 0; i < (TARGET_PAGE_SIZE / sizeof(unsigned long)); i++) {
+        if (array[i] != val)
+            return 0;
+    }
     return 1;
 }
 
-static int ram_save_block(QEMUFile *f)
+/* Pages that are not uniform are saved in batches of up to RAM_BATCH_PAGES
+ * pages, compressed with zlib. A batch record is:
+ *
+ *    be64   RAM_SAVE_FLAG_BATCH
+ *    be32   number of pages
+ *    be64   ram offset of each page
+ *    be32   size of the compressed data
+ *    ...    zlib stream of the page contents, in the same order
+ *
+ * The batches are (de)compressed by a pool of worker threads, with up to
+ * RAM_BATCH_MAX of them in flight, and written to the stream in the order
+ * they were filled. The guest does not run during a ram_save_live() call,
+ * so the workers read guest RAM directly and every page appears at most
+ * once in the records of one call. All batches are written before the
+ * call returns. The loader relies on this to decompress the batches of a
+ * ram_load() call in parallel, straight into guest RAM, and waits for them
+ * before returning.
+ *
+ * qemu_get_ram_ptr() is not thread-safe, so the host address of each page
+ * is looked up by the main thread. On Windows, batches are processed
+ * synchronously.
+ */
+#define RAM_BATCH_PAGES  64
+#define RAM_BATCH_MAX    8
+#define RAM_WORKERS_MAX  4
+
+#define RAM_BATCH_BUFFER_SIZE \
+    (compressBound(RAM_BATCH_PAGES * TARGET_PAGE_SIZE))
+
+enum {
+    RAM_BATCH_FILLING = 0,
+    RAM_BATCH_QUEUED,
+    RAM_BATCH_DONE,
+};
+
+typedef struct RamBatch {
+    int         state;
+    int         load;       /* 1 to decompress, 0 to compress */
+    int         npages;
+    ram_addr_t  addr[RAM_BATCH_PAGES];
+    uint8_t*    host[RAM_BATCH_PAGES];
+    uint8_t*    data;       /* compressed data */
+    uLong       size;       /* size of the compressed data */
+    int         ret;        /* 0 or -errno once done */
+} RamBatch;
+
+/* zlib streams owned by one worker, reset for each batch */
+typedef struct RamWorker {
+    z_stream    deflate;
+    z_stream    inflate;
+    int         deflate_init;
+    int         inflate_init;
+} RamWorker;
+
+static struct {
+    RamBatch    batches[RAM_BATCH_MAX];
+    int         head;       /* oldest batch in flight */
+    int         count;      /* number of batches in flight */
+    int         next;       /* next queued batch for the workers */
+    int         filling;    /* 1 if batches[head + count] is being filled */
+#ifndef _WIN32
+    int             nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;   /* signaled when a batch is queued */
+    pthread_cond_t  done;   /* signaled when a batch is processed */
+#endif
+} ram_batches;
+
+static int ram_batch_compress(RamWorker *w, RamBatch *b)
 {
-    static ram_addr_t current_addr = 0;
-    ram_addr_t saved_addr = current_addr;
-    ram_addr_t addr = 0;
-    int found = 0;
+    z_stream *s = &w->deflate;
+    int i;
+
+    if (!w->deflate_init) {
+        if (deflateInit(s, Z_BEST_SPEED) != Z_OK)
+            return -ENOMEM;
+        w->deflate_init = 1;
+    } else if (deflateReset(s) != Z_OK) {
+        return -EIO;
+    }
+    s->next_out = b->data;
+    s->avail_out = RAM_BATCH_BUFFER_SIZE;
+    for (i = 0; i < b->npages; i++) {
+        s->next_in = b->host[i];
+        s->avail_in = TARGET_PAGE_SIZE;
+        if (deflate(s, Z_NO_FLUSH) != Z_OK || s->avail_in != 0)
+            return -EIO;
+    }
+    if (deflate(s, Z_FINISH) != Z_STREAM_END)
+        return -EIO;
+    b->size = s->total_out;
+    return 0;
+}
+
+static int ram_batch_decompress(RamWorker *w, RamBatch *b)
+{
+    z_stream *s = &w->inflate;
+    int i, ret = Z_OK;
+
+    if (!w->inflate_init) {
+        if (inflateInit(s) != Z_OK)
+            return -ENOMEM;
+        w->inflate_init = 1;
+    } else if (inflateReset(s) != Z_OK) {
+        return -EIO;
+    }
+    s->next_in = b->data;
+    s->avail_in = b->size;
+    for (i = 0; i < b->npages; i++) {
+        s->next_out = b->host[i];
+        s->avail_out = TARGET_PAGE_SIZE;
+        while (s->avail_out > 0) {
+            ret = inflate(s, Z_NO_FLUSH);
+            if (ret != Z_OK && (ret != Z_STREAM_END || s->avail_out > 0))
+                return -EINVAL;
+        }
+    }
+    if (ret != Z_STREAM_END && inflate(s, Z_FINISH) != Z_STREAM_END)
+        return -EINVAL;
+    return 0;
+}
 
-    while (addr < last_ram_offset) {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
+static void ram_batch_process(RamWorker *w, RamBatch *b)
+{
+    if (b->load)
+        b->ret = ram_batch_decompress(w, b);
+    else
+        b->ret = ram_batch_compress(w, b);
+}
 
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+#ifndef _WIN32
+static void *ram_batch_worker(void *opaque)
+{
+    RamWorker worker;
+    RamBatch *b;
 
-            p = qemu_get_ram_ptr(current_addr);
+    memset(&worker, 0, sizeof(worker));
+    pthread_mutex_lock(&ram_batches.lock);
+    for (;;) {
+        int tail = (ram_batches.head + ram_batches.count) % RAM_BATCH_MAX;
 
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-            } else {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-            }
+        if (ram_batches.next == tail) {
+            pthread_cond_wait(&ram_batches.work, &ram_batches.lock);
+            continue;
+        }
+        b = &ram_batches.batches[ram_batches.next];
+        ram_batches.next = (ram_batches.next + 1) % RAM_BATCH_MAX;
+        pthread_mutex_unlock(&ram_batches.lock);
 
-            found = 1;
+        ram_batch_process(&worker, b);
+
+        pthread_mutex_lock(&ram_batches.lock);
+        b->state = RAM_BATCH_DONE;
+        pthread_cond_broadcast(&ram_batches.done);
+    }
+    return NULL;
+}
+
+/* Starts the worker threads on first use. Returns the number of threads,
+ * 0 if batches must be processed synchronously. */
+static int ram_batch_start_workers(void)
+{
+    static int started;
+    pthread_t thread;
+    pthread_attr_t attr;
+    long ncpus;
+    int i;
+
+    if (started)
+        return ram_batches.nthreads;
+    started = 1;
+
+    pthread_mutex_init(&ram_batches.lock, NULL);
+    pthread_cond_init(&ram_batches.work, NULL);
+    pthread_cond_init(&ram_batches.done, NULL);
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+    if (ncpus > RAM_WORKERS_MAX)
+        ncpus = RAM_WORKERS_MAX;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < ncpus; i++) {
+        if (pthread_create(&thread, &attr, ram_batch_worker, NULL) != 0)
             break;
+    }
+    pthread_attr_destroy(&attr);
+    ram_batches.nthreads = i;
+    return i;
+}
+#endif /* !_WIN32 */
+
+/* Hands the batch being filled over to the workers. */
+static void ram_batch_queue(void)
+{
+    RamBatch *b = &ram_batches.batches[(ram_batches.head + ram_batches.count)
+                                       % RAM_BATCH_MAX];
+    ram_batches.filling = 0;
+#ifndef _WIN32
+    if (ram_batch_start_workers() > 0) {
+        pthread_mutex_lock(&ram_batches.lock);
+        b->state = RAM_BATCH_QUEUED;
+        ram_batches.count++;
+        pthread_cond_signal(&ram_batches.work);
+        pthread_mutex_unlock(&ram_batches.lock);
+        return;
+    }
+#endif
+    {
+        static RamWorker worker;
+
+        ram_batch_process(&worker, b);
+        b->state = RAM_BATCH_DONE;
+        ram_batches.count++;
+    }
+}
+
+/* Retires the oldest batch in flight, waiting for it if 'wait' is set.
+ * Compressed batches are written to 'f'. Returns 1 if a batch was
+ * retired, 0 if there is none or it is not done, and -errno if it failed. */
+static int ram_batch_retire(QEMUFile *f, int wait)
+{
+    RamBatch *b;
+    int i, done;
+
+    if (ram_batches.count == 0)
+        return 0;
+    b = &ram_batches.batches[ram_batches.head];
+#ifndef _WIN32
+    if (ram_batches.nthreads > 0) {
+        pthread_mutex_lock(&ram_batches.lock);
+        while (wait && b->state != RAM_BATCH_DONE)
+            pthread_cond_wait(&ram_batches.done, &ram_batches.lock);
+        done = (b->state == RAM_BATCH_DONE);
+        pthread_mutex_unlock(&ram_batches.lock);
+    } else
+#endif
+    done = (b->state == RAM_BATCH_DONE);
+    if (!done)
+        return 0;
+
+    if (!b->load) {
+        if (b->ret == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_BATCH);
+            qemu_put_be32(f, b->npages);
+            for (i = 0; i < b->npages; i++)
+                qemu_put_be64(f, b->addr[i]);
+            qemu_put_be32(f, b->size);
+            qemu_put_buffer(f, b->data, b->size);
+        } else {
+            qemu_file_set_error(f);
         }
-        addr += TARGET_PAGE_SIZE;
-        current_addr = (saved_addr + addr) % last_ram_offset;
     }
 
-    return found;
+#ifndef _WIN32
+    if (ram_batches.nthreads > 0)
+        pthread_mutex_lock(&ram_batches.lock);
+#endif
+    b->state = RAM_BATCH_FILLING;
+    ram_batches.head = (ram_batches.head + 1) % RAM_BATCH_MAX;
+    ram_batches.count--;
+#ifndef _WIN32
+    if (ram_batches.nthreads > 0)
+        pthread_mutex_unlock(&ram_batches.lock);
+#endif
+    return b->ret ? b->ret : 1;
+}
+
+/* Retires all batches in flight. Returns 0, or the first error. */
+static int ram_batch_drain(QEMUFile *f)
+{
+    int ret, err = 0;
+
+    if (ram_batches.filling)
+        ram_batch_queue();
+    while ((ret = ram_batch_retire(f, 1)) != 0) {
+        if (ret < 0 && err == 0)
+            err = ret;
+    }
+    return err;
+}
+
+/* Returns the batch to fill with pages to load or save, or NULL on error.
+ * The oldest batch is retired first if all the others are in flight. */
+static RamBatch *ram_batch_get_free(QEMUFile *f, int load)
+{
+    RamBatch *b;
+
+    b = &ram_batches.batches[(ram_batches.head + ram_batches.count)
+                             % RAM_BATCH_MAX];
+    if (ram_batches.filling)
+        return b;
+
+    if (ram_batches.count == RAM_BATCH_MAX - 1) {
+        /* keep one slot for the batch being filled */
+        if (ram_batch_retire(f, 1) < 0)
+            return NULL;
+    }
+    if (b->data == NULL)
+        b->data = qemu_malloc(RAM_BATCH_BUFFER_SIZE);
+    b->load = load;
+    b->npages = 0;
+    b->ret = 0;
+    ram_batches.filling = 1;
+    return b;
+}
+
+/* Adds the page at 'addr' to the batch being compressed. */
+static void ram_batch_save_page(QEMUFile *f, ram_addr_t addr, uint8_t *p)
+{
+    RamBatch *b = ram_batch_get_free(f, 0);
+
+    if (b == NULL)
+        return;
+    b->addr[b->npages] = addr;
+    b->host[b->npages] = p;
+    if (++b->npages == RAM_BATCH_PAGES) {
+        ram_batch_queue();
+        /* write out what is already compressed, for rate limiting */
+        while (ram_batch_retire(f, 0) > 0)
+            ;
+    }
+}
+
+/* Reads a batch record and queues it for decompression. */
+static int ram_batch_load(QEMUFile *f)
+{
+    RamBatch *b = ram_batch_get_free(f, 1);
+    int i;
+
+    if (b == NULL)
+        return -EINVAL;
+    b->npages = qemu_get_be32(f);
+    if (b->npages <= 0 || b->npages > RAM_BATCH_PAGES)
+        goto fail;
+    for (i = 0; i < b->npages; i++) {
+        b->addr[i] = qemu_get_be64(f);
+        if ((b->addr[i] & ~TARGET_PAGE_MASK) != 0
+            || b->addr[i] >= last_ram_offset)
+            goto fail;
+        b->host[i] = qemu_get_ram_ptr(b->addr[i]);
+    }
+    b->size = qemu_get_be32(f);
+    if (b->size == 0 || b->size > RAM_BATCH_BUFFER_SIZE)
+        goto fail;
+    if (qemu_get_buffer(f, b->data, b->size) != (int)b->size
+        || qemu_file_has_error(f))
+        goto fail;
+
+    ram_batch_queue();
+    return 0;
+
+fail:
+    ram_batches.filling = 0;
+    return -EINVAL;
+}
+
+/* Returns the first page at or after 'page' and before 'end' whose
+ * migration dirty flag is set, or 'end'. The dirty map holds one byte of
+ * flags per page and is scanned a word at a time. */
+static ram_addr_t ram_find_dirty(ram_addr_t page, ram_addr_t end)
+{
+    const unsigned long mask =
+        ((unsigned long)-1 / 0xff) * MIGRATION_DIRTY_FLAG;
+
+    while (page < end && (page % sizeof(unsigned long)) != 0) {
+        if (phys_ram_dirty[page] & MIGRATION_DIRTY_FLAG)
+            return page;
+        page++;
+    }
+    while (page + sizeof(unsigned long) <= end
+           && !(*(unsigned long *)(phys_ram_dirty + page) & mask)) {
+        page += sizeof(unsigned long);
+    }
+    while (page < end) {
+        if (phys_ram_dirty[page] & MIGRATION_DIRTY_FLAG)
+            return page;
+        page++;
+    }
+    return end;
+}
+
+static int ram_save_block(QEMUFile *f)
+{
+    static ram_addr_t current_addr = 0;
+    ram_addr_t npages = last_ram_offset >> TARGET_PAGE_BITS;
+    ram_addr_t page = current_addr >> TARGET_PAGE_BITS;
+    uint8_t *p;
+
+    page = ram_find_dirty(page, npages);
+    if (page == npages) {
+        page = ram_find_dirty(0, current_addr >> TARGET_PAGE_BITS);
+        if (page == current_addr >> TARGET_PAGE_BITS)
+            return 0;
+    }
+    current_addr = page << TARGET_PAGE_BITS;
+
+    cpu_physical_memory_reset_dirty(current_addr,
+                                    current_addr + TARGET_PAGE_SIZE,
+                                    MIGRATION_DIRTY_FLAG);
+
+    p = qemu_get_ram_ptr(current_addr);
+
+    if (is_dup_page(p)) {
+        qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+    } else {
+        ram_batch_save_page(f, current_addr, p);
+    }
+
+    return 1;
 }
 
 static uint64_t bytes_transferred = 0;
 
 static ram_addr_t ram_save_remaining(void)
 {
-    ram_addr_t addr;
+    ram_addr_t npages = last_ram_offset >> TARGET_PAGE_BITS;
+    ram_addr_t page;
     ram_addr_t count = 0;
 
-    for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
-        if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-            count++;
+    for (page = ram_find_dirty(0, npages); page < npages;
+         page = ram_find_dirty(page + 1, npages)) {
+        count++;
     }
 
     return count;
@@ -2061,6 +2611,9 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
     cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX);
 
     if (stage == 1) {
+        /* The VM state of a lazily restored snapshot may be overwritten */
+        ram_lazy_finish();
+
         /* Make sure all dirty bits are set */
         for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
             if (!cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
@@ -2084,6 +2637,7 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
         if (ret == 0) /* no more blocks */
             break;
     }
+    ram_batch_drain(f);
 
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
@@ -2101,6 +2655,7 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
         while (ram_save_block(f) != 0) {
             bytes_transferred += TARGET_PAGE_SIZE;
         }
+        ram_batch_drain(f);
         cpu_physical_memory_set_dirty_tracking(0);
     }
 
@@ -2141,10 +2696,445 @@ static int ram_load_dead(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/***********************************************************/
+/* lazy ram restore */
+
+/* With -lazy-restore, ram_load() does not read the pages of a snapshot
+ * loaded with loadvm. It records where each page is in the VM state of the
+ * snapshot device, and the pages are read with bdrv_load_vmstate() on
+ * first access, or by a prefetch timer that restores the rest in the
+ * background:
+ *
+ * - every path that gets the host address of a RAM page calls
+ *   ram_lazy_touch() first, outside of any signal handler: tlb_set_page()
+ *   for the generated code, the ld*_phys/st*_phys helpers,
+ *   cpu_physical_memory_rw() and cpu_physical_memory_map(), and the
+ *   framebuffer, which reads guest RAM directly;
+ * - host pages that are not restored yet are also protected with
+ *   mprotect(), so that a path that was missed crashes right away instead
+ *   of reading stale data. The SIGSEGV handler only reports it, the block
+ *   layer cannot be used from a signal handler, and faults outside of the
+ *   protected pages are passed on to the previous handler.
+ *
+ * A host page may hold several target pages, which are always restored
+ * together. Everything is restored before the VM state area can change,
+ * i.e. before savevm, loadvm, delvm and outgoing migrations. Lazy restore
+ * is only used when guest RAM is a single host mapping, and not on
+ * Windows. RAM is loaded eagerly otherwise.
+ */
+int ram_lazy_restore = 0;
+
+#ifndef _WIN32
+
+/* host pages restored per tick of the prefetch timer */
+#define RAM_LAZY_PREFETCH_PAGES  64
+
+/* ram_lazy.pos[] entries: stream position of the page data, shifted left
+ * by one, with bit 0 set for pages of a batch record. */
+#define RAM_LAZY_RESTORED  ((int64_t)-1)
+
+static struct {
+    BlockDriverState *bs;       /* NULL when lazy restore is inactive */
+    uint8_t*          host;     /* host address of ram offset 0 */
+    int               shift;    /* log2 of target pages per host page */
+    int64_t*          pos;      /* one entry per target page */
+    uint8_t*          prot;     /* one flag per protected host page */
+    ram_addr_t        nprot;    /* number of protected host pages */
+    ram_addr_t        prefetch; /* next host page for the prefetch timer */
+    QEMUTimer*        timer;
+    RamBatch          batch;    /* last batch record read */
+    int64_t           batch_pos;
+    uint8_t*          pages;    /* its decompressed pages */
+    RamWorker         worker;
+} ram_lazy;
+
+static struct sigaction ram_lazy_old_segv;
+
+static void ram_lazy_protect(ram_addr_t hpage, ram_addr_t count, int prot)
+{
+    int bits = TARGET_PAGE_BITS + ram_lazy.shift;
+
+    if (mprotect(ram_lazy.host + (hpage << bits), count << bits, prot) < 0) {
+        perror("mprotect");
+        abort();
+    }
+}
+
+/* Reads the batch record at stream position 'pos' and decompresses it to
+ * ram_lazy.pages, unless it is the last one read. */
+static int ram_lazy_read_batch(int64_t pos)
+{
+    RamBatch *b = &ram_lazy.batch;
+    uint8_t hdr[4 + 8 * RAM_BATCH_PAGES + 4];
+    int i, len;
+
+    if (pos == ram_lazy.batch_pos)
+        return 0;
+    ram_lazy.batch_pos = -1;
+
+    if (bdrv_load_vmstate(ram_lazy.bs, hdr, pos, 4) != 4)
+        return -EIO;
+    b->npages = ldl_be_p(hdr);
+    if (b->npages <= 0 || b->npages > RAM_BATCH_PAGES)
+        return -EINVAL;
+    len = 8 * b->npages + 4;
+    if (bdrv_load_vmstate(ram_lazy.bs, hdr + 4, pos + 4, len) != len)
+        return -EIO;
+    b->size = ldl_be_p(hdr + 4 + 8 * b->npages);
+    if (b->size == 0 || b->size > RAM_BATCH_BUFFER_SIZE)
+        return -EINVAL;
+    if (bdrv_load_vmstate(ram_lazy.bs, b->data, pos + 4 + len,
+                          b->size) != (int)b->size)
+        return -EIO;
+    for (i = 0; i < b->npages; i++) {
+        b->addr[i] = ldq_be_p(hdr + 4 + 8 * i);
+        b->host[i] = ram_lazy.pages + i * TARGET_PAGE_SIZE;
+    }
+    if (ram_batch_decompress(&ram_lazy.worker, b) < 0)
+        return -EINVAL;
+
+    ram_lazy.batch_pos = pos;
+    return 0;
+}
+
+/* Reads the target page 'page' from the snapshot. */
+static int ram_lazy_read_page(ram_addr_t page)
+{
+    int64_t entry = ram_lazy.pos[page];
+    uint8_t *dst = ram_lazy.host + (page << TARGET_PAGE_BITS);
+    RamBatch *b = &ram_lazy.batch;
+    int i, ret;
+
+    if (!(entry & 1)) {
+        ret = bdrv_load_vmstate(ram_lazy.bs, dst, entry >> 1,
+                                TARGET_PAGE_SIZE);
+        return (ret == TARGET_PAGE_SIZE) ? 0 : -EIO;
+    }
+    ret = ram_lazy_read_batch(entry >> 1);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < b->npages; i++) {
+        if (b->addr[i] == (page << TARGET_PAGE_BITS)) {
+            memcpy(dst, b->host[i], TARGET_PAGE_SIZE);
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+/* Restores the target pages of the protected host page 'hpage'. */
+static void ram_lazy_restore_page(ram_addr_t hpage)
+{
+    ram_addr_t page = hpage << ram_lazy.shift;
+    ram_addr_t end = page + (1 << ram_lazy.shift);
+    int ret = 0;
+
+    ram_lazy_protect(hpage, 1, PROT_READ | PROT_WRITE);
+    ram_lazy.prot[hpage] = 0;
+    ram_lazy.nprot--;
+
+    for (; page < end && ret == 0; page++) {
+        if (ram_lazy.pos[page] != RAM_LAZY_RESTORED) {
+            ret = ram_lazy_read_page(page);
+            ram_lazy.pos[page] = RAM_LAZY_RESTORED;
+        }
+    }
+    if (ret < 0) {
+        /* the guest cannot run without the page */
+        fprintf(stderr, "Error %d while restoring ram page 0x%" PRIx64 "\n",
+                ret, (uint64_t)(page - 1) << TARGET_PAGE_BITS);
+        abort();
+    }
+}
+
+/* Only async-signal-safe calls are allowed in here. */
+static void ram_lazy_segv(int sig, siginfo_t *info, void *ctx)
+{
+    static const char msg[] =
+        "Access to a ram page that was not restored yet\n";
+    uint8_t *addr = info->si_addr;
+
+    if (ram_lazy.bs != NULL && addr >= ram_lazy.host
+        && addr < ram_lazy.host + last_ram_offset) {
+        ram_addr_t hpage = (addr - ram_lazy.host)
+                           >> (TARGET_PAGE_BITS + ram_lazy.shift);
+
+        if (ram_lazy.prot[hpage]) {
+            /* a caller of qemu_get_ram_ptr() that misses ram_lazy_touch() */
+            if (write(2, msg, sizeof(msg) - 1) < 0) {
+                /* nothing else to do */
+            }
+            abort();
+        }
+    }
+
+    /* not ours: chain to the previous handler */
+    if ((ram_lazy_old_segv.sa_flags & SA_SIGINFO)
+        && ram_lazy_old_segv.sa_sigaction != NULL) {
+        ram_lazy_old_segv.sa_sigaction(sig, info, ctx);
+    } else if (ram_lazy_old_segv.sa_handler != SIG_DFL
+               && ram_lazy_old_segv.sa_handler != SIG_IGN) {
+        ram_lazy_old_segv.sa_handler(sig);
+    } else {
+        /* fault again with the previous action */
+        sigaction(SIGSEGV, &ram_lazy_old_segv, NULL);
+    }
+}
+
+void ram_lazy_touch(ram_addr_t addr, ram_addr_t size)
+{
+    int bits = TARGET_PAGE_BITS + ram_lazy.shift;
+    ram_addr_t hpage, end;
+
+    if (ram_lazy.bs == NULL || size == 0)
+        return;
+    end = (addr + size - 1) >> bits;
+    for (hpage = addr >> bits; hpage <= end; hpage++) {
+        if (ram_lazy.prot[hpage])
+            ram_lazy_restore_page(hpage);
+    }
+}
+
+static void ram_lazy_stop(void)
+{
+    qemu_del_timer(ram_lazy.timer);
+    qemu_free(ram_lazy.pos);
+    qemu_free(ram_lazy.prot);
+    ram_lazy.pos = NULL;
+    ram_lazy.prot = NULL;
+    ram_lazy.bs = NULL;
+}
+
+void ram_lazy_finish(void)
+{
+    ram_addr_t hpage;
+
+    if (ram_lazy.bs == NULL)
+        return;
+    for (hpage = 0; ram_lazy.nprot > 0; hpage++) {
+        if (ram_lazy.prot[hpage])
+            ram_lazy_restore_page(hpage);
+    }
+    ram_lazy_stop();
+}
+
+static void ram_lazy_prefetch(void *opaque)
+{
+    ram_addr_t nhpages = last_ram_offset
+                         >> (TARGET_PAGE_BITS + ram_lazy.shift);
+    ram_addr_t hpage = ram_lazy.prefetch;
+    int count = 0;
+
+    while (ram_lazy.nprot > 0 && count < RAM_LAZY_PREFETCH_PAGES) {
+        if (ram_lazy.prot[hpage]) {
+            ram_lazy_restore_page(hpage);
+            count++;
+        }
+        hpage = (hpage + 1) % nhpages;
+    }
+    ram_lazy.prefetch = hpage;
+
+    if (ram_lazy.nprot == 0)
+        ram_lazy_stop();
+    else
+        qemu_mod_timer(ram_lazy.timer, qemu_get_clock(rt_clock) + 1);
+}
+
+void ram_lazy_begin(BlockDriverState *bs)
+{
+    static int initialized;
+    ram_addr_t npages = last_ram_offset >> TARGET_PAGE_BITS;
+    ram_addr_t page;
+    int host_page_size = getpagesize();
+
+    ram_lazy_finish();
+    if (!ram_lazy_restore || last_ram_offset == 0)
+        return;
+
+    if (host_page_size < TARGET_PAGE_SIZE
+        || (last_ram_offset & (host_page_size - 1)) != 0
+        || (uint8_t *)qemu_get_ram_ptr(last_ram_offset - 1)
+           - (uint8_t *)qemu_get_ram_ptr(0) != last_ram_offset - 1) {
+        fprintf(stderr, "Lazy restore is not supported with this RAM "
+                        "layout, restoring eagerly\n");
+        ram_lazy_restore = 0;
+        return;
+    }
+
+    if (!initialized) {
+        struct sigaction act;
+
+        memset(&act, 0, sizeof(act));
+        act.sa_sigaction = ram_lazy_segv;
+        act.sa_flags = SA_SIGINFO;
+        sigaction(SIGSEGV, &act, &ram_lazy_old_segv);
+
+        ram_lazy.timer = qemu_new_timer(rt_clock, ram_lazy_prefetch, NULL);
+        ram_lazy.batch.data = qemu_malloc(RAM_BATCH_BUFFER_SIZE);
+        ram_lazy.pages = qemu_malloc(RAM_BATCH_PAGES * TARGET_PAGE_SIZE);
+        initialized = 1;
+    }
+
+    ram_lazy.bs = bs;
+    ram_lazy.host = qemu_get_ram_ptr(0);
+    for (ram_lazy.shift = 0;
+         (TARGET_PAGE_SIZE << ram_lazy.shift) < host_page_size;
+         ram_lazy.shift++)
+        ;
+    ram_lazy.pos = qemu_malloc(npages * sizeof(int64_t));
+    for (page = 0; page < npages; page++)
+        ram_lazy.pos[page] = RAM_LAZY_RESTORED;
+    ram_lazy.prot = qemu_mallocz(npages >> ram_lazy.shift);
+    ram_lazy.nprot = 0;
+    ram_lazy.prefetch = 0;
+    ram_lazy.batch_pos = -1;
+}
+
+void ram_lazy_end(void)
+{
+    if (ram_lazy.bs == NULL)
+        return;
+    if (ram_lazy.nprot == 0) {
+        ram_lazy_stop();
+        return;
+    }
+    qemu_mod_timer(ram_lazy.timer, qemu_get_clock(rt_clock) + 1);
+}
+
+/* Returns 1 if some target pages of the host page 'hpage' are not
+ * restored yet. */
+static int ram_lazy_pending(ram_addr_t hpage)
+{
+    ram_addr_t page = hpage << ram_lazy.shift;
+    ram_addr_t end = page + (1 << ram_lazy.shift);
+
+    for (; page < end; page++) {
+        if (ram_lazy.pos[page] != RAM_LAZY_RESTORED)
+            return 1;
+    }
+    return 0;
+}
+
+/* Protects the host pages holding target pages that are not restored yet,
+ * at the end of a ram_load() call. */
+static void ram_lazy_protect_pending(void)
+{
+    ram_addr_t nhpages, hpage, start;
+    CPUState *env;
+
+    if (ram_lazy.bs == NULL)
+        return;
+    nhpages = last_ram_offset >> (TARGET_PAGE_BITS + ram_lazy.shift);
+    for (hpage = 0; hpage < nhpages; ) {
+        if (ram_lazy.prot[hpage] || !ram_lazy_pending(hpage)) {
+            hpage++;
+            continue;
+        }
+        for (start = hpage; hpage < nhpages && !ram_lazy.prot[hpage]
+             && ram_lazy_pending(hpage); hpage++) {
+            ram_lazy.prot[hpage] = 1;
+            ram_lazy.nprot++;
+        }
+        ram_lazy_protect(start, hpage - start, PROT_NONE);
+    }
+
+    /* the TLBs may still hold host addresses of the pages, which the
+     * generated code would use without going through tlb_set_page() */
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+        tlb_flush(env, 1);
+}
+
+/* Marks the target page 'page' as restored, before ram_load() fills it. */
+static void ram_lazy_drop(ram_addr_t page)
+{
+    ram_addr_t hpage = page >> ram_lazy.shift;
+
+    if (ram_lazy.prot[hpage])
+        ram_lazy_restore_page(hpage);
+    ram_lazy.pos[page] = RAM_LAZY_RESTORED;
+}
+
+/* Records the location of the pages of the batch record at the current
+ * position of 'f', and skips it. */
+static int ram_lazy_load_batch(QEMUFile *f)
+{
+    int64_t entry = (qemu_ftell(f) << 1) | 1;
+    ram_addr_t addr;
+    uint32_t size;
+    int i, npages;
+
+    npages = qemu_get_be32(f);
+    if (npages <= 0 || npages > RAM_BATCH_PAGES)
+        return -EINVAL;
+    for (i = 0; i < npages; i++) {
+        addr = qemu_get_be64(f);
+        if ((addr & ~TARGET_PAGE_MASK) != 0 || addr >= last_ram_offset)
+            return -EINVAL;
+        ram_lazy.pos[addr >> TARGET_PAGE_BITS] = entry;
+    }
+    size = qemu_get_be32(f);
+    if (size == 0 || size > RAM_BATCH_BUFFER_SIZE)
+        return -EINVAL;
+    qemu_fseek(f, size, SEEK_CUR);
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
+/* Handles a record of ram_load() for the page at 'addr' when lazy restore
+ * is active. Returns 1 if the record was consumed, 0 if ram_load() must
+ * handle it, or -errno. */
+static int ram_lazy_load(QEMUFile *f, ram_addr_t addr, int flags)
+{
+    if (ram_lazy.bs == NULL)
+        return 0;
+
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        /* cheaper to fill than to record */
+        ram_lazy_drop(addr >> TARGET_PAGE_BITS);
+        return 0;
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        ram_lazy.pos[addr >> TARGET_PAGE_BITS] = qemu_ftell(f) << 1;
+        qemu_fseek(f, TARGET_PAGE_SIZE, SEEK_CUR);
+        return 1;
+    } else if (flags & RAM_SAVE_FLAG_BATCH) {
+        int ret = ram_lazy_load_batch(f);
+        return ret < 0 ? ret : 1;
+    }
+    return 0;
+}
+
+#else /* _WIN32 */
+
+static int ram_lazy_load(QEMUFile *f, ram_addr_t addr, int flags)
+{
+    return 0;
+}
+
+static void ram_lazy_protect_pending(void)
+{
+}
+
+void ram_lazy_touch(ram_addr_t addr, ram_addr_t size)
+{
+}
+
+void ram_lazy_begin(BlockDriverState *bs)
+{
+}
+
+void ram_lazy_end(void)
+{
+}
+
+void ram_lazy_finish(void)
+{
+}
+
+#endif /* _WIN32 */
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
-    int flags;
+    int flags, ret;
 
     if (version_id == 1)
         return ram_load_v1(f, opaque);
@@ -2155,9 +3145,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         return ram_load_dead(f, opaque);
     }
 
-    if (version_id != 3)
+    if (version_id != 3 && version_id != 4)
         return -EINVAL;
 
+    ret = 0;
     do {
         addr = qemu_get_be64(f);
 
@@ -2165,23 +3156,42 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         addr &= TARGET_PAGE_MASK;
 
         if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
-            if (addr != last_ram_offset)
-                return -EINVAL;
+            if (addr != last_ram_offset) {
+                ret = -EINVAL;
+                break;
+            }
         }
 
         if (flags & RAM_SAVE_FLAG_FULL) {
-            if (ram_load_dead(f, opaque) < 0)
-                return -EINVAL;
+            if (ram_load_dead(f, opaque) < 0) {
+                ret = -EINVAL;
+                break;
+            }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        ret = ram_lazy_load(f, addr, flags);
+        if (ret < 0)
+            break;
+        if (ret > 0) {
+            ret = 0;
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
             uint8_t ch = qemu_get_byte(f);
             memset(qemu_get_ram_ptr(addr), ch, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_PAGE)
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
             qemu_get_buffer(f, qemu_get_ram_ptr(addr), TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_BATCH) {
+            ret = ram_batch_load(f);
+            if (ret < 0)
+                break;
+        }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
-    return 0;
+    /* wait for the pages of this section to be decompressed */
+    if (ram_batch_drain(f) < 0 && ret == 0)
+        ret = -EINVAL;
+    ram_lazy_protect_pending();
+
+    return ret;
 }
 
 void qemu_service_io(void)
@@ -2934,17 +3944,103 @@ static void host_main_loop_wait(int *timeout)
 }
 #endif
 
-void main_loop_wait(int timeout)
+#ifdef CONFIG_EPOLL
+static void main_loop_poll_io(int timeout)
+{
+    IOHandlerRecord *ioh;
+    int ret, n, count;
+
+    main_iolooper_init();
+
+    /* Handlers with a fd_read_poll callback are the only ones whose
+     * registration can change without qemu_set_fd_handler2() being called */
+    if (polled_io_handlers_changed) {
+        IOHandlerRecord **plast = &first_polled_io_handler;
+        for (ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+            if (!ioh->deleted && ioh->fd_read && ioh->fd_read_poll) {
+                *plast = ioh;
+                plast = &ioh->next_polled;
+            }
+        }
+        *plast = NULL;
+        polled_io_handlers_changed = 0;
+    }
+    for (ioh = first_polled_io_handler; ioh != NULL; ioh = ioh->next_polled) {
+        int flags = ioh->iol_flags & ~IOLOOPER_READ;
+        if (ioh->fd_read_poll(ioh->opaque) != 0)
+            flags |= IOLOOPER_READ;
+        io_handler_set_flags(ioh, flags);
+    }
+
+#if defined(CONFIG_SLIRP)
+    /* slirp sockets stay registered too, only those that changed are
+     * updated */
+    if (slirp_is_inited()) {
+        slirp_looper_fill(main_iolooper);
+    }
+#endif
+
+    qemu_mutex_unlock_iothread();
+    if (iolooper_has_operations(main_iolooper)) {
+        ret = iolooper_wait(main_iolooper, timeout);
+    } else {
+        /* nothing to wait for, just sleep until the next deadline */
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ret = select(0, NULL, NULL, NULL, &tv);
+    }
+    qemu_mutex_lock_iothread();
+
+    count = (ret > 0) ? iolooper_ready_count(main_iolooper) : 0;
+    for (n = 0; n < count; n++) {
+        int fd = iolooper_ready_fd(main_iolooper, n);
+
+        ioh = (fd < io_handlers_by_fd_size) ? io_handlers_by_fd[fd] : NULL;
+        if (ioh != NULL) {
+            if (!ioh->deleted && ioh->fd_read &&
+                iolooper_is_read(main_iolooper, fd)) {
+                ioh->fd_read(ioh->opaque);
+            }
+            /* the read handler may have removed or replaced the record */
+            ioh = (fd < io_handlers_by_fd_size) ? io_handlers_by_fd[fd] : NULL;
+            if (ioh != NULL && !ioh->deleted && ioh->fd_write &&
+                iolooper_is_write(main_iolooper, fd)) {
+                ioh->fd_write(ioh->opaque);
+            }
+        }
+    }
+
+    /* remove deleted IO handlers */
+    if (io_handlers_deleted) {
+        IOHandlerRecord **pioh = &first_io_handler;
+        while (*pioh) {
+            ioh = *pioh;
+            if (ioh->deleted) {
+                *pioh = ioh->next;
+                qemu_free(ioh);
+            } else
+                pioh = &ioh->next;
+        }
+        io_handlers_deleted = 0;
+        polled_io_handlers_changed = 1;
+    }
+
+#if defined(CONFIG_SLIRP)
+    /* the slirp descriptors are dispatched from the same ready list */
+    if (slirp_is_inited()) {
+        slirp_looper_poll(main_iolooper);
+    }
+#endif
+}
+#else /* !CONFIG_EPOLL */
+static void main_loop_poll_io(int timeout)
 {
     IOHandlerRecord *ioh;
     fd_set rfds, wfds, xfds;
     int ret, nfds;
     struct timeval tv;
 
-    qemu_bh_update_timeout(&timeout);
-
-    host_main_loop_wait(&timeout);
-
     /* poll any events */
     /* XXX: separate device handlers from system ones */
     nfds = -1;
@@ -3012,6 +4108,17 @@ void main_loop_wait(int timeout)
         slirp_select_poll(&rfds, &wfds, &xfds);
     }
 #endif
+}
+#endif /* !CONFIG_EPOLL */
+
+void main_loop_wait(int timeout)
+{
+    qemu_bh_update_timeout(&timeout);
+
+    host_main_loop_wait(&timeout);
+
+    main_loop_poll_io(timeout);
+
     charpipe_poll();
 
     qemu_run_all_timers();
@@ -3048,6 +4155,10 @@ static int qemu_cpu_exec(CPUState *env)
         env->icount_extra = count;
     }
 #ifdef CONFIG_TRACE
+    if (trace_report_requested) {
+        trace_report_requested = 0;
+        trace_report_writer();
+    }
     if (tbflush_requested) {
         tbflush_requested = 0;
         tb_flush(env);
@@ -4239,6 +5350,9 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_savevm_on_exit:
                 savevm_on_exit = optarg;
                 break;
+            case QEMU_OPTION_lazy_restore:
+                ram_lazy_restore = 1;
+                break;
 #endif
             case QEMU_OPTION_full_screen:
                 full_screen = 1;
@@ -4419,6 +5533,31 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_qcow2_cache: {
+                int64_t value;
+                char *ptr;
+
+                value = strtoll(optarg, &ptr, 10);
+                switch (*ptr) {
+                case 0: case 'K': case 'k':
+                    value <<= 10;
+                    break;
+                case 'M': case 'm':
+                    value <<= 20;
+                    break;
+                default:
+                    PANIC("qemu: invalid qcow2 cache size: %s", optarg);
+                }
+                qcow2_cache_size = value;
+                break;
+            }
+            case QEMU_OPTION_tb_cache:
+                if (tb_cache_init(optarg) < 0) {
+                    fprintf(stderr, "-tb-cache is not supported on this host\n");
+                } else {
+                    atexit(tb_cache_close);
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -5008,8 +6147,11 @@ int main(int argc, char **argv, char **envp)
     if (qemu_opts_foreach(qemu_find_opts("drive"), drive_init_func, &machine->use_scsi, 1) != 0)
         exit(1);
 
+    /* qcow2 keeps metadata updates in memory, write them back on exit */
+    atexit(bdrv_flush_all);
+
     //register_savevm("timer", 0, 2, timer_save, timer_load, &timers_state);
-    register_savevm_live("ram", 0, 3, ram_save_live, NULL, ram_load, NULL);
+    register_savevm_live("ram", 0, 4, ram_save_live, NULL, ram_load, NULL);
 
 #ifndef _WIN32
     /* must be after terminal init, SDL library changes signal handlers */
@@ -5392,6 +6534,7 @@ int main(int argc, char **argv, char **envp)
 
     main_loop();
     quit_timers();
+    tb_cache_close();
     net_cleanup();
     android_emulation_teardown();
     return 0;